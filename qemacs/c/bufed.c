@@ -24,40 +24,74 @@ enum {
 
 typedef struct BufedState {
     StringArray items;
+    StringArray lines;  /* text of the rows, as displayed */
     int flags;
     int last_index;
 } BufedState;
 
 ModeDef bufed_mode;
 
+/* Build the list of buffers. Only the rows between the longest
+   unchanged head and tail of the list are rewritten, so that a refresh
+   after creating, killing or modifying a buffer does not redisplay the
+   whole list. */
 static void build_bufed_list(EditState *s)
 {
     QEmacsState *qs = s->qe_state;
-    EditBuffer *b, *b1;
+    EditBuffer *b;
     BufedState *hs;
+    StringArray lines;
+    char line[1024];
     int last_index = list_get_pos(s);
-    int i;
+    int i, n, old_n, head, tail, offset, size, len;
 
     hs = (BufedState*)s->mode_data;
 
     free_strings(&hs->items);
+    memset(&lines, 0, sizeof(lines));
     for (b = qs->first_buffer; b != NULL; b = b->next) {
-        if (!(b->flags & BF_SYSTEM) || (hs->flags & BUFED_ALL_VISIBLE))
+        if (!(b->flags & BF_SYSTEM) || (hs->flags & BUFED_ALL_VISIBLE)) {
             add_string(&hs->items, b->name);
-    }
-    
-    /* build buffer */
-    b = s->b;
-    eb_delete(b, 0, eb_total_size(b));
-    for (i = 0; i < hs->items.nb_items; i++) {
-        eb_printf(b, " %-20s", hs->items.items[i]->str);
-        b1 = eb_find(hs->items.items[i]->str);
-        if (b1) {
             /* CG: should also display mode */
-            eb_printf(b, " %10d  %s", eb_total_size(b1), b1->filename);
+            snprintf(line, sizeof(line), " %-20s %10d  %s\n",
+                     b->name, eb_total_size(b), b->filename);
+            add_string(&lines, line);
         }
-        eb_printf(b, "\n");
     }
+
+    /* find the rows to replace */
+    n = lines.nb_items;
+    old_n = hs->lines.nb_items;
+    head = 0;
+    while (head < n && head < old_n
+    &&     !strcmp(lines.items[head]->str, hs->lines.items[head]->str))
+        head++;
+    tail = 0;
+    while (tail < n - head && tail < old_n - head
+    &&     !strcmp(lines.items[n - 1 - tail]->str,
+                   hs->lines.items[old_n - 1 - tail]->str))
+        tail++;
+
+    /* update buffer */
+    b = s->b;
+    offset = 0;
+    for (i = 0; i < head; i++)
+        offset += strlen(hs->lines.items[i]->str);
+    size = 0;
+    for (i = head; i < old_n - tail; i++)
+        size += strlen(hs->lines.items[i]->str);
+    if (old_n == 0)
+        size = eb_total_size(b);
+    if (size > 0)
+        eb_delete(b, offset, size);
+    for (i = head; i < n - tail; i++) {
+        len = strlen(lines.items[i]->str);
+        eb_insert(b, offset, lines.items[i]->str, len);
+        offset += len;
+    }
+    free_strings(&hs->lines);
+    hs->lines = lines;
+
     s->offset = eb_goto_pos(s->b, last_index, 0);
 }
 
@@ -248,6 +282,7 @@ static void bufed_mode_close(EditState *s)
     BufedState *bs = (BufedState*)s->mode_data;
 
     free_strings(&bs->items);
+    free_strings(&bs->lines);
 
     list_mode.mode_close(s);
 }
@@ -21,12 +21,16 @@
 #include <sys/mman.h>
 #endif
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* the log buffer is used for the undo operation */
 /* header of log operation */
 typedef struct LogBuffer {
     u8 op;
     u8 was_modified;
+    u8 linked; /* undone together with the previous entry */
     int offset;
     int size;
 } LogBuffer;
@@ -124,22 +128,168 @@ void eb_log_reset(EditBuffer *b)
     b->nb_logs = 0;
 }
 
+/************************************************************/
+/* buffer registry */
+
+/* Each table chains the buffers whose key hashes to the same bucket
+   through EditBuffer.links[]. Tables grow to keep chains short, so
+   finding a buffer by name or by file does not depend on the number of
+   buffers. */
+typedef struct EditBufferTable {
+    EditBuffer **heads;
+    int size;       /* power of 2 */
+    int count;
+} EditBufferTable;
+
+static EditBufferTable eb_tables[EB_LINK_NB];
+
+static unsigned int eb_hash_str(const char *str)
+{
+    unsigned int h = 2166136261U;
+
+    while (*str) {
+        h ^= (u8)*str++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static unsigned int eb_hash_id(int64_t dev, int64_t ino)
+{
+    uint64_t h;
+
+    h = (uint64_t)ino * 0x9E3779B97F4A7C15ULL ^ (uint64_t)dev;
+    return (unsigned int)(h ^ (h >> 32));
+}
+
+static int eb_table_resize(EditBufferTable *t, int which, int size)
+{
+    EditBuffer **heads, *b, *b1;
+    int i, h;
+
+    heads = (EditBuffer**)calloc(size, sizeof(EditBuffer *));
+    if (!heads)
+        return -1;
+    for (i = 0; i < t->size; i++) {
+        for (b = t->heads[i]; b != NULL; b = b1) {
+            b1 = b->links[which].next;
+            h = b->links[which].hash & (size - 1);
+            b->links[which].next = heads[h];
+            heads[h] = b;
+        }
+    }
+    free(t->heads);
+    t->heads = heads;
+    t->size = size;
+    return 0;
+}
+
+static void eb_table_add(int which, EditBuffer *b, unsigned int hash)
+{
+    EditBufferTable *t = &eb_tables[which];
+    EditBufferLink *l = &b->links[which];
+    int h;
+
+    if (t->count >= t->size
+    &&  eb_table_resize(t, which, t->size ? t->size * 2 : 64) < 0) {
+        if (!t->size)
+            return;
+    }
+    h = hash & (t->size - 1);
+    l->hash = hash;
+    l->next = t->heads[h];
+    l->linked = 1;
+    t->heads[h] = b;
+    t->count++;
+}
+
+static void eb_table_remove(int which, EditBuffer *b)
+{
+    EditBufferTable *t = &eb_tables[which];
+    EditBufferLink *l = &b->links[which];
+    EditBuffer **pb;
+
+    if (!l->linked)
+        return;
+    pb = &t->heads[l->hash & (t->size - 1)];
+    while (*pb != NULL) {
+        if (*pb == b) {
+            *pb = l->next;
+            t->count--;
+            break;
+        }
+        pb = &(*pb)->links[which].next;
+    }
+    l->next = NULL;
+    l->linked = 0;
+}
+
+static EditBuffer *eb_table_first(int which, unsigned int hash)
+{
+    EditBufferTable *t = &eb_tables[which];
+
+    if (!t->size)
+        return NULL;
+    return t->heads[hash & (t->size - 1)];
+}
+
+static void eb_set_name(EditBuffer *b, const char *name)
+{
+    eb_table_remove(EB_LINK_NAME, b);
+    pstrcpy(b->name, sizeof(b->name), name);
+    b->name_suffix = 0;
+    eb_table_add(EB_LINK_NAME, b, eb_hash_str(b->name));
+}
+
+/* register the file of 'b' by name and by identity. The identity is
+   unknown until the file exists */
+static void eb_set_file_id(EditBuffer *b)
+{
+    struct stat st;
+
+    eb_table_remove(EB_LINK_FILE, b);
+    eb_table_remove(EB_LINK_ID, b);
+    b->file_dev = 0;
+    b->file_ino = 0;
+    if (b->filename[0] == '\0')
+        return;
+    eb_table_add(EB_LINK_FILE, b, eb_hash_str(b->filename));
+    if (stat(b->filename, &st) == 0 && st.st_ino != 0) {
+        b->file_dev = st.st_dev;
+        b->file_ino = st.st_ino;
+        eb_table_add(EB_LINK_ID, b, eb_hash_id(b->file_dev, b->file_ino));
+    }
+}
+
 /* rename a buffer and add characters so that the name is unique */
 void set_buffer_name(EditBuffer *b, const char *name1)
 {
     char name[sizeof(b->name)];
+    EditBuffer *b1;
     int n, pos;
 
     pstrcpy(name, sizeof(b->name) - 10, name1);
-    /* set the buffer name to NULL since it will be changed */
+    /* remove the buffer name since it will be changed */
+    eb_table_remove(EB_LINK_NAME, b);
     b->name[0] = '\0';
     pos = strlen(name);
-    n = 2;
-    while (eb_find(name) != NULL) {
-        sprintf(name + pos, "<%d>", n);
-        n++;
+    /* the buffer with the base name remembers the last suffix made from
+       it, so that a series of buffers with the same name does not probe
+       every previous suffix */
+    b1 = eb_find(name);
+    if (b1 != NULL) {
+        n = b1->name_suffix + 1;
+        if (n < 2)
+            n = 2;
+        for (;;) {
+            sprintf(name + pos, "<%d>", n);
+            if (eb_find(name) == NULL)
+                break;
+            n++;
+        }
+        b1->name_suffix = n;
     }
-    pstrcpy(b->name, sizeof(b->name), name);
+    eb_set_name(b, name);
 }
 
 EditBuffer *eb_new(const char *name, int flags)
@@ -147,7 +297,7 @@ EditBuffer *eb_new(const char *name, int flags)
     QEmacsState *qs = &qe_state;
     EditBuffer *b = new EditBuffer();
 
-    pstrcpy(b->name, sizeof(b->name), name);
+    eb_set_name(b, name);
     b->flags = flags;
 
     /* set default data type */
@@ -158,6 +308,8 @@ EditBuffer *eb_new(const char *name, int flags)
 
     /* add buffer in global buffer list */
     b->next = qs->first_buffer;
+    if (b->next)
+        b->next->prev = b;
     qs->first_buffer = b;
 
     /* CG: default charset should be selectable */
@@ -197,7 +349,6 @@ void eb_free_callbacks(EditBuffer *b)
 void eb_free(EditBuffer *b)
 {
     QEmacsState *qs = &qe_state;
-    EditBuffer **pb;
 
     /* call user defined close */
     if (b->close)
@@ -222,42 +373,60 @@ void eb_free(EditBuffer *b)
 #endif
 
     /* suppress from buffer list */
-    pb = &qs->first_buffer;
-    while (*pb != NULL) {
-        if (*pb == b)
-            break;
-        pb = &(*pb)->next;
-    }
-    *pb = (*pb)->next;
+    eb_table_remove(EB_LINK_NAME, b);
+    eb_table_remove(EB_LINK_FILE, b);
+    eb_table_remove(EB_LINK_ID, b);
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        qs->first_buffer = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
 
     delete b;
 }
 
 EditBuffer *eb_find(const char *name)
 {
-    QEmacsState *qs = &qe_state;
     EditBuffer *b;
+    unsigned int hash;
 
-    b = qs->first_buffer;
-    while (b != NULL) {
-        if (!strcmp(b->name, name))
+    hash = eb_hash_str(name);
+    for (b = eb_table_first(EB_LINK_NAME, hash); b != NULL;
+         b = b->links[EB_LINK_NAME].next) {
+        if (b->links[EB_LINK_NAME].hash == hash && !strcmp(b->name, name))
             return b;
-        b = b->next;
     }
     return NULL;
 }
 
+/* find the buffer of a file by its name, or by its identity if the
+   file was opened under another name (link, other path) */
 EditBuffer *eb_find_file(const char *filename)
 {
-    QEmacsState *qs = &qe_state;
     EditBuffer *b;
-
-    b = qs->first_buffer;
-    while (b != NULL) {
-        /* XXX: should also use stat to ensure this is same file */
-        if (!strcmp(b->filename, filename))
+    unsigned int hash;
+    struct stat st, st1;
+
+    hash = eb_hash_str(filename);
+    for (b = eb_table_first(EB_LINK_FILE, hash); b != NULL;
+         b = b->links[EB_LINK_FILE].next) {
+        if (b->links[EB_LINK_FILE].hash == hash
+        &&  !strcmp(b->filename, filename))
             return b;
-        b = b->next;
+    }
+    if (stat(filename, &st) < 0 || st.st_ino == 0)
+        return NULL;
+    hash = eb_hash_id(st.st_dev, st.st_ino);
+    for (b = eb_table_first(EB_LINK_ID, hash); b != NULL;
+         b = b->links[EB_LINK_ID].next) {
+        if (b->file_dev == (int64_t)st.st_dev
+        &&  b->file_ino == (int64_t)st.st_ino) {
+            /* the inode may have been reused by another file */
+            if (stat(b->filename, &st1) == 0
+            &&  st1.st_dev == st.st_dev && st1.st_ino == st.st_ino)
+                return b;
+        }
     }
     return NULL;
 }
@@ -367,19 +536,39 @@ static void eb_limit_log_size(EditBuffer *b)
     if (b->nb_logs < NB_LOGS_MAX-1)
         return;
 
-    /* no free space, delete least recent entry */
-    eb_read(b->log_buffer, 0, (unsigned char *)&lb, sizeof(LogBuffer));
-    len = lb.size;
-    if (lb.op == LOGOP_INSERT)
-        len = 0;
-    len += sizeof(LogBuffer) + sizeof(int);
-    eb_delete(b->log_buffer, 0, len);
-    b->log_new_index -= len;
-    if (b->log_current > 1)
-        b->log_current -= len;
+    /* no free space, delete least recent undo step, that is the
+       first entry and the entries linked to it */
+    do {
+        eb_read(b->log_buffer, 0, (unsigned char *)&lb, sizeof(LogBuffer));
+        len = lb.size;
+        if (lb.op == LOGOP_INSERT)
+            len = 0;
+        len += sizeof(LogBuffer) + sizeof(int);
+        eb_delete(b->log_buffer, 0, len);
+        b->log_new_index -= len;
+        if (b->log_current > 1)
+            b->log_current -= len;
+        if (b->log_new_index <= 0)
+            break;
+        eb_read(b->log_buffer, 0, (unsigned char *)&lb, sizeof(LogBuffer));
+    } while (lb.linked);
     b->nb_logs--;
 }
 
+/* all the modifications made until the matching eb_end_undo_group()
+   are undone in a single step */
+void eb_begin_undo_group(EditBuffer *b)
+{
+    if (b->log_group++ == 0)
+        b->log_group_start = 1;
+}
+
+void eb_end_undo_group(EditBuffer *b)
+{
+    if (b->log_group > 0)
+        b->log_group--;
+}
+
 static void eb_addlog(EditBuffer *b, enum LogOperation op, 
                       int offset, int size)
 {
@@ -404,13 +593,17 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
             return;
     }
 
-    eb_limit_log_size(b);
-
     /* header */
     lb.op = op;
     lb.offset = offset;
     lb.size = size;
     lb.was_modified = was_modified;
+    lb.linked = (b->log_group > 0 && !b->log_group_start);
+    b->log_group_start = 0;
+
+    if (!lb.linked)
+        eb_limit_log_size(b);
+
     eb_write(b->log_buffer, b->log_new_index, 
              (unsigned char *) &lb, sizeof(LogBuffer));
     b->log_new_index += sizeof(LogBuffer);
@@ -432,7 +625,8 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
              (unsigned char *)&size_trailer, sizeof(int));
     b->log_new_index += sizeof(int);
 
-    b->nb_logs++;
+    if (!lb.linked)
+        b->nb_logs++;
 }
 
 void do_undo(EditState *s)
@@ -458,62 +652,109 @@ void do_undo(EditState *s)
     } else {
         put_status(s, "Undo!");
     }
-    /* go backward */
-    log_index -= sizeof(int);
-    eb_read(b->log_buffer, log_index, (unsigned char *)&size_trailer, sizeof(int));
-    log_index -= size_trailer + sizeof(LogBuffer);
-    
-    /* log_current is 1 + index to have zero as default value */
-    b->log_current = log_index + 1;
 
-    /* play the log entry */
-    eb_read(b->log_buffer, log_index, (unsigned char *)&lb, sizeof(LogBuffer));
-    log_index += sizeof(LogBuffer);
+    /* the replayed entries are themselves grouped so that undoing
+       the undo is also a single step */
+    eb_begin_undo_group(b);
+    for (;;) {
+        /* go backward */
+        log_index -= sizeof(int);
+        eb_read(b->log_buffer, log_index, (unsigned char *)&size_trailer, sizeof(int));
+        log_index -= size_trailer + sizeof(LogBuffer);
+    
+        /* log_current is 1 + index to have zero as default value */
+        b->log_current = log_index + 1;
+
+        /* play the log entry */
+        eb_read(b->log_buffer, log_index, (unsigned char *)&lb, sizeof(LogBuffer));
+        log_index += sizeof(LogBuffer);
+
+        switch (lb.op) {
+        case LOGOP_WRITE:
+            /* we must disable the log because we want to record a single
+               write (we should have the single operation: eb_write_buffer) */
+            saved = b->save_log;
+            b->save_log = 0;
+            if (eb_is_patching(b)) {
+                /* write the old bytes back in place so that patch mode
+                   is kept */
+                u8 buf[1024];
+                int pos, len;
+                for (pos = 0; pos < lb.size; pos += len) {
+                    len = min(lb.size - pos, sizeof(buf));
+                    eb_read(b->log_buffer, log_index + pos, buf, len);
+                    eb_write(b, lb.offset + pos, buf, len);
+                }
+            } else {
+                eb_delete(b, lb.offset, lb.size);
+                eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
+            }
+            b->save_log = saved;
+            eb_addlog(b, LOGOP_WRITE, lb.offset, lb.size);
+            s->offset = lb.offset + lb.size;
+            break;
+        case LOGOP_DELETE:
+            /* we must also disable the log there because the log buffer
+               would be modified BEFORE we insert it by the implicit
+               eb_addlog */
+            saved = b->save_log;
+            b->save_log = 0;
+            eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
+            b->save_log = saved;
+            eb_addlog(b, LOGOP_INSERT, lb.offset, lb.size);
+            s->offset = lb.offset + lb.size;
+            break;
+        case LOGOP_INSERT:
+            eb_delete(b, lb.offset, lb.size);
+            s->offset = lb.offset;
+            break;
+        default:
+            abort();
+        }
+        b->modified = lb.was_modified;
 
-    switch (lb.op) {
-    case LOGOP_WRITE:
-        /* we must disable the log because we want to record a single
-           write (we should have the single operation: eb_write_buffer) */
-        saved = b->save_log;
-        b->save_log = 0;
-        eb_delete(b, lb.offset, lb.size);
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log = saved;
-        eb_addlog(b, LOGOP_WRITE, lb.offset, lb.size);
-        s->offset = lb.offset + lb.size;
-        break;
-    case LOGOP_DELETE:
-        /* we must also disable the log there because the log buffer
-           would be modified BEFORE we insert it by the implicit
-           eb_addlog */
-        saved = b->save_log;
-        b->save_log = 0;
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log = saved;
-        eb_addlog(b, LOGOP_INSERT, lb.offset, lb.size);
-        s->offset = lb.offset + lb.size;
-        break;
-    case LOGOP_INSERT:
-        eb_delete(b, lb.offset, lb.size);
-        s->offset = lb.offset;
-        break;
-    default:
-        abort();
+        /* continue with the previous entry of the group. The log may
+           have been shifted by the replayed entries. */
+        log_index = b->log_current - 1;
+        if (!lb.linked || log_index <= 0)
+            break;
     }
-    
-    b->modified = lb.was_modified;
+    eb_end_undo_group(b);
 }
 
 /************************************************************/
 /* line related functions */
 
+/* PATCH_CHARSET_xxx kind of the buffer charset */
+static int eb_patch_charset(EditBuffer *b)
+{
+    int i;
+
+    if (b->charset == &charset_utf8)
+        return PATCH_CHARSET_UTF8;
+    for (i = 0; i < 256; i++) {
+        if (b->charset_state.table[i] == ESCAPE_CHAR)
+            return PATCH_CHARSET_OTHER;
+    }
+    return PATCH_CHARSET_8BIT;
+}
+
 void eb_set_charset(EditBuffer *b, QECharset *charset)
 {
+    int kind;
+
     if (b->charset) {
         charset_decode_close(&b->charset_state);
     }
     b->charset = charset;
     charset_decode_init(&b->charset_state, charset);
+    if (eb_is_patching(b)) {
+        /* the patches were checked against the counts of the old
+           charset */
+        kind = eb_patch_charset(b);
+        if (kind != b->pages.patch_charset)
+            b->pages.FlushPatches();
+    }
 }
 
 /* XXX: change API to go faster */
@@ -522,6 +763,146 @@ int eb_nextc(EditBuffer *b, int offset, int *next_offset)
     return b->pages.NextChar(&b->charset_state, offset, next_offset);
 }
 
+/* decode the bytes of the page span at r->offset into r->buf. Return
+   the number of decoded chars, 0 at the end of the buffer. */
+int eb_reader_fill(EBReader *r)
+{
+    EditBuffer *b = r->b;
+    CharsetDecodeState *cs = &b->charset_state;
+    const u8 *p, *p_start, *p_end, *q;
+    u8 tmp[MAX_CHAR_BYTES];
+    unsigned int *d;
+    u8 *sz;
+    int len, c, n;
+
+    r->pos = r->len = 0;
+    p = eb_get_span(b, r->offset, &len);
+    if (!p)
+        return 0;
+    /* a char is at least one byte long */
+    if (len > EB_READER_SIZE)
+        len = EB_READER_SIZE;
+    p_start = p;
+    p_end = p + len;
+    d = r->buf;
+    sz = r->size;
+    while (p < p_end) {
+        if (cs->ascii_idem) {
+            /* ASCII fast path: no table lookup while the high bits of
+               a whole block of bytes are clear */
+#ifdef __SSE2__
+            while (p_end - p >= 16) {
+                __m128i v, zero, lo, hi;
+                v = _mm_loadu_si128((const __m128i *)p);
+                if (_mm_movemask_epi8(v))
+                    break;
+                zero = _mm_setzero_si128();
+                lo = _mm_unpacklo_epi8(v, zero);
+                hi = _mm_unpackhi_epi8(v, zero);
+                _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi16(lo, zero));
+                _mm_storeu_si128((__m128i *)(d + 4), _mm_unpackhi_epi16(lo, zero));
+                _mm_storeu_si128((__m128i *)(d + 8), _mm_unpacklo_epi16(hi, zero));
+                _mm_storeu_si128((__m128i *)(d + 12), _mm_unpackhi_epi16(hi, zero));
+                memset(sz, 1, 16);
+                d += 16;
+                sz += 16;
+                p += 16;
+            }
+#endif
+            while (p_end - p >= 8) {
+                uint32_t w0, w1;
+                memcpy(&w0, p, 4);
+                memcpy(&w1, p + 4, 4);
+                if ((w0 | w1) & 0x80808080)
+                    break;
+                d[0] = p[0]; d[1] = p[1]; d[2] = p[2]; d[3] = p[3];
+                d[4] = p[4]; d[5] = p[5]; d[6] = p[6]; d[7] = p[7];
+                memset(sz, 1, 8);
+                d += 8;
+                sz += 8;
+                p += 8;
+            }
+            if (p >= p_end)
+                break;
+        }
+        c = cs->table[*p];
+        n = 1;
+        if (c == ESCAPE_CHAR) {
+            if (p_end - p >= MAX_CHAR_BYTES) {
+                q = p;
+                c = cs->decode_func(cs, &q);
+                n = q - p;
+            } else {
+                /* the char may span two pages: decode it alone from
+                   a copy, as eb_nextc() does */
+                if (d > r->buf)
+                    break;
+                memset(tmp, 0, sizeof(tmp));
+                b->pages.Read(r->offset + (p - p_start), tmp, MAX_CHAR_BYTES);
+                q = tmp;
+                c = cs->decode_func(cs, &q);
+                n = q - tmp;
+            }
+        }
+        *d++ = c;
+        *sz++ = n;
+        p += n;
+    }
+    r->len = d - r->buf;
+    r->next_offset = r->offset + (p - p_start);
+    return r->len;
+}
+
+/* convert the buffer contents to 'charset' in a single pass: the
+   decoded blocks are encoded into new pages which then replace the
+   pages of the buffer. This is logged as a deletion followed by an
+   insertion. */
+void eb_convert_charset(EditBuffer *b, QECharset *charset)
+{
+    EBReader r1, *r = &r1;
+    Pages *pages;
+    u8 buf[EB_READER_SIZE * MAX_CHAR_BYTES];
+    u8 *page;
+    int total, n, len, len1, page_size;
+
+    pages = new Pages();
+    total = eb_total_size(b);
+    page = NULL;
+    page_size = 0;
+    eb_reader_init(r, b, 0);
+    while (r->offset < total) {
+        n = eb_reader_fill(r);
+        if (n <= 0)
+            break;
+        r->offset = r->next_offset;
+        len = charset_encode_block(charset, buf, r->buf, n);
+        /* split the encoded bytes into full pages */
+        for (n = 0; n < len;) {
+            if (!page) {
+                page = (u8*)malloc(MAX_PAGE_SIZE);
+                page_size = 0;
+            }
+            len1 = min(len - n, MAX_PAGE_SIZE - page_size);
+            memcpy(page + page_size, buf + n, len1);
+            page_size += len1;
+            n += len1;
+            if (page_size == MAX_PAGE_SIZE) {
+                pages->AppendPage(page, page_size);
+                page = NULL;
+            }
+        }
+    }
+    if (page)
+        pages->AppendPage((u8*)realloc(page, page_size), page_size);
+    r->pos = r->len = 0;
+
+    eb_delete(b, 0, total);
+    eb_addlog(b, LOGOP_INSERT, 0, pages->total_size);
+    b->pages.TakePages(pages);
+    delete pages;
+    eb_set_charset(b, charset);
+}
+
 /* XXX: only UTF8 charset is supported */
 /* XXX: suppress that */
 int eb_prevc(EditBuffer *b, int offset, int *prev_offset)
@@ -726,7 +1107,8 @@ int mmap_buffer(EditBuffer *b, const char *filename)
 #endif
 
 #ifdef WIN32
-    file_handle = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    /* FILE_SHARE_WRITE so that patches can be saved in place */
+    file_handle = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
     if (INVALID_HANDLE_VALUE == file_handle)
         return -1;
     file_mapping = CreateFileMapping(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
@@ -795,6 +1177,114 @@ int mmap_buffer(EditBuffer *b, const char *filename)
     return 0;
 }
 
+/* switch a mmapped buffer to patch mode: overwritten bytes are kept in
+   an overlay and saved in place (see Pages::EnablePatches) */
+int eb_enable_patches(EditBuffer *b)
+{
+#ifdef WIN32
+    if (b->file_handle == 0)
+        return -1;
+#else
+    if (b->file_handle <= 0)
+        return -1;
+#endif
+    if (!b->pages.EnablePatches(eb_patch_charset(b)))
+        return -1;
+    return 0;
+}
+
+/* true if the patches of 'b' can be written in place to 'filename':
+   it must be the file that the pages map */
+int eb_patches_in_place(EditBuffer *b, const char *filename)
+{
+#ifdef WIN32
+    BY_HANDLE_FILE_INFORMATION info1, info2;
+    HANDLE fh;
+    int ret;
+
+    if (!eb_is_patching(b))
+        return 0;
+    fh = CreateFile(filename, 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                    NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (INVALID_HANDLE_VALUE == fh)
+        return 0;
+    ret = GetFileInformationByHandle(b->file_handle, &info1) &&
+        GetFileInformationByHandle(fh, &info2) &&
+        info1.dwVolumeSerialNumber == info2.dwVolumeSerialNumber &&
+        info1.nFileIndexHigh == info2.nFileIndexHigh &&
+        info1.nFileIndexLow == info2.nFileIndexLow;
+    CloseHandle(fh);
+    return ret;
+#else
+    struct stat st1, st2;
+
+    if (!eb_is_patching(b))
+        return 0;
+    return fstat(b->file_handle, &st1) == 0 &&
+        stat(filename, &st2) == 0 &&
+        st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+#endif
+}
+
+/* write the patched bytes back into 'filename' in place. Only the
+   patched ranges are written, the file size does not change */
+static int eb_save_patches(EditBuffer *b, const char *filename)
+{
+    int i, n, start, count, ret;
+    u8 buf[IOBUF_SIZE];
+#ifdef WIN32
+    HANDLE fh;
+    OVERLAPPED ov;
+    DWORD written;
+
+    fh = CreateFile(filename, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                    NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (INVALID_HANDLE_VALUE == fh)
+        return -1;
+#else
+    int fd;
+
+    fd = open(filename, O_WRONLY);
+    if (fd < 0)
+        return -1;
+#endif
+    ret = 0;
+    count = b->pages.PatchCount();
+    for (i = 0; i < count; ) {
+        /* gather a run of contiguous patches */
+        start = b->pages.PatchAt(i)->offset;
+        n = 0;
+        while (i < count && n < IOBUF_SIZE &&
+               b->pages.PatchAt(i)->offset == start + n) {
+            buf[n++] = b->pages.PatchAt(i)->ch;
+            i++;
+        }
+#ifdef WIN32
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = start;
+        if (!WriteFile(fh, buf, n, &written, &ov) || (int)written != n) {
+            ret = -1;
+            break;
+        }
+#else
+        if (pwrite(fd, buf, n, start) != n) {
+            ret = -1;
+            break;
+        }
+#endif
+    }
+#ifdef WIN32
+    CloseHandle(fh);
+#else
+    close(fd);
+#endif
+    if (ret == 0) {
+        /* the mapping now shows the patched file */
+        b->pages.ClearPatches();
+    }
+    return ret;
+}
+
 static int raw_load_buffer(EditBuffer *b, FILE *f)
 {
     int ret;
@@ -846,7 +1336,11 @@ void set_filename(EditBuffer *b, const char *filename)
 {
     const char *p;
 
+    /* patches can only be saved in place to the mapped file */
+    if (strcmp(b->filename, filename))
+        b->pages.FlushPatches();
     pstrcpy(b->filename, sizeof(b->filename), filename);
+    eb_set_file_id(b);
     p = basename(filename);
     set_buffer_name(b, p);
 }
@@ -896,23 +1390,23 @@ int eb_get_str(EditBuffer *b, char *buf, int buf_size)
 int eb_get_line(EditBuffer *b, unsigned int *buf, int buf_size,
                 int *offset_ptr)
 {
+    EBReader r1, *r = &r1;
     int c;
     unsigned int *buf_ptr, *buf_end;
-    int offset;
     
-    offset = *offset_ptr;
+    eb_reader_init(r, b, *offset_ptr);
 
     /* record line */
     buf_ptr = buf;
     buf_end = buf + buf_size;
     for (;;) {
-        c = eb_nextc(b, offset, &offset);
+        c = eb_readc(r);
         if (c == '\n')
             break;
         if (buf_ptr < buf_end)
             *buf_ptr++ = c;
     }
-    *offset_ptr = offset;
+    *offset_ptr = r->offset;
     return buf_ptr - buf;
 }
 
@@ -921,46 +1415,55 @@ int eb_get_line(EditBuffer *b, unsigned int *buf, int buf_size,
 int eb_get_strline(EditBuffer *b, char *buf, int buf_size,
                    int *offset_ptr)
 {
+    EBReader r1, *r = &r1;
     int c;
     char *buf_ptr, *buf_end;
-    int offset;
     
-    offset = *offset_ptr;
+    eb_reader_init(r, b, *offset_ptr);
 
     /* record line */
     buf_ptr = buf;
     buf_end = buf + buf_size - 1;
     for (;;) {
-        c = eb_nextc(b, offset, &offset);
+        c = eb_readc(r);
         if (c == '\n')
             break;
         if (buf_ptr < buf_end)
             *buf_ptr++ = c;
     }
     *buf_ptr = '\0';
-    *offset_ptr = offset;
+    *offset_ptr = r->offset;
     return buf_ptr - buf;
 }
 
 int eb_goto_bol(EditBuffer *b, int offset)
 {
-    int c, offset1;
+    const u8 *p, *q;
+    int len;
 
+    /* a '\n' byte is never part of a multi byte char, so the spans
+       can be scanned backward without decoding them */
     for (;;) {
-        c = eb_prevc(b, offset, &offset1);
-        if (c == '\n')
+        p = eb_get_span_before(b, offset, &len);
+        if (!p)
             break;
-        offset = offset1;
+        for (q = p + len; q > p; q--) {
+            if (q[-1] == '\n')
+                return offset - (p + len - q);
+        }
+        offset -= len;
     }
     return offset;
 }
 
 int eb_is_empty_line(EditBuffer *b, int offset)
 {
+    EBReader r1, *r = &r1;
     int c;
 
+    eb_reader_init(r, b, offset);
     for (;;) {
-        c = eb_nextc(b, offset, &offset);
+        c = eb_readc(r);
         if (c == '\n')
             return 1;
         if (!isspace(c))
@@ -971,13 +1474,14 @@ int eb_is_empty_line(EditBuffer *b, int offset)
 
 int eb_is_empty_from_to(EditBuffer *b, int offset_start, int offset_end)
 {
+    EBReader r1, *r = &r1;
     int c;
-    int offset = offset_start;
 
+    eb_reader_init(r, b, offset_start);
     for (;;) {
-        if (offset >= offset_end)
+        if (r->offset >= offset_end)
             return 1;
-        c = eb_nextc(b, offset, &offset);
+        c = eb_readc(r);
         if (c == '\n')
             return 1;
         if (!isspace(c))
@@ -988,13 +1492,12 @@ int eb_is_empty_from_to(EditBuffer *b, int offset_start, int offset_end)
 
 int eb_next_line(EditBuffer *b, int offset)
 {
-    int c;
-    for (;;) {
-        c = eb_nextc(b, offset, &offset);
-        if (c == '\n')
-            break;
-    }
-    return offset;
+    EBReader r1, *r = &r1;
+
+    eb_reader_init(r, b, offset);
+    while (eb_readc(r) != '\n')
+        continue;
+    return r->offset;
 }
 
 /* buffer data type handling */
@@ -1105,6 +1608,19 @@ int save_buffer(EditBuffer *b)
         return -1;
 
     filename = b->filename;
+
+    /* in patch mode, only the patched bytes are written, in place */
+    if (eb_patches_in_place(b, filename)) {
+        ret = eb_save_patches(b, filename);
+        if (ret < 0)
+            return ret;
+        eb_log_reset(b);
+        b->modified = 0;
+        return 0;
+    }
+    /* any other file gets the whole buffer */
+    b->pages.FlushPatches();
+
     /* get old file permission */
     mode = 0644;
     if (stat(filename, &st) == 0)
@@ -1122,6 +1638,8 @@ int save_buffer(EditBuffer *b)
     /* set correct file mode to old file permissions */
     chmod(filename, mode);
 #endif
+    /* the file was created or replaced: update its identity */
+    eb_set_file_id(b);
     /* reset log */
     eb_log_reset(b);
     b->modified = 0;
@@ -44,6 +44,21 @@ typedef struct EditBufferCallbackList {
 #define BF_SAVING    0x0020  /* buffer is being saved */
 #define BF_DIRED     0x0100  /* buffer is interactive dired */
 
+/* buffer registry: buffers are also chained in hash tables by name, by
+   file name and by file identity (device and inode) */
+enum {
+    EB_LINK_NAME,
+    EB_LINK_FILE,
+    EB_LINK_ID,
+    EB_LINK_NB
+};
+
+typedef struct EditBufferLink {
+    EditBuffer *next;       /* next buffer in the same hash chain */
+    unsigned int hash;
+    int linked;             /* true if in the hash table */
+} EditBufferLink;
+
 class EditBuffer {
 public:
     Pages pages;
@@ -72,7 +87,9 @@ public:
     int save_log;    /* if true, each buffer operation is loged */
     int log_new_index, log_current;
     EditBuffer *log_buffer;
-    int nb_logs;
+    int nb_logs;     /* number of undo steps in the log */
+    int log_group;   /* nesting level of undo groups */
+    int log_group_start; /* true if next entry starts the group */
 
     /* modification callbacks */
     EditBufferCallbackList *first_callback;
@@ -95,9 +112,17 @@ public:
     struct ModeSavedData *saved_data; 
 
     EditBuffer *next; /* next editbuffer in qe_state buffer list */
+    EditBuffer *prev; /* previous editbuffer in qe_state buffer list */
     char name[256];     /* buffer name */
     char filename[MAX_FILENAME_SIZE]; /* file name */
 
+    EditBufferLink links[EB_LINK_NB];
+    /* identity of the file when it was last opened or saved, to find it
+       under another name. file_ino is 0 if unknown */
+    int64_t file_dev;
+    int64_t file_ino;
+    int name_suffix;    /* last <n> suffix made from this name */
+
     EditBuffer() {
         mark = 0;
         modified = 0;
@@ -114,6 +139,7 @@ public:
         log_new_index = log_current = 0;
         log_buffer = 0;
         nb_logs = 0;
+        log_group = log_group_start = 0;
         first_callback = NULL;
         io_state = NULL;
         probed = 0;
@@ -121,8 +147,13 @@ public:
         close = NULL;
         saved_data = NULL;
         next = NULL;
+        prev = NULL;
         name[0] = 0;
         filename[0] = 0;
+        memset(links, 0, sizeof(links));
+        file_dev = 0;
+        file_ino = 0;
+        name_suffix = 0;
     }
 
 };
@@ -163,8 +194,12 @@ int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, int offset);
 int eb_goto_char(EditBuffer *b, int pos);
 int eb_get_char_offset(EditBuffer *b, int offset);
 void do_undo(struct EditState *s);
+void eb_begin_undo_group(EditBuffer *b);
+void eb_end_undo_group(EditBuffer *b);
 
 int raw_load_buffer1(EditBuffer *b, FILE *f, int offset);
+int eb_enable_patches(EditBuffer *b);
+int eb_patches_in_place(EditBuffer *b, const char *filename);
 int save_buffer(EditBuffer *b);
 void set_buffer_name(EditBuffer *b, const char *name1);
 void set_filename(EditBuffer *b, const char *filename);
@@ -200,5 +235,55 @@ static inline int eb_total_size(EditBuffer *b) {
     return b->pages.total_size;
 }
 
+/* true if the buffer is in patch mode (see eb_enable_patches) */
+static inline int eb_is_patching(EditBuffer *b) {
+    return b->pages.patches != NULL;
+}
+
+/* direct read only access to the bytes at 'offset': see Pages::GetSpan */
+static inline const u8 *eb_get_span(EditBuffer *b, int offset, int *len_ptr) {
+    return b->pages.GetSpan(offset, len_ptr);
+}
+
+/* same for the bytes just before 'offset' */
+static inline const u8 *eb_get_span_before(EditBuffer *b, int offset,
+                                           int *len_ptr) {
+    return b->pages.GetSpanBefore(offset, len_ptr);
+}
+
+/* Sequential character reader: the buffer is decoded by page spans
+   into 'buf' instead of one eb_nextc() call per character. As with
+   eb_nextc(), '\n' is returned at the end of the buffer. The reader
+   must be initialized again after a buffer modification. */
+#define EB_READER_SIZE 256
+
+typedef struct EBReader {
+    EditBuffer *b;
+    int offset;    /* offset of the next char returned by eb_readc() */
+    int pos, len;  /* chars not yet returned: buf[pos] to buf[len - 1] */
+    int next_offset; /* offset after buf[len - 1] */
+    unsigned int buf[EB_READER_SIZE];
+    u8 size[EB_READER_SIZE]; /* byte size of each decoded char */
+} EBReader;
+
+static inline void eb_reader_init(EBReader *r, EditBuffer *b, int offset) {
+    r->b = b;
+    r->offset = offset;
+    r->pos = r->len = 0;
+}
+
+int eb_reader_fill(EBReader *r);
+void eb_convert_charset(EditBuffer *b, QECharset *charset);
+
+/* return the next char and advance r->offset */
+static inline int eb_readc(EBReader *r) {
+    if (r->pos >= r->len && eb_reader_fill(r) <= 0) {
+        r->offset = eb_total_size(r->b);
+        return '\n';
+    }
+    r->offset += r->size[r->pos];
+    return r->buf[r->pos++];
+}
+
 #endif
 
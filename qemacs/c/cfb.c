@@ -45,6 +45,374 @@ static unsigned int cfb24_get_color(unsigned int color)
     return color & 0xffffff;
 }
 
+/* row kernels. 'col' is the pixel value, duplicated in both halves
+   for 16 bit pixels. Glyph pixels are drawn if their value is >= 0x80 */
+
+static void cfb16_fill_row(unsigned char *d, int n, unsigned int col)
+{
+    if (((long)d & 3) != 0 && n > 0) {
+        ((short *)d)[0] = col;
+        d += 2;
+        n--;
+    }
+    while (n >= 8) {
+        ((int *)d)[0] = col;
+        ((int *)d)[1] = col;
+        ((int *)d)[2] = col;
+        ((int *)d)[3] = col;
+        d += 16;
+        n -= 8;
+    }
+    while (n > 0) {
+        ((short *)d)[0] = col;
+        d += 2;
+        n--;
+    }
+}
+
+static void cfb32_fill_row(unsigned char *d, int n, unsigned int col)
+{
+    while (n >= 4) {
+        ((int *)d)[0] = col;
+        ((int *)d)[1] = col;
+        ((int *)d)[2] = col;
+        ((int *)d)[3] = col;
+        d += 16;
+        n -= 4;
+    }
+    while (n > 0) {
+        ((int *)d)[0] = col;
+        d += 4;
+        n--;
+    }
+}
+
+static void cfb16_glyph_row(unsigned char *d, const unsigned char *s,
+                            int n, unsigned int col)
+{
+    while (n >= 4) {
+        if (s[0] >= 0x80)
+            ((short *)d)[0] = col;
+        if (s[1] >= 0x80)
+            ((short *)d)[1] = col;
+        if (s[2] >= 0x80)
+            ((short *)d)[2] = col;
+        if (s[3] >= 0x80)
+            ((short *)d)[3] = col;
+        s += 4;
+        d += 4 * 2;
+        n -= 4;
+    }
+    while (n > 0) {
+        if (s[0] >= 0x80)
+            ((short *)d)[0] = col;
+        s++;
+        d += 2;
+        n--;
+    }
+}
+
+static void cfb32_glyph_row(unsigned char *d, const unsigned char *s,
+                            int n, unsigned int col)
+{
+    while (n >= 4) {
+        if (s[0] >= 0x80)
+            ((int *)d)[0] = col;
+        if (s[1] >= 0x80)
+            ((int *)d)[1] = col;
+        if (s[2] >= 0x80)
+            ((int *)d)[2] = col;
+        if (s[3] >= 0x80)
+            ((int *)d)[3] = col;
+        s += 4;
+        d += 4 * 4;
+        n -= 4;
+    }
+    while (n > 0) {
+        if (s[0] >= 0x80)
+            ((int *)d)[0] = col;
+        s++;
+        d += 4;
+        n--;
+    }
+}
+
+#if defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__i386__) || defined(__x86_64__))
+#define CONFIG_CFB_SSE2
+#include <emmintrin.h>
+#if __GNUC__ >= 5
+/* AVX2 kernels are compiled with the target attribute and selected
+   at runtime */
+#define CONFIG_CFB_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+#ifdef CONFIG_CFB_SSE2
+
+/* 8 pixels per step */
+static void cfb16_fill_row_sse2(unsigned char *d, int n, unsigned int col)
+{
+    __m128i c = _mm_set1_epi32(col);
+
+    while (n >= 8) {
+        _mm_storeu_si128((__m128i *)d, c);
+        d += 16;
+        n -= 8;
+    }
+    cfb16_fill_row(d, n, col);
+}
+
+/* 16 pixels per step */
+static void cfb32_fill_row_sse2(unsigned char *d, int n, unsigned int col)
+{
+    __m128i c = _mm_set1_epi32(col);
+
+    while (n >= 16) {
+        _mm_storeu_si128((__m128i *)d, c);
+        _mm_storeu_si128((__m128i *)(d + 16), c);
+        _mm_storeu_si128((__m128i *)(d + 32), c);
+        _mm_storeu_si128((__m128i *)(d + 48), c);
+        d += 64;
+        n -= 16;
+    }
+    cfb32_fill_row(d, n, col);
+}
+
+/* the sign bit of each glyph byte is the pixel mask. Duplicating the
+   bytes gives 16 bit and 32 bit masks */
+static void cfb16_glyph_row_sse2(unsigned char *d, const unsigned char *s,
+                                 int n, unsigned int col)
+{
+    __m128i c = _mm_set1_epi32(col);
+    __m128i g, m, v;
+
+    while (n >= 8) {
+        g = _mm_loadl_epi64((const __m128i *)s);
+        m = _mm_srai_epi16(_mm_unpacklo_epi8(g, g), 15);
+        v = _mm_loadu_si128((__m128i *)d);
+        v = _mm_or_si128(_mm_and_si128(m, c), _mm_andnot_si128(m, v));
+        _mm_storeu_si128((__m128i *)d, v);
+        s += 8;
+        d += 16;
+        n -= 8;
+    }
+    cfb16_glyph_row(d, s, n, col);
+}
+
+static void cfb32_glyph_row_sse2(unsigned char *d, const unsigned char *s,
+                                 int n, unsigned int col)
+{
+    __m128i c = _mm_set1_epi32(col);
+    __m128i g, g16, m, v;
+    int i;
+
+    while (n >= 16) {
+        g = _mm_loadu_si128((const __m128i *)s);
+        if (_mm_movemask_epi8(g) != 0) {
+            for (i = 0; i < 2; i++) {
+                g16 = (i == 0) ? _mm_unpacklo_epi8(g, g) : 
+                    _mm_unpackhi_epi8(g, g);
+                m = _mm_srai_epi32(_mm_unpacklo_epi16(g16, g16), 31);
+                v = _mm_loadu_si128((__m128i *)d);
+                v = _mm_or_si128(_mm_and_si128(m, c), _mm_andnot_si128(m, v));
+                _mm_storeu_si128((__m128i *)d, v);
+                m = _mm_srai_epi32(_mm_unpackhi_epi16(g16, g16), 31);
+                v = _mm_loadu_si128((__m128i *)(d + 16));
+                v = _mm_or_si128(_mm_and_si128(m, c), _mm_andnot_si128(m, v));
+                _mm_storeu_si128((__m128i *)(d + 16), v);
+                d += 32;
+            }
+        } else {
+            d += 64;
+        }
+        s += 16;
+        n -= 16;
+    }
+    cfb32_glyph_row(d, s, n, col);
+}
+
+#endif /* CONFIG_CFB_SSE2 */
+
+#ifdef CONFIG_CFB_AVX2
+
+/* 16 pixels per step */
+static __attribute__((target("avx2"))) 
+void cfb16_fill_row_avx2(unsigned char *d, int n, unsigned int col)
+{
+    __m256i c = _mm256_set1_epi32(col);
+
+    while (n >= 16) {
+        _mm256_storeu_si256((__m256i *)d, c);
+        d += 32;
+        n -= 16;
+    }
+    cfb16_fill_row(d, n, col);
+}
+
+static __attribute__((target("avx2"))) 
+void cfb32_fill_row_avx2(unsigned char *d, int n, unsigned int col)
+{
+    __m256i c = _mm256_set1_epi32(col);
+
+    while (n >= 16) {
+        _mm256_storeu_si256((__m256i *)d, c);
+        _mm256_storeu_si256((__m256i *)(d + 32), c);
+        d += 64;
+        n -= 16;
+    }
+    cfb32_fill_row(d, n, col);
+}
+
+static __attribute__((target("avx2"))) 
+void cfb16_glyph_row_avx2(unsigned char *d, const unsigned char *s,
+                          int n, unsigned int col)
+{
+    __m256i c = _mm256_set1_epi32(col);
+    __m256i m, v;
+
+    while (n >= 16) {
+        /* XXX: the byte intrinsics (cvtepi8, blendv) do not work
+           with -funsigned-char on some gcc versions */
+        m = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)s));
+        m = _mm256_srai_epi16(_mm256_slli_epi16(m, 8), 15);
+        v = _mm256_loadu_si256((__m256i *)d);
+        v = _mm256_or_si256(_mm256_and_si256(m, c), _mm256_andnot_si256(m, v));
+        _mm256_storeu_si256((__m256i *)d, v);
+        s += 16;
+        d += 32;
+        n -= 16;
+    }
+    cfb16_glyph_row(d, s, n, col);
+}
+
+/* 8 pixels per step with a masked store */
+static __attribute__((target("avx2"))) 
+void cfb32_glyph_row_avx2(unsigned char *d, const unsigned char *s,
+                          int n, unsigned int col)
+{
+    __m256i c = _mm256_set1_epi32(col);
+    __m256i m;
+
+    while (n >= 8) {
+        /* only the sign bit of the mask is used */
+        m = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)s));
+        _mm256_maskstore_epi32((int *)d, _mm256_slli_epi32(m, 24), c);
+        s += 8;
+        d += 32;
+        n -= 8;
+    }
+    cfb32_glyph_row(d, s, n, col);
+}
+
+#endif /* CONFIG_CFB_AVX2 */
+
+/* Self check of the SIMD row kernels: compare them with the scalar
+   kernels for every row length up to CFB_CHECK_MAX_LEN pixels, at
+   every pixel alignment, on random pixels and glyph bytes. The glyph
+   bytes are biased towards 0x00, 0x7f, 0x80 and 0xff. */
+
+#define CFB_CHECK_MAX_LEN 70
+
+typedef struct CFBKernels {
+    const char *name;
+    int bpp;
+    void (*fill_row)(unsigned char *d, int n, unsigned int col);
+    void (*glyph_row)(unsigned char *d, const unsigned char *s,
+                      int n, unsigned int col);
+} CFBKernels;
+
+static unsigned int cfb_check_seed;
+
+static unsigned int cfb_check_rand(void)
+{
+    cfb_check_seed = cfb_check_seed * 1103515245 + 12345;
+    return cfb_check_seed >> 8;
+}
+
+static int cfb_check_kernel(const CFBKernels *ref, const CFBKernels *k,
+                            int do_glyph)
+{
+    static const unsigned char glyph_values[4] = { 0x00, 0x7f, 0x80, 0xff };
+    unsigned char buf1[(CFB_CHECK_MAX_LEN + 8) * 4];
+    unsigned char buf2[(CFB_CHECK_MAX_LEN + 8) * 4];
+    unsigned char glyph[CFB_CHECK_MAX_LEN + 32];
+    unsigned int col, r;
+    int n, align, i, pass, errors;
+
+    errors = 0;
+    for (pass = 0; pass < 8; pass++) {
+        for (align = 0; align < 4; align++) {
+            for (n = 0; n <= CFB_CHECK_MAX_LEN; n++) {
+                for (i = 0; i < (int)sizeof(buf1); i++)
+                    buf1[i] = buf2[i] = cfb_check_rand();
+                for (i = 0; i < (int)sizeof(glyph); i++) {
+                    r = cfb_check_rand();
+                    glyph[i] = (r & 1) ? glyph_values[(r >> 1) & 3] : r >> 3;
+                }
+                col = cfb_check_rand();
+                if (ref->bpp == 2)
+                    col = (col & 0xffff) * 0x10001;
+                if (do_glyph) {
+                    ref->glyph_row(buf1 + align * ref->bpp, glyph, n, col);
+                    k->glyph_row(buf2 + align * ref->bpp, glyph, n, col);
+                } else {
+                    ref->fill_row(buf1 + align * ref->bpp, n, col);
+                    k->fill_row(buf2 + align * ref->bpp, n, col);
+                }
+                if (memcmp(buf1, buf2, sizeof(buf1)) != 0) {
+                    if (errors < 10) {
+                        fprintf(stderr, "cfb: %s %s row differs: "
+                                "length=%d alignment=%d\n", k->name,
+                                do_glyph ? "glyph" : "fill", n, align);
+                    }
+                    errors++;
+                }
+            }
+        }
+    }
+    return errors;
+}
+
+/* return the number of mismatches found, 0 if the kernels are right */
+int cfb_check_kernels(void)
+{
+    static const CFBKernels scalar16 = {
+        "scalar16", 2, cfb16_fill_row, cfb16_glyph_row };
+    static const CFBKernels scalar32 = {
+        "scalar32", 4, cfb32_fill_row, cfb32_glyph_row };
+    static const CFBKernels kernels[] = {
+#ifdef CONFIG_CFB_SSE2
+        { "sse2_16", 2, cfb16_fill_row_sse2, cfb16_glyph_row_sse2 },
+        { "sse2_32", 4, cfb32_fill_row_sse2, cfb32_glyph_row_sse2 },
+#endif
+#ifdef CONFIG_CFB_AVX2
+        { "avx2_16", 2, cfb16_fill_row_avx2, cfb16_glyph_row_avx2 },
+        { "avx2_32", 4, cfb32_fill_row_avx2, cfb32_glyph_row_avx2 },
+#endif
+        { NULL, 0, NULL, NULL },
+    };
+    const CFBKernels *k, *ref;
+    int errors;
+
+    cfb_check_seed = 1;
+    errors = 0;
+    for (k = kernels; k->name != NULL; k++) {
+#ifdef CONFIG_CFB_AVX2
+        if (!strncmp(k->name, "avx2", 4) && !__builtin_cpu_supports("avx2")) {
+            fprintf(stderr, "cfb: %s skipped, no AVX2 support\n", k->name);
+            continue;
+        }
+#endif
+        ref = (k->bpp == 2) ? &scalar16 : &scalar32;
+        errors += cfb_check_kernel(ref, k, 0);
+        errors += cfb_check_kernel(ref, k, 1);
+        fprintf(stderr, "cfb: %s checked\n", k->name);
+    }
+    return errors;
+}
+
 static void cfb16_fill_rectangle(QEditScreen *s,
                                  int x1, int y1, int w, int h, QEColor color)
 {
@@ -69,28 +437,7 @@ static void cfb16_fill_rectangle(QEditScreen *s,
         }
     } else {
         for (y = 0; y < h; y++) {
-            d = dest;
-            n = w;
-            
-            if (((int)d & 3) != 0) {
-                ((short *)d)[0] = col;
-                d += 2;
-                n--;
-            }
-            
-            while (n >= 8) {
-                ((int *)d)[0] = col;
-                ((int *)d)[1] = col;
-                ((int *)d)[2] = col;
-                ((int *)d)[3] = col;
-                d += 16;
-                n -= 8;
-            }
-            while (n > 0) {
-                ((short *)d)[0] = col;
-                d += 2;
-                n--;
-            }
+            cfb->fill_row(dest, w, col);
             dest += cfb->wrap;
         }
     }
@@ -111,28 +458,14 @@ static void cfb32_fill_rectangle(QEditScreen *s,
         for (y = 0; y < h; y++) {
             d = dest;
             for (n = w; n != 0; n--) {
-                ((short *)d)[0] ^= 0x00ffffff;
+                ((int *)d)[0] ^= 0x00ffffff;
                 d += 4;
             }
             dest += cfb->wrap;
         }
     } else {
         for (y = 0; y < h; y++) {
-            d = dest;
-            n = w;
-            while (n >= 4) {
-                ((int *)d)[0] = col;
-                ((int *)d)[1] = col;
-                ((int *)d)[2] = col;
-                ((int *)d)[3] = col;
-                d += 16;
-                n -= 4;
-            }
-            while (n > 0) {
-                ((int *)d)[0] = col;
-                d += 4;
-                n--;
-            }
+            cfb->fill_row(dest, w, col);
             dest += cfb->wrap;
         }
     }
@@ -143,41 +476,17 @@ static void cfb16_draw_glyph(QEditScreen *s1,
                              unsigned char *glyph, int glyph_wrap)
 {
     CFBContext *cfb = s1->private;
-    unsigned char *dest, *d, *s, *src;
-    int n;
+    unsigned char *dest;
     unsigned int col;
 
     col = cfb->get_color(color);
+    col = (col << 16) | col;
     dest = cfb->base + y1 * cfb->wrap + x1 * 2;
-    src = glyph;
 
     while (h > 0) {
-        n = w;
-        s = src;
-        d = dest;
-        while (n >= 4) {
-            if (s[0] >= 0x80)
-                ((short *)d)[0] = col;
-            if (s[1] >= 0x80)
-                ((short *)d)[1] = col;
-            if (s[2] >= 0x80)
-                ((short *)d)[2] = col;
-            if (s[3] >= 0x80)
-                ((short *)d)[3] = col;
-            s += 4;
-            d += 4 * 2;
-            n -= 4;
-        }
-        while (n > 0) {
-            if (s[0] >= 0x80)
-                ((short *)d)[0] = col;
-            s++;
-            d += 2;
-            n--;
-        }
-
+        cfb->glyph_row(dest, glyph, w, col);
         h--;
-        src += glyph_wrap;
+        glyph += glyph_wrap;
         dest += cfb->wrap;
     }
 }
@@ -187,45 +496,54 @@ static void cfb32_draw_glyph(QEditScreen *s1,
                              unsigned char *glyph, int glyph_wrap)
 {
     CFBContext *cfb = s1->private;
-    unsigned char *dest, *d, *s, *src;
-    int n;
+    unsigned char *dest;
     unsigned int col;
 
     col = cfb->get_color(color);
     dest = cfb->base + y1 * cfb->wrap + x1 * 4;
-    src = glyph;
 
     while (h > 0) {
-        n = w;
-        s = src;
-        d = dest;
-        while (n >= 4) {
-            if (s[0] >= 0x80)
-                ((int *)d)[0] = col;
-            if (s[1] >= 0x80)
-                ((int *)d)[1] = col;
-            if (s[2] >= 0x80)
-                ((int *)d)[2] = col;
-            if (s[3] >= 0x80)
-                ((int *)d)[3] = col;
-            s += 4;
-            d += 4 * 4;
-            n -= 4;
-        }
-        while (n > 0) {
-            if (s[0] >= 0x80)
-                ((int *)d)[0] = col;
-            s++;
-            d += 4;
-            n--;
-        }
-
+        cfb->glyph_row(dest, glyph, w, col);
         h--;
-        src += glyph_wrap;
+        glyph += glyph_wrap;
         dest += cfb->wrap;
     }
 }
 
+/* select the row kernels for the pixel size and the CPU */
+void cfb_set_kernels(QEditScreen *s)
+{
+    CFBContext *cfb = s->private;
+
+    if (cfb->bpp == 2) {
+        cfb->fill_row = cfb16_fill_row;
+        cfb->glyph_row = cfb16_glyph_row;
+#ifdef CONFIG_CFB_SSE2
+        cfb->fill_row = cfb16_fill_row_sse2;
+        cfb->glyph_row = cfb16_glyph_row_sse2;
+#endif
+#ifdef CONFIG_CFB_AVX2
+        if (__builtin_cpu_supports("avx2")) {
+            cfb->fill_row = cfb16_fill_row_avx2;
+            cfb->glyph_row = cfb16_glyph_row_avx2;
+        }
+#endif
+    } else {
+        cfb->fill_row = cfb32_fill_row;
+        cfb->glyph_row = cfb32_glyph_row;
+#ifdef CONFIG_CFB_SSE2
+        cfb->fill_row = cfb32_fill_row_sse2;
+        cfb->glyph_row = cfb32_glyph_row_sse2;
+#endif
+#ifdef CONFIG_CFB_AVX2
+        if (__builtin_cpu_supports("avx2")) {
+            cfb->fill_row = cfb32_fill_row_avx2;
+            cfb->glyph_row = cfb32_glyph_row_avx2;
+        }
+#endif
+    }
+}
+
 static void cfb_draw_text(QEditScreen *s, QEFont *font,
                           int x_start, int y, const unsigned int *str, int len,
                           QEColor color)
@@ -337,6 +655,8 @@ int cfb_init(QEditScreen *s,
         break;
     }
 
+    cfb_set_kernels(s);
+
     s->dpy.dpy_set_clip = cfb_set_clip;
     s->dpy.dpy_draw_text = cfb_draw_text;
 
@@ -8,7 +8,13 @@ typedef struct CFBContext {
     void (*draw_glyph)(QEditScreen *s1,
                        int x1, int y1, int w, int h, QEColor color,
                        unsigned char *glyph, int glyph_wrap);
+    /* row kernels, selected by cfb_set_kernels() */
+    void (*fill_row)(unsigned char *d, int n, unsigned int col);
+    void (*glyph_row)(unsigned char *d, const unsigned char *s, 
+                      int n, unsigned int col);
 } CFBContext;
 
 int cfb_init(QEditScreen *s, 
              void *base, int wrap, int depth, const char *font_path);
+void cfb_set_kernels(QEditScreen *s);
+int cfb_check_kernels(void);
@@ -17,6 +17,9 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 #include "qe.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 QECharset *first_charset = NULL;
 
@@ -319,6 +322,16 @@ void charset_decode_init(CharsetDecodeState *s, QECharset *charset)
     s->decode_func = charset->decode_func;
     if (charset->decode_init)
         charset->decode_init(s);
+
+    /* ASCII text can then be decoded without the table (see
+       eb_reader_fill()) */
+    s->ascii_idem = 0;
+    if (s->table) {
+        int i;
+        for (i = 0; i < 0x80 && s->table[i] == i; i++)
+            continue;
+        s->ascii_idem = (i == 0x80);
+    }
 }
 
 void charset_decode_close(CharsetDecodeState *s)
@@ -330,34 +343,461 @@ void charset_decode_close(CharsetDecodeState *s)
     memset(s, 0, sizeof(CharsetDecodeState));
 }
 
-/* detect the charset. Actually only UTF8 is detected */
-QECharset *detect_charset (const unsigned char *buf, int size)
+/************************************************************/
+/* charset detection */
+
+/* The detection only looks at a bounded number of samples spread over
+   the data. UTF-8 is selected if all the samples are valid UTF-8.
+   Otherwise each registered charset decodes the samples and gets a
+   score from the classes of consecutive decoded chars: letters of the
+   same script following each other and lower case letters score,
+   symbols, controls and undecodable bytes cost. */
+
+#define DETECT_NB_SAMPLES  8
+#define DETECT_SAMPLE_SIZE 4096
+
+typedef struct DetectSample {
+    const unsigned char *buf;
+    int size;      /* bytes where a char may start */
+    int buf_size;  /* 'size' plus the bytes of the last char */
+} DetectSample;
+
+enum {
+    DC_OTHER = 0,  /* ASCII non letter */
+    DC_ASCII,      /* ASCII letter */
+    DC_SYMBOL,     /* non ASCII non letter */
+    DC_BAD,        /* control, invalid or undecodable */
+    DC_LATIN,
+    DC_GREEK,
+    DC_CYRILLIC,
+    DC_HEBREW,
+    DC_ARABIC,
+    DC_THAI,
+    DC_HALFKANA,   /* half width katakana */
+    DC_KANA,
+    DC_CJK,
+    DC_HANGUL,
+};
+
+/* return the class of 'c'. '*lower_ptr' is set to 1 for a lower case
+   letter, -1 for an upper case one, 0 if the script has no case */
+static int detect_char_class(unsigned int c, int *lower_ptr)
+{
+    *lower_ptr = 0;
+    if (c < 0x80) {
+        if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z')
+            return DC_ASCII;
+        return DC_OTHER;
+    }
+    if (c < 0xa0 || c == INVALID_CHAR)
+        return DC_BAD;
+    if (c < 0xc0 || c == 0xd7 || c == 0xf7)
+        return DC_SYMBOL;
+    if (c < 0x250) {
+        if (c < 0x100)
+            *lower_ptr = (c >= 0xdf) ? 1 : -1;
+        else if (c < 0x138 || (c >= 0x14a && c < 0x178))
+            *lower_ptr = (c & 1) ? 1 : -1;
+        else if (c < 0x180 && c != 0x149 && c != 0x178)
+            *lower_ptr = (c & 1) ? -1 : 1;
+        return DC_LATIN;
+    }
+    if (c >= 0x1e00 && c < 0x1f00) {
+        *lower_ptr = (c & 1) ? 1 : -1;
+        return DC_LATIN;
+    }
+    if (c >= 0x386 && c < 0x3d0) {
+        *lower_ptr = (c >= 0x3ac) ? 1 : -1;
+        return DC_GREEK;
+    }
+    if (c >= 0x400 && c < 0x460) {
+        *lower_ptr = (c >= 0x430) ? 1 : -1;
+        return DC_CYRILLIC;
+    }
+    if (c >= 0x490 && c < 0x4c0) {
+        *lower_ptr = (c & 1) ? 1 : -1;
+        return DC_CYRILLIC;
+    }
+    if (c >= 0x5d0 && c <= 0x5ea)
+        return DC_HEBREW;
+    if (c >= 0x621 && c <= 0x64a)
+        return DC_ARABIC;
+    if (c >= 0xe01 && c <= 0xe5b)
+        return DC_THAI;
+    if (c >= 0x3040 && c < 0x3100)
+        return DC_KANA;
+    if (c >= 0x4e00 && c < 0xa000)
+        return DC_CJK;
+    if (c >= 0xac00 && c <= 0xd7a3)
+        return DC_HANGUL;
+    if (c >= 0xff61 && c <= 0xff9f)
+        return DC_HALFKANA;
+    return DC_SYMBOL;
+}
+
+/* score of the char class 'cls' after the class 'prev' */
+static int detect_pair_score(int prev, int prev_lower, int cls, int lower)
+{
+    int score;
+
+    switch (cls) {
+    case DC_OTHER:
+    case DC_ASCII:
+        return 0;
+    case DC_BAD:
+        return -10;
+    case DC_SYMBOL:
+        return -2;
+    case DC_HALFKANA:
+        return (prev == DC_HALFKANA) ? 1 : -2;
+    case DC_KANA:
+        /* kana are frequent in Japanese text, but are not produced
+           by the byte pairs of other scripts */
+        score = 10;
+        if (prev == DC_KANA || prev == DC_CJK)
+            score += 2;
+        return score;
+    case DC_CJK:
+    case DC_HANGUL:
+        /* the JIS tables are dense: most byte pairs decode to an
+           ideogram */
+        score = 4;
+        if (prev == DC_KANA || prev == DC_CJK || prev == DC_HANGUL)
+            score += 2;
+        return score;
+    case DC_LATIN:
+        /* accented letters seldom follow each other, whereas a wrong
+           8 bit table decodes every byte as a letter */
+        if (prev == DC_LATIN)
+            return 0;
+        score = 1;
+        if (prev == DC_ASCII)
+            score += 2;
+        if (lower > 0)
+            score += 1;
+        else if (lower < 0 && prev_lower > 0)
+            score -= 2;
+        return score;
+    default:
+        score = 1;
+        if (prev == cls)
+            score += 2;
+        if (lower > 0)
+            score += 1;
+        else if (lower < 0 && prev_lower > 0)
+            score -= 2; /* upper case letter inside a word */
+        return score;
+    }
+}
+
+static int detect_score(CharsetDecodeState *cs, DetectSample *samples,
+                        int nb_samples)
+{
+    const unsigned char *p, *p_end, *q, *buf_end;
+    unsigned char tmp[MAX_CHAR_BYTES];
+    int i, c, cls, lower, prev, prev_lower, score;
+
+    score = 0;
+    for (i = 0; i < nb_samples; i++) {
+        p = samples[i].buf;
+        p_end = p + samples[i].size;
+        buf_end = p + samples[i].buf_size;
+        prev = DC_OTHER;
+        prev_lower = 0;
+        while (p < p_end) {
+            c = cs->table[*p];
+            if (c == ESCAPE_CHAR) {
+                if (buf_end - p >= MAX_CHAR_BYTES) {
+                    q = p;
+                    c = cs->decode_func(cs, &q);
+                } else {
+                    /* the decoder may read MAX_CHAR_BYTES bytes */
+                    memset(tmp, 0, sizeof(tmp));
+                    memcpy(tmp, p, buf_end - p);
+                    q = tmp;
+                    c = cs->decode_func(cs, &q);
+                    q = p + (q - tmp);
+                }
+                if (q == p + 1) {
+                    /* lead byte without a valid sequence */
+                    c = INVALID_CHAR;
+                }
+                p = q;
+            } else {
+                p++;
+            }
+            cls = detect_char_class(c, &lower);
+            score += detect_pair_score(prev, prev_lower, cls, lower);
+            prev = cls;
+            prev_lower = lower;
+        }
+    }
+    return score;
+}
+
+/* return true if the samples are valid UTF-8 with at least one non
+   ASCII char */
+static int detect_utf8(DetectSample *samples, int nb_samples)
 {
-    int i, l, c, has_utf8;
+    const unsigned char *p, *p_end, *buf_end;
+    int i, c, l, has_utf8;
 
     has_utf8 = 0;
-    for (i = 0; i < size;) {
-        c = buf[i++];
-        if ((c >= 0x80 && c < 0xc0) || c >= 0xfe)
-            goto no_utf8;
-        l = utf8_length[c];
-        while (l > 1) {
+    for (i = 0; i < nb_samples; i++) {
+        p = samples[i].buf;
+        p_end = p + samples[i].size;
+        buf_end = p + samples[i].buf_size;
+        while (p < p_end) {
+            c = *p++;
+            if (c < 0x80)
+                continue;
+            if (c < 0xc0 || c >= 0xfe)
+                return 0;
+            for (l = utf8_length[c]; l > 1; l--) {
+                /* a truncated last char is accepted */
+                if (p >= buf_end)
+                    break;
+                c = *p++;
+                if (!(c >= 0x80 && c < 0xc0))
+                    return 0;
+            }
             has_utf8 = 1;
-            if (i >= size)
-                break;
-            c = buf[i++];
-            if (!(c >= 0x80 && c < 0xc0)) {
-            no_utf8:
-                has_utf8 = 0;
+        }
+    }
+    return has_utf8;
+}
+
+/* return 1 for UTF-16LE, 2 for UTF-16BE data, 0 otherwise. The
+   samples must start at even offsets. */
+static int detect_utf16(DetectSample *samples, int nb_samples)
+{
+    const unsigned char *p;
+    int i, j, n, zeros[2];
+
+    p = samples[0].buf;
+    if (samples[0].buf_size >= 2) {
+        if (p[0] == 0xff && p[1] == 0xfe)
+            return 1;
+        if (p[0] == 0xfe && p[1] == 0xff)
+            return 2;
+    }
+    n = 0;
+    zeros[0] = zeros[1] = 0;
+    for (i = 0; i < nb_samples; i++) {
+        p = samples[i].buf;
+        for (j = 0; j + 1 < samples[i].buf_size; j += 2) {
+            zeros[0] += (p[j] == 0);
+            zeros[1] += (p[j + 1] == 0);
+        }
+        n += j / 2;
+    }
+    /* text files have no zero bytes, but the spaces and newlines of
+       UTF-16 text all have a zero byte at the same parity */
+    if (n < 16 || zeros[0] + zeros[1] < n / 16)
+        return 0;
+    if (zeros[1] >= 9 * zeros[0])
+        return 1;
+    if (zeros[0] >= 9 * zeros[1])
+        return 2;
+    return 0;
+}
+
+static QECharset *detect_charset_samples(DetectSample *samples,
+                                         int nb_samples)
+{
+    CharsetDecodeState cs;
+    QECharset *charset, *best;
+    int i, j, score, best_score, has_8bit;
+
+    has_8bit = 0;
+    for (i = 0; i < nb_samples && !has_8bit; i++) {
+        for (j = 0; j < samples[i].size; j++) {
+            if (samples[i].buf[j] >= 0x80) {
+                has_8bit = 1;
                 break;
             }
-            l--;
         }
     }
-    if (has_utf8)
+    if (!has_8bit)
+        return &charset_8859_1;
+    if (detect_utf8(samples, nb_samples))
         return &charset_utf8;
-    else
+
+    /* on equal scores, the first registered charset (8859-1) wins */
+    best = NULL;
+    best_score = 0;
+    for (charset = first_charset; charset != NULL; charset = charset->next) {
+        if (charset == &charset_utf8)
+            continue;
+        charset_decode_init(&cs, charset);
+        if (cs.table) {
+            score = detect_score(&cs, samples, nb_samples);
+            if (!best || score > best_score) {
+                best_score = score;
+                best = charset;
+            }
+        }
+        charset_decode_close(&cs);
+    }
+    if (!best)
+        best = &charset_8859_1;
+    return best;
+}
+
+/* detect the charset of the probe buffer */
+QECharset *detect_charset(const unsigned char *buf, int size)
+{
+    DetectSample sample;
+
+    sample.buf = buf;
+    sample.size = size;
+    sample.buf_size = size;
+    return detect_charset_samples(&sample, 1);
+}
+
+/* detect the charset of the file 'f' from samples spread over the
+   whole file, so that the time does not depend on the file size.
+   '*utf16_ptr' is set to 1 or 2 if the file contains UTF-16LE or
+   UTF-16BE data, which cannot be decoded. The file position is
+   preserved. */
+QECharset *detect_charset_file(FILE *f, int *utf16_ptr)
+{
+    DetectSample samples[DETECT_NB_SAMPLES];
+    unsigned char *buf, *p;
+    long pos, file_size, offset, step;
+    int i, n, len, skip;
+    QECharset *charset;
+
+    *utf16_ptr = 0;
+    pos = ftell(f);
+    if (pos < 0 || fseek(f, 0, SEEK_END) < 0)
+        return &charset_8859_1;
+    file_size = ftell(f);
+
+    buf = (unsigned char*)malloc(DETECT_NB_SAMPLES * DETECT_SAMPLE_SIZE);
+    if (!buf) {
+        fseek(f, pos, SEEK_SET);
+        return &charset_8859_1;
+    }
+    n = 1;
+    step = 0;
+    if (file_size > DETECT_SAMPLE_SIZE) {
+        n = DETECT_NB_SAMPLES;
+        step = (file_size - DETECT_SAMPLE_SIZE) / (n - 1);
+    }
+    for (i = 0; i < n; i++) {
+        p = buf + i * DETECT_SAMPLE_SIZE;
+        offset = (i * step) & ~1L;
+        len = 0;
+        if (fseek(f, offset, SEEK_SET) == 0)
+            len = fread(p, 1, DETECT_SAMPLE_SIZE, f);
+        if (len < 0)
+            len = 0;
+        samples[i].buf = p;
+        samples[i].buf_size = len;
+        samples[i].size = len;
+    }
+    fseek(f, pos, SEEK_SET);
+
+    *utf16_ptr = detect_utf16(samples, n);
+    if (*utf16_ptr) {
+        free(buf);
         return &charset_8859_1;
+    }
+    if (samples[0].buf_size >= 3 &&
+        samples[0].buf[0] == 0xef && samples[0].buf[1] == 0xbb &&
+        samples[0].buf[2] == 0xbf) {
+        /* UTF-8 byte order mark */
+        free(buf);
+        return &charset_utf8;
+    }
+
+    for (i = 0; i < n; i++) {
+        /* the last char may continue after the end of the sample */
+        if (samples[i].size == DETECT_SAMPLE_SIZE)
+            samples[i].size -= MAX_CHAR_BYTES;
+        if (i > 0) {
+            /* resynchronize on a byte which cannot be part of a
+               multi byte char in any of the charsets */
+            for (skip = 0; skip < samples[i].size; skip++) {
+                if (samples[i].buf[skip] < 0x40)
+                    break;
+            }
+            samples[i].buf += skip;
+            samples[i].size -= skip;
+            samples[i].buf_size -= skip;
+        }
+    }
+    charset = detect_charset_samples(samples, n);
+    free(buf);
+    return charset;
+}
+
+#ifdef __SSE2__
+/* if the 16 chars at 'p' are all <= 'max' (0x7f or 0xff), store them
+   as bytes at 'q' and return true */
+static inline int encode_16_bytes(u8 *q, const unsigned int *p,
+                                  unsigned int max)
+{
+    __m128i a, b, c, d, m;
+
+    a = _mm_loadu_si128((const __m128i *)p);
+    b = _mm_loadu_si128((const __m128i *)(p + 4));
+    c = _mm_loadu_si128((const __m128i *)(p + 8));
+    d = _mm_loadu_si128((const __m128i *)(p + 12));
+    m = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+    m = _mm_and_si128(m, _mm_set1_epi32(~max));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(m, _mm_setzero_si128())) != 0xffff)
+        return 0;
+    a = _mm_packs_epi32(a, b);
+    c = _mm_packs_epi32(c, d);
+    _mm_storeu_si128((__m128i *)q, _mm_packus_epi16(a, c));
+    return 1;
+}
+#endif
+
+/* encode the 'n' chars of 'p' to 'charset' into 'dst', which must
+   hold at least n * MAX_CHAR_BYTES bytes. As in unicode_to_charset(),
+   the chars which cannot be encoded become '?'. Return the number of
+   bytes stored. */
+int charset_encode_block(QECharset *charset, u8 *dst,
+                         const unsigned int *p, int n)
+{
+    const unsigned int *p_end;
+    unsigned int max;
+    u8 *q, *q1;
+
+    /* chars up to 'max' are encoded as a single byte of same value */
+    if (charset == &charset_utf8 || charset->encode_func == encode_7bit)
+        max = 0x7f;
+    else if (charset->encode_func == encode_8859_1 ||
+             charset->encode_func == encode_vt100)
+        max = 0xff;
+    else
+        max = 0;
+
+    q = dst;
+    p_end = p + n;
+    while (p < p_end) {
+        if (max) {
+#ifdef __SSE2__
+            while (p_end - p >= 16 && encode_16_bytes(q, p, max)) {
+                p += 16;
+                q += 16;
+            }
+#endif
+            while (p < p_end && *p <= max)
+                *q++ = *p++;
+            if (p >= p_end)
+                break;
+        }
+        q1 = charset->encode_func(charset, q, *p++);
+        if (!q1)
+            *q++ = '?';
+        else
+            q = q1;
+    }
+    return q - dst;
 }
 
 /* the function uses '?' to indicate that no match could be found in
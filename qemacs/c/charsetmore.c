@@ -90,9 +90,6 @@ unsigned char *encode_8bit(QECharset *charset, unsigned char *q, int c)
 /********************************************************/
 /* JIS */
 
-const unsigned short *table_jis208;
-const unsigned short *table_jis212;
-
 static int jis0208_decode(int b1, int b2)
 {
     b1 -= 0x21;
@@ -16,10 +16,16 @@
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* statx, fdopendir, readlinkat */
+#endif
 #include "qe.h"
 
 enum { DIRED_HEADER = 0 };
 
+/* ms between two merges of scanned rows into the list */
+#define DIRED_MERGE_DELAY  100
+
 enum {
     DIRED_SORT_NAME = 1,
     DIRED_SORT_EXTENSION = 2,
@@ -30,11 +36,20 @@ enum {
     DIRED_SORT_DESCENDING = 32,
 };
 
+typedef struct DiredScan DiredScan;
+
 typedef struct DiredState {
     StringArray items;
     int sort_mode; /* DIRED_SORT_GROUP | DIRED_SORT_NAME */
     int last_index;
     char path[MAX_FILENAME_SIZE]; /* current path */
+    /* background scan of 'path', if any */
+    DiredScan *scan;
+    StringItem **pending;   /* scanned rows not yet in the list */
+    int nb_pending, pending_size;
+    int last_merge;         /* get_clock_ms() of the last merge */
+    QETimer *merge_timer;
+    char target[MAX_FILENAME_SIZE]; /* file to put the cursor on */
 } DiredState;
 
 #ifdef WIN32
@@ -87,12 +102,12 @@ typedef struct DiredItem {
     mode_t mode;
     off_t size;
     time_t mtime;
-    int offset;
     char mark;
     char name[1];
 } DiredItem;
 
 static void dired_view_file(EditState *s, const char *filename);
+static void dired_scan_stop(DiredState *hs);
 
 
 static inline int dired_get_index(EditState *s) {
@@ -103,7 +118,9 @@ void dired_free(EditState *s)
 {
     DiredState *ds = (DiredState*)s->mode_data;
     int i;
-    
+
+    dired_scan_stop(ds);
+
     /* free opaques */
     for (i = 0; i < ds->items.nb_items; i++) {
         free(ds->items.items[i]->opaque);
@@ -184,7 +201,6 @@ static void do_dired_sort(EditState *s)
     for (i = 0; i < hs->items.nb_items; i++) {
         item = hs->items.items[i];
         dip = (DiredItem*)item->opaque;
-        dip->offset = eb_total_size(b);
         if (item == cur_item)
             s->offset = eb_total_size(b);
         eb_printf(b, "%c %s\n", dip->mark, item->str);
@@ -209,7 +225,7 @@ static void dired_mark(EditState *s, int mark)
     dip = (DiredItem*)item->opaque;
 
     ch = dip->mark = mark;
-    eb_write(s->b, dip->offset, &ch, 1);
+    eb_write(s->b, eb_goto_pos(s->b, index + DIRED_HEADER, 0), &ch, 1);
 
     text_move_up_down(s, 1, 1);
 }
@@ -259,16 +275,702 @@ static void dired_sort(EditState *s, const char *sort_order)
 
 #define MAX_COL_FILE_SIZE 32
 
+/* build the list line of the file 'name'. 'link' is the target of a
+   symbolic link */
+static void dired_format_line(char *line, int line_size, const char *name,
+                              const struct stat *st, const char *link)
+{
+    char buf[1024];
+    int ct, len;
+
+    pstrcpy(line, line_size, name);
+    ct = 0;
+    if (S_ISDIR(st->st_mode)) {
+        ct = DIR_SEP_CHAR;
+    } else if (S_ISFIFO(st->st_mode)) {
+        ct = '|';
+    } else if (S_ISSOCK(st->st_mode)) {
+        ct = '=';
+    } else if (S_ISLNK(st->st_mode)) {
+        ct = '@';
+    } else if ((st->st_mode & 0111) != 0) {
+        ct = '*';
+    }
+    if (ct) {
+        buf[0] = ct;
+        buf[1] = '\0';
+        pstrcat(line, line_size, buf);
+    }
+    /* pad with ' ' */
+    len = strlen(line);
+    while (len < MAX_COL_FILE_SIZE && len < line_size - 1)
+        line[len++] = ' ';
+    line[len] = '\0';
+    /* add file size or file info */
+    if (S_ISREG(st->st_mode)) {
+        sprintf(buf, "%9ld", (long)st->st_size);
+    } else if (S_ISDIR(st->st_mode)) {
+        sprintf(buf, "%9s", "<dir>");
+    } else if (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode)) {
+        int major, minor;
+        major = (st->st_rdev >> 8) & 0xff;
+        minor = st->st_rdev & 0xff;
+        sprintf(buf, "%c%4d%4d", 
+                S_ISCHR(st->st_mode) ? 'c' : 'b', 
+                major, minor);
+    } else if (S_ISLNK(st->st_mode)) {
+        pstrcat(line, line_size, "-> ");
+        pstrcpy(buf, sizeof(buf), link ? link : "");
+    } else {
+        buf[0] = '\0';
+    }
+    pstrcat(line, line_size, buf);
+}
+
+/* allocate the list item of a file, with its DiredItem as opaque. This
+   is also called from the scan threads: it must not touch 'hs' */
+static StringItem *dired_new_item(DiredState *hs, const char *name,
+                                  const struct stat *st, const char *link)
+{
+    char line[1024];
+    StringItem *item;
+    DiredItem *dip;
+    int len;
+
+    dired_format_line(line, sizeof(line), name, st, link);
+    len = strlen(line);
+    item = (StringItem*)malloc(sizeof(StringItem) + len);
+    dip = (DiredItem*)malloc(sizeof(DiredItem) + strlen(name));
+    if (!item || !dip) {
+        free(item);
+        free(dip);
+        return NULL;
+    }
+    item->opaque = dip;
+    item->selected = 0;
+    memcpy(item->str, line, len + 1);
+    dip->state = hs;
+    dip->mode = st->st_mode;
+    dip->size = st->st_size;
+    dip->mtime = st->st_mtime;
+    dip->mark = ' ';
+    strcpy(dip->name, name);
+    return item;
+}
+
+static void dired_free_item(StringItem *item)
+{
+    free(item->opaque);
+    free(item);
+}
+
+static int dired_add_pending(DiredState *hs, StringItem **rows, int nb_rows)
+{
+    StringItem **tab;
+    int size;
+
+    if (hs->nb_pending + nb_rows > hs->pending_size) {
+        size = hs->pending_size ? hs->pending_size * 2 : 256;
+        while (size < hs->nb_pending + nb_rows)
+            size *= 2;
+        tab = (StringItem**)realloc(hs->pending, size * sizeof(StringItem *));
+        if (!tab)
+            return -1;
+        hs->pending = tab;
+        hs->pending_size = size;
+    }
+    memcpy(hs->pending + hs->nb_pending, rows, nb_rows * sizeof(StringItem *));
+    hs->nb_pending += nb_rows;
+    return 0;
+}
+
+/* insert the pending rows into the sorted list and into the buffer.
+   The rows are sorted with dired_sort_func and merged with the list:
+   each run of new rows between two existing ones is inserted at once,
+   so the cost is linear in the size of the list. */
+static void dired_merge_pending(EditState *s)
+{
+    DiredState *hs = (DiredState*)s->mode_data;
+    StringItem **items, **rows, *item, *cur_item;
+    DiredItem *dip;
+    EditBuffer *b = s->b;
+    char filename[MAX_FILENAME_SIZE];
+    char *run, *run1;
+    int i, j, k, n, nb_old, nb_rows, index, offset, cur_offset;
+    int run_len, run_size, len;
+
+    hs->last_merge = get_clock_ms();
+    nb_rows = hs->nb_pending;
+    if (nb_rows == 0)
+        return;
+    rows = hs->pending;
+    qsort(rows, nb_rows, sizeof(StringItem *), dired_sort_func);
+
+    nb_old = hs->items.nb_items;
+    n = nb_old + nb_rows;
+    items = (StringItem**)malloc(n * sizeof(StringItem *));
+    if (!items)
+        return;
+
+    index = dired_get_index(s);
+    cur_item = NULL;
+    if (index >= 0 && index < nb_old)
+        cur_item = hs->items.items[index];
+
+    b->flags &= ~BF_READONLY;
+    offset = DIRED_HEADER ? eb_goto_pos(b, DIRED_HEADER, 0) : 0;
+    cur_offset = -1;
+    run = NULL;
+    run_size = 0;
+    for (i = j = k = 0; k < n;) {
+        if (i < nb_old && (j >= nb_rows ||
+            dired_sort_func(&hs->items.items[i], &rows[j]) <= 0)) {
+            item = hs->items.items[i++];
+            if (item == cur_item)
+                cur_offset = offset;
+            items[k++] = item;
+            offset += strlen(item->str) + 3;
+            continue;
+        }
+        /* a run of new rows */
+        run_len = 0;
+        while (j < nb_rows && (i >= nb_old ||
+               dired_sort_func(&rows[j], &hs->items.items[i]) < 0)) {
+            item = rows[j++];
+            dip = (DiredItem*)item->opaque;
+            if (hs->target[0] &&
+                makepath(filename, sizeof(filename), hs->path, dip->name) &&
+                !strcmp(filename, hs->target)) {
+                cur_item = item;
+                cur_offset = offset + run_len;
+                hs->target[0] = '\0';
+            }
+            len = strlen(item->str) + 3;
+            if (run_len + len + 1 > run_size) {
+                run_size = max(run_size * 2, run_len + len + 1024);
+                run1 = (char*)realloc(run, run_size);
+                if (!run1)
+                    break;
+                run = run1;
+            }
+            sprintf(run + run_len, "%c %s\n", dip->mark, item->str);
+            run_len += len;
+            items[k++] = item;
+        }
+        if (run_len == 0) {
+            /* out of memory: drop the rest of the new rows */
+            for (; j < nb_rows; j++)
+                dired_free_item(rows[j]);
+            n = k + nb_old - i;
+            continue;
+        }
+        eb_insert(b, offset, run, run_len);
+        offset += run_len;
+    }
+    free(run);
+    b->modified = 0;
+    b->flags |= BF_READONLY;
+
+    free(hs->items.items);
+    hs->items.items = items;
+    hs->items.nb_items = n;
+    hs->items.nb_allocated = n;
+    hs->nb_pending = 0;
+
+    /* keep the cursor on the same file */
+    if (cur_offset >= 0)
+        s->offset = cur_offset;
+}
+
+#ifndef WIN32
+
+/* The directory is read in the background by a few threads. A thread
+   that finds no names to look at reads the next block of entries with
+   getdents64() and queues them in batches of DIRED_BATCH names. The
+   threads stat the names of a batch, format the rows and queue them
+   for the main thread, which is woken up through a pipe. */
+
+#include <pthread.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define DIRED_MAX_THREADS  8
+#define DIRED_BATCH        128
+#define DIRED_READ_SIZE    65536
+
+typedef struct DiredBatch {
+    struct DiredBatch *next;
+    int nb;
+    union {
+        char *names[DIRED_BATCH];       /* names to stat */
+        StringItem *rows[DIRED_BATCH];  /* rows for the list */
+    } u;
+    /* names follow */
+} DiredBatch;
+
+struct DiredScan {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int refcount;           /* main thread and running threads */
+    int cancel;
+    int dir_fd;
+#ifndef __linux__
+    DIR *dir;
+#endif
+    DiredState *hs;         /* only for DiredItem.state */
+    DiredBatch *todo, *todo_last;
+    DiredBatch *done, *done_last;
+    int reading;            /* a thread reads the directory */
+    int eof;
+    int nb_running;
+    int finished;           /* all threads are done */
+    int notified;
+    int notify_fd[2];
+};
+
+static void dired_free_batches(DiredBatch *p, int rows)
+{
+    DiredBatch *next;
+    int i;
+
+    for (; p != NULL; p = next) {
+        next = p->next;
+        if (rows) {
+            for (i = 0; i < p->nb; i++)
+                dired_free_item(p->u.rows[i]);
+        }
+        free(p);
+    }
+}
+
+static void dired_scan_unref(DiredScan *sc)
+{
+    int last;
+
+    pthread_mutex_lock(&sc->mutex);
+    last = (--sc->refcount == 0);
+    pthread_mutex_unlock(&sc->mutex);
+    if (!last)
+        return;
+
+    dired_free_batches(sc->todo, 0);
+    dired_free_batches(sc->done, 1);
+#ifdef __linux__
+    close(sc->dir_fd);
+#else
+    closedir(sc->dir);
+#endif
+    close(sc->notify_fd[0]);
+    close(sc->notify_fd[1]);
+    pthread_mutex_destroy(&sc->mutex);
+    pthread_cond_destroy(&sc->cond);
+    free(sc);
+}
+
+static void dired_queue(DiredBatch **first, DiredBatch **last, DiredBatch *p)
+{
+    p->next = NULL;
+    if (*first)
+        (*last)->next = p;
+    else
+        *first = p;
+    *last = p;
+}
+
+/* read the next block of directory entries and split it in batches.
+   Return the number of batches or -1 at the end of the directory */
+static int dired_read_names(DiredScan *sc, DiredBatch **first,
+                            DiredBatch **last)
+{
+    DiredBatch *p = NULL;
+    const char *name;
+    char *q = NULL;
+    int nb_batches = 0, len;
+#ifdef __linux__
+    struct dirent64_hdr {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[1];
+    } *de;
+    char *buf;
+    long pos, size;
+
+    buf = (char*)malloc(DIRED_READ_SIZE);
+    if (!buf)
+        return -1;
+    size = syscall(SYS_getdents64, sc->dir_fd, buf, DIRED_READ_SIZE);
+    if (size <= 0) {
+        free(buf);
+        return -1;
+    }
+    for (pos = 0; pos < size; pos += de->d_reclen) {
+        de = (struct dirent64_hdr *)(buf + pos);
+        name = de->d_name;
+#else
+    struct dirent *de;
+    int count;
+
+    for (count = 0; count < DIRED_READ_SIZE / 32; count++) {
+        de = readdir(sc->dir);
+        if (!de)
+            break;
+        name = de->d_name;
+#endif
+        /* exclude redundant '.' and '..' */
+        if (!strcmp(name, ".") || !strcmp(name, ".."))
+            continue;
+        len = strlen(name) + 1;
+        if (!p || p->nb == DIRED_BATCH) {
+            /* room for DIRED_BATCH names of 256 bytes */
+            p = (DiredBatch*)malloc(sizeof(DiredBatch) + DIRED_BATCH * 256);
+            if (!p)
+                break;
+            p->nb = 0;
+            dired_queue(first, last, p);
+            nb_batches++;
+            q = (char*)(p + 1);
+        }
+        if (len > 256)
+            continue;
+        memcpy(q, name, len);
+        p->u.names[p->nb++] = q;
+        q += len;
+    }
+#ifdef __linux__
+    free(buf);
+#else
+    if (count == 0)
+        return -1;
+#endif
+    return nb_batches;
+}
+
+#if defined(__linux__) && defined(STATX_BASIC_STATS)
+/* set when the kernel has no statx (before Linux 4.11). It is only
+   ever set, so the scan threads can race on it. */
+static int dired_no_statx;
+#endif
+
+/* lstat() of 'name' in the directory 'dir_fd' */
+static int dired_lstat(int dir_fd, const char *name, struct stat *st)
+{
+#if defined(__linux__) && defined(STATX_BASIC_STATS)
+    struct statx stx;
+
+    if (!dired_no_statx) {
+        /* only ask for what the list shows: this spares network
+           file systems a full attribute refresh */
+        if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                  STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME,
+                  &stx) == 0) {
+            memset(st, 0, sizeof(*st));
+            st->st_mode = stx.stx_mode;
+            st->st_size = stx.stx_size;
+            st->st_mtime = stx.stx_mtime.tv_sec;
+            st->st_rdev = (stx.stx_rdev_major << 8) |
+                (stx.stx_rdev_minor & 0xff);
+            return 0;
+        }
+        if (errno != ENOSYS)
+            return -1;
+        dired_no_statx = 1;
+    }
+#endif
+    return fstatat(dir_fd, name, st, AT_SYMLINK_NOFOLLOW);
+}
+
+static void dired_stat_batch(DiredScan *sc, DiredBatch *p)
+{
+    StringItem *rows[DIRED_BATCH];
+    char link[1024];
+    struct stat st;
+    int i, n, len, dir_fd;
+
+#ifdef __linux__
+    dir_fd = sc->dir_fd;
+#else
+    dir_fd = dirfd(sc->dir);
+#endif
+    n = 0;
+    for (i = 0; i < p->nb; i++) {
+        if (dired_lstat(dir_fd, p->u.names[i], &st) < 0)
+            continue;
+        link[0] = '\0';
+        if (S_ISLNK(st.st_mode)) {
+            len = readlinkat(dir_fd, p->u.names[i], link, sizeof(link) - 1);
+            if (len < 0)
+                len = 0;
+            link[len] = '\0';
+        }
+        rows[n] = dired_new_item(sc->hs, p->u.names[i], &st, link);
+        if (rows[n])
+            n++;
+    }
+    /* the batch now holds the rows */
+    memcpy(p->u.rows, rows, n * sizeof(StringItem *));
+    p->nb = n;
+}
+
+/* wake up the main thread. Called with the mutex held */
+static void dired_scan_notify(DiredScan *sc)
+{
+    if (!sc->notified) {
+        sc->notified = 1;
+        if (write(sc->notify_fd[1], "", 1) < 0) {
+            /* the pipe is non blocking and holds one byte at most */
+        }
+    }
+}
+
+static void *dired_scan_thread(void *opaque)
+{
+    DiredScan *sc = (DiredScan*)opaque;
+    DiredBatch *p, *first, *last;
+    int nb;
+
+    pthread_mutex_lock(&sc->mutex);
+    for (;;) {
+        if (sc->cancel)
+            break;
+        if (sc->todo) {
+            p = sc->todo;
+            sc->todo = p->next;
+            pthread_mutex_unlock(&sc->mutex);
+            dired_stat_batch(sc, p);
+            pthread_mutex_lock(&sc->mutex);
+            dired_queue(&sc->done, &sc->done_last, p);
+            dired_scan_notify(sc);
+            continue;
+        }
+        if (sc->eof)
+            break;
+        if (sc->reading) {
+            pthread_cond_wait(&sc->cond, &sc->mutex);
+            continue;
+        }
+        sc->reading = 1;
+        pthread_mutex_unlock(&sc->mutex);
+        first = last = NULL;
+        nb = dired_read_names(sc, &first, &last);
+        pthread_mutex_lock(&sc->mutex);
+        sc->reading = 0;
+        if (nb < 0)
+            sc->eof = 1;
+        if (first) {
+            if (sc->todo)
+                sc->todo_last->next = first;
+            else
+                sc->todo = first;
+            sc->todo_last = last;
+        }
+        pthread_cond_broadcast(&sc->cond);
+    }
+    if (--sc->nb_running == 0) {
+        sc->finished = 1;
+        dired_scan_notify(sc);
+    }
+    pthread_mutex_unlock(&sc->mutex);
+    dired_scan_unref(sc);
+    return NULL;
+}
+
+static void dired_merge_timer(void *opaque)
+{
+    EditState *s = (EditState*)opaque;
+    DiredState *hs = (DiredState*)s->mode_data;
+    QEmacsState *qs = s->qe_state;
+
+    hs->merge_timer = NULL;
+    dired_merge_pending(s);
+    edit_display(qs);
+    dpy_flush(qs->screen);
+}
+
+/* move the rows queued by the scan threads to hs->pending. Return
+   non zero when the scan is over */
+static int dired_scan_collect(DiredState *hs)
+{
+    DiredScan *sc = hs->scan;
+    DiredBatch *done, *p;
+    char buf[16];
+    int finished;
+
+    if (read(sc->notify_fd[0], buf, sizeof(buf)) < 0)
+        return 0;
+
+    pthread_mutex_lock(&sc->mutex);
+    done = sc->done;
+    sc->done = sc->done_last = NULL;
+    finished = sc->finished;
+    sc->notified = 0;
+    pthread_mutex_unlock(&sc->mutex);
+
+    for (p = done; p != NULL; p = p->next) {
+        if (dired_add_pending(hs, p->u.rows, p->nb) < 0) {
+            dired_free_batches(p, 1);
+            break;
+        }
+        p->nb = 0;
+    }
+    dired_free_batches(done, 0);
+
+    if (finished) {
+        set_read_handler(sc->notify_fd[0], NULL, NULL);
+        hs->scan = NULL;
+        dired_scan_unref(sc);
+    }
+    return finished;
+}
+
+/* called when the scan threads have queued rows */
+static void dired_scan_cb(void *opaque)
+{
+    EditState *s = (EditState*)opaque;
+    DiredState *hs = (DiredState*)s->mode_data;
+    int finished, elapsed;
+
+    finished = dired_scan_collect(hs);
+
+    /* merging costs a pass over the list: while scanning a big
+       directory, do it at most every DIRED_MERGE_DELAY ms */
+    elapsed = get_clock_ms() - hs->last_merge;
+    if (!finished && elapsed < DIRED_MERGE_DELAY) {
+        if (!hs->merge_timer) {
+            hs->merge_timer = qe_add_timer(DIRED_MERGE_DELAY - elapsed,
+                                           s, dired_merge_timer);
+        }
+        return;
+    }
+    if (hs->merge_timer) {
+        qe_kill_timer(hs->merge_timer);
+        hs->merge_timer = NULL;
+    }
+    dired_merge_timer(s);
+}
+
+/* start scanning hs->path. Return -1 if it cannot be read */
+static int dired_scan_start(EditState *s)
+{
+    DiredState *hs = (DiredState*)s->mode_data;
+    DiredScan *sc;
+    pthread_t tid;
+    int fd, i, nb_threads;
+
+    fd = open(hs->path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return -1;
+    sc = (DiredScan*)calloc(1, sizeof(DiredScan));
+    if (!sc) {
+        close(fd);
+        return -1;
+    }
+    sc->dir_fd = fd;
+#ifndef __linux__
+    sc->dir = fdopendir(fd);
+    if (!sc->dir) {
+        close(fd);
+        free(sc);
+        return -1;
+    }
+#endif
+    if (pipe(sc->notify_fd) < 0) {
+#ifdef __linux__
+        close(fd);
+#else
+        closedir(sc->dir);
+#endif
+        free(sc);
+        return -1;
+    }
+    fcntl(sc->notify_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(sc->notify_fd[1], F_SETFL, O_NONBLOCK);
+    fcntl(sc->notify_fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(sc->notify_fd[1], F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    pthread_mutex_init(&sc->mutex, NULL);
+    pthread_cond_init(&sc->cond, NULL);
+    sc->hs = hs;
+    sc->refcount = 1;
+
+    /* stat() latency rather than CPU bounds the scan of a network
+       file system, so use a few threads even on a single CPU */
+    nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    nb_threads = max(2, min(nb_threads, DIRED_MAX_THREADS));
+
+    hs->scan = sc;
+    set_read_handler(sc->notify_fd[0], dired_scan_cb, s);
+    pthread_mutex_lock(&sc->mutex);
+    for (i = 0; i < nb_threads; i++) {
+        sc->refcount++;
+        sc->nb_running++;
+        if (pthread_create(&tid, NULL, dired_scan_thread, sc) != 0) {
+            sc->refcount--;
+            sc->nb_running--;
+            break;
+        }
+        pthread_detach(tid);
+    }
+    pthread_mutex_unlock(&sc->mutex);
+    if (i == 0) {
+        /* no thread: scan synchronously */
+        sc->refcount++;
+        sc->nb_running++;
+        dired_scan_thread(sc);
+        dired_scan_collect(hs);
+        dired_merge_pending(s);
+    }
+    return 0;
+}
+
+#endif /* !WIN32 */
+
+/* stop the scan and drop the rows not yet in the list */
+static void dired_scan_stop(DiredState *hs)
+{
+    int i;
+
+#ifndef WIN32
+    DiredScan *sc = hs->scan;
+
+    if (sc) {
+        set_read_handler(sc->notify_fd[0], NULL, NULL);
+        pthread_mutex_lock(&sc->mutex);
+        sc->cancel = 1;
+        pthread_cond_broadcast(&sc->cond);
+        pthread_mutex_unlock(&sc->mutex);
+        /* the threads may still wait for the file system: the last one
+           frees the scan */
+        dired_scan_unref(sc);
+        hs->scan = NULL;
+    }
+#endif
+    if (hs->merge_timer) {
+        qe_kill_timer(hs->merge_timer);
+        hs->merge_timer = NULL;
+    }
+    for (i = 0; i < hs->nb_pending; i++)
+        dired_free_item(hs->pending[i]);
+    free(hs->pending);
+    hs->pending = NULL;
+    hs->nb_pending = hs->pending_size = 0;
+}
+
 void build_dired_list(EditState *s, const char *path)
 {
     DiredState *hs = (DiredState*)s->mode_data;
+#ifdef WIN32
     FindFileState *ffs;
     char filename[MAX_FILENAME_SIZE];
-    char line[1024], buf[1024];
+    char link[1024];
     const char *p;
     struct stat st;
-    int ct, len;
     StringItem *item;
+    int len;
+#endif
 
     /* free previous list, if any */
     dired_free(s);
@@ -278,6 +980,18 @@ void build_dired_list(EditState *s, const char *path)
     set_filename(s->b, hs->path);
     s->b->flags |= BF_DIRED;
 
+    /* the rows are inserted as they come */
+    s->b->flags &= ~BF_READONLY;
+    eb_delete(s->b, 0, eb_total_size(s->b));
+    if (DIRED_HEADER)
+        eb_printf(s->b, "  %s:\n", hs->path);
+    s->b->modified = 0;
+    s->b->flags |= BF_READONLY;
+    hs->last_merge = get_clock_ms() - DIRED_MERGE_DELAY;
+
+#ifndef WIN32
+    dired_scan_start(s);
+#else
     ffs = find_file_open(hs->path, "*");
     while (!find_file_next(ffs, filename, sizeof(filename))) {
         if (lstat(filename, &st) < 0)
@@ -289,68 +1003,20 @@ void build_dired_list(EditState *s, const char *path)
         if (!strcmp(p, ".") || !strcmp(p, ".."))
             continue;
 #endif
-        pstrcpy(line, sizeof(line), p);
-        ct = 0;
-        if (S_ISDIR(st.st_mode)) {
-            ct = DIR_SEP_CHAR;
-        } else if (S_ISFIFO(st.st_mode)) {
-            ct = '|';
-        } else if (S_ISSOCK(st.st_mode)) {
-            ct = '=';
-        } else if (S_ISLNK(st.st_mode)) {
-            ct = '@';
-        } else if ((st.st_mode & 0111) != 0) {
-            ct = '*';
-        }
-        if (ct) {
-            buf[0] = ct;
-            buf[1] = '\0';
-            pstrcat(line, sizeof(line), buf);
-        }
-        /* pad with ' ' */
-        len = strlen(line);
-        while (len < MAX_COL_FILE_SIZE)
-            line[len++] = ' ';
-        line[len] = '\0';
-        /* add file size or file info */
-        if (S_ISREG(st.st_mode)) {
-            sprintf(buf, "%9ld", (long)st.st_size);
-        } else if (S_ISDIR(st.st_mode)) {
-            sprintf(buf, "%9s", "<dir>");
-        } else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) {
-            int major, minor;
-            major = (st.st_rdev >> 8) & 0xff;
-            minor = st.st_rdev & 0xff;
-            sprintf(buf, "%c%4d%4d", 
-                    S_ISCHR(st.st_mode) ? 'c' : 'b', 
-                    major, minor);
-        } else if (S_ISLNK(st.st_mode)) {
-            pstrcat(line, sizeof(line), "-> ");
-            len = readlink(filename, buf, sizeof(buf) - 1);
+        link[0] = '\0';
+        if (S_ISLNK(st.st_mode)) {
+            len = readlink(filename, link, sizeof(link) - 1);
             if (len < 0)
                 len = 0;
-            buf[len] = '\0';
-        } else {
-            buf[0] = '\0';
-        }
-        pstrcat(line, sizeof(line), buf);
-        
-        item = add_string(&hs->items, line);
-        if (item) {
-            DiredItem *dip;
-
-            dip = (DiredItem*)malloc(sizeof(DiredItem) + strlen(p));
-            dip->state = hs;
-            dip->mode = st.st_mode;
-            dip->size = st.st_size;
-            dip->mtime = st.st_mtime;
-            dip->mark = ' ';
-            strcpy(dip->name, p);
-            item->opaque = dip;
+            link[len] = '\0';
         }
+        item = dired_new_item(hs, p, &st, link);
+        if (item && dired_add_pending(hs, &item, 1) < 0)
+            dired_free_item(item);
     }
     find_file_close(ffs);
-    do_dired_sort(s);
+    dired_merge_pending(s);
+#endif
 }
 
 static char *get_dired_filename(EditState *s, 
@@ -573,6 +1239,9 @@ void do_dired(EditState *s)
             break;
         }
     }
+    /* the file may not be scanned yet */
+    if (i == hs->items.nb_items && hs->scan)
+        pstrcpy(hs->target, sizeof(hs->target), b0->filename);
     e->offset = eb_goto_pos(e->b, index + DIRED_HEADER, 0);
 
     /* modify active window */
@@ -5,7 +5,7 @@
 #define MAX_SCREEN_LINES 256  /* in text lines */
 
 typedef unsigned int QEColor;
-#define QEARGB(a,r,g,b) (((a) << 24) | ((r) << 16) | ((g) << 8) | (b))
+#define QEARGB(a,r,g,b) (((QEColor)(a) << 24) | ((r) << 16) | ((g) << 8) | (b))
 #define QERGB(r,g,b) QEARGB(0xff, r, g, b)
 #define COLOR_TRANSPARENT 0
 #define QECOLOR_XOR       1
@@ -155,6 +155,7 @@ static inline void text_metrics(QEditScreen *s, QEFont *font,
                                 QECharMetrics *metrics,
                                 const unsigned int *str, int len)
 {
+    PROF_COUNT(PROF_GLYPHS_MEASURED, len);
     s->dpy.dpy_text_metrics(s, font, metrics, str, len);
 }
 
@@ -170,7 +171,11 @@ static inline int glyph_width(QEditScreen *s, QEFont *font, int ch)
 
 static inline void dpy_flush(QEditScreen *s)
 {
+    int64_t t;
+
+    PROF_BEGIN(t);
     s->dpy.dpy_flush(s);
+    PROF_END(prof_scope_flush, t);
 }
 
 static inline void dpy_close(QEditScreen *s)
@@ -181,7 +186,7 @@ static inline void dpy_close(QEditScreen *s)
 void fill_rectangle(QEditScreen *s,
                     int x1, int y1, int w, int h, QEColor color);
 void set_clip_rectangle(QEditScreen *s, CSSRect *r);
-void push_clip_rectangle(QEditScreen *s, CSSRect *or, CSSRect *r);
+void push_clip_rectangle(QEditScreen *s, CSSRect *old_clip, CSSRect *r);
 
 int qe_register_display(QEDisplay *dpy);
 QEDisplay *probe_display(void);
@@ -29,101 +29,292 @@ static UniFontData *fallback_font;
 
 /**********************************************/
 /* glyph cache handling */
-#define HASH_SIZE      263
-#define MAX_CACHE_SIZE (256 * 1024)
 
-static GlyphCache *hash_table[HASH_SIZE];
-static int cache_size = 0;
-static GlyphCache first_cache_entry;
+/* The decoded glyphs are packed in a ring of slabs. When the ring is
+   full, the oldest slab is reused and its glyphs are dropped. A glyph
+   found in the older half of the ring is copied to the current slab,
+   so that the glyphs in use are never evicted. The glyphs are found
+   with an open addressing hash table keyed by (font, size, style,
+   code). */
+
+#define GLYPH_SLAB_SIZE          (64 * 1024)
+#define GLYPH_CACHE_DEFAULT_SIZE (1024 * 1024)
+#define GLYPH_ALIGN              8
+
+static int glyph_cache_max_size = GLYPH_CACHE_DEFAULT_SIZE;
+static unsigned char *glyph_slabs;
+static int *glyph_slab_sizes; /* bytes used in each slab */
+static int nb_glyph_slabs;
+static int glyph_slab_gen;   /* generation of the current slab */
+static int glyph_slab_used;  /* bytes used in the current slab */
+static GlyphCache **glyph_table;
+static int glyph_table_size; /* power of two */
+static int nb_glyphs;
+static GlyphCache *big_glyph; /* glyph too big to be cached */
+static int big_glyph_size;    /* allocated size of big_glyph */
+static int glyph_cache_hits, glyph_cache_misses;
+
+static inline int glyph_entry_size(int data_size)
+{
+    return (sizeof(GlyphCache) + data_size + GLYPH_ALIGN - 1) & 
+        ~(GLYPH_ALIGN - 1);
+}
 
-void glyph_cache_init(void)
+static inline unsigned char *glyph_slab(int gen)
 {
-    first_cache_entry.next = &first_cache_entry;
-    first_cache_entry.prev = &first_cache_entry;
+    return glyph_slabs + (gen % nb_glyph_slabs) * GLYPH_SLAB_SIZE;
 }
 
-static inline int glyph_hash(int index, int size, int style)
+static inline unsigned int glyph_hash(void *font_data, unsigned int index, 
+                                      int size, int style)
 {
     unsigned int h;
 
-    h = index + (style << 24) + (size << 16);
-    return h % HASH_SIZE;
+    h = (unsigned int)(unsigned long)font_data;
+    h = (h ^ index) * 0x9E3779B1;
+    h = (h ^ ((size << 16) | style)) * 0x9E3779B1;
+    return h ^ (h >> 15);
 }
 
-static GlyphCache *get_cached_glyph(QEFont *font, int index)
+/* return the slot of the glyph or of the empty slot where it can be
+   inserted */
+static int glyph_find_slot(void *font_data, unsigned int index,
+                           int size, int style)
 {
     GlyphCache *p;
-    int h;
+    unsigned int h, mask;
 
-    h = glyph_hash(index, font->size, font->style);
-    p = hash_table[h];
-    while (p != NULL) {
-        if (p->index == index &&
-            p->size == font->size &&
-            p->style == font->style)
-            goto found;
-        p = p->hash_next;
+    mask = glyph_table_size - 1;
+    h = glyph_hash(font_data, index, size, style) & mask;
+    while ((p = glyph_table[h]) != NULL) {
+        if (p->index == index && p->font_data == font_data &&
+            p->size == size && p->style == style)
+            break;
+        h = (h + 1) & mask;
     }
-    return NULL;
- found:
-    /* suppress in linked list */
-    p->next->prev = p->prev;
-    p->prev->next = p->next;
-    /* move to front */
-    first_cache_entry.next->prev = p;
-    p->next = first_cache_entry.next;
-    first_cache_entry.next = p;
-    p->prev = &first_cache_entry;
+    return h;
+}
 
-    return p;
+/* remove the glyph at slot 'h' (backward shift deletion) */
+static void glyph_remove_slot(unsigned int h)
+{
+    GlyphCache *p;
+    unsigned int mask, i, h1;
+
+    mask = glyph_table_size - 1;
+    i = h;
+    for (;;) {
+        glyph_table[h] = NULL;
+        for (;;) {
+            i = (i + 1) & mask;
+            p = glyph_table[i];
+            if (!p)
+                return;
+            h1 = glyph_hash(p->font_data, p->index, 
+                            p->size, p->style) & mask;
+            /* move p to h if h is between its ideal slot and i */
+            if (((i - h1) & mask) >= ((i - h) & mask))
+                break;
+        }
+        glyph_table[h] = p;
+        h = i;
+    }
 }
 
-static GlyphCache *add_cached_glyph(QEFont *font, int index, int data_size)
+static int glyph_table_resize(int size)
 {
-    GlyphCache **pp, *p;
+    GlyphCache **table, **old_table, *p;
+    unsigned int h, mask;
+    int i, old_size;
+
+    table = (GlyphCache **)malloc(size * sizeof(GlyphCache *));
+    if (!table)
+        return -1;
+    memset(table, 0, size * sizeof(GlyphCache *));
+    old_table = glyph_table;
+    old_size = glyph_table_size;
+    mask = size - 1;
+    for (i = 0; i < old_size; i++) {
+        p = old_table[i];
+        if (!p)
+            continue;
+        h = glyph_hash(p->font_data, p->index, p->size, p->style) & mask;
+        while (table[h] != NULL)
+            h = (h + 1) & mask;
+        table[h] = p;
+    }
+    free(old_table);
+    glyph_table = table;
+    glyph_table_size = size;
+    return 0;
+}
+
+/* drop all the glyphs of the slab of generation 'gen' */
+static void glyph_free_slab(int gen)
+{
+    unsigned char *ptr, *end;
+    GlyphCache *p;
     int h;
 
-    cache_size += sizeof(GlyphCache) + data_size + 4;
-
-    while (cache_size > MAX_CACHE_SIZE) {
-        /* supress oldest entry */
-        p = first_cache_entry.prev;
-        cache_size -= sizeof(GlyphCache) + p->data_size + 4;
-        p->next->prev = p->prev;
-        p->prev->next = p->next;
-        /* suppress from hash table (should use double linked list ?) */
-        h = glyph_hash(p->index, p->size, p->style);
-        pp = &hash_table[h];
-        while (*pp != p) pp = &(*pp)->hash_next;
-        *pp = p->hash_next;
-
-        free(p);
+    ptr = glyph_slab(gen);
+    end = ptr + glyph_slab_sizes[gen % nb_glyph_slabs];
+    while (ptr < end) {
+        p = (GlyphCache *)ptr;
+        h = glyph_find_slot(p->font_data, p->index, p->size, p->style);
+        /* the glyph may have been copied to a newer slab */
+        if (glyph_table[h] == p) {
+            glyph_remove_slot(h);
+            nb_glyphs--;
+        }
+        ptr += glyph_entry_size(p->data_size);
     }
+}
 
-    p = malloc(sizeof(GlyphCache) + data_size);
+/* allocate 'size' bytes in the current slab */
+static GlyphCache *glyph_alloc(int data_size)
+{
+    GlyphCache *p;
+    int size;
+
+    size = glyph_entry_size(data_size);
+    if (size > GLYPH_SLAB_SIZE / 4) {
+        /* do not cache huge glyphs: reuse a single buffer, only
+           growing it */
+        if (size > big_glyph_size) {
+            p = (GlyphCache *)realloc(big_glyph, size);
+            if (!p)
+                return NULL;
+            big_glyph = p;
+            big_glyph_size = size;
+        }
+        return big_glyph;
+    }
+    if (glyph_slab_used + size > GLYPH_SLAB_SIZE) {
+        glyph_slab_sizes[glyph_slab_gen % nb_glyph_slabs] = glyph_slab_used;
+        /* go to the next slab, dropping the oldest one */
+        glyph_slab_gen++;
+        if (glyph_slab_gen >= nb_glyph_slabs)
+            glyph_free_slab(glyph_slab_gen);
+        glyph_slab_used = 0;
+    }
+    p = (GlyphCache *)(glyph_slab(glyph_slab_gen) + glyph_slab_used);
+    glyph_slab_used += size;
+    return p;
+}
+
+void glyph_cache_init(void)
+{
+    glyph_cache_close();
+    nb_glyph_slabs = max(glyph_cache_max_size / GLYPH_SLAB_SIZE, 2);
+    glyph_slabs = (unsigned char *)malloc(nb_glyph_slabs * GLYPH_SLAB_SIZE);
+    glyph_slab_sizes = (int *)malloc(nb_glyph_slabs * sizeof(int));
+    if (!glyph_slabs || !glyph_slab_sizes) {
+        glyph_cache_close();
+        return;
+    }
+    glyph_table_resize(1024);
+}
+
+void glyph_cache_close(void)
+{
+    free(glyph_slabs);
+    glyph_slabs = NULL;
+    free(glyph_slab_sizes);
+    glyph_slab_sizes = NULL;
+    nb_glyph_slabs = 0;
+    glyph_slab_gen = 0;
+    glyph_slab_used = 0;
+    free(glyph_table);
+    glyph_table = NULL;
+    glyph_table_size = 0;
+    nb_glyphs = 0;
+    free(big_glyph);
+    big_glyph = NULL;
+    big_glyph_size = 0;
+}
+
+/* set the maximum memory used by the glyph cache. The cache is
+   flushed. */
+void glyph_cache_set_size(int size)
+{
+    glyph_cache_max_size = size;
+    glyph_cache_init();
+}
+
+void glyph_cache_get_stats(GlyphCacheStats *st)
+{
+    st->hits = glyph_cache_hits;
+    st->misses = glyph_cache_misses;
+    st->nb_glyphs = nb_glyphs;
+    st->size = min(glyph_slab_gen, nb_glyph_slabs - 1) * GLYPH_SLAB_SIZE + 
+        glyph_slab_used;
+    st->max_size = nb_glyph_slabs * GLYPH_SLAB_SIZE;
+}
+
+static GlyphCache *get_cached_glyph(QEFont *font, int index)
+{
+    GlyphCache *p, *p1;
+    int h, size;
+
+    if (!glyph_table)
+        return NULL;
+    h = glyph_find_slot(font->private, index, font->size, font->style);
+    p = glyph_table[h];
     if (!p)
         return NULL;
+    /* the glyph is used: keep it out of the slabs to be dropped next */
+    if (glyph_slab_gen - p->gen >= nb_glyph_slabs / 2) {
+        size = glyph_entry_size(p->data_size);
+        /* cannot copy it if its slab is the one dropped to make room */
+        if (glyph_slab_used + size > GLYPH_SLAB_SIZE &&
+            glyph_slab_gen - p->gen >= nb_glyph_slabs - 1)
+            return p;
+        p1 = glyph_alloc(p->data_size);
+        if (!p1)
+            return p;
+        memcpy(p1, p, size);
+        p1->gen = glyph_slab_gen;
+        h = glyph_find_slot(font->private, index, font->size, font->style);
+        glyph_table[h] = p1;
+        p = p1;
+    }
+    return p;
+}
 
-    h = glyph_hash(index, font->size, font->style);
-    pp = &hash_table[h];
-    p->hash_next = *pp;
-    *pp = p;
+static GlyphCache *add_cached_glyph(QEFont *font, int index, int data_size)
+{
+    GlyphCache *p;
+    int h;
+
+    if (!glyph_table)
+        return NULL;
+    p = glyph_alloc(data_size);
+    if (!p)
+        return NULL;
+    p->font_data = font->private;
     p->index = index;
     p->size = font->size;
     p->style = font->style;
     p->data_size = data_size;
+    p->gen = glyph_slab_gen;
     p->private = NULL;
-    first_cache_entry.next->prev = p;
-    p->next = first_cache_entry.next;
-    first_cache_entry.next = p;
-    p->prev = &first_cache_entry;
+    if (p == big_glyph)
+        return p;
 
+    /* keep the load factor below 1/2 */
+    if (2 * (nb_glyphs + 1) > glyph_table_size) {
+        if (glyph_table_resize(glyph_table_size * 2) < 0)
+            return p;
+    }
+    h = glyph_find_slot(font->private, index, font->size, font->style);
+    glyph_table[h] = p;
+    nb_glyphs++;
     return p;
 }
 
-GlyphCache *fbf_decode_glyph1(QEFont *font, int code)
+/* decode glyph 'code' of font 'uf' and cache it as a glyph of 'font' */
+static GlyphCache *fbf_decode_glyph1(UniFontData *uf, QEFont *font, int code)
 {
-    UniFontData *uf = font->private;
     int glyph_index, size, src_width, src_height;
     GlyphCache *glyph_cache;
     GlyphEntry *fbf_glyph_entry;
@@ -165,6 +356,7 @@ GlyphCache *fbf_decode_glyph1(QEFont *font, int code)
     glyph_cache->x = fbf_glyph_entry->x;
     glyph_cache->y = fbf_glyph_entry->y;
     glyph_cache->xincr = fbf_glyph_entry->xincr;
+    glyph_cache->is_fallback = (uf != font->private);
     return glyph_cache;
 }
 
@@ -178,26 +370,42 @@ GlyphCache *decode_cached_glyph(QEditScreen *s, QEFont *font, int code)
     QEFont *font1;
 
     g = get_cached_glyph(font, code);
+    if (g) {
+        glyph_cache_hits++;
+        return g;
+    }
+    glyph_cache_misses++;
+    g = fbf_decode_glyph1(font->private, font, code);
     if (!g) {
-        g = fbf_decode_glyph1(font, code);
-        if (!g) {
-            /* try with fallback font */
-            font1 = select_font(s, font->style | (1 << QE_FAMILY_FALLBACK_SHIFT),
-                                font->size);
-            g = fbf_decode_glyph1(font1, code);
-            release_font(s, font1);
-            if (!g) 
-                return NULL;
-            /* indicates that it is a fallback glyph so that the
-               correct font height can be computed */
-            g->is_fallback = 1;
-        } else {
-            g->is_fallback = 0;
-        }
+        /* try with fallback font. The glyph is cached as a glyph of
+           'font' so that the next lookup finds it */
+        font1 = select_font(s, font->style | (1 << QE_FAMILY_FALLBACK_SHIFT),
+                            font->size);
+        g = fbf_decode_glyph1(font1->private, font, code);
+        release_font(s, font1);
     }
     return g;
 }
 
+/* decode and cache in advance the glyphs from 'first_code' to
+   'last_code' (for example a Unicode block). Stop when half of the
+   cache is filled. Return the number of glyphs cached */
+int glyph_cache_warmup(QEditScreen *s, QEFont *font, 
+                       int first_code, int last_code)
+{
+    int code, n, gen;
+
+    n = 0;
+    gen = glyph_slab_gen;
+    for (code = first_code; code <= last_code; code++) {
+        if (glyph_slab_gen - gen >= nb_glyph_slabs / 2)
+            break;
+        if (decode_cached_glyph(s, font, code))
+            n++;
+    }
+    return n;
+}
+
 void fbf_text_metrics(QEditScreen *s, QEFont *font, 
                       QECharMetrics *metrics,
                       const unsigned int *str, int len)
@@ -385,6 +593,7 @@ void fbf_render_cleanup(void)
         fclose(uf->infile);
     }
     first_font = NULL;
+    glyph_cache_close();
 }
 
 #else
@@ -500,6 +709,7 @@ void fbf_render_cleanup(void)
         free(uf);
     }
     first_font = NULL;
+    glyph_cache_close();
 }
 
 #endif
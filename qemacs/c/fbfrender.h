@@ -1,21 +1,34 @@
 
 /* glyph cache */
 typedef struct GlyphCache {
-    struct GlyphCache *hash_next;
-    struct GlyphCache *prev, *next;
     void *private; /* private data available for the driver, initialized to NULL */
     /* font info */
+    void *font_data; /* private data of the font */
+    int gen; /* generation of the slab containing the glyph */
+    unsigned int index; /* unicode char */
     short size; /* font size */
     unsigned short style; /* font style */
     short w, h;   /* glyph bitmap size */
     short x, y;     /* glyph bitmap offset */
-    unsigned short index; /* glyph index */
     unsigned short data_size;
     short xincr;  /* glyph x increment */
     unsigned char is_fallback; /* true if fallback glyph */
     unsigned char data[0];
 } GlyphCache;
 
+typedef struct GlyphCacheStats {
+    int hits, misses;
+    int nb_glyphs;
+    int size, max_size; /* in bytes */
+} GlyphCacheStats;
+
+void glyph_cache_init(void);
+void glyph_cache_close(void);
+void glyph_cache_set_size(int size);
+void glyph_cache_get_stats(GlyphCacheStats *st);
+int glyph_cache_warmup(QEditScreen *s, QEFont *font, 
+                       int first_code, int last_code);
+
 void fbf_text_metrics(QEditScreen *s, QEFont *font, 
                       QECharMetrics *metrics,
                       const unsigned int *str, int len);
@@ -20,11 +20,19 @@
 
 extern ModeDef hex_mode;
 
-static int to_disp(int c)
+/* printable form of each byte in the ascii column */
+static unsigned char hex_ascii[256];
+
+static void hex_init_tables(void)
 {
-    if (c < ' ' || c >= 127)
-        c = '.';
-    return c;
+    int c;
+
+    for (c = 0; c < 256; c++) {
+        if (c < ' ' || c >= 127)
+            hex_ascii[c] = '.';
+        else
+            hex_ascii[c] = c;
+    }
 }
 
 static int hex_backward_offset(EditState *s, int offset)
@@ -32,33 +40,66 @@ static int hex_backward_offset(EditState *s, int offset)
     return align(offset, s->disp_width);
 }
 
+/* return a pointer to the 'size' bytes of the row at 'offset'. The
+   page data is used directly unless the row straddles a page
+   boundary, in which case the spans are gathered in 'buf' */
+static const u8 *hex_get_row(EditBuffer *b, int offset, u8 *buf, int size)
+{
+    const u8 *p;
+    int len, n;
+
+    p = eb_get_span(b, offset, &len);
+    if (len >= size)
+        return p;
+    for (n = 0; n < size; n += len) {
+        p = eb_get_span(b, offset + n, &len);
+        if (len <= 0)
+            break;
+        if (len > size - n)
+            len = size - n;
+        memcpy(buf + n, p, len);
+    }
+    return buf;
+}
+
 static int hex_display(EditState *s, DisplayState *ds, int offset)
 {
-    int j, len, eof;
+    int j, len, eof, width, n;
     int offset1;
-    unsigned char b;
+    const u8 *row;
+    u8 buf[MAX_SCREEN_WIDTH];
 
     display_bol(ds);
 
-    display_printf(ds, -1, -1, "%08x ", offset);
+    display_printhex(ds, -1, -1, offset, 8);
+    display_char(ds, -1, -1, ' ');
     eof = 0;
     len = eb_total_size(s->b) - offset;
     if (len > s->disp_width)
         len = s->disp_width;
+    /* no more than MAX_SCREEN_WIDTH bytes are drawn, but the row
+       still covers 'len' bytes of the buffer */
+    width = min(s->disp_width, (int)sizeof(buf));
+    n = min(len, width);
+    /* fetch the whole row at once instead of one eb_read() per byte */
+    row = buf;
+    if (n > 0)
+        row = hex_get_row(s->b, offset, buf, n);
+
     if (s->mode == &hex_mode) {
-        for (j = 0; j < s->disp_width; j++) {
+        for (j = 0; j < width; j++) {
             display_char(ds, -1, -1, ' ');
             offset1 = offset + j;
-            if (j < len) {
-                eb_read(s->b, offset + j, &b, 1);
-                display_printhex(ds, offset1, offset1 + 1, b, 2);
+            if (j < n) {
+                display_printhex(ds, offset1, offset1 + 1, row[j], 2);
             } else {
                 if (!eof) {
                     eof = 1;
                 } else {
                     offset1 = -2;
                 }
-                display_printf(ds, offset1, offset1 + 1, "  ");
+                display_char(ds, offset1, offset1 + 1, ' ');
+                display_char(ds, -1, -1, ' ');
             }
             if ((j & 7)== 7)
                 display_char(ds, -1, -1, ' ');
@@ -67,19 +108,18 @@ static int hex_display(EditState *s, DisplayState *ds, int offset)
         display_char(ds, -1, -1, ' ');
     }
     eof = 0;
-    for (j = 0; j < s->disp_width; j++) {
+    for (j = 0; j < width; j++) {
         offset1 = offset + j;
-        if (j < len) {
-            eb_read(s->b, offset + j, &b, 1);
+        if (j < n) {
+            display_char(ds, offset1, offset1 + 1, hex_ascii[row[j]]);
         } else {
-            b = ' ';
             if (!eof) {
                 eof = 1;
             } else {
                 offset1 = -2;
             }
+            display_char(ds, offset1, offset1 + 1, ' ');
         }
-        display_char(ds, offset1, offset1 + 1, to_disp(b));
     }
     offset += len;
     display_eol(ds, -1, -1);
@@ -164,6 +204,9 @@ static int hex_mode_init(EditState *s, ModeSavedData *saved_data)
     s->unihex_mode = 0;
     s->hex_nibble = 0;
     s->wrap = WRAP_TRUNCATE;
+    /* edit big mmapped files with patches instead of page copies */
+    if (!s->b->modified)
+        eb_enable_patches(s->b);
     return 0;
 }
 
@@ -238,7 +281,8 @@ void hex_write_char(EditState *s, int key)
         h = to_hex(key);
         if (h < 0)
             return;
-        if (s->insert && s->hex_nibble == 0) {
+        /* patch mode is overwrite only */
+        if (s->insert && s->hex_nibble == 0 && !eb_is_patching(s->b)) {
             ch = h << ((hsize - 1) * 4);
             if (s->unihex_mode) {
                 len = unicode_to_charset(buf, ch, s->b->charset);
@@ -297,6 +341,8 @@ void hex_mode_line(EditState *s, char *buf, int buf_size)
     if (eb_total_size(s->b) > 0)
         percent = (s->offset * 100) / eb_total_size(s->b);
     q += sprintf(q, "--%d%%", percent);
+    if (eb_is_patching(s->b))
+        q += sprintf(q, "--patch:%d", s->b->pages.PatchCount());
 }
 
 ModeDef ascii_mode = { 
@@ -356,6 +402,8 @@ ModeDef hex_mode = {
 
 static int hex_init()
 {
+    hex_init_tables();
+
     /* first register mode(s) */
     qe_register_mode(&ascii_mode);
     qe_register_mode(&hex_mode);
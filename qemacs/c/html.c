@@ -19,12 +19,22 @@
 #include "qe.h"
 #include "css.h"
 
-/* define to enable timers */
-//#define HTML_PROFILE
-
 #define SCROLL_MHEIGHT     10
 #define HTML_ERROR_BUFFER       "*xml-error*"
 
+/* maximum number of buffer modifications applied incrementally
+   between two displays */
+#define HTML_MAX_EDITS 16
+
+/* time given to each step of the background layout, in microseconds */
+#define HTML_LAYOUT_SLICE 20000
+
+typedef struct HTMLEdit {
+    enum LogOperation op;
+    int offset;
+    int size;
+} HTMLEdit;
+
 /* mode state */
 typedef struct HTMLState {
     /* default style sheet */
@@ -39,7 +49,13 @@ typedef struct HTMLState {
     CSSRect invalid_rect; /* this rectangle should be redrawn */
     int up_to_date;    /* true if css representation is synced with
                           buffer content */
+    int relayout;      /* true if only the layout must be redone */
+    int layout_bh;     /* true if the lazy layout is continued in a
+                          bottom half */
     int parse_flags;   /* can contain XML_HTML and XML_IGNORE_CASE */
+    /* buffer modifications not yet applied to the css representation */
+    int nb_edits;
+    HTMLEdit edits[HTML_MAX_EDITS];
 } HTMLState;
 
 const char *html_style;
@@ -109,31 +125,307 @@ void css_error(const char *filename, int line_num, const char *msg)
 }
 
 
-#ifdef HTML_PROFILE
+PROF_SCOPE(prof_xml_parse, "xml_parse_buffer");
+PROF_SCOPE(prof_css_compute, "css_compute");
+PROF_SCOPE(prof_css_layout, "css_layout");
+PROF_SCOPE(prof_css_layout_dirty, "css_layout_dirty_block");
+PROF_SCOPE(prof_css_cursor, "css_get_cursor_pos");
+PROF_SCOPE(prof_css_display, "css_display");
 
-static int timer_val;
+static int html_test_abort(void *opaque)
+{
+    return is_user_input_pending();
+}
 
-static int get_time(void)
+/* extract document size. If the layout is not complete, the height
+   of the remaining boxes is estimated from the size of their text */
+static void html_update_size(EditState *s)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return tv.tv_sec * 1000000 + tv.tv_usec;
+    HTMLState *hs = (HTMLState*)s->mode_data;
+    CSSContext *ctx = hs->css_ctx;
+
+    hs->total_width = hs->top_box->bbox.x2;
+    hs->total_height = hs->top_box->bbox.y2;
+    if (ctx->layout_partial && ctx->layout_stop_offset > 0) {
+        hs->total_height = (int)((double)hs->total_height *
+                                 eb_total_size(s->b) / 
+                                 ctx->layout_stop_offset);
+    }
 }
 
-#define timer_start() timer_val = get_time()
-#define timer_stop(str) \
- printf("timer %s: %0.3f ms\n", str, (double)(get_time() - timer_val) / 1000.0)
+static void html_layout_bh(void *opaque);
 
-#else
+/* continue the lazy layout in the background */
+static void html_schedule_layout(EditState *s)
+{
+    HTMLState *hs = (HTMLState*)s->mode_data;
 
-#define timer_start()
-#define timer_stop(str)
+    if (!hs->layout_bh) {
+        hs->layout_bh = 1;
+        register_bottom_half(html_layout_bh, s);
+    }
+}
 
-#endif
+/* lay out the document down to hs->css_ctx->layout_limit, from the
+   top or, if 'resume' is true, from where the previous lazy layout
+   stopped. Return non zero if interrupted */
+static int html_layout(EditState *s, int resume)
+{
+    HTMLState *hs = (HTMLState*)s->mode_data;
+    int ret;
+    int64_t t;
 
-static int html_test_abort(void *opaque)
+    PROF_BEGIN(t);
+    if (resume) {
+        ret = css_layout_resume(hs->css_ctx, hs->top_box,
+                                html_test_abort, NULL);
+    } else {
+        ret = css_relayout(hs->css_ctx, hs->top_box, s->width,
+                           html_test_abort, NULL);
+    }
+    PROF_END(prof_css_layout, t);
+    if (ret) {
+        /* the layout must be done again before displaying */
+        hs->relayout = 1;
+        return ret;
+    }
+    hs->relayout = 0;
+    html_update_size(s);
+    s->display_invalid = 1;
+    if (hs->css_ctx->layout_partial)
+        html_schedule_layout(s);
+    return 0;
+}
+
+/* extend the lazy layout until the window and the cursor are laid
+   out. Return non zero if interrupted */
+static int html_layout_window(EditState *s)
 {
-    return is_user_input_pending();
+    HTMLState *hs = (HTMLState*)s->mode_data;
+    CSSContext *ctx = hs->css_ctx;
+    int y;
+
+    y = -s->y_disp + s->height;
+    while (ctx->layout_partial &&
+           (hs->top_box->bbox.y2 < y ||
+            s->offset >= ctx->layout_stop_offset)) {
+        ctx->layout_limit = max(ctx->layout_limit * 2, y + s->height);
+        if (html_layout(s, 1))
+            return -1;
+    }
+    return 0;
+}
+
+/* lay out the next part of the document from where the previous
+   step stopped. Each step doubles the laid out height, and also stops
+   after HTML_LAYOUT_SLICE so that the editor stays responsive when
+   the display driver cannot report pending input. User input
+   interrupts it: it is then restarted by html_display() */
+static void html_layout_bh(void *opaque)
+{
+    EditState *s = (EditState*)opaque;
+    HTMLState *hs = (HTMLState*)s->mode_data;
+    QEmacsState *qs = s->qe_state;
+    CSSContext *ctx = hs->css_ctx;
+    int ret;
+
+    hs->layout_bh = 0;
+    /* pending edits are applied by html_display() first */
+    if (!hs->up_to_date || hs->relayout || hs->nb_edits > 0 ||
+        !ctx->layout_partial)
+        return;
+    ctx->layout_limit *= 2;
+    ctx->layout_deadline = get_clock_usec() + HTML_LAYOUT_SLICE;
+    ret = html_layout(s, 1);
+    ctx->layout_deadline = 0;
+    if (ret)
+        return;
+    edit_display(qs);
+    dpy_flush(qs->screen);
+}
+
+/* return true if 'box' or one of its parents is in 'tab' */
+static int html_box_in(CSSBox *box, CSSBox **tab, int nb)
+{
+    int i;
+
+    for (; box != NULL; box = box->parent) {
+        for (i = 0; i < nb; i++) {
+            if (tab[i] == box)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/* add 'box' to 'tab' if not already there */
+static void html_add_box(CSSBox *box, CSSBox **tab, int *nb_ptr)
+{
+    int i;
+
+    for (i = 0; i < *nb_ptr; i++) {
+        if (tab[i] == box)
+            return;
+    }
+    tab[(*nb_ptr)++] = box;
+}
+
+/* Apply the pending buffer modifications to the css representation
+   without parsing the whole document again. If they only change the
+   text inside text boxes, the structure and the styles are unchanged
+   and only the blocks containing the text are laid out again.
+   Otherwise, the content of the innermost element containing the
+   modification is parsed again and its styles are computed for that
+   element only. Return -1 if the document must be rebuilt. */
+static int html_apply_edits(EditState *s)
+{
+    HTMLState *hs = (HTMLState*)s->mode_data;
+    CSSBox *boxes[HTML_MAX_EDITS], *elements[HTML_MAX_EDITS];
+    CSSBox *blocks[HTML_MAX_EDITS];
+    CSSBox *box, *box1;
+    HTMLEdit *e;
+    int i, nb_boxes, nb_elements, nb_blocks, offset, size, text_ok, markup;
+    int64_t t;
+
+    nb_boxes = 0;
+    nb_elements = 0;
+    for (i = 0; i < hs->nb_edits; i++) {
+        e = &hs->edits[i];
+        box = css_find_text_box(hs->top_box, e->offset);
+        text_ok = 0;
+        if (box) {
+            css_unsplit_box(box);
+            switch (e->op) {
+            case LOGOP_INSERT:
+                text_ok = 1;
+                break;
+            case LOGOP_DELETE:
+                /* the parser does not generate empty boxes */
+                text_ok = (e->offset + e->size <= box->u.buffer.end &&
+                           e->size < box->u.buffer.end - box->u.buffer.start);
+                break;
+            case LOGOP_WRITE:
+                text_ok = (e->offset + e->size <= box->u.buffer.end);
+                break;
+            default:
+                return -1;
+            }
+        }
+        if (text_ok) {
+            switch (e->op) {
+            case LOGOP_INSERT:
+                box->u.buffer.end += e->size;
+                css_shift_text_boxes(hs->top_box, e->offset, e->size, box);
+                break;
+            case LOGOP_DELETE:
+                box->u.buffer.end -= e->size;
+                css_shift_text_boxes(hs->top_box, e->offset + 1, -e->size,
+                                     box);
+                break;
+            default:
+                break;
+            }
+            html_add_box(box, boxes, &nb_boxes);
+            continue;
+        }
+
+        /* the structure may change: the enclosing element is parsed
+           again. Its old childs are shifted with the rest but are
+           not used */
+        size = (e->op == LOGOP_INSERT) ? 0 : e->size;
+        box = css_find_content_box(hs->top_box, e->offset, size);
+        if (!box)
+            return -1;
+        switch (e->op) {
+        case LOGOP_INSERT:
+            css_shift_text_boxes(hs->top_box, e->offset, e->size, NULL);
+            break;
+        case LOGOP_DELETE:
+            css_shift_text_boxes(hs->top_box, e->offset + 1, -e->size, NULL);
+            break;
+        default:
+            break;
+        }
+        html_add_box(box, elements, &nb_elements);
+    }
+
+    /* the elements whose new text contains markup are parsed again */
+    for (i = 0; i < nb_boxes; i++) {
+        box = boxes[i];
+        markup = 0;
+        for (offset = box->u.buffer.start; offset < box->u.buffer.end;) {
+            if (eb_nextc(s->b, offset, &offset) == '<') {
+                markup = 1;
+                break;
+            }
+        }
+        if (markup) {
+            box1 = css_find_content_box(hs->top_box, box->u.buffer.start,
+                                        box->u.buffer.end -
+                                        box->u.buffer.start);
+            if (!box1)
+                return -1;
+            html_add_box(box1, elements, &nb_elements);
+        }
+    }
+
+    /* only the outermost elements are parsed again, and the text
+       boxes inside them are replaced */
+    for (i = 0; i < nb_elements;) {
+        if (html_box_in(elements[i]->parent, elements, nb_elements))
+            elements[i] = elements[--nb_elements];
+        else
+            i++;
+    }
+    for (i = 0; i < nb_boxes;) {
+        if (html_box_in(boxes[i], elements, nb_elements))
+            boxes[i] = boxes[--nb_boxes];
+        else
+            i++;
+    }
+    for (i = 0; i < nb_elements; i++) {
+        box = elements[i];
+        PROF_BEGIN(t);
+        box1 = xml_parse_content(s->b, box, hs->css_ctx, hs->parse_flags,
+                                 html_test_abort, NULL);
+        PROF_END(prof_xml_parse, t);
+        if (!box1)
+            return -1;
+        PROF_BEGIN(t);
+        if (css_replace_childs(hs->css_ctx, box, box1))
+            return -1;
+        PROF_END(prof_css_compute, t);
+    }
+
+    /* find the blocks to lay out again */
+    nb_blocks = 0;
+    for (i = 0; i < nb_boxes + nb_elements; i++) {
+        if (i < nb_boxes) {
+            box = boxes[i];
+        } else {
+            box = elements[i - nb_boxes]->u.child.first;
+            if (!box)
+                goto full_layout;
+        }
+        box = css_get_dirty_block(hs->css_ctx, box);
+        if (!box)
+            goto full_layout;
+        html_add_box(box, blocks, &nb_blocks);
+    }
+    PROF_BEGIN(t);
+    for (i = 0; i < nb_blocks; i++) {
+        if (css_layout_dirty_block(hs->css_ctx, blocks[i]))
+            break;
+    }
+    PROF_END(prof_css_layout_dirty, t);
+    if (i < nb_blocks)
+        goto full_layout;
+    return 0;
+
+ full_layout:
+    if (html_layout(s, 0))
+        return -1;
+    return 0;
 }
 
 static void html_display(EditState *s)
@@ -144,17 +436,36 @@ static void html_display(EditState *s)
     int n, cursor_found, d, ret, sel_start, sel_end;
     CSSRect rect;
     EditBuffer *b;
+    int64_t t;
 
     /* XXX: should be generic ? */
     if (hs->last_width != s->width) {
         hs->last_width = s->width;
-        hs->up_to_date = 0;
+        hs->relayout = 1;
     }
     if (s->b->charset != hs->last_charset) {
         hs->last_charset = s->b->charset;
         hs->up_to_date = 0;
     }
 
+    /* the buffer was modified: update the document incrementally */
+    if (hs->up_to_date && hs->nb_edits > 0) {
+        if (html_apply_edits(s) < 0)
+            hs->up_to_date = 0;
+        hs->nb_edits = 0;
+        html_update_size(s);
+        s->display_invalid = 1;
+    }
+
+    /* width change: the parsed and computed document is kept */
+    if (hs->up_to_date && hs->relayout) {
+        /* only the window is laid out again in the foreground: the
+           background layout may have left a much larger limit */
+        hs->css_ctx->layout_limit = -s->y_disp + 2 * s->height;
+        if (html_layout(s, 0))
+            return;
+    }
+
     /* reparse & layout if needed */
     if (!hs->up_to_date) {
         /* display busy message */
@@ -192,47 +503,46 @@ static void html_display(EditState *s)
         hs->css_ctx->selection_fgcolor = qe_styles[QE_STYLE_SELECTION].fg_color;
         hs->css_ctx->default_bgcolor = qe_styles[QE_STYLE_CSS_DEFAULT].bg_color;
 
-        timer_start();
+        PROF_BEGIN(t);
         hs->top_box = xml_parse_buffer(s->b, 0, eb_total_size(s->b), 
-                                       hs->css_ctx->style_sheet, 
-                                       hs->parse_flags,
+                                       hs->css_ctx, hs->parse_flags,
                                        html_test_abort, NULL);
-        timer_stop("xml_parse_buffer");
+        PROF_END(prof_xml_parse, t);
         if (!hs->top_box)
             return;
 
-        timer_start();
+        PROF_BEGIN(t);
         css_compute(hs->css_ctx, hs->top_box);
-        timer_stop("css_compute");
+        PROF_END(prof_css_compute, t);
 
-        timer_start();
-        ret = css_layout(hs->css_ctx, hs->top_box, s->width,
-                         html_test_abort, NULL);
-        timer_stop("css_layout");
+        /* only lay out what is needed to fill the window, the rest
+           is done in the background */
+        hs->css_ctx->layout_limit = -s->y_disp + 2 * s->height;
+        ret = html_layout(s, 0);
         if (ret) {
             return;
         }
             
-        /* extract document size */
-        hs->total_width = hs->top_box->bbox.x2;
-        hs->total_height = hs->top_box->bbox.y2;
-        
         /* set invalid rectangle to the whole window */
         css_set_rect(&hs->invalid_rect, s->xleft, s->ytop,
                      s->xleft + s->width, s->ytop + s->height);
         hs->up_to_date = 1;
+        hs->relayout = 0;
+        hs->nb_edits = 0;
         s->busy = 0;
     }
 
     /* draw if possible */
     if (hs->up_to_date) {
+        if (html_layout_window(s))
+            return;
         n = 0;
     redo:
-        timer_start();
+        PROF_BEGIN(t);
         cursor_found = css_get_cursor_pos(hs->css_ctx, hs->top_box, 
                                           NULL, NULL, NULL,
                                           &cursor_pos, &dirc, s->offset);
-        timer_stop("css_get_cursor_pos");
+        PROF_END(prof_css_cursor, t);
         //        printf("cursor_found=%d offset=%d\n", cursor_found, s->offset);
         if (!cursor_found) {
             if (++n == 1) {
@@ -307,11 +617,11 @@ static void html_display(EditState *s)
 
             push_clip_rectangle(s->screen, &old_clip, &rect);
 
-            timer_start();
+            PROF_BEGIN(t);
 
             css_display(hs->css_ctx, hs->top_box, 
                         &rect, s->xleft + s->x_disp[0], s->ytop + s->y_disp);
-            timer_stop("css_display");
+            PROF_END(prof_css_display, t);
 
             set_clip_rectangle(s->screen, &old_clip);
             
@@ -406,6 +716,11 @@ static void html_scroll_up_down(EditState *s, int dir)
     } else if (hs->total_height + s->y_disp < s->height) {
         s->y_disp = s->height - hs->total_height;
     }
+    /* the estimated height may be reached before the layout */
+    if (html_layout_window(s))
+        return;
+    if (hs->total_height + s->y_disp < s->height)
+        s->y_disp = min(0, s->height - hs->total_height);
 
     /* XXX: max height ? */
     
@@ -755,7 +1070,8 @@ static void html_mouse_goto(EditState *s, int x, int y)
     }
 }
 
-/* invalidate the html data if modification done (XXX: be more precise) */
+/* record the modification so that it is applied incrementally by
+   html_apply_edits(), or invalidate the html data if too many */
 static void html_callback(EditBuffer *b,
                           void *opaque,
                           enum LogOperation op,
@@ -764,7 +1080,18 @@ static void html_callback(EditBuffer *b,
 {
     EditState *s = (EditState*)opaque;
     HTMLState *hs = (HTMLState*)s->mode_data;
-    hs->up_to_date = 0;
+    HTMLEdit *e;
+
+    if (!hs->up_to_date)
+        return;
+    if (hs->nb_edits >= HTML_MAX_EDITS) {
+        hs->up_to_date = 0;
+        return;
+    }
+    e = &hs->edits[hs->nb_edits++];
+    e->op = op;
+    e->offset = offset;
+    e->size = size;
 }
     
 static void load_default_style_sheet(HTMLState *hs, const char *stylesheet_str, 
@@ -818,6 +1145,8 @@ static void html_mode_close(EditState *s)
 {
     HTMLState *hs = (HTMLState*)s->mode_data;
     eb_free_callback(s->b, html_callback, s);
+    if (hs->layout_bh)
+        unregister_bottom_half(html_layout_bh, s);
 
     s->busy = 0;
     if (hs->top_box)
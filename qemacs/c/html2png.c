@@ -19,11 +19,20 @@
 #include "qe.h"
 #include "css.h"
 #include "cfb.h"
+#include "fbfrender.h"
 
 #ifdef CONFIG_PNG_OUTPUT
 #include <png.h>
 #endif
 
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#endif
+
 #define DEFAULT_WIDTH 640
 #ifdef CONFIG_PNG_OUTPUT
 #define DEFAULT_OUTFILENAME "a.png"
@@ -31,6 +40,26 @@
 #define DEFAULT_OUTFILENAME "a.ppm"
 #endif
 
+/* height of the horizontal bands rendered by the workers */
+#define BAND_HEIGHT 128
+#define MAX_JOBS    64
+
+/* band rendering state. With more than one job, the framebuffer is
+   shared with forked worker processes, each rendering every nb_jobs-th
+   band and signaling its completion on a pipe. Processes are used
+   instead of threads because the glyph and font caches and the
+   display temporaries of CSSContext are not thread safe, while a
+   forked worker gets its own copy of them for free. */
+static int nb_jobs = 1;
+static int glyph_cache_size;      /* in bytes, 0 for the default */
+static int nb_bands;
+static int band_fd = -1;          /* read side of the completion pipe */
+static unsigned char *band_done;
+#ifndef WIN32
+static pid_t band_pids[MAX_JOBS];
+static size_t fb_size;            /* size of the shared framebuffer */
+#endif
+
 /* file I/O for the qHTML library */
 
 CSSFile *css_open(CSSContext *s, const char *filename)
@@ -115,9 +144,24 @@ int ppm_resize(QEditScreen *s, int w, int h)
     unsigned char *data;
     
     /* alloc bitmap */
-    data = realloc(cfb->base, w * h * sizeof(int));
-    if (!data) {
-        return -1;
+#ifndef WIN32
+    if (nb_jobs > 1) {
+        /* the workers must draw in the pages seen by the encoder */
+        size_t size = (size_t)w * h * sizeof(int);
+        data = (unsigned char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED)
+            return -1;
+        if (cfb->base)
+            munmap(cfb->base, fb_size);
+        fb_size = size;
+    } else
+#endif
+    {
+        data = realloc(cfb->base, w * h * sizeof(int));
+        if (!data) {
+            return -1;
+        }
     }
     cfb->base = data;
     cfb->wrap = w * sizeof(int);
@@ -141,11 +185,14 @@ static int ppm_init(QEditScreen *s, int w, int h)
     if (!cfb)
         return -1;
 
+    cfb->base = NULL;
     s->private = cfb;
     s->media = CSS_MEDIA_SCREEN;
 
     if (cfb_init(s, NULL, w * sizeof(int), 32, ".") < 0)
         goto fail;
+    if (glyph_cache_size > 0)
+        glyph_cache_set_size(glyph_cache_size);
 
     if (ppm_resize(s, w, h) < 0) {
     fail:
@@ -159,10 +206,63 @@ static void ppm_close(QEditScreen *s)
 {
     CFBContext *cfb = s->private;
     
-    free(cfb->base);
+#ifndef WIN32
+    if (nb_jobs > 1)
+        munmap(cfb->base, fb_size);
+    else
+#endif
+        free(cfb->base);
     free(cfb);
 }
 
+/* wait until the band containing row 'y' is rendered */
+static int band_wait(int y)
+{
+    int band, n;
+
+    if (band_fd < 0)
+        return 0;
+    while (!band_done[y / BAND_HEIGHT]) {
+        n = read(band_fd, &band, sizeof(band));
+        if (n != sizeof(band)) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            /* all workers exited before finishing their bands */
+            fprintf(stderr, "html2png: rendering worker failed\n");
+            return -1;
+        }
+        if (band >= 0 && band < nb_bands)
+            band_done[band] = 1;
+    }
+    return 0;
+}
+
+/* reap the workers */
+static int band_finish(void)
+{
+    int ret = 0;
+
+#ifndef WIN32
+    int i, status;
+
+    if (band_fd < 0)
+        return 0;
+    close(band_fd);
+    band_fd = -1;
+    for (i = 0; i < nb_jobs; i++) {
+        if (band_pids[i] <= 0)
+            continue;
+        if (waitpid(band_pids[i], &status, 0) < 0 ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ret = -1;
+        band_pids[i] = 0;
+    }
+    free(band_done);
+    band_done = NULL;
+#endif
+    return ret;
+}
+
 int ppm_save(QEditScreen *s, const char *filename)
 {
     CFBContext *cfb = s->private;
@@ -180,6 +280,10 @@ int ppm_save(QEditScreen *s, const char *filename)
 
     fprintf(f, "P6\n%d %d\n%d\n", w, h, 255);
     for (y = 0; y < h; y++) {
+        if (band_wait(y) < 0) {
+            fclose(f);
+            return -1;
+        }
         for (x = 0; x < w; x++) {
             v = data[x];
             r = (v >> 16) & 0xff;
@@ -254,6 +358,8 @@ int png_save(QEditScreen *s, const char *filename)
     row_pointers[0] = row;
 
     for (y = 0; y < h; y++) {
+        if (band_wait(y) < 0)
+            longjmp(png_ptr->jmpbuf, 1);
         row_ptr = row;
         for (x = 0; x < w; x++) {
             v = data[x];
@@ -302,6 +408,21 @@ void test_display(QEditScreen *screen)
 
 extern const char html_style[];
 
+/* the default style sheet is parsed once and merged into each
+   document */
+static CSSStyleSheet *default_style_sheet;
+
+/* per document timings, in microseconds */
+typedef struct DocTimes {
+    int64_t parse;
+    int64_t compute;
+    int64_t layout;
+    int64_t raster;
+    int64_t save;
+    int64_t teardown;
+    int nb_styles;      /* computed styles after interning */
+} DocTimes;
+
 static int html_test_abort(void *opaque)
 {
     return 0;
@@ -309,8 +430,70 @@ static int html_test_abort(void *opaque)
 
 #define IO_BUF_SIZE 4096
 
+#ifndef WIN32
+/* render the bands job, job + nb_jobs, ... and signal each of them on
+   'fd' as soon as it is in the framebuffer */
+static void render_bands(QEditScreen *scr, CSSContext *s, CSSBox *top_box,
+                         int job, int fd)
+{
+    CSSRect rect;
+    int band;
+
+    for (band = job; band < nb_bands; band += nb_jobs) {
+        rect.x1 = 0;
+        rect.y1 = band * BAND_HEIGHT;
+        rect.x2 = scr->width;
+        rect.y2 = min(rect.y1 + BAND_HEIGHT, scr->height);
+        set_clip_rectangle(scr, &rect);
+        css_display(s, top_box, &rect, 0, 0);
+        if (fd >= 0)
+            write(fd, &band, sizeof(band));
+        else
+            band_done[band] = 1;
+    }
+}
+
+/* start the band workers. The parent returns immediately: the
+   encoder waits for each band with band_wait(). */
+static int start_band_workers(QEditScreen *scr, CSSContext *s,
+                              CSSBox *top_box)
+{
+    int fds[2], i;
+    pid_t pid;
+
+    nb_bands = (scr->height + BAND_HEIGHT - 1) / BAND_HEIGHT;
+    band_done = (unsigned char *)calloc(nb_bands + 1, 1);
+    if (!band_done)
+        return -1;
+    if (pipe(fds) < 0) {
+        free(band_done);
+        band_done = NULL;
+        return -1;
+    }
+    /* flush stdio so that the workers do not output it again */
+    fflush(NULL);
+    for (i = 0; i < nb_jobs; i++) {
+        pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            render_bands(scr, s, top_box, i, fds[1]);
+            _exit(0);
+        }
+        band_pids[i] = pid;
+        if (pid < 0) {
+            /* no more processes: render these bands ourselves */
+            render_bands(scr, s, top_box, i, -1);
+        }
+    }
+    close(fds[1]);
+    band_fd = fds[0];
+    return 0;
+}
+#endif
+
 int draw_html(QEditScreen *scr, 
-              const char *filename, QECharset *charset, int flags)
+              const char *filename, QECharset *charset, int flags,
+              DocTimes *times)
 {
     CSSContext *s = NULL;
     CSSBox *top_box = NULL;
@@ -320,16 +503,21 @@ int draw_html(QEditScreen *scr,
     char buf[IO_BUF_SIZE];
     CSSRect rect;
     int page_height;
+    int64_t t0, t1;
 
+    t0 = get_clock_usec();
     s = css_new_document(scr, NULL);
     if (!s)
         return -1;
 
     /* prepare default style sheet */
+    if (!default_style_sheet) {
+        default_style_sheet = css_new_style_sheet();
+        css_parse_style_sheet_str(default_style_sheet, html_style, 
+                                  flags);
+    }
     s->style_sheet = css_new_style_sheet();
-
-    css_parse_style_sheet_str(s->style_sheet, html_style, 
-                              flags);
+    css_merge_style_sheet(s->style_sheet, default_style_sheet);
     
     /* default colors */
     s->selection_bgcolor = QERGB(0x00, 0x00, 0xff);
@@ -342,7 +530,7 @@ int draw_html(QEditScreen *scr,
     if (!f)
         goto fail;
 
-    xml = xml_begin(s->style_sheet, flags, html_test_abort, NULL, filename, charset);
+    xml = xml_begin(s, flags, html_test_abort, NULL, filename, charset);
     
     for (;;) {
         len = css_read(f, buf, IO_BUF_SIZE);
@@ -354,12 +542,24 @@ int draw_html(QEditScreen *scr,
     css_close(f);
 
     top_box = xml_end(xml);
+    t1 = get_clock_usec();
+    if (times)
+        times->parse = t1 - t0;
+    t0 = t1;
     
     /* CSS computation */
     css_compute(s, top_box);
+    t1 = get_clock_usec();
+    if (times)
+        times->compute = t1 - t0;
+    t0 = t1;
 
     /* CSS layout */
     css_layout(s, top_box, scr->width, html_test_abort, NULL);
+    t1 = get_clock_usec();
+    if (times)
+        times->layout = t1 - t0;
+    t0 = t1;
     
     /* now we know the total size, so we allocate the ppm */
     page_height = top_box->bbox.y2;
@@ -368,15 +568,30 @@ int draw_html(QEditScreen *scr,
         goto fail;
 
     /* CSS display */
-    rect.x1 = 0;
-    rect.y1 = 0;
-    rect.x2 = scr->width;
-    rect.y2 = scr->height;
+#ifndef WIN32
+    if (nb_jobs > 1) {
+        if (start_band_workers(scr, s, top_box) < 0)
+            goto fail;
+    } else
+#endif
+    {
+        rect.x1 = 0;
+        rect.y1 = 0;
+        rect.x2 = scr->width;
+        rect.y2 = scr->height;
 
-    css_display(s, top_box, &rect, 0, 0);
+        css_display(s, top_box, &rect, 0, 0);
+    }
+    if (times) {
+        times->raster = get_clock_usec() - t0;
+        times->nb_styles = s->nb_props;
+    }
     
+    t0 = get_clock_usec();
     css_delete_box(top_box);
     css_delete_document(s);
+    if (times)
+        times->teardown = get_clock_usec() - t0;
     return 0;
  fail:
     if (f)
@@ -388,15 +603,305 @@ int draw_html(QEditScreen *scr,
     return -1;
 }
 
+static int save_image(QEditScreen *screen, const char *outfilename)
+{
+    /* save ppm file */
+#ifdef CONFIG_PNG_OUTPUT
+    if (!strstr(outfilename, ".ppm"))
+        return png_save(screen, outfilename);
+#endif
+    return ppm_save(screen, outfilename);
+}
+
+#ifndef WIN32
+
+/* batch mode: each request line is 'infile [outfile]'. Documents are
+   rendered one after the other on the same screen, so the fonts, the
+   glyph cache and the default style sheet are loaded only once. Each
+   document has its own CSSContext, deleted after rendering. */
+
+#define MAX_BATCH_LINE 1024
+
+/* render one request line and output its timings on 'out' */
+static void batch_render(QEditScreen *screen, const char *line,
+                         QECharset *charset, int flags, FILE *out)
+{
+    char infilename[MAX_BATCH_LINE], outfilename[MAX_BATCH_LINE];
+    DocTimes times;
+    struct rusage ru;
+    int64_t t0;
+    char *p;
+    int ret;
+
+    infilename[0] = outfilename[0] = '\0';
+    if (sscanf(line, "%1023s %1023s", infilename, outfilename) < 1 ||
+        infilename[0] == '#')
+        return;
+    if (outfilename[0] == '\0') {
+        /* replace the extension of the input file */
+        pstrcpy(outfilename, sizeof(outfilename), infilename);
+        p = strrchr(outfilename, '.');
+        if (p && !strchr(p, '/'))
+            *p = '\0';
+#ifdef CONFIG_PNG_OUTPUT
+        pstrcat(outfilename, sizeof(outfilename), ".png");
+#else
+        pstrcat(outfilename, sizeof(outfilename), ".ppm");
+#endif
+    }
+
+    memset(&times, 0, sizeof(times));
+    /* the page height of the previous document is not relevant */
+    ppm_resize(screen, screen->width, 1);
+    ret = draw_html(screen, infilename, charset, flags, &times);
+    if (ret == 0) {
+        t0 = get_clock_usec();
+        ret = save_image(screen, outfilename);
+        times.save = get_clock_usec() - t0;
+    }
+    /* the peak RSS is the maximum of the process so far: render the
+       biggest document first or alone to measure it */
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(out, "%s %s %s parse=%d.%03d compute=%d.%03d layout=%d.%03d "
+            "raster=%d.%03d save=%d.%03d teardown=%d.%03d ms "
+            "styles=%d maxrss=%ld KB\n",
+            ret < 0 ? "ERROR" : "OK", infilename, outfilename,
+            (int)(times.parse / 1000), (int)(times.parse % 1000),
+            (int)(times.compute / 1000), (int)(times.compute % 1000),
+            (int)(times.layout / 1000), (int)(times.layout % 1000),
+            (int)(times.raster / 1000), (int)(times.raster % 1000),
+            (int)(times.save / 1000), (int)(times.save % 1000),
+            (int)(times.teardown / 1000), (int)(times.teardown % 1000),
+            times.nb_styles, (long)ru.ru_maxrss);
+    fflush(out);
+}
+
+/* read one request line of 'in' into 'buf'. A line that does not fit
+   is skipped and reported as an error on 'out'. Return 0 at the end of
+   the input. */
+static int batch_get_line(char *buf, int size, FILE *in, FILE *out)
+{
+    int len, c;
+
+    for (;;) {
+        if (!fgets(buf, size, in))
+            return 0;
+        len = strlen(buf);
+        if (len < size - 1 || buf[len - 1] == '\n')
+            return 1;
+        c = getc(in);
+        if (c == '\n' || c == EOF)
+            return 1;
+        while (c != '\n' && c != EOF)
+            c = getc(in);
+        fprintf(out, "ERROR request line longer than %d bytes: %.40s...\n",
+                size - 1, buf);
+        fflush(out);
+    }
+}
+
+/* read the whole manifest so that the workers can share it */
+static char **batch_read_manifest(FILE *in, int *nb_lines_ptr)
+{
+    char line[MAX_BATCH_LINE];
+    char **lines = NULL, **lines1;
+    int nb_lines = 0, size = 0;
+
+    while (batch_get_line(line, sizeof(line), in, stdout)) {
+        if (nb_lines >= size) {
+            size = size ? size * 2 : 64;
+            lines1 = (char **)realloc(lines, size * sizeof(char *));
+            if (!lines1)
+                break;
+            lines = lines1;
+        }
+        lines[nb_lines] = strdup(line);
+        if (!lines[nb_lines])
+            break;
+        nb_lines++;
+    }
+    *nb_lines_ptr = nb_lines;
+    return lines;
+}
+
+/* warm up the shared caches before forking the document workers */
+static void batch_warmup(QEditScreen *screen)
+{
+    QEFont *font;
+
+    /* typical body text */
+    font = select_font(screen, QE_STYLE_NORM, 12);
+    if (font) {
+        glyph_cache_warmup(screen, font, 0x20, 0x7e);
+        release_font(screen, font);
+    }
+}
+
+/* serve the connections accepted on 'sock' forever */
+static void batch_serve(QEditScreen *screen, int sock,
+                        QECharset *charset, int flags)
+{
+    char line[MAX_BATCH_LINE];
+    int fd, fd1;
+    FILE *in, *out;
+
+    for (;;) {
+        fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            return;
+        }
+        /* a socket cannot be repositioned, so a single "r+" stream
+           cannot switch between reading and writing: use one stream
+           for each direction */
+        in = fdopen(fd, "r");
+        if (!in) {
+            close(fd);
+            continue;
+        }
+        out = NULL;
+        fd1 = dup(fd);
+        if (fd1 >= 0) {
+            out = fdopen(fd1, "w");
+            if (!out)
+                close(fd1);
+        }
+        if (!out) {
+            fclose(in);
+            continue;
+        }
+        while (batch_get_line(line, sizeof(line), in, out))
+            batch_render(screen, line, charset, flags, out);
+        fclose(out);
+        fclose(in);
+    }
+}
+
+static int batch_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    pstrcpy(addr.sun_path, sizeof(addr.sun_path), path);
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(sock, 16) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void batch_print_glyph_stats(void)
+{
+    GlyphCacheStats st;
+
+    glyph_cache_get_stats(&st);
+    fprintf(stderr, "glyph cache: hits=%d misses=%d glyphs=%d size=%d/%d KB\n",
+            st.hits, st.misses, st.nb_glyphs,
+            st.size / 1024, st.max_size / 1024);
+}
+
+/* run the batch with 'nb_workers' processes. Each worker gets its own
+   copy of the warmed up screen and caches, and renders its documents
+   with an isolated CSSContext. */
+static int batch_main(QEditScreen *screen, const char *manifest,
+                      const char *socket_path, int nb_workers,
+                      QECharset *charset, int flags)
+{
+    FILE *in;
+    char **lines = NULL;
+    int nb_lines = 0, sock = -1, i, j, status, ret;
+    pid_t pid;
+
+    if (socket_path) {
+        sock = batch_listen(socket_path);
+        if (sock < 0) {
+            perror(socket_path);
+            return -1;
+        }
+    } else {
+        if (!strcmp(manifest, "-")) {
+            in = stdin;
+        } else {
+            in = fopen(manifest, "r");
+            if (!in) {
+                perror(manifest);
+                return -1;
+            }
+        }
+        lines = batch_read_manifest(in, &nb_lines);
+        if (in != stdin)
+            fclose(in);
+    }
+
+    batch_warmup(screen);
+    fflush(NULL);
+    ret = 0;
+    for (i = 0; i < nb_workers; i++) {
+        if (nb_workers > 1) {
+            pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                ret = -1;
+                break;
+            }
+            if (pid > 0)
+                continue;
+        }
+        /* worker, or the only process */
+        if (sock >= 0) {
+            batch_serve(screen, sock, charset, flags);
+        } else {
+            for (j = i; j < nb_lines; j += nb_workers)
+                batch_render(screen, lines[j], charset, flags, stdout);
+        }
+        batch_print_glyph_stats();
+        if (nb_workers > 1)
+            _exit(0);
+    }
+    if (nb_workers > 1) {
+        while (wait(&status) > 0) {
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                ret = -1;
+        }
+    }
+    for (j = 0; j < nb_lines; j++)
+        free(lines[j]);
+    free(lines);
+    if (sock >= 0) {
+        close(sock);
+        unlink(socket_path);
+    }
+    return ret;
+}
+#endif
+
 void help(void)
 {
     printf("html2png version %s (c) 2002 Fabrice Bellard\n"
            "\n"
-           "usage: html2png [-h] [-x] [-w width] [-o outfile] [-f charset] infile\n"
+           "usage: html2png [-h] [-x] [-j jobs] [-w width] [-o outfile] [-f charset] infile\n"
+           "       html2png [-x] [-j jobs] [-w width] [-c size] [-f charset] -b manifest|-s socket\n"
            "Convert the HTML page 'infile' into the png/ppm image file 'outfile'\n"
            "\n"
            "-h         : display this help\n"
            "-x         : use strict XML parser (xhtml type parsing)\n"
+           "-j jobs    : render the page with 'jobs' processes (default=1)\n"
+           "             in batch mode, render 'jobs' documents at a time\n"
+           "-b manifest: render each 'infile [outfile]' line of 'manifest'\n"
+           "             ('-' for stdin) and output the timings\n"
+           "-s socket  : same as -b for the lines received on the UNIX socket\n"
+           "             the glyph cache statistics are output on stderr\n"
+           "-c size    : set the glyph cache size in KB\n"
+           "-t         : check the SIMD frame buffer kernels and exit\n"
            "-w width   : set the image width (default=%d)\n"
            "-f charset : set the default charset (default='%s')\n"
            "             use -f ? to list supported charsets\n"
@@ -416,7 +921,9 @@ int main(int argc, char **argv)
     QEditScreen screen1, *screen = &screen1;
     int page_width, c, strict_xml, flags;
     char *outfilename, *infilename;
+    char *manifest, *socket_path;
     QECharset *charset;
+    int ret;
 
     charset_init();
     charset_more_init();
@@ -426,9 +933,11 @@ int main(int argc, char **argv)
     outfilename = DEFAULT_OUTFILENAME;
     charset = &charset_8859_1;
     strict_xml = 0;
+    manifest = NULL;
+    socket_path = NULL;
     
     for (;;) {
-        c = getopt(argc, argv, "h?w:o:f:x");
+        c = getopt(argc, argv, "h?j:w:o:f:xb:s:c:t");
         if (c == -1)
             break;
         switch (c) {
@@ -436,9 +945,28 @@ int main(int argc, char **argv)
         case '?':
             help();
             exit(1);
+        case 'j':
+            nb_jobs = atoi(optarg);
+#ifdef WIN32
+            nb_jobs = 1;
+#endif
+            if (nb_jobs < 1)
+                nb_jobs = 1;
+            if (nb_jobs > MAX_JOBS)
+                nb_jobs = MAX_JOBS;
+            break;
         case 'w':
             page_width = atoi(optarg);
             break;
+        case 'c':
+            glyph_cache_size = atoi(optarg) * 1024;
+            break;
+        case 't':
+            /* self check of the frame buffer SIMD kernels */
+            ret = cfb_check_kernels();
+            if (ret == 0)
+                printf("cfb: the row kernels match the scalar ones\n");
+            exit(ret != 0);
         case 'o':
             outfilename = optarg;
             break;
@@ -457,8 +985,37 @@ int main(int argc, char **argv)
         case 'x':
             strict_xml = 1;
             break;
+        case 'b':
+            manifest = optarg;
+            break;
+        case 's':
+            socket_path = optarg;
+            break;
         }
     }
+
+    flags = XML_HTML;
+    if (!strict_xml)
+        flags |= XML_IGNORE_CASE | XML_HTML_SYNTAX;
+
+#ifndef WIN32
+    if (manifest || socket_path) {
+        int nb_workers;
+
+        /* the documents are rendered in parallel, not their bands */
+        nb_workers = nb_jobs;
+        nb_jobs = 1;
+        if (ppm_dpy.dpy_init(screen, page_width, 1) < 0) {
+            fprintf(stderr, "Could not init display driver\n");
+            exit(1);
+        }
+        ret = batch_main(screen, manifest, socket_path, nb_workers,
+                         charset, flags);
+        screen->dpy.dpy_close(screen);
+        return ret < 0;
+    }
+#endif
+
     if (optind >= argc) {
         help();
         exit(1);
@@ -472,21 +1029,10 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    flags = XML_HTML;
-    if (!strict_xml)
-        flags |= XML_IGNORE_CASE | XML_HTML_SYNTAX;
-
-    draw_html(screen, infilename, charset, flags);
-
-    /* save ppm file */
-#ifdef CONFIG_PNG_OUTPUT
-    if (strstr(outfilename, ".ppm"))
-        ppm_save(screen, outfilename);
-    else
-        png_save(screen, outfilename);
-#else    
-    ppm_save(screen, outfilename);
-#endif
+    draw_html(screen, infilename, charset, flags, NULL);
+    save_image(screen, outfilename);
+    if (band_finish() < 0)
+        fprintf(stderr, "html2png: some rendering workers failed\n");
 
     /* close screen */
     screen->dpy.dpy_close(screen);
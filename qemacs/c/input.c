@@ -74,99 +74,385 @@ void register_input_method(InputMethod *m)
 
 /* XXX: use an edit buffer to access the kmap !!!! */
 
+/* The compressed kmaps are compiled on first use into a double-array
+   trie over the input characters. Each state records whether kmap
+   entries end there and whether its subtree holds a single entry, so
+   that a match costs one transition per input character. The trie is
+   a single relocatable block which replaces the method data. */
+
+#define KMAP_MAX_INPUT   16
+#define KMAP_ALPHABET    256
+
+/* state flags, stored above the output character */
+#define KMAP_END         0x01000000 /* an entry ends at this state */
+#define KMAP_END_MULTI   0x02000000 /* several entries end at this state */
+#define KMAP_UNIQUE      0x04000000 /* one entry goes through this state */
+#define KMAP_CHAR_MASK   0x00ffffff
+
+typedef struct KmapTrie {
+    int nb_states;
+    /* followed by int base[nb_states], int check[nb_states] and
+       unsigned int val[nb_states] */
+} KmapTrie;
+
+/* pointer trie used during the compilation */
+typedef struct KmapNode {
+    int first_child;
+    int next_sibling;
+    int code;
+    int nb_entries;
+    int nb_end;
+    int output;
+} KmapNode;
+
+typedef struct KmapBuild {
+    KmapNode *nodes;
+    int nb_nodes, nodes_size;
+    int *base, *check;
+    unsigned int *val;
+    int nb_states, states_size;
+} KmapBuild;
+
+static int kmap_new_node(KmapBuild *kb, int code)
+{
+    KmapNode *n;
+
+    if (kb->nb_nodes >= kb->nodes_size) {
+        int size = kb->nodes_size ? kb->nodes_size * 2 : 1024;
+        n = (KmapNode *)realloc(kb->nodes, size * sizeof(KmapNode));
+        if (!n)
+            return -1;
+        kb->nodes = n;
+        kb->nodes_size = size;
+    }
+    n = &kb->nodes[kb->nb_nodes];
+    n->first_child = -1;
+    n->next_sibling = -1;
+    n->code = code;
+    n->nb_entries = 0;
+    n->nb_end = 0;
+    n->output = 0;
+    return kb->nb_nodes++;
+}
+
+static int kmap_add_entry(KmapBuild *kb, const unsigned int *input, int len,
+                          int output)
+{
+    int i, n, child;
+
+    n = 0;
+    kb->nodes[n].nb_entries++;
+    for (i = 0; i < len; i++) {
+        if (input[i] >= KMAP_ALPHABET)
+            return 0; /* cannot be typed */
+        for (child = kb->nodes[n].first_child; child >= 0;
+             child = kb->nodes[child].next_sibling) {
+            if (kb->nodes[child].code == (int)input[i])
+                break;
+        }
+        if (child < 0) {
+            child = kmap_new_node(kb, input[i]);
+            if (child < 0)
+                return -1;
+            kb->nodes[child].next_sibling = kb->nodes[n].first_child;
+            kb->nodes[n].first_child = child;
+        }
+        n = child;
+        kb->nodes[n].nb_entries++;
+    }
+    /* the first entry wins, as in the table order */
+    if (kb->nodes[n].nb_end++ == 0)
+        kb->nodes[n].output = output;
+    return 0;
+}
+
 /* parse the internal compressed input method format */
-int kmap_input(int *match_len_ptr, 
-               const u8 *data, const unsigned int *buf, int len)
+static int kmap_decode(KmapBuild *kb, const u8 *data)
 {
     const u8 *p, *p1;
-    int c, d, i, l, l1, match_len, match_char, match_count, match_real_len;
-    int nb_prefixes, last_outputc, match, prefix_len, trailing_space;
+    unsigned int input[KMAP_MAX_INPUT];
+    int c, d, k, l1, nb_sections, nb_prefixes, prefix_len;
+    int last_outputc, trailing_space;
 
     p = data;
     nb_prefixes = p[0] & 0x7f;
     trailing_space = p[0] & 0x80;
-    p++;
-    prefix_len = 0;
-    if (nb_prefixes > 0) {
-        p1 = p;
-        for (i = 0; i < nb_prefixes; i++) {
-            if (buf[0] == p1[0])
-                goto prefix_match;
-            p1 += 4;
+    nb_sections = nb_prefixes ? nb_prefixes : 1;
+    for (k = 0; k < nb_sections; k++) {
+        p = data + 1;
+        prefix_len = 0;
+        if (nb_prefixes > 0) {
+            /* the entries of each section share their first char */
+            p1 = p + k * 4;
+            input[0] = p1[0];
+            prefix_len = 1;
+            p += nb_prefixes * 4 + (p1[1] << 16) + (p1[2] << 8) + p1[3];
         }
-        return INPUTMETHOD_NOMATCH;
-    prefix_match:
-        p += nb_prefixes * 4 + (p1[1] << 16) + (p1[2] << 8) + p1[3];
-        prefix_len = 1;
+        last_outputc = 0;
+        for (;;) {
+            l1 = prefix_len; /* length of input pattern */
+            for (;;) {
+                c = *p++;
+                d = c & 0x80;
+                c = c & 0x7f;
+                if (c == 0) {
+                    /* end of table */
+                    goto next_section;
+                } else if (c >= 1 && c <= 0x1d) {
+                    /* delta */
+                    last_outputc += c;
+                    break;
+                } else if (c == 0x1e) {
+                    /* explicit output */
+                    last_outputc = (p[0] << 8) | p[1];
+                    p += 2;
+                    break;
+                } else if (c == 0x1f) {
+                    /* unicode value */
+                    c = (p[0] << 8) | p[1];
+                    p += 2;
+                }
+                if (l1 < KMAP_MAX_INPUT - 1)
+                    input[l1++] = c;
+                if (d) {
+                    /* delta = 1 */
+                    last_outputc++;
+                    break;
+                }
+            }
+            if (trailing_space)
+                input[l1++] = ' ';
+            if (kmap_add_entry(kb, input, l1, last_outputc) < 0)
+                return -1;
+        }
+    next_section: ;
     }
+    return 0;
+}
 
-    match_len = 0;
-    match_real_len = 0;
-    match_char = 0;
-    match_count = 0;
-    last_outputc = 0;
-    for (;;) {
-        match = 1;
-        l1 = prefix_len; /* length of input pattern */
+static int kmap_grow_states(KmapBuild *kb, int size)
+{
+    int new_size, i;
+    int *base, *check;
+    unsigned int *val;
+
+    if (size <= kb->states_size)
+        return 0;
+    new_size = kb->states_size ? kb->states_size : 1024;
+    while (new_size < size)
+        new_size *= 2;
+    base = (int *)realloc(kb->base, new_size * sizeof(int));
+    if (!base)
+        return -1;
+    kb->base = base;
+    check = (int *)realloc(kb->check, new_size * sizeof(int));
+    if (!check)
+        return -1;
+    kb->check = check;
+    val = (unsigned int *)realloc(kb->val, new_size * sizeof(unsigned int));
+    if (!val)
+        return -1;
+    kb->val = val;
+    for (i = kb->states_size; i < new_size; i++) {
+        kb->base[i] = 0;
+        kb->check[i] = -1;
+        kb->val[i] = 0;
+    }
+    kb->states_size = new_size;
+    return 0;
+}
+
+/* place the pointer trie in the double array, breadth first */
+static int kmap_build_states(KmapBuild *kb)
+{
+    int *queue, head, tail, n, state, child, b, ok, min_code;
+    int pos, next_check_pos, first, nb_used;
+
+    queue = (int *)malloc(2 * kb->nb_nodes * sizeof(int));
+    if (!queue)
+        return -1;
+    if (kmap_grow_states(kb, KMAP_ALPHABET + 2) < 0)
+        goto fail;
+    kb->check[0] = 0; /* root */
+    kb->nb_states = 1;
+    next_check_pos = 1;
+    head = tail = 0;
+    queue[tail++] = 0;
+    queue[tail++] = 0;
+    while (head < tail) {
+        n = queue[head++];
+        state = queue[head++];
+        kb->val[state] = kb->nodes[n].output & KMAP_CHAR_MASK;
+        if (kb->nodes[n].nb_end > 0)
+            kb->val[state] |= KMAP_END;
+        if (kb->nodes[n].nb_end > 1)
+            kb->val[state] |= KMAP_END_MULTI;
+        if (kb->nodes[n].nb_entries == 1)
+            kb->val[state] |= KMAP_UNIQUE;
+        if (kb->nodes[n].first_child < 0)
+            continue;
+
+        min_code = KMAP_ALPHABET;
+        for (child = kb->nodes[n].first_child; child >= 0;
+             child = kb->nodes[child].next_sibling) {
+            if (kb->nodes[child].code < min_code)
+                min_code = kb->nodes[child].code;
+        }
+        /* find a base where all the children slots are free. The
+           slot of the first child is searched from next_check_pos,
+           which is moved forward when the area before it is full. */
+        pos = max(next_check_pos, min_code + 1) - 1;
+        first = 1;
+        nb_used = 0;
         for (;;) {
-            c = *p++;
-            d = c & 0x80;
-            c = c & 0x7f;
-            if (c == 0) {
-                /* end of table */
-                goto the_end;
-            } else if (c >= 1 && c <= 0x1d) {
-                /* delta */
-                last_outputc += c;
-                break;
-            } else if (c == 0x1e) {
-                /* explicit output */
-                last_outputc = (p[0] << 8) | p[1];
-                p += 2;
-                break;
-            } else if (c == 0x1f) {
-                /* unicode value */
-                c = (p[0] << 8) | p[1];
-                p += 2;
+            pos++;
+            if (kmap_grow_states(kb, pos + KMAP_ALPHABET + 1) < 0)
+                goto fail;
+            if (kb->check[pos] >= 0) {
+                nb_used++;
+                continue;
             }
-            if (l1 < len && c != (int)buf[l1])
-                match = 0;
-            l1++;
-            if (d) {
-                /* delta = 1 */
-                last_outputc++;
-                break;
+            if (first) {
+                next_check_pos = pos;
+                first = 0;
+            }
+            b = pos - min_code - 1;
+            ok = 1;
+            for (child = kb->nodes[n].first_child; child >= 0;
+                 child = kb->nodes[child].next_sibling) {
+                if (kb->check[b + kb->nodes[child].code + 1] >= 0) {
+                    ok = 0;
+                    break;
+                }
             }
+            if (ok)
+                break;
         }
-        if (trailing_space) {
-            if (l1 < len && ' ' != buf[l1])
-                match = 0;
-            l1++;
+        if (nb_used * 20 >= (pos - next_check_pos + 1) * 19)
+            next_check_pos = pos;
+        kb->base[state] = b;
+        for (child = kb->nodes[n].first_child; child >= 0;
+             child = kb->nodes[child].next_sibling) {
+            int t = b + kb->nodes[child].code + 1;
+            kb->check[t] = state;
+            if (t >= kb->nb_states)
+                kb->nb_states = t + 1;
+            queue[tail++] = child;
+            queue[tail++] = t;
         }
+    }
+    free(queue);
+    return 0;
+ fail:
+    free(queue);
+    return -1;
+}
 
-        if (match) {
-            l = l1;
-            if (l > len)
-                l = len;
-            if (l == match_len) {
-                match_count++;
-            } else if (l > match_len) {
-                match_len = l;
-                match_real_len = l1;
-                match_char = last_outputc;
-                match_count = 1;
-            }
+static u8 *kmap_compile(const u8 *data)
+{
+    KmapBuild kb1, *kb = &kb1;
+    KmapTrie *trie = NULL;
+    u8 *block = NULL;
+    int n;
+
+    memset(kb, 0, sizeof(*kb));
+    if (kmap_new_node(kb, 0) < 0 ||
+        kmap_decode(kb, data) < 0 ||
+        kmap_build_states(kb) < 0)
+        goto done;
+
+    n = kb->nb_states;
+    block = (u8 *)malloc(sizeof(KmapTrie) + n * (2 * sizeof(int) + sizeof(int)));
+    if (!block)
+        goto done;
+    trie = (KmapTrie *)block;
+    trie->nb_states = n;
+    block += sizeof(KmapTrie);
+    memcpy(block, kb->base, n * sizeof(int));
+    block += n * sizeof(int);
+    memcpy(block, kb->check, n * sizeof(int));
+    block += n * sizeof(int);
+    memcpy(block, kb->val, n * sizeof(unsigned int));
+    block = (u8 *)trie;
+ done:
+    free(kb->nodes);
+    free(kb->base);
+    free(kb->check);
+    free(kb->val);
+    return block;
+}
+
+/* match the input against a compiled kmap. The result is the same as
+   a scan of all the entries: the longest entries compatible with the
+   input win, and more chars are needed while it is ambiguous. */
+static int kmap_trie_input(int *match_len_ptr, 
+                           const u8 *data, const unsigned int *buf, int len)
+{
+    const KmapTrie *trie = (const KmapTrie *)data;
+    const int *base, *check;
+    const unsigned int *val;
+    int i, t, state, nb_states, last_end, last_len;
+    unsigned int c;
+
+    if (len <= 0)
+        return INPUTMETHOD_NOMATCH;
+    nb_states = trie->nb_states;
+    base = (const int *)(trie + 1);
+    check = base + nb_states;
+    val = (const unsigned int *)(check + nb_states);
+
+    state = 0;
+    last_end = -1;
+    last_len = 0;
+    for (i = 0; i < len; i++) {
+        c = buf[i];
+        if (c >= KMAP_ALPHABET)
+            break;
+        t = base[state] + c + 1;
+        if (t >= nb_states || check[t] != state)
+            break;
+        state = t;
+        if (val[state] & KMAP_END) {
+            last_end = state;
+            last_len = i + 1;
         }
     }
-the_end:
-    if (match_len == 0) {
+    if (i == len) {
+        /* the input is a prefix of at least one entry */
+        if ((val[state] & (KMAP_UNIQUE | KMAP_END)) !=
+            (KMAP_UNIQUE | KMAP_END))
+            return INPUTMETHOD_MORECHARS;
+        *match_len_ptr = len;
+        return val[state] & KMAP_CHAR_MASK;
+    }
+    /* otherwise, the longest entry which is a prefix of the input */
+    if (last_end < 0)
         return INPUTMETHOD_NOMATCH;
-    } else if (match_count > 1 || match_real_len > len) {
+    if (val[last_end] & KMAP_END_MULTI)
         return INPUTMETHOD_MORECHARS;
-    } else {
-        *match_len_ptr = match_len;
-        return match_char;
+    *match_len_ptr = last_len;
+    return val[last_end] & KMAP_CHAR_MASK;
+}
+
+/* compile the kmap on first use */
+int kmap_input(int *match_len_ptr, 
+               const u8 *data, const unsigned int *buf, int len)
+{
+    InputMethod *m;
+    u8 *trie;
+
+    for (m = input_methods; m != NULL; m = m->next) {
+        if (m->data == data && m->input_match == kmap_input)
+            break;
     }
+    if (!m)
+        return INPUTMETHOD_NOMATCH;
+    trie = kmap_compile(data);
+    if (!trie)
+        return INPUTMETHOD_NOMATCH;
+    m->data = trie;
+    m->input_match = kmap_trie_input;
+    return kmap_trie_input(match_len_ptr, trie, buf, len);
 }
 
 static int input_method_fd;
@@ -226,6 +512,15 @@ void load_input_methods(void)
 
 void unload_input_methods(void)
 {
+    InputMethod *m;
+
+    for (m = input_methods; m != NULL; m = m->next) {
+        if (m->input_match == kmap_trie_input) {
+            free((void *)m->data);
+            m->data = NULL;
+            m->input_match = default_input;
+        }
+    }
     if (input_method_fd >= 0) {
         close(input_method_fd);
         input_method_fd = -1;
@@ -30,577 +30,454 @@
 # include <string.h>
 #endif /* STDC_HEADERS */
 
-#if !(defined(_MSC_VER))
-# include <strings.h>
-#endif
-
 #if HAVE_UNISTD_H
 # include <unistd.h>
 #endif /* HAVE_UNISTD_H */
 
-#if defined(_MSC_VER)
-# define strncasecmp _strnicmp
-#endif
-
 #define hexdigit(x) (((x) <= '9') ? (x) - '0' : ((x) & 7) + 9)
 
-int serialize_generic(json_object *me, strbuf *buf);
+/** JSON_DOC.C */
+
+/* the arena is a list of chunks. Chunk sizes double from
+   JSON_CHUNK_MIN up to JSON_CHUNK_MAX. Allocations larger than a
+   quarter of the chunk size get a chunk of their own. */
+#define JSON_CHUNK_MIN   4096
+#define JSON_CHUNK_MAX   (1024 * 1024)
+#define JSON_ALIGN       8
+
+typedef struct json_chunk {
+    struct json_chunk *next;
+    /* the data follows, aligned on JSON_ALIGN */
+} json_chunk;
+
+#define JSON_CHUNK_HDR \
+    ((sizeof(json_chunk) + JSON_ALIGN - 1) & ~(JSON_ALIGN - 1))
+
+typedef struct json_key {
+    const char *    str;
+    unsigned int    hash;
+    int             len;
+} json_key;
+
+struct json_doc {
+    json_chunk *    chunks;
+    char *          ptr;        /* free space of the current chunk */
+    char *          end;
+    int             chunk_size; /* size of the next chunk */
+    int             arena_size;
+    int             arena_used;
+
+    /* interned object keys: open addressing, power of 2 size */
+    json_key *      keys;
+    int             nb_keys;
+    int             keys_size;
+
+    /* parser scratch stack of the members of the open containers */
+    json_member *   stack;
+    int             stack_len;
+    int             stack_size;
+
+    strbuf *        pb;         /* for json_serialize() */
+};
 
-#if !HAVE_STRNDUP
-char* strndup(const char* str, size_t n)
+json_doc* json_doc_new(void)
 {
-    size_t len;
-    char * s;
+    json_doc *doc;
 
-    if (!str)
-        return NULL;
-    len = strlen(str);
-    if (n < len)
-        len = n;
-    s = (char*)malloc(sizeof(char) * (len + 1));
-    if (!s)
+    doc = (json_doc*)calloc(1, sizeof(json_doc));
+    if (!doc)
         return NULL;
-
-    memcpy(s, str, len);
-    s[len] = '\0';
-    return s;
+    doc->chunk_size = JSON_CHUNK_MIN;
+    return doc;
 }
-#endif
 
-struct array_list*
-array_list_new(array_list_free_fn *free_fn)
+void json_doc_free(json_doc *doc)
 {
-    struct array_list *me;
+    json_chunk *c, *next;
 
-    me = (array_list*)calloc(1, sizeof(struct array_list));
-    if (!me) 
-        return NULL;
-    me->size = ARRAY_LIST_DEFAULT_SIZE;
-    me->length = 0;
-    me->free_fn = free_fn;
-    me->array = (void**)calloc(sizeof(void*), me->size);
-    if (!me->array) {
-        free(me);
-        return NULL;
-    }
-    return me;
-}
-
-void
-array_list_free(struct array_list *me)
-{
-    int i;
-    for (i = 0; i < me->length; i++)
-    {
-        if (me->array[i]) 
-            me->free_fn(me->array[i]);
+    if (!doc)
+        return;
+    for (c = doc->chunks; c != NULL; c = next) {
+        next = c->next;
+        free(c);
     }
-    free(me->array);
-    free(me);
+    free(doc->keys);
+    free(doc->stack);
+    strbuf_free(doc->pb);
+    free(doc);
 }
 
-void*
-array_list_get_idx(struct array_list *me, int i)
+void json_doc_get_stats(json_doc *doc, json_doc_stats *st)
 {
-    if(i >= me->length) 
-        return NULL;
-    return me->array[i];
+    st->arena_size = doc->arena_size;
+    st->arena_used = doc->arena_used;
+    st->nb_keys = doc->nb_keys;
 }
 
-static int array_list_expand_internal(struct array_list *me, int max)
+static void *json_arena_alloc_slow(json_doc *doc, int size)
 {
-    void **t;
-    int new_size;
-
-    if (max < me->size) 
-        return 0;
-    new_size = max;
-    if (me->size << 1 > max)
-        new_size = me->size << 1;
-    t = (void**)realloc(me->array, new_size*sizeof(void*));
-    if (!t) 
-        return -1;
-    me->array = t;
-    memset(me->array + me->size, 0, (new_size-me->size)*sizeof(void*));
-    me->size = new_size;
-    return 0;
-}
-
-int array_list_put_idx(struct array_list *me, int idx, void *data)
-{
-    if (array_list_expand_internal(me, idx)) 
-        return -1;
-    if (me->array[idx]) 
-        me->free_fn(me->array[idx]);
-    me->array[idx] = data;
-    if (me->length <= idx) 
-        me->length = idx + 1;
-    return 0;
-}
-
-int array_list_add(struct array_list *me, void *data)
-{
-  return array_list_put_idx(me, me->length, data);
-}
-
-int array_list_length(struct array_list *me)
-{
-  return me->length;
-}
-
-/** LINKHASH.C */
-
-/**
- * golden prime used in hash functions
- */
-#define LH_PRIME 0x9e370001UL
-
-/**
- * sentinel pointer value for empty slots
- */
-#define LH_EMPTY (void*)-1
-
-/**
- * sentinel pointer value for freed slots
- */
-#define LH_FREED (void*)-2
-
-unsigned long lh_ptr_hash(void *k)
-{
-    return (unsigned long)((((ptrdiff_t)k * LH_PRIME) >> 4) & ULONG_MAX);
-}
-
-int lh_ptr_equal(void *k1, void *k2)
-{
-    return (k1 == k2);
-}
-
-unsigned long lh_char_hash(void *k)
-{
-    unsigned int h = 0;
-    const char* data = (const char*)k;
-
-    while( *data ) 
-        h = h*129 + (unsigned int)(*data++) + LH_PRIME;
+    json_chunk *c;
+    int chunk_size;
+
+    if (size > doc->chunk_size / 4) {
+        /* dedicated chunk, linked after the current one so that the
+           free space of the current chunk stays usable */
+        c = (json_chunk*)malloc(JSON_CHUNK_HDR + size);
+        if (!c)
+            return NULL;
+        if (doc->chunks) {
+            c->next = doc->chunks->next;
+            doc->chunks->next = c;
+        } else {
+            c->next = NULL;
+            doc->chunks = c;
+        }
+        doc->arena_size += size;
+        doc->arena_used += size;
+        return (char*)c + JSON_CHUNK_HDR;
+    }
 
-    return h;
+    chunk_size = doc->chunk_size;
+    if (doc->chunk_size < JSON_CHUNK_MAX)
+        doc->chunk_size *= 2;
+    c = (json_chunk*)malloc(JSON_CHUNK_HDR + chunk_size);
+    if (!c)
+        return NULL;
+    c->next = doc->chunks;
+    doc->chunks = c;
+    doc->arena_size += chunk_size;
+    doc->ptr = (char*)c + JSON_CHUNK_HDR;
+    doc->end = doc->ptr + chunk_size;
+
+    doc->ptr += size;
+    doc->arena_used += size;
+    return doc->ptr - size;
 }
 
-int lh_char_equal(void *k1, void *k2)
+static inline void *json_arena_alloc(json_doc *doc, int size)
 {
-    return (strcmp((char*)k1, (char*)k2) == 0);
+    size = (size + JSON_ALIGN - 1) & ~(JSON_ALIGN - 1);
+    if (size > doc->end - doc->ptr)
+        return json_arena_alloc_slow(doc, size);
+    doc->ptr += size;
+    doc->arena_used += size;
+    return doc->ptr - size;
 }
 
-lh_table* lh_table_new(int size, char *name,
-                              lh_entry_free_fn *free_fn,
-                              lh_hash_fn *hash_fn,
-                              lh_equal_fn *equal_fn)
+static char *json_arena_strndup(json_doc *doc, const char *s, int len)
 {
-    int i;
-    lh_table *t;
+    char *p;
 
-    t = (lh_table*)calloc(1, sizeof(lh_table));
-    if (!t) 
+    p = (char*)json_arena_alloc(doc, len + 1);
+    if (!p)
         return NULL;
-    t->count = 0;
-    t->size = size;
-    t->name = name;
-    t->table = (lh_entry*)calloc(size, sizeof(lh_entry));
-    if (!t->table) 
-    {
-        free(t);
-        return NULL;
-    }
-    t->free_fn = free_fn;
-    t->hash_fn = hash_fn;
-    t->equal_fn = equal_fn;
-    for (i = 0; i < size; i++) 
-        t->table[i].key = LH_EMPTY;
-    return t;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
 }
 
-lh_table* lh_kchar_table_new(int size, char *name,
-                                    lh_entry_free_fn *free_fn)
+/* FNV-1a */
+static unsigned int json_hash(const char *s, int len)
 {
-    return lh_table_new(size, name, free_fn, lh_char_hash, lh_char_equal);
-}
+    const unsigned char *p = (const unsigned char*)s;
+    unsigned int h = 2166136261U;
 
-lh_table* lh_kptr_table_new(int size, char *name,
-                                   lh_entry_free_fn *free_fn)
-{
-    return lh_table_new(size, name, free_fn, lh_ptr_hash, lh_ptr_equal);
+    while (len-- > 0)
+        h = (h ^ *p++) * 16777619U;
+    return h;
 }
 
-int lh_table_resize(lh_table *t, int new_size)
+static int json_keys_resize(json_doc *doc, int new_size)
 {
-    lh_table *new_t;
-    lh_entry *ent;
+    json_key *keys, *k;
+    int i, n;
 
-    new_t = lh_table_new(new_size, t->name, NULL, t->hash_fn, t->equal_fn);
-    if (!new_t)
+    keys = (json_key*)calloc(new_size, sizeof(json_key));
+    if (!keys)
         return 0;
-    ent = t->head;
-    while (ent) {
-        lh_table_insert(new_t, ent->key, ent->val);
-        ent = ent->next;
+    for (i = 0; i < doc->keys_size; i++) {
+        k = &doc->keys[i];
+        if (!k->str)
+            continue;
+        n = k->hash & (new_size - 1);
+        while (keys[n].str)
+            n = (n + 1) & (new_size - 1);
+        keys[n] = *k;
     }
-    free(t->table);
-    t->table = new_t->table;
-    t->size = new_size;
-    t->head = new_t->head;
-    t->tail = new_t->tail;
-    t->resizes++;
-    free(new_t);
+    free(doc->keys);
+    doc->keys = keys;
+    doc->keys_size = new_size;
     return 1;
 }
 
-void lh_table_free(lh_table *t)
+/* find the interned copy of the key 's'. If 'copy' is not NULL, intern
+   the key if it is new: 'copy' tells whether 's' must be copied to the
+   arena or stays valid as long as the document. */
+static const char *json_intern(json_doc *doc, const char *s, int len,
+                               unsigned int hash, int *copy)
 {
-    lh_entry *c;
-    for (c = t->head; c != NULL; c = c->next) {
-            if(t->free_fn) {
-                    t->free_fn(c);
-            }
+    json_key *k;
+    int n = 0;
+
+    if (doc->keys_size) {
+        n = hash & (doc->keys_size - 1);
+        for (;;) {
+            k = &doc->keys[n];
+            if (!k->str)
+                break;
+            if (k->hash == hash && k->len == len && !memcmp(k->str, s, len))
+                return k->str;
+            n = (n + 1) & (doc->keys_size - 1);
+        }
     }
-    free(t->table);
-    free(t);
-}
-
-/* insert 'key'/'val' into hash table.
-   Return 0 (FALSE) if failed, 1 (TRUE) if ok */
-int lh_table_insert(lh_table *t, void *key, void *val)
-{
-    unsigned long h;
-    int           n;
-    int           ok;
+    if (!copy)
+        return NULL;
 
-    t->inserts++;
-    if (t->count > t->size * 0.66)
-    {
-        ok = lh_table_resize(t, t->size * 2);
-        if (!ok)
-            return 0;
+    if (2 * (doc->nb_keys + 1) > doc->keys_size) {
+        if (!json_keys_resize(doc, doc->keys_size ? doc->keys_size * 2 : 64))
+            return NULL;
+        n = hash & (doc->keys_size - 1);
+        while (doc->keys[n].str)
+            n = (n + 1) & (doc->keys_size - 1);
     }
-
-    h = t->hash_fn(key);
-    n = h % t->size;
-
-    for (;;) {
-        if (t->table[n].key == LH_EMPTY || t->table[n].key == LH_FREED) 
-            break;
-        t->collisions++;
-        if (++n == t->size) 
-            n = 0;
+    if (*copy) {
+        s = json_arena_strndup(doc, s, len);
+        if (!s)
+            return NULL;
     }
+    k = &doc->keys[n];
+    k->str = s;
+    k->hash = hash;
+    k->len = len;
+    doc->nb_keys++;
+    return s;
+}
 
-    t->table[n].key = key;
-    t->table[n].val = val;
-    t->count++;
-
-    if(t->head == NULL) {
-            t->head = t->tail = &t->table[n];
-            t->table[n].next = t->table[n].prev = NULL;
-    } else {
-            t->tail->next = &t->table[n];
-            t->table[n].prev = t->tail;
-            t->table[n].next = NULL;
-            t->tail = &t->table[n];
-    }
+/** JSON_OBJECT.C */
 
-    return 1;
-}
+#define HEX_CHARS "0123456789abcdef"
 
-lh_entry* lh_table_lookup_entry(lh_table *t, void *k)
+static json_object* json_new(json_doc *doc, enum json_type o_type)
 {
-    unsigned long h = t->hash_fn(k);
-    unsigned long n = h % t->size;
+    json_object *me;
 
-    t->lookups++;
-    for(;;) {
-        if (t->table[n].key == LH_EMPTY) 
-            break;
-        if ( (t->table[n].key != LH_FREED) && t->equal_fn(t->table[n].key, k)) 
-           return &t->table[n];
-        if (++n == t->size) 
-            n = 0;
-    }
-    return NULL;
+    me = (json_object*)json_arena_alloc(doc, sizeof(json_object));
+    if (!me)
+        return NULL;
+    memset(me, 0, sizeof(json_object));
+    me->o_type = o_type;
+    me->doc = doc;
+    return me;
 }
 
-void* lh_table_lookup(lh_table *t, void *k)
+enum json_type json_get_type(json_object *me)
 {
-    lh_entry *e = lh_table_lookup_entry(t, k);
-    if(e) 
-        return e->val;
-    return NULL;
+    if (!me)
+        return json_type_null;
+    return me->o_type;
 }
 
-int lh_table_delete_entry(lh_table *t, lh_entry *e)
+json_object* json_new_null(json_doc *doc)
 {
-    ptrdiff_t n = (ptrdiff_t)(e - t->table); /* CAW: fixed to be 64bit nice, still need the crazy negative case... */
+    return json_new(doc, json_type_null);
+}
 
-    /* CAW: this is bad, really bad, maybe stack goes other direction on this machine... */
-    if(n < 0) 
-        return -2;
+char* json_serialize(json_object *me)
+{
+    json_doc *doc = me->doc;
 
-    if (t->table[n].key == LH_EMPTY || t->table[n].key == LH_FREED) 
-        return -1;
-    t->count--;
-    if (t->free_fn) 
-        t->free_fn(e);
-    t->table[n].val = NULL;
-    t->table[n].key = LH_FREED;
-    if (t->tail == &t->table[n] && t->head == &t->table[n]) {
-            t->head = t->tail = NULL;
-    } else if (t->head == &t->table[n]) {
-            t->head->next->prev = NULL;
-            t->head = t->head->next;
-    } else if (t->tail == &t->table[n]) {
-            t->tail->prev->next = NULL;
-            t->tail = t->tail->prev;
+    if (!doc->pb) {
+        doc->pb = strbuf_new_with_size(256);
+        if (!doc->pb)
+            return NULL;
     } else {
-            t->table[n].prev->next = t->table[n].next;
-            t->table[n].next->prev = t->table[n].prev;
+        strbuf_reset(doc->pb);
     }
-    t->table[n].next = t->table[n].prev = NULL;
-    return 0;
-}
 
-
-int lh_table_delete(lh_table *t, void *k)
-{
-    lh_entry *e = lh_table_lookup_entry(t, k);
-    if (!e) 
-        return -1;
-    return lh_table_delete_entry(t, e);
+    if (!json_serialize_buf(me, doc->pb))
+        return NULL;
+    return doc->pb->data;
 }
 
-/** JSON_OBJECT.H */
-
-#define NUMBER_CHARS "0123456789.+-e"
-#define HEX_CHARS "0123456789abcdef"
-
-static void json_generic_delete(json_object* me);
-static json_object* json_new(enum json_type o_type);
+/* json_object */
 
-/* string escaping */
-
-static int json_escape_str(strbuf *pb, char *str)
+json_object* json_new_object(json_doc *doc)
 {
-    int     phase;
-    int     escaped_len;
-    char *  tmp;
-    int     ok = 1;
-
-    /* during phase 0 calculate the length of escaped string, during phase
-       1 do the escaping */
-    escaped_len = 0;
-    for (phase = 0; phase < 2; phase++)
-    {
-        tmp = str;
-        while (*tmp)
-        {
-            switch (*tmp)
-            {
-                case '\b':
-                case '\n':
-                case '\r':
-                case '\t':
-                case '"':
-                    if (0 == phase)
-                        escaped_len += 1;
-                    else
-                        if (*tmp == '\b') 
-                            ok = strbuf_append(pb, "\\b", 2);
-                        else if(*tmp == '\n') 
-                            ok = strbuf_append(pb, "\\n", 2);
-                        else if(*tmp == '\r') 
-                            ok = strbuf_append(pb, "\\r", 2);
-                        else if(*tmp == '\t') 
-                            ok = strbuf_append(pb, "\\t", 2);
-                        else if(*tmp == '"') 
-                            ok = strbuf_append(pb, "\\\"", 2);
-                break;
-                default:
-                    if (*tmp < ' ')
-                    {
-                        if (0 == phase)
-                            escaped_len += 6;
-                        else
-                            ok = strbuf_appendf(pb, "\\u00%c%c",
-                                      HEX_CHARS[*tmp >> 4],
-                                      HEX_CHARS[*tmp & 0xf]);
-                    }
-                    else
-                    {
-                        if (0 == phase)
-                            ++escaped_len;
-                        else
-                            ok = strbuf_appendc(pb, *tmp);
-                    }
-            }
-            if (!ok)
-                return 0;
-            ++tmp;
-        }
-        if (0 == phase)
-        {
-            ok = strbuf_reserve(pb, pb->cur_size + escaped_len + 4);
-            if (!ok)
-                return 0;
-        }
-    }
-    return ok;
+    return json_new(doc, json_type_object);
 }
 
-json_object* json_addref(json_object *me)
+static void json_index_insert(json_object *me, int i)
 {
-  if (me)
-    me->_ref_count++;
-  return me;
-}
+    int mask = me->o.c_object.index_size - 1;
+    int n;
 
-static void json_generic_delete(json_object* me)
-{
-    strbuf_free(me->_pb);
-    free(me);
+    n = me->o.c_object.members[i].hash & mask;
+    while (me->o.c_object.index[n])
+        n = (n + 1) & mask;
+    me->o.c_object.index[n] = i + 1;
 }
 
-static void json_delete_object(json_object *me)
+static int json_index_rebuild(json_object *me, int min_count)
 {
-    if (!me)
-        return;
+    int size, i;
 
-    switch (me->o_type)
-    {
-        case json_type_object:
-            lh_table_free(me->o.c_object);
-            break;
-        case json_type_string:
-            free(me->o.c_string);
-            break;
-        case json_type_array:
-            array_list_free(me->o.c_array);
-            break;
-        default:
-            break;
-    }
-    json_generic_delete(me);
-}
-
-/* Unref and delete if refcount drops to zero.
-   Return 1 (TRUE) if was deleted, 0 (FALSE) otherwise */
-int json_unref(json_object *me)
-{
-    if (!me)
-        return 0;
-    --me->_ref_count;
-    if (0 == me->_ref_count)
-    {
-        json_delete_object(me);
+    if (min_count < JSON_OBJECT_INDEX_MIN) {
+        me->o.c_object.index = NULL;
+        me->o.c_object.index_size = 0;
         return 1;
     }
-    return 0;
+    for (size = 16; size < 2 * min_count; size *= 2)
+        continue;
+    if (size != me->o.c_object.index_size) {
+        /* the previous index stays in the arena until the document
+           is freed */
+        me->o.c_object.index =
+            (int*)json_arena_alloc(me->doc, size * sizeof(int));
+        if (!me->o.c_object.index) {
+            me->o.c_object.index_size = 0;
+            return 0;
+        }
+        me->o.c_object.index_size = size;
+    }
+    memset(me->o.c_object.index, 0, size * sizeof(int));
+    for (i = 0; i < me->o.c_object.count; i++)
+        json_index_insert(me, i);
+    return 1;
 }
 
-static json_object* json_new(enum json_type o_type)
+/* return the index of the member with the interned key 'key' or -1 */
+static int json_object_find(json_object *me, const char *key,
+                            unsigned int hash)
 {
-    json_object *me = (json_object*)calloc(sizeof(json_object), 1);
-    if (!me) 
-        return NULL;
-    me->o_type = o_type;
-    me->_ref_count = 1;
-    return me;
+    json_member *m = me->o.c_object.members;
+    int i, n, mask;
+
+    if (me->o.c_object.index_size) {
+        mask = me->o.c_object.index_size - 1;
+        for (n = hash & mask; (i = me->o.c_object.index[n]) != 0;
+             n = (n + 1) & mask) {
+            if (m[i - 1].key == key)
+                return i - 1;
+        }
+        return -1;
+    }
+    for (i = 0; i < me->o.c_object.count; i++) {
+        if (m[i].key == key)
+            return i;
+    }
+    return -1;
 }
 
-enum json_type json_get_type(json_object *me)
+/* add or replace a member whose key is already interned */
+static int json_object_put(json_object *me, const char *key,
+                           unsigned int hash, json_object *val)
 {
-    return me->o_type;
-}
+    json_member *members;
+    int i, size;
 
-char* json_serialize(json_object *me)
-{
-    if (!me->_pb) {
-        me->_pb = strbuf_new();
-        if(!me->_pb) 
-            return NULL;
-    } else {
-        strbuf_reset(me->_pb);
+    i = json_object_find(me, key, hash);
+    if (i >= 0) {
+        me->o.c_object.members[i].val = val;
+        return 1;
     }
 
-    if (!serialize_generic(me, me->_pb)) 
-        return NULL;
-    return me->_pb->data;
+    if (me->o.c_object.count == me->o.c_object.size) {
+        size = me->o.c_object.size ? me->o.c_object.size * 2 : 4;
+        members = (json_member*)json_arena_alloc(me->doc,
+                                                 size * sizeof(json_member));
+        if (!members)
+            return 0;
+        if (me->o.c_object.count) {
+            memcpy(members, me->o.c_object.members,
+                   me->o.c_object.count * sizeof(json_member));
+        }
+        me->o.c_object.members = members;
+        me->o.c_object.size = size;
+    }
+    i = me->o.c_object.count++;
+    me->o.c_object.members[i].key = key;
+    me->o.c_object.members[i].hash = hash;
+    me->o.c_object.members[i].val = val;
+
+    if (me->o.c_object.index_size &&
+        2 * me->o.c_object.count <= me->o.c_object.index_size) {
+        json_index_insert(me, i);
+    } else
+    if (me->o.c_object.count >= JSON_OBJECT_INDEX_MIN) {
+        return json_index_rebuild(me, me->o.c_object.count);
+    }
+    return 1;
 }
 
-static void json_lh_entry_free(lh_entry *ent)
+/* add an 'key'/'val' to 'me' hash.
+   Return 0 (FALSE) if failed, 1 (TRUE) otherwise */
+int json_object_add(json_object* me, const char *key, json_object *val)
 {
-    free(ent->key);
-    json_unref((json_object*)ent->val);
-}
+    int len = strlen(key);
+    unsigned int hash = json_hash(key, len);
+    int copy = 1;
 
-static void json_object_delete(json_object* me)
-{
-    json_generic_delete(me);
+    key = json_intern(me->doc, key, len, hash, &copy);
+    if (!key)
+        return 0;
+    return json_object_put(me, key, hash, val);
 }
 
-#define DEF_HASH_ENTIRES 16
-
-json_object* json_new_object()
+json_object* json_object_get(json_object* me, const char *key)
 {
-    json_object *me = json_new(json_type_object);
-    if (!me) 
+    int len, i;
+    unsigned int hash;
+
+    if (!me || me->o_type != json_type_object)
         return NULL;
-    me->o.c_object = lh_kchar_table_new(DEF_HASH_ENTIRES, NULL, &json_lh_entry_free);
-    if (!me->o.c_object)
-    {
-        free(me);
+    len = strlen(key);
+    hash = json_hash(key, len);
+    /* a key that was never interned is not a member of any object */
+    key = json_intern(me->doc, key, len, hash, NULL);
+    if (!key)
         return NULL;
-    }
-    return me;
-}
-
-lh_table* json_get_object(json_object *me)
-{
-    if (!me) 
+    i = json_object_find(me, key, hash);
+    if (i < 0)
         return NULL;
-
-    switch (me->o_type) 
-    {
-        case json_type_object:
-            return me->o.c_object;
-        default:
-            return NULL;
-    }
+    return me->o.c_object.members[i].val;
 }
 
-/* add an 'key'/'val' to 'this' hash.
-   Return 0 (FALSE) if failed, 1 (TRUE) otherwise */
-int json_object_add(json_object* me, char *key, json_object *val)
+void json_object_del(json_object* me, const char *key)
 {
-    char *  key_dup = strdup(key);
-    if (!key_dup)
-        return 0;
+    int len, i;
+    unsigned int hash;
 
-    lh_table_delete(me->o.c_object, key);
-    return lh_table_insert(me->o.c_object, key_dup, val);
+    len = strlen(key);
+    hash = json_hash(key, len);
+    key = json_intern(me->doc, key, len, hash, NULL);
+    if (!key)
+        return;
+    i = json_object_find(me, key, hash);
+    if (i < 0)
+        return;
+    me->o.c_object.count--;
+    memmove(me->o.c_object.members + i, me->o.c_object.members + i + 1,
+            (me->o.c_object.count - i) * sizeof(json_member));
+    json_index_rebuild(me, me->o.c_object.count);
 }
 
-json_object* json_object_get(json_object* me, char *key)
+int json_object_length(json_object *me)
 {
-    return (json_object*) lh_table_lookup(me->o.c_object, key);
+    return me->o.c_object.count;
 }
 
-void json_object_del(json_object* me, char *key)
+json_member* json_object_get_idx(json_object *me, int idx)
 {
-    lh_table_delete(me->o.c_object, key);
+    if (idx < 0 || idx >= me->o.c_object.count)
+        return NULL;
+    return &me->o.c_object.members[idx];
 }
 
 /* json_boolean */
-json_object* json_new_boolean(int b)
+json_object* json_new_boolean(json_doc *doc, int b)
 {
-    json_object *me = json_new(json_type_boolean);
-    if (!me) 
+    json_object *me = json_new(doc, json_type_boolean);
+    if (!me)
         return NULL;
     me->o.c_boolean = b;
     return me;
@@ -608,11 +485,13 @@ json_object* json_new_boolean(int b)
 
 int json_get_boolean(json_object *me)
 {
-    if (!me) 
+    if (!me)
         return 0;
 
-    switch (me->o_type) 
+    switch (me->o_type)
     {
+        case json_type_null:
+            return 0;
         case json_type_boolean:
             return me->o.c_boolean;
         case json_type_int:
@@ -620,8 +499,7 @@ int json_get_boolean(json_object *me)
         case json_type_double:
             return (me->o.c_double != 0);
         case json_type_string:
-            if (strlen(me->o.c_string)) 
-                return 1;
+            return (me->o.c_string.len != 0);
         default:
             return 1;
     }
@@ -629,23 +507,23 @@ int json_get_boolean(json_object *me)
 
 /* json_int */
 
-json_object* json_new_int(int i)
+json_object* json_new_int(json_doc *doc, int i)
 {
-  json_object *me = json_new(json_type_int);
-  if (!me) 
-      return NULL;
-  me->o.c_int = i;
-  return me;
+    json_object *me = json_new(doc, json_type_int);
+    if (!me)
+        return NULL;
+    me->o.c_int = i;
+    return me;
 }
 
 int json_get_int(json_object *me)
 {
     int cint;
 
-    if (!me) 
+    if (!me)
         return 0;
 
-    switch(me->o_type) 
+    switch(me->o_type)
     {
         case json_type_int:
             return me->o.c_int;
@@ -654,7 +532,7 @@ int json_get_int(json_object *me)
         case json_type_boolean:
             return me->o.c_boolean;
         case json_type_string:
-            if (sscanf(me->o.c_string, "%d", &cint) == 1) 
+            if (sscanf(me->o.c_string.str, "%d", &cint) == 1)
                 return cint;
         default:
             return 0;
@@ -662,10 +540,10 @@ int json_get_int(json_object *me)
 }
 
 /* json_double */
-json_object* json_new_double(double d)
+json_object* json_new_double(json_doc *doc, double d)
 {
-    json_object *me = json_new(json_type_double);
-    if (!me) 
+    json_object *me = json_new(doc, json_type_double);
+    if (!me)
         return NULL;
     me->o.c_double = d;
     return me;
@@ -675,9 +553,9 @@ double json_get_double(json_object *me)
 {
     double cdouble;
 
-    if (!me) 
+    if (!me)
         return 0.0;
-    switch(me->o_type) 
+    switch(me->o_type)
     {
         case json_type_double:
             return me->o.c_double;
@@ -686,268 +564,316 @@ double json_get_double(json_object *me)
         case json_type_boolean:
             return me->o.c_boolean;
         case json_type_string:
-            if (sscanf(me->o.c_string, "%lf", &cdouble) == 1) 
+            if (sscanf(me->o.c_string.str, "%lf", &cdouble) == 1)
                 return cdouble;
         default:
         return 0.0;
     }
 }
 
-
 /* json_string */
-static void json_string_delete(json_object* me)
-{
-    free(me->o.c_string);
-    json_generic_delete(me);
-}
 
-json_object* json_new_string(char *s)
+json_object* json_new_string(json_doc *doc, const char *s)
 {
     int str_len = 0;
     if (s)
         str_len = strlen(s);
-    return json_new_string_len(s,str_len);
+    return json_new_string_len(doc, s, str_len);
 }
 
-json_object* json_new_string_len(char *s, int len)
+json_object* json_new_string_len(json_doc *doc, const char *s, int len)
 {
-    json_object *me = json_new(json_type_string);
-    if (!me) 
+    json_object *me = json_new(doc, json_type_string);
+    if (!me)
         return NULL;
-    me->o.c_string = strndup(s, len);
-    if (!me->o.c_string)
-    {
-        free(me);
+    me->o.c_string.str = json_arena_strndup(doc, s ? s : "", len);
+    if (!me->o.c_string.str)
         return NULL;
-    }
+    me->o.c_string.len = len;
     return me;
 }
 
-char* json_get_string(json_object *me)
+const char* json_get_string(json_object *me)
 {
-    if (!me) 
+    if (!me)
         return NULL;
-    switch(me->o_type) 
+    switch(me->o_type)
     {
         case json_type_string:
-            return me->o.c_string;
+            return me->o.c_string.str;
         default:
             return json_serialize(me);
     }
 }
 
 /* json_array */
-static void json_array_entry_free(void *data)
-{
-    json_unref((json_object*)data);
-}
 
-static void json_array_delete(json_object* me)
+json_object* json_new_array(json_doc *doc)
 {
-    array_list_free(me->o.c_array);
-    json_generic_delete(me);
+    return json_new(doc, json_type_array);
 }
 
-json_object* json_new_array()
+int json_array_length(json_object *me)
 {
-    json_object *me = json_new(json_type_array);
-    if (!me) 
-        return NULL;
-    me->o.c_array = array_list_new(&json_array_entry_free);
-    return me;
+    return me->o.c_array.length;
 }
 
-struct array_list* json_get_array(json_object *me)
+static int json_array_expand(json_object *me, int max)
 {
-    if (!me) 
-        return NULL;
+    json_object **items;
+    int size;
 
-    switch (me->o_type) 
-    {
-        case json_type_array:
-            return me->o.c_array;
-        default:
-            return NULL;
+    if (max < me->o.c_array.size)
+        return 1;
+    size = me->o.c_array.size ? me->o.c_array.size * 2 : 8;
+    if (size <= max)
+        size = max + 1;
+    items = (json_object**)json_arena_alloc(me->doc,
+                                            size * sizeof(json_object*));
+    if (!items)
+        return 0;
+    if (me->o.c_array.length) {
+        memcpy(items, me->o.c_array.items,
+               me->o.c_array.length * sizeof(json_object*));
     }
+    memset(items + me->o.c_array.length, 0,
+           (size - me->o.c_array.length) * sizeof(json_object*));
+    me->o.c_array.items = items;
+    me->o.c_array.size = size;
+    return 1;
 }
 
-int json_array_length(json_object *me)
-{
-    return array_list_length(me->o.c_array);
-}
-
-int json_array_add(json_object *me,json_object *val)
+int json_array_add(json_object *me, json_object *val)
 {
-    return array_list_add(me->o.c_array, val);
+    return json_array_put_idx(me, me->o.c_array.length, val);
 }
 
 int json_array_put_idx(json_object *me, int idx, json_object *val)
 {
-    return array_list_put_idx(me->o.c_array, idx, val);
+    if (idx < 0 || !json_array_expand(me, idx))
+        return 0;
+    me->o.c_array.items[idx] = val;
+    if (me->o.c_array.length <= idx)
+        me->o.c_array.length = idx + 1;
+    return 1;
 }
 
 json_object* json_array_get_idx(json_object *me, int idx)
 {
-    return (json_object*)array_list_get_idx(me->o.c_array, idx);
+    if (idx < 0 || idx >= me->o.c_array.length)
+        return NULL;
+    return me->o.c_array.items[idx];
 }
 
 /* serialization support */
 
-static int serialize_array(json_object* me, strbuf *pb)
+static inline int json_put(strbuf *pb, const char *s, int len)
 {
-    int i;
-    json_object *val;
+    return strbuf_append(pb, (char*)s, len);
+}
 
-    strbuf_appendf(pb, "[");
-    for (i=0; i < json_array_length(me); i++) {
-        if (0 != i)
-            strbuf_appendf(pb, ", "); 
-        else
-            strbuf_appendf(pb, " ");
+/* string escaping: the runs of characters that need no escape are
+   appended at once */
+static int json_escape_str(strbuf *pb, const char *str, int len)
+{
+    const unsigned char *p = (const unsigned char*)str;
+    const unsigned char *end = p + len;
+    const unsigned char *run;
+    char esc[8];
+    int c;
 
-        val = json_array_get_idx(me, i);
-        serialize_generic(val, pb);
+    if (!strbuf_reserve(pb, pb->cur_size + len + 2))
+        return 0;
+    run = p;
+    while (p < end) {
+        c = *p;
+        if (c >= ' ' && c != '"' && c != '\\') {
+            p++;
+            continue;
+        }
+        if (p > run && !json_put(pb, (const char*)run, p - run))
+            return 0;
+        esc[0] = '\\';
+        switch (c) {
+        case '\b': esc[1] = 'b'; break;
+        case '\n': esc[1] = 'n'; break;
+        case '\r': esc[1] = 'r'; break;
+        case '\t': esc[1] = 't'; break;
+        case '\f': esc[1] = 'f'; break;
+        case '"':
+        case '\\': esc[1] = c; break;
+        default:
+            esc[1] = 'u';
+            esc[2] = '0';
+            esc[3] = '0';
+            esc[4] = HEX_CHARS[c >> 4];
+            esc[5] = HEX_CHARS[c & 0xf];
+            if (!json_put(pb, esc, 6))
+                return 0;
+            run = ++p;
+            continue;
+        }
+        if (!json_put(pb, esc, 2))
+            return 0;
+        run = ++p;
     }
-    return strbuf_appendf(pb, " ]");
+    if (p > run)
+        return json_put(pb, (const char*)run, p - run);
+    return 1;
 }
 
-int serialize_object(json_object* me, strbuf *pb)
+static int json_serialize_string(strbuf *pb, const char *str, int len)
 {
-    int         ok = 1;
-    lh_entry *  entry;
-    lh_entry *  head;
+    return json_put(pb, "\"", 1) && json_escape_str(pb, str, len) &&
+        json_put(pb, "\"", 1);
+}
 
-    ok = strbuf_appendf(pb, "{");
+static int json_serialize_int(strbuf *pb, int v)
+{
+    char buf[16], *q = buf + sizeof(buf);
+    unsigned int u = v;
+
+    if (v < 0)
+        u = -u;
+    do {
+        *--q = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (v < 0)
+        *--q = '-';
+    return json_put(pb, q, buf + sizeof(buf) - q);
+}
 
-    head = json_get_object(me)->head;
-    entry = head;
-    while (entry)
-    {
-        if (entry != head)
-            ok = strbuf_appendf(pb, ",");
-
-        if (ok)
-            ok = strbuf_appendf(pb, " \"");
-        if (ok)
-            ok = json_escape_str(pb, (char*)entry->key);
-        if (ok)
-            ok = strbuf_appendf(pb, "\": ");
-        if (ok)
-            ok = serialize_generic((json_object*)entry->val, pb);
-
-        if (!ok)
+static int json_serialize_double(strbuf *pb, double d)
+{
+    char buf[40];
+    int len;
+
+    len = sprintf(buf, "%.17g", d);
+    /* keep a double a double when it is parsed back */
+    if (!strpbrk(buf, ".eEn"))
+        len += sprintf(buf + len, ".0");
+    return json_put(pb, buf, len);
+}
+
+static int serialize_array(json_object* me, strbuf *pb)
+{
+    int i;
+
+    if (!json_put(pb, "[", 1))
+        return 0;
+    for (i = 0; i < me->o.c_array.length; i++) {
+        if (!json_put(pb, i ? ", " : " ", i ? 2 : 1))
+            return 0;
+        if (!json_serialize_buf(me->o.c_array.items[i], pb))
             return 0;
-        entry = entry->next;
     }
-
-    return strbuf_appendf(pb, " }");
+    return json_put(pb, " ]", 2);
 }
 
-int serialize_generic(json_object *me, strbuf *buf)
+static int serialize_object(json_object* me, strbuf *pb)
 {
-    int ok = 1;
+    json_member *m;
+    int i;
 
+    if (!json_put(pb, "{", 1))
+        return 0;
+    for (i = 0; i < me->o.c_object.count; i++) {
+        m = &me->o.c_object.members[i];
+        if (!json_put(pb, i ? ", " : " ", i ? 2 : 1))
+            return 0;
+        if (!json_serialize_string(pb, m->key, strlen(m->key)))
+            return 0;
+        if (!json_put(pb, ": ", 2))
+            return 0;
+        if (!json_serialize_buf(m->val, pb))
+            return 0;
+    }
+    return json_put(pb, " }", 2);
+}
+
+int json_serialize_buf(json_object *me, strbuf *pb)
+{
     if (!me)
-        return strbuf_appendf(buf, "null");
+        return json_put(pb, "null", 4);
 
     switch (me->o_type)
     {
+        case json_type_null:
+            return json_put(pb, "null", 4);
+
         case json_type_boolean:
-            if (me->o.c_boolean) 
-                ok = strbuf_appendf(buf, "true");
+            if (me->o.c_boolean)
+                return json_put(pb, "true", 4);
             else
-                ok = strbuf_appendf(buf, "false");
-            break;
+                return json_put(pb, "false", 5);
 
         case json_type_int:
-            ok = strbuf_appendf(buf, "%d", me->o.c_int);
-            break;
+            return json_serialize_int(pb, me->o.c_int);
 
         case json_type_double:
-            ok = strbuf_appendf(buf, "%lf", me->o.c_double);
-            break;
+            return json_serialize_double(pb, me->o.c_double);
 
         case json_type_string:
-            ok = strbuf_reserve(buf, 2 + 4 + strlen(me->o.c_string));
-            if (ok)
-                ok = strbuf_append(buf, "\"", 1);
-            if (ok)
-                ok = json_escape_str(buf, me->o.c_string);
-            if (ok)
-                ok = strbuf_append(buf, "\"", 1);
-            break;
+            return json_serialize_string(pb, me->o.c_string.str,
+                                         me->o.c_string.len);
 
         case json_type_array:
-            ok = serialize_array(me, buf);
-            break;
+            return serialize_array(me, pb);
 
         case json_type_object:
-            ok = serialize_object(me, buf);
-            break;
+            return serialize_object(me, pb);
     }
-    return ok;
+    return 1;
 }
 
 /** JSON_UTIL.C */
-#define JSON_FILE_BUF_SIZE 4096
 
-json_object* json_from_file(char *filename)
+json_object* json_from_file(json_doc *doc, const char *filename)
 {
-    strbuf *    pb = NULL;
-    FILE *      fp = NULL;
-
+    FILE *      fp;
+    char *      buf;
+    long        size;
     json_object *obj = NULL;
-    char        buf[JSON_FILE_BUF_SIZE];
-    int         bytes_read;
 
     fp = fopen(filename, "rb");
     if (!fp)
         return NULL;
 
-    pb = strbuf_new_with_size(1024);
-    if (!pb)
+    if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 ||
+        size >= INT_MAX || fseek(fp, 0, SEEK_SET) != 0)
         goto Exit;
 
-    for (;;)
-    {
-        bytes_read = fread(buf, 1, JSON_FILE_BUF_SIZE, fp);
-        if (bytes_read > 0)
-        {
-            if (!strbuf_append(pb, buf, bytes_read))
-                goto Exit;
-        }
-        if (bytes_read < JSON_FILE_BUF_SIZE)
-        {
-            if (ferror(fp))
-                goto Exit;
-            break;
-        }
-    }
+    /* the text is parsed in place and stays in the arena */
+    buf = (char*)json_arena_alloc(doc, size + 1);
+    if (!buf)
+        goto Exit;
+    if (fread(buf, 1, size, fp) != (size_t)size)
+        goto Exit;
+    buf[size] = '\0';
 
-    obj = json_deserialize(pb->data);
+    obj = json_parse_insitu(doc, buf, size);
 
 Exit:
-    if (fp)
-        fclose(fp);
-    strbuf_free(pb);
+    fclose(fp);
     return obj;
 }
 
 /* serialize 'obj' to a file 'filename'.
    Returns a 0 (FALSE) if failed, TRUE if went ok */
-int json_to_file(char *filename, json_object *obj)
+int json_to_file(const char *filename, json_object *obj)
 {
     FILE *  fp;
     size_t  to_write, written;
     char *  json_str;
-    
+
     json_str = json_serialize(obj);
     if (!json_str)
         return 0;
     fp = fopen(filename, "wb");
     if (!fp)
         return 0;
-    to_write = strlen(json_str);
+    to_write = obj->doc->pb->cur_size;
     written = fwrite((void*)json_str, 1, to_write, fp);
     fclose(fp);
     if (written != to_write)
@@ -955,447 +881,415 @@ int json_to_file(char *filename, json_object *obj)
     return 1;
 }
 
-/** JSON_TOKENER.C */
-enum json_tokener_state {
-    json_tokener_state_eatws,
-    json_tokener_state_start,
-    json_tokener_state_finish,
-    json_tokener_state_null,
-    json_tokener_state_comment_start,
-    json_tokener_state_comment,
-    json_tokener_state_comment_eol,
-    json_tokener_state_comment_end,
-    json_tokener_state_string,
-    json_tokener_state_string_escape,
-    json_tokener_state_escape_unicode,
-    json_tokener_state_boolean,
-    json_tokener_state_number,
-    json_tokener_state_array,
-    json_tokener_state_array_sep,
-    json_tokener_state_object,
-    json_tokener_state_object_field_start,
-    json_tokener_state_object_field,
-    json_tokener_state_object_field_end,
-    json_tokener_state_object_value,
-    json_tokener_state_object_sep,
-};
+/** JSON_PARSER.C */
 
-enum json_tokener_error {
-  json_tokener_success,
-  json_tokener_error_parse_unexpected,
-  json_tokener_error_parse_null,
-  json_tokener_error_parse_boolean,
-  json_tokener_error_parse_number,
-  json_tokener_error_parse_array,
-  json_tokener_error_parse_object,
-  json_tokener_error_parse_string,
-  json_tokener_error_parse_comment,
-  json_tokener_error_parse_eof,
-};
+/* Recursive descent parser working in place on a null terminated
+   buffer. Like the json-c tokener it replaces, it accepts C and C++
+   comments, single quoted strings, trailing commas and case
+   insensitive literals. */
 
-struct json_tokener
-{
-    char *      source;
-    int         pos;
-    strbuf *    pb;
-};
+#define JSON_MAX_DEPTH 512
 
-static json_object* json_tokener_do_parse(struct json_tokener *me)
-{
-  enum json_tokener_state state, saved_state;
-  enum json_tokener_error err = json_tokener_success;
-  json_object *current = NULL, *obj;
-  char *obj_field_name = NULL;
-  char quote_char;
-  int deemed_double, start_offset;
-  char c;
-
-  state = json_tokener_state_eatws;
-  saved_state = json_tokener_state_start;
-
-  do {
-    c = me->source[me->pos];
-    switch(state) {
-
-    case json_tokener_state_eatws:
-      if(isspace(c)) {
-        me->pos++;
-      } else if(c == '/') {
-        state = json_tokener_state_comment_start;
-        start_offset = me->pos++;
-      } else {
-        state = saved_state;
-      }
-      break;
-
-    case json_tokener_state_start:
-      switch(c) {
-      case '{':
-        state = json_tokener_state_eatws;
-        saved_state = json_tokener_state_object;
-        current = json_new_object();
-        me->pos++;
-        break;
-      case '[':
-        state = json_tokener_state_eatws;
-        saved_state = json_tokener_state_array;
-        current = json_new_array();
-        me->pos++;
-        break;
-      case 'N':
-      case 'n':
-        state = json_tokener_state_null;
-        start_offset = me->pos++;
-        break;
-      case '"':
-      case '\'':
-        quote_char = c;
-        strbuf_reset(me->pb);
-        state = json_tokener_state_string;
-        start_offset = ++me->pos;
-        break;
-      case 'T':
-      case 't':
-      case 'F':
-      case 'f':
-        state = json_tokener_state_boolean;
-        start_offset = me->pos++;
-        break;
-          case '0':
-      case '1':
-      case '2':
-      case '3':
-      case '4':
-      case '5':
-      case '6':
-      case '7':
-      case '8':
-      case '9':
-      case '-':
-        deemed_double = 0;
-        state = json_tokener_state_number;
-        start_offset = me->pos++;
-        break;
-      default:
-        err = json_tokener_error_parse_unexpected;
-        goto out;
-      }
-      break;
+typedef struct json_parser {
+    json_doc *  doc;
+    char *      p;
+    int         depth;
+} json_parser;
 
-    case json_tokener_state_finish:
-      goto out;
+static json_object* json_parse_value(json_parser *ps);
 
-    case json_tokener_state_null:
-      if (strncasecmp("null", me->source + start_offset, me->pos - start_offset))
-            return NULL;
-      if(me->pos - start_offset == 4) {
-        current = NULL;
-        saved_state = json_tokener_state_finish;
-        state = json_tokener_state_eatws;
-      } else {
-        me->pos++;
-      }
-      break;
-
-    case json_tokener_state_comment_start:
-      if(c == '*') {
-        state = json_tokener_state_comment;
-      } else if(c == '/') {
-        state = json_tokener_state_comment_eol;
-      } else {
-        err = json_tokener_error_parse_comment;
-        goto out;
-      }
-      me->pos++;
-      break;
-
-    case json_tokener_state_comment:
-      if(c == '*') state = json_tokener_state_comment_end;
-      me->pos++;
-      break;
-
-    case json_tokener_state_comment_eol:
-      if(c == '\n') {
-        state = json_tokener_state_eatws;
-      }
-      me->pos++;
-      break;
-
-    case json_tokener_state_comment_end:
-      if(c == '/') {
-        state = json_tokener_state_eatws;
-      } else {
-        state = json_tokener_state_comment;
-      }
-      me->pos++;
-      break;
-
-    case json_tokener_state_string:
-      if(c == quote_char) {
-        strbuf_append(me->pb, me->source + start_offset,
-                           me->pos - start_offset);
-        current = json_new_string(me->pb->data);
-        saved_state = json_tokener_state_finish;
-        state = json_tokener_state_eatws;
-      } else if(c == '\\') {
-        saved_state = json_tokener_state_string;
-        state = json_tokener_state_string_escape;
-      }
-      me->pos++;
-      break;
-
-    case json_tokener_state_string_escape:
-      switch(c) {
-      case '"':
-      case '\\':
-        strbuf_append(me->pb, me->source + start_offset,
-                           me->pos - start_offset - 1);
-        start_offset = me->pos++;
-        state = saved_state;
-        break;
-      case 'b':
-      case 'n':
-      case 'r':
-      case 't':
-        strbuf_append(me->pb, me->source + start_offset,
-                           me->pos - start_offset - 1);
-        if(c == 'b') strbuf_append(me->pb, "\b", 1);
-        else if(c == 'n') strbuf_append(me->pb, "\n", 1);
-        else if(c == 'r') strbuf_append(me->pb, "\r", 1);
-        else if(c == 't') strbuf_append(me->pb, "\t", 1);
-        start_offset = ++me->pos;
-        state = saved_state;
-        break;
-      case 'u':
-        strbuf_append(me->pb, me->source + start_offset,
-                           me->pos - start_offset - 1);
-        start_offset = ++me->pos;
-        state = json_tokener_state_escape_unicode;
-        break;
-      default:
-        err = json_tokener_error_parse_string;
-        goto out;
-      }
-      break;
-
-    case json_tokener_state_escape_unicode:
-      if(strchr(HEX_CHARS, c)) {
-        me->pos++;
-        if(me->pos - start_offset == 4) {
-          unsigned char utf_out[3];
-          unsigned int ucs_char =
-            (hexdigit(*(me->source + start_offset)) << 12) +
-            (hexdigit(*(me->source + start_offset + 1)) << 8) +
-            (hexdigit(*(me->source + start_offset + 2)) << 4) +
-            hexdigit(*(me->source + start_offset + 3));
-          if (ucs_char < 0x80) {
-            utf_out[0] = ucs_char;
-            strbuf_append(me->pb, (char*)utf_out, 1);
-          } else if (ucs_char < 0x800) {
-            utf_out[0] = 0xc0 | (ucs_char >> 6);
-            utf_out[1] = 0x80 | (ucs_char & 0x3f);
-            strbuf_append(me->pb, (char*)utf_out, 2);
-          } else {
-            utf_out[0] = 0xe0 | (ucs_char >> 12);
-            utf_out[1] = 0x80 | ((ucs_char >> 6) & 0x3f);
-            utf_out[2] = 0x80 | (ucs_char & 0x3f);
-            strbuf_append(me->pb, (char*)utf_out, 3);
-          }
-          start_offset = me->pos;
-          state = saved_state;
-        }
-      } else {
-        err = json_tokener_error_parse_string;
-        goto out;
-      }
-      break;
-
-    case json_tokener_state_boolean:
-      if(strncasecmp("true", me->source + start_offset,
-                 me->pos - start_offset) == 0) {
-        if(me->pos - start_offset == 4) {
-          current = json_new_boolean(1);
-          saved_state = json_tokener_state_finish;
-          state = json_tokener_state_eatws;
-        } else {
-          me->pos++;
-        }
-      } else if(strncasecmp("false", me->source + start_offset,
-                        me->pos - start_offset) == 0) {
-        if(me->pos - start_offset == 5) {
-          current = json_new_boolean(0);
-          saved_state = json_tokener_state_finish;
-          state = json_tokener_state_eatws;
+static int json_skip_space(json_parser *ps)
+{
+    char *p = ps->p;
+
+    for (;;) {
+        while (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')
+            p++;
+        if (*p != '/')
+            break;
+        if (p[1] == '/') {
+            p += 2;
+            while (*p && *p != '\n')
+                p++;
+        } else
+        if (p[1] == '*') {
+            p += 2;
+            while (*p && !(p[0] == '*' && p[1] == '/'))
+                p++;
+            if (!*p) {
+                ps->p = p;
+                return -1;
+            }
+            p += 2;
         } else {
-          me->pos++;
+            break;
         }
-      } else {
-        err = json_tokener_error_parse_boolean;
-        goto out;
-      }
-      break;
-
-    case json_tokener_state_number:
-      if(!c || !strchr(NUMBER_CHARS, c)) {
-        int numi;
-        double numd;
-        char *tmp = strndup(me->source + start_offset,
-                            me->pos - start_offset);
-        if(!deemed_double && sscanf(tmp, "%d", &numi) == 1) {
-          current = json_new_int(numi);
-        } else if(deemed_double && sscanf(tmp, "%lf", &numd) == 1) {
-          current = json_new_double(numd);
-        } else {
-          free(tmp);
-          err = json_tokener_error_parse_number;
-          goto out;
+    }
+    ps->p = p;
+    return *p;
+}
+
+static int json_put_utf8(char *q, unsigned int c)
+{
+    if (c < 0x80) {
+        q[0] = c;
+        return 1;
+    }
+    if (c < 0x800) {
+        q[0] = 0xc0 | (c >> 6);
+        q[1] = 0x80 | (c & 0x3f);
+        return 2;
+    }
+    if (c < 0x10000) {
+        q[0] = 0xe0 | (c >> 12);
+        q[1] = 0x80 | ((c >> 6) & 0x3f);
+        q[2] = 0x80 | (c & 0x3f);
+        return 3;
+    }
+    q[0] = 0xf0 | (c >> 18);
+    q[1] = 0x80 | ((c >> 12) & 0x3f);
+    q[2] = 0x80 | ((c >> 6) & 0x3f);
+    q[3] = 0x80 | (c & 0x3f);
+    return 4;
+}
+
+static int json_parse_hex4(const char *p, unsigned int *pc)
+{
+    unsigned int c = 0;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (!isxdigit((unsigned char)p[i]))
+            return 0;
+        c = (c << 4) | hexdigit(p[i] | 0x20);
+    }
+    *pc = c;
+    return 1;
+}
+
+/* parse the string starting after the quote at ps->p - 1. Escapes are
+   decoded in place: the decoded text is never longer than the source.
+   Return its length or -1 on error. */
+static int json_parse_string(json_parser *ps, char **pstr)
+{
+    char *p = ps->p;
+    char quote = p[-1];
+    char *q;
+    unsigned int c, c2;
+
+    *pstr = p;
+    while (*p != quote && *p != '\\') {
+        if (!*p)
+            return -1;
+        p++;
+    }
+    if (*p == quote) {
+        /* common case: no escape, the string stays in the source */
+        *p = '\0';
+        ps->p = p + 1;
+        return p - *pstr;
+    }
+
+    q = p;
+    for (;;) {
+        c = (unsigned char)*p;
+        if (c == (unsigned char)quote)
+            break;
+        if (!c)
+            return -1;
+        if (c != '\\') {
+            *q++ = c;
+            p++;
+            continue;
         }
-        free(tmp);
-        saved_state = json_tokener_state_finish;
-        state = json_tokener_state_eatws;
-      } else {
-        if(c == '.' || c == 'e') deemed_double = 1;
-        me->pos++;
-      }
-      break;
-
-    case json_tokener_state_array:
-      if(c == ']') {
-        me->pos++;
-        saved_state = json_tokener_state_finish;
-        state = json_tokener_state_eatws;
-      } else {
-        obj = json_tokener_do_parse(me);
-        if(!obj) {
-          err = json_tokener_error_parse_unexpected;
-          goto out;
+        c = (unsigned char)p[1];
+        p += 2;
+        switch (c) {
+        case 'b': *q++ = '\b'; break;
+        case 'f': *q++ = '\f'; break;
+        case 'n': *q++ = '\n'; break;
+        case 'r': *q++ = '\r'; break;
+        case 't': *q++ = '\t'; break;
+        case 'u':
+            if (!json_parse_hex4(p, &c))
+                return -1;
+            p += 4;
+            if (c >= 0xd800 && c < 0xdc00 && p[0] == '\\' && p[1] == 'u' &&
+                json_parse_hex4(p + 2, &c2) && c2 >= 0xdc00 && c2 < 0xe000) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+                p += 6;
+            }
+            q += json_put_utf8(q, c);
+            break;
+        case '\0':
+            return -1;
+        default:
+            /* '"', '\\', '/' and anything else stand for themselves */
+            *q++ = c;
+            break;
         }
-        json_array_add(current, obj);
-        saved_state = json_tokener_state_array_sep;
-        state = json_tokener_state_eatws;
-      }
-      break;
-
-    case json_tokener_state_array_sep:
-      if(c == ']') {
-        me->pos++;
-        saved_state = json_tokener_state_finish;
-        state = json_tokener_state_eatws;
-      } else if(c == ',') {
-        me->pos++;
-        saved_state = json_tokener_state_array;
-        state = json_tokener_state_eatws;
-      } else {
-        json_unref(current);
+    }
+    *q = '\0';
+    ps->p = p + 1;
+    return q - *pstr;
+}
+
+static json_object* json_parse_number(json_parser *ps)
+{
+    char *p = ps->p;
+    char *end;
+    long long v = 0;
+    int neg = 0;
+    json_object *obj;
+
+    if (*p == '-') {
+        neg = 1;
+        p++;
+    }
+    if (!(*p >= '0' && *p <= '9'))
+        return NULL;
+    while (*p >= '0' && *p <= '9' && v <= INT_MAX) {
+        v = v * 10 + (*p - '0');
+        p++;
+    }
+    if (neg)
+        v = -v;
+    if (*p != '.' && *p != 'e' && *p != 'E' && !(*p >= '0' && *p <= '9') &&
+        v >= INT_MIN && v <= INT_MAX) {
+        ps->p = p;
+        return json_new_int(ps->doc, (int)v);
+    }
+    /* fractions, exponents and integers out of range */
+    obj = json_new_double(ps->doc, strtod(ps->p, &end));
+    if (end == ps->p)
         return NULL;
-      }
-      break;
-
-    case json_tokener_state_object:
-      state = json_tokener_state_object_field_start;
-      start_offset = me->pos;
-      break;
-
-    case json_tokener_state_object_field_start:
-      if(c == '}') {
-        me->pos++;
-        saved_state = json_tokener_state_finish;
-        state = json_tokener_state_eatws;
-      } else if (c == '"' || c == '\'') {
-        quote_char = c;
-        strbuf_reset(me->pb);
-        state = json_tokener_state_object_field;
-        start_offset = ++me->pos;
-      } else {
-        err = json_tokener_error_parse_object;
-        goto out;
-      }
-      break;
-
-    case json_tokener_state_object_field:
-      if(c == quote_char) {
-        strbuf_append(me->pb, me->source + start_offset,
-                           me->pos - start_offset);
-        obj_field_name = strdup(me->pb->data);
-        saved_state = json_tokener_state_object_field_end;
-        state = json_tokener_state_eatws;
-      } else if(c == '\\') {
-        saved_state = json_tokener_state_object_field;
-        state = json_tokener_state_string_escape;
-      }
-      me->pos++;
-      break;
-
-    case json_tokener_state_object_field_end:
-      if(c == ':') {
-        me->pos++;
-        saved_state = json_tokener_state_object_value;
-        state = json_tokener_state_eatws;
-      } else {
+    ps->p = end;
+    return obj;
+}
+
+static int json_match_word(json_parser *ps, const char *word)
+{
+    char *p = ps->p;
+
+    while (*word) {
+        if ((*p | 0x20) != *word)
+            return 0;
+        p++;
+        word++;
+    }
+    ps->p = p;
+    return 1;
+}
+
+static int json_push_member(json_parser *ps, const char *key,
+                            unsigned int hash, json_object *val)
+{
+    json_doc *doc = ps->doc;
+    json_member *stack;
+    int size;
+
+    if (doc->stack_len == doc->stack_size) {
+        size = doc->stack_size ? doc->stack_size * 2 : 256;
+        stack = (json_member*)realloc(doc->stack, size * sizeof(json_member));
+        if (!stack)
+            return 0;
+        doc->stack = stack;
+        doc->stack_size = size;
+    }
+    stack = &doc->stack[doc->stack_len++];
+    stack->key = key;
+    stack->hash = hash;
+    stack->val = val;
+    return 1;
+}
+
+static json_object* json_parse_array(json_parser *ps)
+{
+    json_doc *doc = ps->doc;
+    json_object *me, *val;
+    int base = doc->stack_len;
+    int i, n, c;
+
+    for (;;) {
+        c = json_skip_space(ps);
+        if (c == ']')
+            break;
+        val = json_parse_value(ps);
+        if (!val || !json_push_member(ps, NULL, 0, val))
+            return NULL;
+        c = json_skip_space(ps);
+        if (c == ',') {
+            ps->p++;
+        } else
+        if (c != ']') {
+            return NULL;
+        }
+    }
+    ps->p++;
+
+    /* the items are known: allocate them once, at their exact size */
+    me = json_new_array(doc);
+    if (!me)
         return NULL;
-      }
-      break;
-
-    case json_tokener_state_object_value:
-      obj = json_tokener_do_parse(me);
-      if(!obj) {
-        err = json_tokener_error_parse_unexpected;
-        goto out;
-      }
-      if (!json_object_add(current, obj_field_name, obj))
-      {
-        err = json_tokener_error_parse_unexpected;
-        goto out;
-      }
-      free(obj_field_name);
-      obj_field_name = NULL;
-      saved_state = json_tokener_state_object_sep;
-      state = json_tokener_state_eatws;
-      break;
-
-    case json_tokener_state_object_sep:
-      if(c == '}') {
-        me->pos++;
-        saved_state = json_tokener_state_finish;
-        state = json_tokener_state_eatws;
-      } else if(c == ',') {
-        me->pos++;
-        saved_state = json_tokener_state_object;
-        state = json_tokener_state_eatws;
-      } else {
-        err = json_tokener_error_parse_object;
-        goto out;
-      }
-      break;
+    n = doc->stack_len - base;
+    if (n) {
+        me->o.c_array.items =
+            (json_object**)json_arena_alloc(doc, n * sizeof(json_object*));
+        if (!me->o.c_array.items)
+            return NULL;
+        for (i = 0; i < n; i++)
+            me->o.c_array.items[i] = doc->stack[base + i].val;
+        me->o.c_array.length = me->o.c_array.size = n;
+    }
+    doc->stack_len = base;
+    return me;
+}
+
+static json_object* json_parse_object(json_parser *ps)
+{
+    json_doc *doc = ps->doc;
+    json_object *me, *val;
+    json_member *m;
+    char *key;
+    int base = doc->stack_len;
+    int i, n, c, len, copy = 0;
+    unsigned int hash;
+
+    for (;;) {
+        c = json_skip_space(ps);
+        if (c == '}')
+            break;
+        if (c != '"' && c != '\'')
+            return NULL;
+        ps->p++;
+        len = json_parse_string(ps, &key);
+        if (len < 0)
+            return NULL;
+        hash = json_hash(key, len);
+        /* the key stays in the source buffer */
+        key = (char*)json_intern(doc, key, len, hash, &copy);
+        if (!key)
+            return NULL;
+        if (json_skip_space(ps) != ':')
+            return NULL;
+        ps->p++;
+        json_skip_space(ps);
+        val = json_parse_value(ps);
+        if (!val || !json_push_member(ps, key, hash, val))
+            return NULL;
+        c = json_skip_space(ps);
+        if (c == ',') {
+            ps->p++;
+        } else
+        if (c != '}') {
+            return NULL;
+        }
+    }
+    ps->p++;
 
+    me = json_new_object(doc);
+    if (!me)
+        return NULL;
+    n = doc->stack_len - base;
+    if (n) {
+        me->o.c_object.members =
+            (json_member*)json_arena_alloc(doc, n * sizeof(json_member));
+        if (!me->o.c_object.members)
+            return NULL;
+        me->o.c_object.size = n;
+        if (n >= JSON_OBJECT_INDEX_MIN && !json_index_rebuild(me, n))
+            return NULL;
+        for (i = 0; i < n; i++) {
+            /* json_object_put() keeps the last of duplicate keys */
+            m = &doc->stack[base + i];
+            if (!json_object_put(me, m->key, m->hash, m->val))
+                return NULL;
+        }
     }
-  } while(c);
-
-  if(state != json_tokener_state_finish &&
-     saved_state != json_tokener_state_finish)
-    err = json_tokener_error_parse_eof;
-
- out:
-  free(obj_field_name);
-  if (err == json_tokener_success) 
-    return current;
-  json_unref(current);
-  return NULL;
+    doc->stack_len = base;
+    return me;
 }
 
-json_object* json_deserialize(char * s)
+static json_object* json_parse_value(json_parser *ps)
 {
-    struct json_tokener tok;
-    json_object* obj;
+    json_object *obj = NULL;
+    char *str;
+    int len;
 
-    tok.pb = strbuf_new();
-    if (!tok.pb)
+    if (++ps->depth > JSON_MAX_DEPTH)
         return NULL;
 
-    tok.source = s;
-    tok.pos = 0;
-    obj = json_tokener_do_parse(&tok);
-    strbuf_free(tok.pb);
+    switch (*ps->p) {
+    case '{':
+        ps->p++;
+        obj = json_parse_object(ps);
+        break;
+    case '[':
+        ps->p++;
+        obj = json_parse_array(ps);
+        break;
+    case '"':
+    case '\'':
+        ps->p++;
+        len = json_parse_string(ps, &str);
+        if (len < 0)
+            break;
+        obj = json_new(ps->doc, json_type_string);
+        if (obj) {
+            obj->o.c_string.str = str;
+            obj->o.c_string.len = len;
+        }
+        break;
+    case 'T':
+    case 't':
+        if (json_match_word(ps, "true"))
+            obj = json_new_boolean(ps->doc, 1);
+        break;
+    case 'F':
+    case 'f':
+        if (json_match_word(ps, "false"))
+            obj = json_new_boolean(ps->doc, 0);
+        break;
+    case 'N':
+    case 'n':
+        if (json_match_word(ps, "null"))
+            obj = json_new_null(ps->doc);
+        break;
+    default:
+        obj = json_parse_number(ps);
+        break;
+    }
+    ps->depth--;
+    return obj;
+}
+
+json_object* json_parse_insitu(json_doc *doc, char *s, int len)
+{
+    json_parser ps;
+    json_object *obj;
+
+    ps.doc = doc;
+    ps.p = s;
+    ps.depth = 0;
+    doc->stack_len = 0;
+
+    json_skip_space(&ps);
+    obj = json_parse_value(&ps);
+    if (obj && json_skip_space(&ps) != '\0')
+        obj = NULL;
+    if (obj && ps.p != s + len)
+        obj = NULL;     /* embedded null byte */
+    doc->stack_len = 0;
     return obj;
 }
 
+json_object* json_deserialize(json_doc *doc, const char *s)
+{
+    int len = strlen(s);
+    char *buf;
+
+    buf = json_arena_strndup(doc, s, len);
+    if (!buf)
+        return NULL;
+    return json_parse_insitu(doc, buf, len);
+}
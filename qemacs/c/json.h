@@ -25,120 +25,35 @@
 # include <stddef.h>
 #endif /* STDC_HEADERS */
 
-typedef struct lh_entry {
-    void *key;
-    void *val;
-    struct lh_entry *next;
-    struct lh_entry *prev;
-} lh_entry;
-
-typedef void (lh_entry_free_fn) (lh_entry *e);
-typedef unsigned long (lh_hash_fn) (void *k);
-typedef int (lh_equal_fn) (void *k1, void *k2);
-
-/**
- * The hash table structure.
- */
-typedef struct lh_table {
-    int size;
-    int count;
-    int collisions;
-    int resizes;
-    int lookups;
-    int inserts;
-    int deletes;
-    char *name;
-    lh_entry *head;
-    lh_entry *tail;
-
-    lh_entry *table;
-
-    /**
-     * A pointer onto the function responsible for freeing an entry.
-     */
-    lh_entry_free_fn *free_fn;
-    lh_hash_fn *hash_fn;
-    lh_equal_fn *equal_fn;
-}lh_table;
+/** JSON_DOC */
 
 /**
- * Pre-defined hash and equality functions
+ * A document owns every value created in it. The values are allocated
+ * from an arena and are all freed at once by json_doc_free(): there is
+ * no per-value reference count.
+ *
+ * Object keys are interned in the document, so a key used by many
+ * objects is stored once. Parsed strings point into the parsed text
+ * when they have no escape, which is why json_parse_insitu() needs a
+ * buffer that lives as long as the document.
  */
-extern unsigned long lh_ptr_hash(void *k);
-extern int lh_ptr_equal(void *k1, void *k2);
-
-extern unsigned long lh_char_hash(void *k);
-extern int lh_char_equal(void *k1, void *k2);
-
-/**
- * Convenience list iterator.
- */
-#define lh_foreach(table, entry) \
-for(entry = table->head; entry; entry = entry->next)
-
-/**
- * lh_foreach_safe allows calling of deletion routine while iterating.
- */
-#define lh_foreach_safe(table, entry, tmp) \
-for(entry = table->head; entry && ((tmp = entry->next) || 1); entry = tmp)
-
-lh_table* lh_table_new(int size, char *name,
-                                     lh_entry_free_fn *free_fn,
-                                     lh_hash_fn *hash_fn,
-                                     lh_equal_fn *equal_fn);
-
-lh_table* lh_kchar_table_new(int size, char *name,
-                                           lh_entry_free_fn *free_fn);
-
-lh_table* lh_kptr_table_new(int size, char *name,
-                                          lh_entry_free_fn *free_fn);
-void lh_table_free(lh_table *t);
-
-int lh_table_insert(lh_table *t, void *key, void *val);
-
-lh_entry* lh_table_lookup_entry(lh_table *t, void *k);
-
-void* lh_table_lookup(lh_table *t, void *k);
-
-int lh_table_delete_entry(lh_table *t, lh_entry *e);
-
-int lh_table_delete(lh_table *t, void *k);
-
-/* ARRAY_LIST interface */
-
-#define ARRAY_LIST_DEFAULT_SIZE 32
-
-typedef void (array_list_free_fn) (void *data);
-
-struct array_list
-{
-  void **array;
-  int length;
-  int size;
-  array_list_free_fn *free_fn;
-};
+typedef struct json_doc json_doc;
 
-extern struct array_list*
-array_list_new(array_list_free_fn *free_fn);
+json_doc* json_doc_new(void);
+void json_doc_free(json_doc *doc);
 
-extern void
-array_list_free(struct array_list *me);
+typedef struct json_doc_stats {
+    int arena_size;     /* bytes allocated for the arena chunks */
+    int arena_used;     /* bytes handed out from the arena */
+    int nb_keys;        /* number of interned keys */
+} json_doc_stats;
 
-extern void*
-array_list_get_idx(struct array_list *me, int i);
-
-extern int
-array_list_put_idx(struct array_list *me, int i, void *data);
-
-extern int
-array_list_add(struct array_list *me, void *data);
-
-extern int
-array_list_length(struct array_list *me);
+void json_doc_get_stats(json_doc *doc, json_doc_stats *st);
 
 /** JSON_OBJECT.H */
 
 enum json_type {
+  json_type_null,
   json_type_boolean,
   json_type_double,
   json_type_int,
@@ -147,61 +62,93 @@ enum json_type {
   json_type_string,
 };
 
-typedef struct json_object
+typedef struct json_object json_object;
+
+typedef struct json_member {
+    const char *    key;        /* interned in the document */
+    unsigned int    hash;
+    json_object *   val;
+} json_member;
+
+/**
+ * Objects keep their members in insertion order. Small objects are
+ * searched linearly by hash; from JSON_OBJECT_INDEX_MIN members on, an
+ * open addressing table of member indexes is kept as well.
+ */
+#define JSON_OBJECT_INDEX_MIN 8
+
+struct json_object
 {
     enum json_type  o_type;
-    int             _ref_count;
-    strbuf *        _pb;
+    json_doc *      doc;
     union data {
         int     c_boolean;
         double  c_double;
         int     c_int;
-        lh_table *c_object;
-        struct array_list *c_array;
-        char *  c_string;
+        struct {
+            json_member *   members;
+            int *           index;      /* member index + 1, 0 if empty */
+            int             count;
+            int             size;
+            int             index_size; /* power of 2, 0 if no index */
+        } c_object;
+        struct {
+            json_object **  items;
+            int             length;
+            int             size;
+        } c_array;
+        struct {
+            const char *    str;        /* null terminated */
+            int             len;
+        } c_string;
     } o;
-} json_object;
-
-json_object* json_addref(json_object *me);
-int json_unref(json_object *me);
+};
 
 extern enum json_type json_get_type(json_object *me);
 
-json_object* json_new_object();
+json_object* json_new_null(json_doc *doc);
 
-lh_table* json_get_object(json_object *me);
+json_object* json_new_object(json_doc *doc);
 
-int json_object_add(json_object* me, char *key, json_object *val);
-json_object* json_object_get(json_object* me, char *key);
-void json_object_del(json_object* me, char *key);
+/** Add or replace the member 'key' of an object.
+ *
+ * The key is interned in the document of the object, so the caller
+ * keeps ownership of 'key'. 'val' must belong to the same document.
+ *
+ * @returns 0 (FALSE) if failed, 1 (TRUE) otherwise
+ */
+int json_object_add(json_object* me, const char *key, json_object *val);
+json_object* json_object_get(json_object* me, const char *key);
+void json_object_del(json_object* me, const char *key);
 
-json_object* json_new_array();
+int json_object_length(json_object *me);
 
-struct array_list* json_get_array(json_object *me);
+/** Get the member at index 'idx' of an object, in insertion order
+ * @returns the member or NULL if out of range
+ */
+json_member* json_object_get_idx(json_object *me, int idx);
+
+json_object* json_new_array(json_doc *doc);
 
 int json_array_length(json_object *me);
 
 int json_array_add(json_object *me, json_object *val);
 
 /** Insert or replace an element at a specified index in an array (a json_object of type json_type_array)
- *
- * The reference count will *not* be incremented. This is to make adding
- * fields to objects in code more compact. If you want to retain a reference
- * to an added object you must wrap the passed object with json_addref
- *
- * The reference count of a replaced object will be decremented.
  *
  * The array size will be automatically be expanded to the size of the
- * index if the index is larger than the current size.
+ * index if the index is larger than the current size. The elements
+ * added in between are NULL.
  *
- * @param this the json_object instance
+ * @param me the json_object instance
  * @param idx the index to insert the element at
  * @param val the json_object to be added
+ * @returns 0 (FALSE) if failed, 1 (TRUE) otherwise
  */
 int json_array_put_idx(json_object *me, int idx, json_object *val);
 
 /** Get the element at specificed index of the array (a json_object of type json_type_array)
- * @param this the json_object instance
+ * @param me the json_object instance
  * @param idx the index to get the element at
  * @returns the json_object at the specified index (or NULL)
  */
@@ -209,24 +156,24 @@ json_object* json_array_get_idx(json_object *me, int idx);
 
 /* boolean type methods */
 
-json_object* json_new_boolean(int b);
+json_object* json_new_boolean(json_doc *doc, int b);
 
 /** Get the boolean value of a json_object
  *
  * The type is coerced to a boolean if the passed object is not a boolean.
  * integer and double objects will return FALSE if there value is zero
  * or TRUE otherwise. If the passed object is a string it will return
- * TRUE if it has a non zero length. If any other object type is passed
- * TRUE will be returned if the object is not NULL.
+ * TRUE if it has a non zero length. null returns FALSE. If any other
+ * object type is passed TRUE will be returned if the object is not NULL.
  *
- * @param this the json_object instance
+ * @param me the json_object instance
  * @returns a boolean
  */
 int json_get_boolean(json_object *me);
 
 /* int type methods */
 
-json_object* json_new_int(int i);
+json_object* json_new_int(json_doc *doc, int i);
 
 /** Get the int value of a json_object
  *
@@ -234,18 +181,18 @@ json_object* json_new_int(int i);
  * double objects will return their integer conversion. Strings will be
  * parsed as an integer. If no conversion exists then 0 is returned.
  *
- * @param this the json_object instance
+ * @param me the json_object instance
  * @returns an int
  */
 int json_get_int(json_object *me);
 
 /* double type methods */
 
-/** Create a new empty json_object of type json_type_double
+/** Create a new json_object of type json_type_double
  * @param d the double
  * @returns a json_object of type json_type_double
  */
-json_object* json_new_double(double d);
+json_object* json_new_double(json_doc *doc, double d);
 
 /** Get the double value of a json_object
  *
@@ -253,7 +200,7 @@ json_object* json_new_double(double d);
  * integer objects will return their dboule conversion. Strings will be
  * parsed as a double. If no conversion exists then 0.0 is returned.
  *
- * @param this the json_object instance
+ * @param me the json_object instance
  * @returns an double
  */
 double json_get_double(json_object *me);
@@ -261,33 +208,47 @@ double json_get_double(json_object *me);
 
 /* string type methods */
 
-/** Create a new empty json_object of type json_type_string
+/** Create a new json_object of type json_type_string
  *
- * A copy of the string is made and the memory is managed by the json_object
+ * A copy of the string is made in the document arena.
  *
  * @param s the string
  * @returns a json_object of type json_type_string
  */
-json_object* json_new_string(char *s);
+json_object* json_new_string(json_doc *doc, const char *s);
 
-json_object* json_new_string_len(char *s, int len);
+json_object* json_new_string_len(json_doc *doc, const char *s, int len);
 
 /** Get the string value of a json_object
  *
  * If the passed object is not of type json_type_string then the JSON
- * representation of the object is returned.
- *
- * The returned string memory is managed by the json_object and will
- * be freed when the reference count of the json_object drops to zero.
+ * representation of the object is returned, as by json_serialize().
  *
- * @param this the json_object instance
+ * @param me the json_object instance
  * @returns a string
  */
-char* json_get_string(json_object *me);
+const char* json_get_string(json_object *me);
 
+/** Serialize a value to JSON text.
+ *
+ * The text is kept in a buffer of the document of 'me' and is valid
+ * until the next call for the same document.
+ */
 char*        json_serialize(json_object *me);
-json_object* json_deserialize(char *s);
-json_object* json_from_file(char *filename);
-int          json_to_file(char *filename, json_object *obj);
+int          json_serialize_buf(json_object *me, strbuf *pb);
+
+/** Parse the null terminated JSON text 's' of length 'len'.
+ *
+ * The text is modified: escapes are decoded in place and strings are
+ * null terminated, so it must stay allocated as long as 'doc'.
+ *
+ * @returns the root value or NULL on syntax error
+ */
+json_object* json_parse_insitu(json_doc *doc, char *s, int len);
+
+/* same, on a copy of 's' made in the document arena */
+json_object* json_deserialize(json_doc *doc, const char *s);
+json_object* json_from_file(json_doc *doc, const char *filename);
+int          json_to_file(const char *filename, json_object *obj);
 
 #endif
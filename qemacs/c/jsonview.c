@@ -0,0 +1,1328 @@
+/*
+ * JSON viewer mode for QEmacs.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "qe.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* The buffer is never parsed into a tree: a structural index holding
+   the offsets of the objects and arrays is built in one pass over the
+   page data, and the pretty printed lines are computed on the fly
+   from the raw text. One virtual line is displayed per member,
+   whatever the layout of the file. */
+
+#define JSON_BLOCK_BITS   12   /* one line checkpoint per 4 KB */
+#define JSON_INDENT_SIZE  2
+#define JSON_MAX_INDENT   64   /* deeper levels are not indented more */
+#define JSON_MAX_TOKEN    256  /* longer tokens are elided */
+
+typedef struct JsonContainer {
+    int start;   /* offset of the opening bracket */
+    int end;     /* offset of the closing bracket (buffer size if none) */
+    int parent;  /* index of the enclosing container, -1 at top level */
+    unsigned int count : 31;    /* number of commas at this level */
+    unsigned int is_object : 1; /* '{' rather than '[' */
+} JsonContainer;
+
+typedef struct JsonState {
+    int index_valid;
+    /* containers in the order of their opening bracket */
+    JsonContainer *tab;
+    int nb_containers, containers_size;
+    /* for each block of the buffer, the first offset which follows a
+       comma outside strings (-1 if none): always a line start */
+    int *checkpoints;
+    int nb_checkpoints;
+    u8 *folded;  /* one bit per container */
+    int index_time; /* in ms */
+    /* edited bytes not indexed yet, dirty_start < 0 if none */
+    int dirty_start, dirty_end;
+    int dirty_struct; /* the edits removed structural chars */
+} JsonState;
+
+static ModeDef json_mode;
+
+/***************************************************************/
+/* structural index */
+
+typedef struct JsonScan {
+    JsonState *js;
+    uint64_t prev_escaped;   /* first char of the next block escaped */
+    uint64_t prev_in_string; /* all ones if the next block starts in a
+                                string */
+    int *stack;              /* open containers */
+    int sp, stack_size;
+} JsonScan;
+
+#define JSON_EVEN_BITS 0x5555555555555555ULL
+
+static inline int json_ctz(uint64_t x)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/* bit i is set if an odd number of quotes are at or before i */
+static inline uint64_t json_prefix_xor(uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+static void json_scan_masks(const u8 *p, uint64_t *quote_ptr,
+                            uint64_t *backslash_ptr,
+                            uint64_t *structural_ptr)
+{
+    uint64_t quote, backslash, structural;
+    int i;
+#ifdef __SSE2__
+    __m128i v, v20;
+    unsigned int q, bs, st;
+
+    quote = backslash = structural = 0;
+    for (i = 0; i < 64; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(p + i));
+        q = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+        bs = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+        /* '[' and ']' are '{' and '}' without bit 5 */
+        v20 = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        st = _mm_movemask_epi8(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v20, _mm_set1_epi8('{')),
+                                      _mm_cmpeq_epi8(v20, _mm_set1_epi8('}'))),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+        quote |= (uint64_t)q << i;
+        backslash |= (uint64_t)bs << i;
+        structural |= (uint64_t)st << i;
+    }
+#else
+    int c;
+
+    quote = backslash = structural = 0;
+    for (i = 0; i < 64; i++) {
+        c = p[i];
+        if (c == '"')
+            quote |= 1ULL << i;
+        else if (c == '\\')
+            backslash |= 1ULL << i;
+        else if (c == '{' || c == '}' || c == '[' || c == ']' || c == ',')
+            structural |= 1ULL << i;
+    }
+#endif
+    *quote_ptr = quote;
+    *backslash_ptr = backslash;
+    *structural_ptr = structural;
+}
+
+static int json_add_container(JsonScan *st, int offset, int is_object)
+{
+    JsonState *js = st->js;
+    JsonContainer *c;
+    int n;
+
+    if (js->nb_containers >= js->containers_size) {
+        n = js->containers_size ? js->containers_size * 2 : 1024;
+        c = (JsonContainer*)realloc(js->tab, n * sizeof(JsonContainer));
+        if (!c)
+            return -1;
+        js->tab = c;
+        js->containers_size = n;
+    }
+    if (st->sp >= st->stack_size) {
+        n = st->stack_size ? st->stack_size * 2 : 64;
+        st->stack = (int*)realloc(st->stack, n * sizeof(int));
+        if (!st->stack) {
+            st->stack_size = st->sp = 0;
+            return -1;
+        }
+        st->stack_size = n;
+    }
+    c = &js->tab[js->nb_containers];
+    c->start = offset;
+    c->end = -1;
+    c->parent = st->sp > 0 ? st->stack[st->sp - 1] : -1;
+    c->count = 0;
+    c->is_object = is_object;
+    st->stack[st->sp++] = js->nb_containers;
+    return js->nb_containers++;
+}
+
+/* scan the 64 bytes at 'p'. The string state is tracked with bit
+   masks as in simdjson, so that the structural chars are found
+   without a per byte state machine. */
+static void json_scan_block(JsonScan *st, const u8 *p, int offset)
+{
+    JsonState *js = st->js;
+    uint64_t quote, backslash, structural, follows, odd_starts;
+    uint64_t even_starts, escaped, in_string;
+    int i, block;
+
+    json_scan_masks(p, &quote, &backslash, &structural);
+
+    if (backslash | st->prev_escaped) {
+        /* a char is escaped if it follows an odd sequence of
+           backslashes: the carry of the addition clears the even
+           sequences */
+        backslash &= ~st->prev_escaped;
+        follows = (backslash << 1) | st->prev_escaped;
+        odd_starts = backslash & ~JSON_EVEN_BITS & ~follows;
+        even_starts = odd_starts + backslash;
+        st->prev_escaped = (even_starts < odd_starts);
+        escaped = (JSON_EVEN_BITS ^ (even_starts << 1)) & follows;
+        quote &= ~escaped;
+    }
+    in_string = json_prefix_xor(quote) ^ st->prev_in_string;
+    st->prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+    structural &= ~in_string;
+
+    while (structural) {
+        i = json_ctz(structural);
+        structural &= structural - 1;
+        switch (p[i]) {
+        case '{':
+        case '[':
+            json_add_container(st, offset + i, p[i] == '{');
+            break;
+        case '}':
+        case ']':
+            if (st->sp > 0)
+                js->tab[st->stack[--st->sp]].end = offset + i;
+            break;
+        default:
+            if (st->sp > 0)
+                js->tab[st->stack[st->sp - 1]].count++;
+            block = (offset + i + 1) >> JSON_BLOCK_BITS;
+            if (block < js->nb_checkpoints && js->checkpoints[block] < 0)
+                js->checkpoints[block] = offset + i + 1;
+            break;
+        }
+    }
+}
+
+static inline int json_is_folded(JsonState *js, int k)
+{
+    return js->folded && ((js->folded[k >> 3] >> (k & 7)) & 1);
+}
+
+static inline void json_set_folded(JsonState *js, int k, int folded)
+{
+    if (!js->folded)
+        return;
+    if (folded)
+        js->folded[k >> 3] |= 1 << (k & 7);
+    else
+        js->folded[k >> 3] &= ~(1 << (k & 7));
+}
+
+static void json_free_index(JsonState *js)
+{
+    free(js->tab);
+    js->tab = NULL;
+    js->nb_containers = js->containers_size = 0;
+    free(js->checkpoints);
+    js->checkpoints = NULL;
+    js->nb_checkpoints = 0;
+    free(js->folded);
+    js->folded = NULL;
+    js->index_valid = 0;
+}
+
+/* scan the bytes from 'offset' to 'end' */
+static void json_scan_range(JsonScan *st, EditBuffer *b, int offset, int end)
+{
+    u8 block[64];
+    const u8 *p;
+    int len, n, i;
+
+    while (offset < end) {
+        p = eb_get_span(b, offset, &len);
+        if (len > end - offset)
+            len = end - offset;
+        if (len >= 64) {
+            /* scan the page data in place */
+            n = len & ~63;
+            for (i = 0; i < n; i += 64)
+                json_scan_block(st, p + i, offset + i);
+            offset += n;
+        } else {
+            /* gather a block over the page boundary, the end of the
+               range is padded with spaces */
+            n = eb_read(b, offset, block, min(end - offset, 64));
+            if (n <= 0)
+                break;
+            memset(block + n, ' ', 64 - n);
+            json_scan_block(st, block, offset);
+            offset += n;
+        }
+    }
+}
+
+/* return the malloc'ed list of the starts of the folded containers,
+   in increasing order */
+static int *json_save_folds(JsonState *js, int *nb_ptr)
+{
+    int *folds, k, n;
+
+    n = 0;
+    for (k = 0; k < js->nb_containers; k++)
+        n += json_is_folded(js, k);
+    *nb_ptr = n;
+    if (!n)
+        return NULL;
+    folds = (int*)malloc(n * sizeof(int));
+    if (!folds) {
+        *nb_ptr = 0;
+        return NULL;
+    }
+    n = 0;
+    for (k = 0; k < js->nb_containers; k++) {
+        if (json_is_folded(js, k))
+            folds[n++] = js->tab[k].start;
+    }
+    return folds;
+}
+
+/* fold again the containers which start at an offset of 'folds' */
+static void json_restore_folds(JsonState *js, const int *folds, int nb)
+{
+    int k, i;
+
+    for (k = i = 0; k < js->nb_containers && i < nb; k++) {
+        while (i < nb && folds[i] < js->tab[k].start)
+            i++;
+        if (i < nb && folds[i] == js->tab[k].start)
+            json_set_folded(js, k, 1);
+    }
+}
+
+/* build the whole index. The containers folded before keep their fold
+   if they start at the same offset. */
+static void json_build_index(EditState *s, JsonState *js)
+{
+    JsonScan st1, *st = &st1;
+    EditBuffer *b = s->b;
+    int total, n, *folds, nb_folds;
+    int64_t ti;
+
+    folds = json_save_folds(js, &nb_folds);
+    json_free_index(js);
+    js->index_valid = 1;
+    js->dirty_start = -1;
+    js->dirty_struct = 0;
+    ti = get_clock_usec();
+    total = eb_total_size(b);
+    n = (total >> JSON_BLOCK_BITS) + 1;
+    js->checkpoints = (int*)malloc(n * sizeof(int));
+    if (!js->checkpoints) {
+        free(folds);
+        return;
+    }
+    js->nb_checkpoints = n;
+    memset(js->checkpoints, 0xff, n * sizeof(int));
+
+    memset(st, 0, sizeof(*st));
+    st->js = js;
+    json_scan_range(st, b, 0, total);
+    /* truncated file: the open containers end with the buffer */
+    while (st->sp > 0)
+        js->tab[st->stack[--st->sp]].end = total;
+    free(st->stack);
+
+    js->folded = (u8*)calloc((js->nb_containers + 7) >> 3, 1);
+    json_restore_folds(js, folds, nb_folds);
+    free(folds);
+    js->index_time = (int)((get_clock_usec() - ti) / 1000);
+    if (total >= (1 << 20)) {
+        put_status(s, "JSON index: %d containers in %d ms",
+                   js->nb_containers, js->index_time);
+    }
+}
+
+/* return the first container opened at or after 'offset' */
+static int json_lower_bound(JsonState *js, int offset)
+{
+    int lo, hi, m;
+
+    lo = 0;
+    hi = js->nb_containers;
+    while (lo < hi) {
+        m = (lo + hi) >> 1;
+        if (js->tab[m].start < offset)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+    return lo;
+}
+
+/* return the container whose opening bracket is at 'offset', or -1 */
+static int json_container_at(JsonState *js, int offset)
+{
+    int k = json_lower_bound(js, offset);
+
+    if (k < js->nb_containers && js->tab[k].start == offset)
+        return k;
+    return -1;
+}
+
+/* return the innermost container such that start < offset <= end, or
+   -1 at top level */
+static int json_find_container(JsonState *js, int offset)
+{
+    int m;
+
+    /* last container opened before 'offset' */
+    m = json_lower_bound(js, offset) - 1;
+    /* the enclosing containers are its ancestors */
+    while (m >= 0 && js->tab[m].end < offset)
+        m = js->tab[m].parent;
+    return m;
+}
+
+static int json_depth(JsonState *js, int k)
+{
+    int depth;
+
+    for (depth = 0; k >= 0; depth++)
+        k = js->tab[k].parent;
+    return depth;
+}
+
+/* return the outermost folded container hiding 'offset', or -1 */
+static int json_folded_ancestor(JsonState *js, int offset)
+{
+    int k, found;
+
+    found = -1;
+    for (k = json_find_container(js, offset); k >= 0; k = js->tab[k].parent) {
+        if (json_is_folded(js, k))
+            found = k;
+    }
+    return found;
+}
+
+/***************************************************************/
+/* index update */
+
+/* The buffer callback is called before each edit. It only moves the
+   offsets of the index, and records the edited range. On the next
+   access, if the edit added or removed structural chars, only the
+   innermost container around it is scanned again. */
+
+static inline int json_is_special(int c)
+{
+    return c == '"' || c == '\\' || c == ',' ||
+        c == '{' || c == '}' || c == '[' || c == ']';
+}
+
+/* return true if editing the 'size' bytes at 'offset' can change the
+   index. The char before is included: a backslash escapes the first
+   char of the range. */
+static int json_has_special(EditBuffer *b, int offset, int size)
+{
+    const u8 *p;
+    int len, i;
+
+    if (offset > 0) {
+        offset--;
+        size++;
+    }
+    while (size > 0) {
+        p = eb_get_span(b, offset, &len);
+        if (len <= 0)
+            break;
+        if (len > size)
+            len = size;
+        for (i = 0; i < len; i++) {
+            if (json_is_special(p[i]))
+                return 1;
+        }
+        offset += len;
+        size -= len;
+    }
+    return 0;
+}
+
+/* return the offset of the char at 'p' after 'delta' bytes were
+   inserted (delta > 0) or deleted (delta < 0) at 'offset'. A deleted
+   char goes to 'offset'. */
+static inline int json_move_char(int p, int offset, int delta)
+{
+    if (p >= offset) {
+        p += delta;
+        if (p < offset)
+            p = offset;
+    }
+    return p;
+}
+
+static void json_move_offsets(JsonState *js, int offset, int delta)
+{
+    JsonContainer *ct;
+    int k, i;
+
+    /* the containers opened before 'offset' and closed after it are
+       the enclosing ones */
+    k = json_lower_bound(js, offset);
+    for (i = json_find_container(js, offset); i >= 0; i = js->tab[i].parent)
+        js->tab[i].end = json_move_char(js->tab[i].end, offset, delta);
+    for (i = k; i < js->nb_containers; i++) {
+        ct = &js->tab[i];
+        ct->start = json_move_char(ct->start, offset, delta);
+        ct->end = json_move_char(ct->end, offset, delta);
+    }
+    /* a checkpoint moves with the comma before it */
+    for (i = 0; i < js->nb_checkpoints; i++) {
+        if (js->checkpoints[i] > 0) {
+            js->checkpoints[i] =
+                json_move_char(js->checkpoints[i] - 1, offset, delta) + 1;
+        }
+    }
+    if (js->dirty_start >= 0) {
+        js->dirty_start = json_move_char(js->dirty_start, offset, delta);
+        js->dirty_end = json_move_char(js->dirty_end, offset, delta);
+    }
+}
+
+static void json_add_dirty(JsonState *js, int start, int end)
+{
+    if (js->dirty_start < 0) {
+        js->dirty_start = start;
+        js->dirty_end = end;
+    } else {
+        js->dirty_start = min(js->dirty_start, start);
+        js->dirty_end = max(js->dirty_end, end);
+    }
+}
+
+static void json_buffer_callback(EditBuffer *b, void *opaque,
+                                 enum LogOperation op,
+                                 int offset, int size)
+{
+    JsonState *js = (JsonState*)opaque;
+
+    if (!js->index_valid)
+        return;
+    switch (op) {
+    case LOGOP_WRITE:
+        /* the old bytes are checked now, the new ones on the next
+           access */
+        if (json_has_special(b, offset, size))
+            js->dirty_struct = 1;
+        json_add_dirty(js, offset, offset + size);
+        break;
+    case LOGOP_INSERT:
+        json_move_offsets(js, offset, size);
+        json_add_dirty(js, offset, offset + size);
+        break;
+    case LOGOP_DELETE:
+        if (json_has_special(b, offset, size)) {
+            js->dirty_struct = 1;
+            json_move_offsets(js, offset, -size);
+            /* a container closed at 'offset' may have lost its
+               bracket: the range includes it */
+            json_add_dirty(js, offset, offset + 1);
+        } else {
+            json_move_offsets(js, offset, -size);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* scan again the content of the container 'k'. Return -1 if the
+   edits changed more than its content. */
+static int json_index_container(EditState *s, JsonState *js, int k)
+{
+    JsonState js1, *tmp = &js1;
+    JsonScan st1, *st = &st1;
+    JsonContainer *ct;
+    int start, end, i, j, n, delta, *folds, nb_folds;
+    u8 *folded;
+
+    start = js->tab[k].start;
+    end = js->tab[k].end;
+    if (end >= eb_total_size(s->b))
+        return -1;
+
+    /* the commas of the content are found again */
+    for (i = 0; i < js->nb_checkpoints; i++) {
+        if (js->checkpoints[i] > start && js->checkpoints[i] <= end)
+            js->checkpoints[i] = -1;
+    }
+    memset(tmp, 0, sizeof(*tmp));
+    tmp->checkpoints = js->checkpoints;
+    tmp->nb_checkpoints = js->nb_checkpoints;
+    memset(st, 0, sizeof(*st));
+    st->js = tmp;
+    json_scan_range(st, s->b, start, end + 1);
+    free(st->stack);
+    if (tmp->nb_containers == 0 || st->sp != 0 || st->prev_in_string ||
+        tmp->tab[0].start != start || tmp->tab[0].end != end ||
+        tmp->tab[0].is_object != js->tab[k].is_object) {
+        free(tmp->tab);
+        return -1;
+    }
+
+    /* replace the descendants of 'k', which are the following
+       containers opened before its end */
+    for (j = k + 1; j < js->nb_containers && js->tab[j].start <= end; j++)
+        continue;
+    n = tmp->nb_containers - 1;
+    delta = n - (j - k - 1);
+    if (js->nb_containers + delta > js->containers_size) {
+        ct = (JsonContainer*)realloc(js->tab, (js->nb_containers + delta) *
+                                     sizeof(JsonContainer));
+        if (!ct) {
+            free(tmp->tab);
+            return -1;
+        }
+        js->tab = ct;
+        js->containers_size = js->nb_containers + delta;
+    }
+    folds = json_save_folds(js, &nb_folds);
+    memmove(js->tab + j + delta, js->tab + j,
+            (js->nb_containers - j) * sizeof(JsonContainer));
+    js->nb_containers += delta;
+    for (i = j + delta; i < js->nb_containers; i++) {
+        if (js->tab[i].parent >= j)
+            js->tab[i].parent += delta;
+    }
+    js->tab[k].count = tmp->tab[0].count;
+    for (i = 1; i <= n; i++) {
+        js->tab[k + i] = tmp->tab[i];
+        js->tab[k + i].parent += k;
+    }
+    free(tmp->tab);
+
+    /* the fold bits move with their containers */
+    folded = (u8*)calloc((js->nb_containers + 7) >> 3, 1);
+    free(js->folded);
+    js->folded = folded;
+    json_restore_folds(js, folds, nb_folds);
+    free(folds);
+    return 0;
+}
+
+static void json_update_index(EditState *s, JsonState *js)
+{
+    int start, end, k;
+
+    start = js->dirty_start;
+    end = js->dirty_end;
+    js->dirty_start = -1;
+    if (!js->dirty_struct &&
+        !json_has_special(s->b, start, min(end, eb_total_size(s->b)) - start))
+        return;
+    js->dirty_struct = 0;
+
+    /* innermost container whose brackets were not edited */
+    for (k = json_find_container(js, start); k >= 0; k = js->tab[k].parent) {
+        if (js->tab[k].start < start && js->tab[k].end >= end)
+            break;
+    }
+    if (k < 0 || json_index_container(s, js, k) < 0)
+        json_build_index(s, js);
+}
+
+static JsonState *json_get_state(EditState *s)
+{
+    JsonState *js = (JsonState*)s->mode_data;
+
+    if (js->index_valid && js->dirty_start >= 0)
+        json_update_index(s, js);
+    if (!js->index_valid)
+        json_build_index(s, js);
+    return js;
+}
+
+/***************************************************************/
+/* byte access by page spans */
+
+typedef struct JsonCursor {
+    EditBuffer *b;
+    int offset;   /* offset of *p */
+    const u8 *p, *end;
+} JsonCursor;
+
+static inline void json_seek(JsonCursor *cur, int offset)
+{
+    cur->offset = offset;
+    cur->p = cur->end = NULL;
+}
+
+static int json_fill(JsonCursor *cur)
+{
+    int len;
+
+    cur->p = eb_get_span(cur->b, cur->offset, &len);
+    if (len <= 0) {
+        cur->p = cur->end = NULL;
+        return 0;
+    }
+    cur->end = cur->p + len;
+    return len;
+}
+
+/* return the byte at the cursor, or -1 at the end of the buffer */
+static inline int json_peek(JsonCursor *cur)
+{
+    if (cur->p >= cur->end && json_fill(cur) <= 0)
+        return -1;
+    return *cur->p;
+}
+
+/* skip the byte returned by json_peek() */
+static inline void json_advance(JsonCursor *cur)
+{
+    cur->p++;
+    cur->offset++;
+}
+
+static inline int json_is_space(int c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static int json_skip_space(JsonCursor *cur)
+{
+    int c;
+
+    while (json_is_space(c = json_peek(cur)))
+        json_advance(cur);
+    return c;
+}
+
+static inline int json_is_delim(int c)
+{
+    return c < 0 || json_is_space(c) || c == ',' || c == ':' || c == '"' ||
+        c == '{' || c == '}' || c == '[' || c == ']';
+}
+
+/* skip the rest of a string, up to and including the closing quote */
+static void json_skip_string_end(JsonCursor *cur)
+{
+    int c;
+
+    while ((c = json_peek(cur)) >= 0) {
+        json_advance(cur);
+        if (c == '\\') {
+            if (json_peek(cur) >= 0)
+                json_advance(cur);
+        } else if (c == '"') {
+            break;
+        }
+    }
+}
+
+/* skip the string at the cursor */
+static void json_skip_string(JsonCursor *cur)
+{
+    json_advance(cur);
+    json_skip_string_end(cur);
+}
+
+/* skip the value at the cursor, using the index for containers */
+static void json_skip_value(JsonState *js, JsonCursor *cur)
+{
+    int c, k;
+
+    c = json_peek(cur);
+    if (c == '{' || c == '[') {
+        k = json_container_at(js, cur->offset);
+        if (k >= 0) {
+            json_seek(cur, js->tab[k].end);
+            if (json_peek(cur) >= 0)
+                json_advance(cur);
+            return;
+        }
+        json_advance(cur);
+    } else if (c == '"') {
+        json_skip_string(cur);
+    } else {
+        while (!json_is_delim(json_peek(cur)))
+            json_advance(cur);
+    }
+}
+
+/***************************************************************/
+/* virtual display */
+
+static inline void json_putc(DisplayState *ds, int offset1, int offset2,
+                             int c, int style)
+{
+    if (ds)
+        display_char(ds, offset1, offset2, c | (style << STYLE_SHIFT));
+}
+
+static void json_puts(DisplayState *ds, int offset1, int offset2,
+                      const char *str, int style)
+{
+    if (ds && *str) {
+        json_putc(ds, offset1, offset2, *str++, style);
+        while (*str)
+            json_putc(ds, -1, -1, *str++, style);
+    }
+}
+
+/* display the string at the cursor. The chars skipped before it are
+   attributed to the opening quote. */
+static void json_display_string(EditState *s, DisplayState *ds,
+                                JsonCursor *cur, int start, int style)
+{
+    int c, n, offset, next;
+
+    if (!ds) {
+        json_skip_string(cur);
+        return;
+    }
+    json_putc(ds, start, cur->offset + 1, '"', style);
+    json_advance(cur);
+    for (n = 0; (c = json_peek(cur)) >= 0; n++) {
+        offset = cur->offset;
+        if (n >= JSON_MAX_TOKEN) {
+            /* elide the end of long strings */
+            json_skip_string_end(cur);
+            json_puts(ds, offset, cur->offset, "...\"", QE_STYLE_COMMENT);
+            return;
+        }
+        if (c >= 0x80) {
+            c = eb_nextc(s->b, offset, &next);
+            json_seek(cur, next);
+            json_putc(ds, offset, next, c, style);
+            continue;
+        }
+        json_advance(cur);
+        if (c == '\\' && json_peek(cur) >= 0) {
+            json_putc(ds, offset, offset + 1, c, style);
+            c = json_peek(cur);
+            offset++;
+            json_advance(cur);
+        } else if (c == '"') {
+            json_putc(ds, offset, offset + 1, c, style);
+            break;
+        }
+        if (c < ' ')
+            c = '?';
+        json_putc(ds, offset, offset + 1, c, style);
+    }
+}
+
+/* Compute, and display if 'ds' is not NULL, the virtual line starting
+   at 'offset'. A line holds one member: it ends after a comma, after
+   the opening bracket of a non empty container, or before a closing
+   bracket. '*container_ptr' receives the last container opened on
+   the line, or -1. Return the offset of the next line, or -1 at the
+   end of the buffer. */
+static int json_line(EditState *s, DisplayState *ds, int offset,
+                     int *container_ptr)
+{
+    JsonState *js = (JsonState*)s->mode_data;
+    JsonCursor cur1, *cur = &cur1;
+    JsonContainer *ct;
+    int c, c1, start, start1, off, i, k, ntok, indent, toplevel;
+    int is_object, style;
+
+    *container_ptr = -1;
+    cur->b = s->b;
+    json_seek(cur, offset);
+    start = offset;
+    c = json_skip_space(cur);
+
+    /* the indentation is given by the enclosing container */
+    indent = 0;
+    toplevel = 1;
+    is_object = 0;
+    k = json_find_container(js, cur->offset);
+    if (k >= 0) {
+        ct = &js->tab[k];
+        toplevel = 0;
+        is_object = ct->is_object;
+        indent = json_depth(js, k);
+        if (ct->end == cur->offset && (c == '}' || c == ']'))
+            indent--;
+    }
+    if (ds) {
+        display_bol(ds);
+        if (indent > JSON_MAX_INDENT)
+            indent = JSON_MAX_INDENT;
+        for (i = 0; i < indent * JSON_INDENT_SIZE; i++)
+            display_char(ds, -1, -1, ' ');
+    }
+
+    for (ntok = 0;; ntok++) {
+        off = cur->offset;
+        if (c < 0) {
+            /* the end of buffer position is on the last line */
+            if (ds)
+                display_eol(ds, start, off + 1);
+            return -1;
+        }
+        /* top level values are displayed on separate lines */
+        if (toplevel && ntok > 0 && c != ',')
+            goto line_break;
+
+        switch (c) {
+        case '}':
+        case ']':
+            if (ntok > 0)
+                goto line_break;
+            json_putc(ds, start, off + 1, c, QE_STYLE_DEFAULT);
+            json_advance(cur);
+            k = json_find_container(js, off);
+            if (k >= 0 && js->tab[k].end == off)
+                toplevel = (js->tab[k].parent < 0);
+            break;
+        case ',':
+            json_putc(ds, start, off + 1, c, QE_STYLE_DEFAULT);
+            json_advance(cur);
+            start = cur->offset;
+            goto line_break;
+        case ':':
+            json_putc(ds, start, off + 1, c, QE_STYLE_DEFAULT);
+            json_putc(ds, -1, -1, ' ', QE_STYLE_DEFAULT);
+            json_advance(cur);
+            break;
+        case '{':
+        case '[':
+            json_putc(ds, start, off + 1, c, QE_STYLE_DEFAULT);
+            json_advance(cur);
+            k = json_container_at(js, off);
+            if (k >= 0 && json_is_folded(js, k)) {
+                ct = &js->tab[k];
+                *container_ptr = k;
+                json_puts(ds, off + 1, ct->end, " ... ", QE_STYLE_COMMENT);
+                json_seek(cur, ct->end);
+                if (json_peek(cur) >= 0) {
+                    json_putc(ds, ct->end, ct->end + 1, c + 2,
+                              QE_STYLE_DEFAULT);
+                    json_advance(cur);
+                }
+                toplevel = (ct->parent < 0);
+                break;
+            }
+            start1 = cur->offset;
+            c1 = json_skip_space(cur);
+            if (c1 == c + 2) {
+                /* empty container: '{' + 2 is '}', '[' + 2 is ']' */
+                json_putc(ds, start1, cur->offset + 1, c1, QE_STYLE_DEFAULT);
+                json_advance(cur);
+                break;
+            }
+            *container_ptr = k;
+            start = start1;
+            goto line_break;
+        case '"':
+            /* the first string of a line in an object is a key */
+            style = (ntok == 0 && is_object) ?
+                QE_STYLE_VARIABLE : QE_STYLE_STRING;
+            json_display_string(s, ds, cur, start, style);
+            break;
+        default:
+            /* number, literal or invalid char */
+            style = (c >= 'a' && c <= 'z') ?
+                QE_STYLE_KEYWORD : QE_STYLE_DEFAULT;
+            json_putc(ds, start, off + 1, c, style);
+            json_advance(cur);
+            for (i = 1; !json_is_delim(c = json_peek(cur)); i++) {
+                if (i < JSON_MAX_TOKEN)
+                    json_putc(ds, cur->offset, cur->offset + 1, c, style);
+                json_advance(cur);
+            }
+            break;
+        }
+        start = cur->offset;
+        c = json_skip_space(cur);
+    }
+ line_break:
+    if (ds)
+        display_eol(ds, -1, -1);
+    return start;
+}
+
+static int json_display(EditState *s, DisplayState *ds, int offset)
+{
+    int k;
+
+    json_get_state(s);
+    return json_line(s, ds, offset, &k);
+}
+
+/* return a line start at or before 'offset' */
+static int json_line_search_start(JsonState *js, int offset)
+{
+    int i, start, k;
+
+    for (;;) {
+        i = offset >> JSON_BLOCK_BITS;
+        if (i >= js->nb_checkpoints)
+            i = js->nb_checkpoints - 1;
+        while (i >= 0 &&
+               (js->checkpoints[i] < 0 || js->checkpoints[i] > offset))
+            i--;
+        if (i < 0)
+            return 0;
+        start = js->checkpoints[i];
+        /* a checkpoint hidden by a fold is not a line start */
+        k = json_folded_ancestor(js, start);
+        if (k < 0)
+            return start;
+        offset = js->tab[k].start;
+    }
+}
+
+static int json_backward_offset(EditState *s, int offset)
+{
+    JsonState *js = json_get_state(s);
+    int start, next, k;
+
+    /* the content of a folded container is on the line of its
+       opening bracket */
+    k = json_folded_ancestor(js, offset);
+    if (k >= 0)
+        offset = js->tab[k].start;
+
+    start = json_line_search_start(js, offset);
+    for (;;) {
+        next = json_line(s, NULL, start, &k);
+        if (next < 0 || next > offset)
+            return start;
+        start = next;
+    }
+}
+
+static void json_move_bol(EditState *s)
+{
+    s->offset = json_backward_offset(s, s->offset);
+}
+
+static void json_move_eol(EditState *s)
+{
+    int start, next, k;
+
+    start = json_backward_offset(s, s->offset);
+    next = json_line(s, NULL, start, &k);
+    if (next < 0)
+        s->offset = eb_total_size(s->b);
+    else
+        s->offset = next - 1;
+}
+
+/***************************************************************/
+/* commands */
+
+/* return the container opened on the line of 'offset', or else the
+   container enclosing 'offset' */
+static int json_current_container(EditState *s, int offset)
+{
+    JsonState *js = json_get_state(s);
+    int k;
+
+    json_line(s, NULL, json_backward_offset(s, offset), &k);
+    if (k < 0)
+        k = json_find_container(js, offset);
+    return k;
+}
+
+static int json_nb_items(EditState *s, JsonContainer *ct)
+{
+    JsonCursor cur1, *cur = &cur1;
+
+    if (ct->count > 0)
+        return ct->count + 1;
+    cur->b = s->b;
+    json_seek(cur, ct->start + 1);
+    json_skip_space(cur);
+    return cur->offset < ct->end;
+}
+
+static void json_fold(EditState *s, int k, int fold)
+{
+    JsonState *js = (JsonState*)s->mode_data;
+    JsonContainer *ct = &js->tab[k];
+
+    json_set_folded(js, k, fold);
+    if (fold) {
+        if (s->offset > ct->start && s->offset <= ct->end)
+            s->offset = ct->start;
+        put_status(s, "%d items folded", json_nb_items(s, ct));
+    }
+}
+
+static void do_json_toggle_fold(EditState *s)
+{
+    JsonState *js = json_get_state(s);
+    int k;
+
+    k = json_current_container(s, s->offset);
+    if (k < 0) {
+        put_status(s, "Not in a JSON object or array");
+        return;
+    }
+    json_fold(s, k, !json_is_folded(js, k));
+    s->offset_top = json_backward_offset(s, s->offset_top);
+}
+
+/* fold the containers at nesting 'level', the top level being 0 */
+static void do_json_fold_level(EditState *s, int level)
+{
+    JsonState *js = json_get_state(s);
+    int k, n;
+
+    n = 0;
+    for (k = 0; k < js->nb_containers; k++) {
+        if (json_depth(js, js->tab[k].parent) == level) {
+            json_set_folded(js, k, 1);
+            n++;
+        }
+    }
+    k = json_folded_ancestor(js, s->offset);
+    if (k >= 0)
+        s->offset = js->tab[k].start;
+    s->offset_top = json_backward_offset(s, s->offset_top);
+    put_status(s, "%d containers folded", n);
+}
+
+static void do_json_unfold_all(EditState *s)
+{
+    JsonState *js = json_get_state(s);
+
+    if (js->folded)
+        memset(js->folded, 0, (js->nb_containers + 7) >> 3);
+    s->offset_top = json_backward_offset(s, s->offset_top);
+}
+
+/* find the member 'key' (or the item of index 'key' in an array) of
+   container 'k'. Return the offset of its value or -1. */
+static int json_find_member(EditState *s, int k, const char *key)
+{
+    JsonState *js = (JsonState*)s->mode_data;
+    JsonCursor cur1, *cur = &cur1;
+    char buf[256];
+    int c, i, len, index, is_object, offset;
+
+    cur->b = s->b;
+    json_seek(cur, js->tab[k].start);
+    is_object = (json_peek(cur) == '{');
+    json_advance(cur);
+    index = 0;
+    if (!is_object) {
+        if (*key < '0' || *key > '9')
+            return -1;
+        index = strtol(key, NULL, 10);
+    }
+    for (i = 0;; i++) {
+        c = json_skip_space(cur);
+        if (c < 0 || c == '}' || c == ']')
+            return -1;
+        if (is_object) {
+            if (c != '"')
+                return -1;
+            /* the raw key is compared, escapes are not decoded */
+            json_advance(cur);
+            len = 0;
+            while ((c = json_peek(cur)) >= 0 && c != '"') {
+                if (c == '\\' && len < (int)sizeof(buf) - 1) {
+                    buf[len++] = c;
+                    json_advance(cur);
+                    c = json_peek(cur);
+                    if (c < 0)
+                        break;
+                }
+                if (len < (int)sizeof(buf) - 1)
+                    buf[len++] = c;
+                json_advance(cur);
+            }
+            buf[len] = '\0';
+            if (c >= 0)
+                json_advance(cur);
+            if (json_skip_space(cur) != ':')
+                return -1;
+            json_advance(cur);
+            json_skip_space(cur);
+        }
+        offset = cur->offset;
+        if (is_object ? !strcmp(buf, key) : (i == index))
+            return offset;
+        json_skip_value(js, cur);
+        if (json_skip_space(cur) != ',')
+            return -1;
+        json_advance(cur);
+    }
+}
+
+/* path syntax: members separated by '.' or '/', array items as [n]
+   or as a number, as in "$.store.book[2].title" or "store/book/2" */
+static void do_json_goto_path(EditState *s, const char *path)
+{
+    JsonState *js = json_get_state(s);
+    JsonCursor cur1, *cur = &cur1;
+    char key[256];
+    const char *p;
+    int k, offset, len, c;
+
+    cur->b = s->b;
+    json_seek(cur, 0);
+    json_skip_space(cur);
+    offset = cur->offset;
+    p = path;
+    if (*p == '$')
+        p++;
+    for (;;) {
+        while (*p == '.' || *p == '/')
+            p++;
+        if (*p == '\0')
+            break;
+        len = 0;
+        if (*p == '[') {
+            p++;
+            c = ']';
+            if (*p == '"' || *p == '\'')
+                c = *p++;
+        } else {
+            c = 0;
+        }
+        while (*p != '\0') {
+            if (c ? (*p == c) : (*p == '.' || *p == '/' || *p == '['))
+                break;
+            if (len < (int)sizeof(key) - 1)
+                key[len++] = *p;
+            p++;
+        }
+        key[len] = '\0';
+        if (c && *p == c)
+            p++;
+        if (*p == ']')
+            p++;
+
+        k = json_container_at(js, offset);
+        if (k < 0 || (offset = json_find_member(s, k, key)) < 0) {
+            put_status(s, "JSON path not found: %s", key);
+            return;
+        }
+    }
+    /* make the target visible */
+    while ((k = json_folded_ancestor(js, offset)) >= 0)
+        json_set_folded(js, k, 0);
+    s->offset = offset;
+}
+
+static void json_mode_line(EditState *s, char *buf, int buf_size)
+{
+    JsonState *js = json_get_state(s);
+    char *q;
+    int percent, k;
+
+    basic_mode_line(s, buf, buf_size, 'T');
+    q = buf + strlen(buf);
+    percent = 0;
+    if (eb_total_size(s->b) > 0)
+        percent = (int)((s->offset * (int64_t)100) / eb_total_size(s->b));
+    k = json_find_container(js, s->offset);
+    q += sprintf(q, "0x%x--%d%%--D%d--%s", s->offset, percent,
+                 json_depth(js, k), s->b->charset->name);
+}
+
+static int json_mode_probe(ModeProbeData *p)
+{
+    const char *r;
+    int i;
+
+    r = extension(p->filename);
+    if (*r && strfind("|json|geojson|", r + 1, 1))
+        return 100;
+    /* minified data: no line break in the probe buffer */
+    for (i = 0; i < p->buf_size && json_is_space(p->buf[i]); i++)
+        continue;
+    if (i < p->buf_size && (p->buf[i] == '{' || p->buf[i] == '[') &&
+        p->buf_size >= 1024 && !memchr(p->buf, '\n', p->buf_size))
+        return 60;
+    return 0;
+}
+
+static int json_mode_init(EditState *s, ModeSavedData *saved_data)
+{
+    int ret;
+
+    ret = text_mode_init(s, saved_data);
+    if (ret)
+        return ret;
+    s->wrap = WRAP_TRUNCATE;
+    eb_add_callback(s->b, json_buffer_callback, s->mode_data);
+    return 0;
+}
+
+static void json_mode_close(EditState *s)
+{
+    JsonState *js = (JsonState*)s->mode_data;
+
+    eb_free_callback(s->b, json_buffer_callback, js);
+    json_free_index(js);
+    text_mode_close(s);
+}
+
+/* specific JSON commands */
+static CmdDef json_commands[] = {
+    CMD0( KEY_TAB, KEY_NONE, "json-toggle-fold", do_json_toggle_fold)
+    CMD_( KEY_NONE, KEY_NONE, "json-fold-level", do_json_fold_level,
+          "i{Fold level: }")
+    CMD0( KEY_NONE, KEY_NONE, "json-unfold-all", do_json_unfold_all)
+    CMD_( KEY_NONE, KEY_NONE, "json-goto-path", do_json_goto_path,
+          "s{JSON path: }|jsonpath|")
+    CMD_DEF_END,
+};
+
+static int json_init(void)
+{
+    /* JSON mode is a text mode with its own line layout */
+    memcpy(&json_mode, &text_mode, sizeof(ModeDef));
+    json_mode.name = "json";
+    json_mode.instance_size = sizeof(JsonState);
+    json_mode.mode_probe = json_mode_probe;
+    json_mode.mode_init = json_mode_init;
+    json_mode.mode_close = json_mode_close;
+    json_mode.text_display = json_display;
+    json_mode.text_backward_offset = json_backward_offset;
+    json_mode.move_bol = json_move_bol;
+    json_mode.move_eol = json_move_eol;
+    json_mode.mode_line = json_mode_line;
+
+    qe_register_mode(&json_mode);
+    qe_register_cmd_table(json_commands, "json");
+
+    return 0;
+}
+
+void module_json_init(void)
+{
+    json_init();
+}
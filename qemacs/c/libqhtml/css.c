@@ -808,8 +808,7 @@ static inline int strcmp_null(const char *s1, const char *s2)
 }
 #endif
 
-/* hash a byte string */
-/* XXX: faster hash ? */
+/* hash a byte string (FNV-1a) */
 static inline unsigned int hash_bytes(unsigned int h, 
                                       const unsigned char *p, int len)
 {
@@ -817,7 +816,7 @@ static inline unsigned int hash_bytes(unsigned int h,
 
     p_end = p + len;
     for (; p < p_end; p++) {
-        h = ((h << 8) + p[0]) % PROPS_HASH_SIZE;
+        h = (h ^ p[0]) * 16777619;
     }
     return h;
 }
@@ -828,7 +827,7 @@ static unsigned int hash_props(CSSState *props)
 
     /* since no holes are the the structure, we can compute the hash on
        the bytes */
-    h = hash_bytes(1, (unsigned char *)props, PROPS_SIZE);
+    h = hash_bytes(2166136261U, (unsigned char *)props, PROPS_SIZE);
     return h;
 }
 
@@ -839,37 +838,63 @@ static int is_equal_props(CSSState *p1, CSSState *p2)
     return 1;
 }
 
+#define PROPS_TABLE_MIN_SIZE 256
+
+/* double the size of the shared props hash table */
+static int resize_props_table(CSSContext *s)
+{
+    CSSState **table, *p;
+    unsigned int h, mask;
+    int i, size;
+
+    size = max(s->props_table_size * 2, PROPS_TABLE_MIN_SIZE);
+    table = (CSSState**)malloc(size * sizeof(CSSState *));
+    if (!table)
+        return -1;
+    memset(table, 0, size * sizeof(CSSState *));
+    mask = size - 1;
+    for (i = 0; i < s->props_table_size; i++) {
+        p = s->props_table[i];
+        if (!p)
+            continue;
+        for (h = hash_props(p) & mask; table[h] != NULL; h = (h + 1) & mask)
+            continue;
+        table[h] = p;
+    }
+    free(s->props_table);
+    s->props_table = table;
+    s->props_table_size = size;
+    return 0;
+}
+
 /* allocate a memory slot for 'props' which is shared with others */
 static CSSState *allocate_props(CSSContext *s, CSSState *props)
 {
-    CSSState **pp, *p;
-    pp = &s->hash_props[hash_props(props)];
-    for (;;) {
-        p = *pp;
-        if (!p)
-            break;
+    CSSState *p;
+    unsigned int h, mask;
+
+    /* keep the load factor below 1/2 */
+    if (2 * (s->nb_props + 1) > s->props_table_size) {
+        if (resize_props_table(s) < 0)
+            return NULL;
+    }
+    mask = s->props_table_size - 1;
+    for (h = hash_props(props) & mask; (p = s->props_table[h]) != NULL;
+         h = (h + 1) & mask) {
         /* if properties are already there, then no need to allocate */
         if (is_equal_props(p, props))
             return p;
-        pp = &p->hash_next;
     }
     /* add new props */
-    p = (CSSState*)malloc(sizeof(CSSState));
+    p = (CSSState*)css_arena_alloc(&s->arena, sizeof(CSSState));
     if (!p)
         return NULL;
     s->nb_props++;
     memcpy(p, props, sizeof(CSSState));
-    *pp = p;
-    p->hash_next = NULL;
+    s->props_table[h] = p;
     return p;
 }
 
-/* free one CSSState */
-static void free_props(CSSState *props)
-{
-    free(props);
-}
-
 static int css_compute_block(CSSContext *s, CSSBox *box, 
                              CSSState *parent_props);
 
@@ -886,12 +911,12 @@ static CSSBox *add_before_after_box(CSSContext *s,
     content = eval_content(s, pelement_props->content, box);
     if (!content)
         return NULL;
-    box1 = css_new_box(CSS_ID_NIL, NULL);
+    box1 = css_new_box(s, CSS_ID_NIL, NULL);
     if (!box1) 
         return NULL;
     css_compute_block(s, box1, pelement_props);
     
-    css_set_text_string(box1, content);
+    css_set_text_string(s, box1, content);
     free(content);
     /* XXX: make child box */
     return box1;
@@ -984,7 +1009,7 @@ static CSSBox *add_marker_box(CSSContext *s, CSSBox *box)
     int index;
     int position;
 
-    box1 = css_new_box(CSS_ID_NIL, NULL);
+    box1 = css_new_box(s, CSS_ID_NIL, NULL);
     if (!box1)
         return NULL;
     
@@ -1016,10 +1041,10 @@ static CSSBox *add_marker_box(CSSContext *s, CSSBox *box)
         /* add an extra space if inside */
         pstrcat(text, sizeof(text), " ");
     }
-    css_set_text_string(box1, text);
+    css_set_text_string(s, box1, text);
     if (marker_props->display == CSS_DISPLAY_MARKER) {
         CSSBox *box2;
-        css_make_child_box(box1); /* add the inline text inside */
+        css_make_child_box(s, box1); /* add the inline text inside */
         /* XXX: alloc error testing ? */
         box2 = box1->u.child.first;
         marker_props->display = CSS_DISPLAY_INLINE;
@@ -1052,7 +1077,7 @@ static int css_compute_block(CSSContext *s, CSSBox *box,
     if (props->display != CSS_DISPLAY_INLINE &&
         box->content_type != CSS_CONTENT_TYPE_CHILDS &&
         box->content_type != CSS_CONTENT_TYPE_IMAGE) {
-        css_make_child_box(box);
+        css_make_child_box(s, box);
     }
 
     /* if boxes are inside, then evaluate their properties too */
@@ -1169,6 +1194,8 @@ static void css_box_split(CSSBox *box1, int offset)
         return;
     memset(box2, 0, sizeof(CSSBox));
     box2->split = 1;
+    box2->content_start = -1;
+    box2->content_end = -1;
     box2->props = box1->props; /* same properties */
     box2->content_type = box1->content_type;
     box2->content_eol = box1->content_eol;
@@ -1202,10 +1229,22 @@ typedef struct FloatBlock {
 typedef struct LayoutState {
     CSSContext *ctx;
     FloatBlock *first_float;
+    int lazy; /* true if the layout can stop at ctx->layout_limit */
+    int nb_blocks; /* number of blocks laid out by a lazy layout */
+    /* stack of the blocks of the normal flow being laid out by a lazy
+       layout, saved as the resume point when it stops */
+    int nb_frames;
+    CSSBox *frame_blocks[CSS_MAX_LAYOUT_FRAMES];
+    struct InlineLayout *frame_layouts[CSS_MAX_LAYOUT_FRAMES];
+    /* resume point being continued by css_layout_resume() */
+    CSSLayoutFrame *resume_frames;
+    int nb_resume_frames;
 } LayoutState;
 
 static int css_layout_block(CSSContext *s, LayoutOutput *block_layout,
                             CSSBox *block_box);
+static int css_layout_block1(CSSContext *s, LayoutOutput *block_layout,
+                             CSSBox *block_box, int lazy);
 static int css_layout_block_min_max(CSSContext *s, 
                                     int *min_width_ptr, int *max_width_ptr,
                                     CSSBox *block_box);
@@ -1655,6 +1694,8 @@ static int css_layout_float(InlineLayout *s, FloatBlock *b)
     }
     if (props->height != CSS_AUTO)
         box->height = props->height;
+    else
+        box->height = 0; /* may have been set by a previous layout */
 
 #if 0
     printf("layout float: %s w=%d h=%d\n", 
@@ -3172,6 +3213,7 @@ static int css_add_float(InlineLayout *s, CSSBox *box)
     b->box = box;
     b->float_type = -1;
     b->next = NULL;
+    s->ctx->has_floats = 1;
 
     /* add the float at the end of the list */
     pb = &s->layout_state->first_float;
@@ -3194,8 +3236,10 @@ static void css_free_floats(FloatBlock *b)
 
 static int css_layout_block_recurse(LayoutState *s, LayoutOutput *block_layout,
                                     CSSBox *block_box, int x_parent, int y_parent);
-static int css_layout_block_recurse1(InlineLayout *il, CSSBox *box, 
+static int css_layout_block_recurse1(InlineLayout *il, CSSBox *box,
                                      int baseline);
+static int css_layout_block_resume(LayoutState *s, LayoutOutput *block_layout,
+                                   int frame_index);
 
 static int css_layout_block_iterate(InlineLayout *il, CSSBox *box, int baseline)
 {
@@ -3211,6 +3255,163 @@ static int css_layout_block_iterate(InlineLayout *il, CSSBox *box, int baseline)
     return 0;
 }
 
+/* return the buffer offset of the first text in 'box', or -1 if none */
+static int css_box_first_offset(CSSBox *box)
+{
+    CSSBox *box1;
+    int offset;
+
+    if (box->content_type == CSS_CONTENT_TYPE_BUFFER)
+        return box->u.buffer.start;
+    if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
+        for (box1 = box->u.child.first; box1 != NULL; box1 = box1->next) {
+            offset = css_box_first_offset(box1);
+            if (offset >= 0)
+                return offset;
+        }
+    }
+    return -1;
+}
+
+/* mark 'box' as not laid out by a lazy layout */
+static void css_skip_box(CSSContext *s, CSSBox *box)
+{
+    box->skipped = 1;
+    box->x = 0;
+    box->y = 0;
+    box->width = 0;
+    box->height = 0;
+    if (s->layout_stop_offset < 0)
+        s->layout_stop_offset = css_box_first_offset(box);
+}
+
+/* save in the context the resume point of a lazy layout stopping
+   before 'box', a child of the block laid out by 'il'. The layout can
+   only be resumed if each block of the stack is a child of the
+   previous one. */
+static void css_save_layout_frames(InlineLayout *il, CSSBox *box)
+{
+    LayoutState *s = il->layout_state;
+    CSSContext *ctx = il->ctx;
+    CSSLayoutFrame *f;
+    InlineLayout *il1;
+    int i;
+
+    ctx->nb_layout_frames = 0;
+    if (s->nb_frames == 0 || s->nb_frames > CSS_MAX_LAYOUT_FRAMES ||
+        s->frame_layouts[s->nb_frames - 1] != il)
+        return;
+    for (i = 0; i < s->nb_frames; i++) {
+        f = &ctx->layout_frames[i];
+        f->block_box = s->frame_blocks[i];
+        if (i + 1 < s->nb_frames)
+            f->box = s->frame_blocks[i + 1];
+        else
+            f->box = box;
+        if (f->box->parent != f->block_box)
+            return;
+        /* the blocks of the stack have not been modified since they
+           started the layout of 'f->box' */
+        il1 = s->frame_layouts[i];
+        f->x0 = il1->x0;
+        f->y0 = il1->y0;
+        f->y = il1->y;
+        f->is_first_box = il1->is_first_box;
+        f->margin_top = il1->margin_top;
+        f->last_ymargin = il1->last_ymargin;
+        f->first_line_baseline = il1->first_line_baseline;
+        f->line_count = il1->line_count;
+    }
+    ctx->nb_layout_frames = s->nb_frames;
+}
+
+/* lay out the block box 'box' in the block layout 'il'. If
+   'frame_index' is non zero, the layout of its content is continued
+   from this frame of the resume point. */
+static int css_layout_block_box(InlineLayout *il, CSSBox *box,
+                                int frame_index)
+{
+    CSSState *props = box->props;
+    LayoutOutput layout;
+    int ymargin, ret;
+
+    if (props->width == CSS_AUTO) {
+        int w;
+        w = props->padding.x1 + props->padding.x2 +
+            props->border.x1 + props->border.x2;
+        if (props->margin.x1 != CSS_AUTO)
+            w += props->margin.x1;
+        if (props->margin.x2 != CSS_AUTO)
+            w += props->margin.x2;
+        box->width = il->total_width - w;
+    } else {
+        box->width = props->width;
+    }
+
+    /* position the box before so that we can pass x_parent and y_parent */
+    if (props->margin.x1 == CSS_AUTO &&
+        props->margin.x2 == CSS_AUTO) {
+        int w;
+        w = props->border.x1 + props->padding.x1 +
+            box->width +
+            props->padding.x2 + props->border.x2;
+        box->x = (il->total_width - w) / 2;
+    } else if (props->direction == CSS_DIRECTION_LTR) {
+        box->x = props->margin.x1 + props->border.x1 + props->padding.x1;
+    } else {
+        box->x = il->total_width - (props->margin.x2 + props->border.x2 +
+                                     props->padding.x2 + box->width);
+    }
+    /* XXX: compute y position there, but difficult to do
+       because we do not have the complete margin info */
+
+    if (props->height == CSS_AUTO) {
+        box->height = 0; /* will be extended later */
+    } else {
+        box->height = props->height;
+    }
+    if (frame_index > 0) {
+        ret = css_layout_block_resume(il->layout_state, &layout,
+                                      frame_index);
+    } else {
+        /* XXX: y_parent does not take into account margins ! */
+        ret = css_layout_block_recurse(il->layout_state, &layout, box,
+                                       il->x0 + box->x,
+                                       il->y0 + il->y +
+                                       props->border.y1 + props->padding.y1);
+    }
+    if (ret)
+        return -1;
+
+    /* compute the margin */
+    if (il->is_first_box) {
+        il->margin_top = max(il->margin_top, layout.margin_top);
+        ymargin = 0; /* the margin is taken into account by the parent block */
+    } else {
+        ymargin = max(il->last_ymargin, layout.margin_top);
+    }
+    il->last_ymargin = layout.margin_bottom;
+    /* compute the box position */
+    box->y = il->y + ymargin + props->border.y1 + props->padding.y1;
+    box->padding_top = 0;
+    box->padding_bottom = 0;
+    /* update position for the next box */
+    il->y = box->y + box->height + props->border.y2 + props->padding.y2;
+
+    /* apply relative offset if specified */
+    if (props->position == CSS_POSITION_RELATIVE) {
+        if (props->left != CSS_AUTO)
+            box->x += props->left;
+        else if (props->right != CSS_AUTO)
+            box->x -= props->right;
+        if (props->top != CSS_AUTO)
+            box->y += props->top;
+        else if (props->bottom != CSS_AUTO)
+            box->y -= props->bottom;
+    }
+    return 0;
+}
+
 /* layout one box in an inline or block context */
 static int css_layout_block_recurse1(InlineLayout *il, CSSBox *box, 
                                      int baseline)
@@ -3222,6 +3423,13 @@ static int css_layout_block_recurse1(InlineLayout *il, CSSBox *box,
     if (il->ctx->abort_func(il->ctx->abort_opaque))
         return -1;
     
+    /* lazy layout: all the boxes after the stop point are skipped */
+    if (il->ctx->layout_partial) {
+        css_skip_box(il->ctx, box);
+        return 0;
+    }
+    box->skipped = 0;
+
     props = box->props;
     if (props->position == CSS_POSITION_ABSOLUTE ||
         props->position == CSS_POSITION_FIXED) {
@@ -3265,76 +3473,24 @@ static int css_layout_block_recurse1(InlineLayout *il, CSSBox *box,
                 css_end_inline_layout(il);
                 il->last_ymargin = 0;
             }
-            il->marker_box = NULL; /* the marker was already positionned correctly */
-
-            if (props->width == CSS_AUTO) {
-                int w;
-                w = props->padding.x1 + props->padding.x2 +
-                    props->border.x1 + props->border.x2;
-                if (props->margin.x1 != CSS_AUTO)
-                    w += props->margin.x1;
-                if (props->margin.x2 != CSS_AUTO)
-                    w += props->margin.x2;
-                box->width = il->total_width - w;
-            } else {
-                box->width = props->width;
-            }
-
-            /* position the box before so that we can pass x_parent and y_parent */
-            if (props->margin.x1 == CSS_AUTO &&
-                props->margin.x2 == CSS_AUTO) {
-                int w;
-                w = props->border.x1 + props->padding.x1 + 
-                    box->width +
-                    props->padding.x2 + props->border.x2;
-                box->x = (il->total_width - w) / 2;
-            } else if (props->direction == CSS_DIRECTION_LTR) {
-                box->x = props->margin.x1 + props->border.x1 + props->padding.x1;
-            } else {
-                box->x = il->total_width - (props->margin.x2 + props->border.x2 + 
-                                             props->padding.x2 + box->width);
+            /* lazy layout: stop at the first block below the limit,
+               or when the time given to the layout is elapsed */
+            if (il->layout_state->lazy &&
+                ((il->ctx->layout_limit > 0 &&
+                  il->y0 + il->y >= il->ctx->layout_limit) ||
+                 (il->ctx->layout_deadline > 0 &&
+                  il->layout_state->nb_blocks > 0 &&
+                  get_clock_usec() >= il->ctx->layout_deadline))) {
+                il->ctx->layout_partial = 1;
+                css_save_layout_frames(il, box);
+                css_skip_box(il->ctx, box);
+                return 0;
             }
-            /* XXX: compute y position there, but difficult to do
-               because we do not have the complete margin info */
+            il->layout_state->nb_blocks++;
+            il->marker_box = NULL; /* the marker was already positionned correctly */
 
-            if (props->height == CSS_AUTO) {
-                box->height = 0; /* will be extended later */
-            } else {
-                box->height = props->height;
-            }
-            /* XXX: y_parent does not take into account margins ! */
-            if (css_layout_block_recurse(il->layout_state, &layout, box,
-                                         il->x0 + box->x, 
-                                         il->y0 + il->y + 
-                                         props->border.y1 + props->padding.y1))
+            if (css_layout_block_box(il, box, 0))
                 return -1;
-
-            /* compute the margin */
-            if (il->is_first_box) {
-                il->margin_top = max(il->margin_top, layout.margin_top);
-                ymargin = 0; /* the margin is taken into account by the parent block */
-            } else {
-                ymargin = max(il->last_ymargin, layout.margin_top);
-            }
-            il->last_ymargin = layout.margin_bottom;
-            /* compute the box position */
-            box->y = il->y + ymargin + props->border.y1 + props->padding.y1;
-            box->padding_top = 0;
-            box->padding_bottom = 0;
-            /* update position for the next box */
-            il->y = box->y + box->height + props->border.y2 + props->padding.y2;
-
-            /* apply relative offset if specified */
-            if (props->position == CSS_POSITION_RELATIVE) {
-                if (props->left != CSS_AUTO)
-                    box->x += props->left;
-                else if (props->right != CSS_AUTO)
-                    box->x -= props->right;
-                if (props->top != CSS_AUTO)
-                    box->y += props->top;
-                else if (props->bottom != CSS_AUTO)
-                    box->y -= props->bottom;
-            }
             break;
         case CSS_DISPLAY_MARKER:
             /* marker is put in the left margin of block_box */
@@ -3362,7 +3518,7 @@ static int css_layout_block_recurse1(InlineLayout *il, CSSBox *box,
                 w = props->margin.x1 + props->border.x1 + props->padding.x1 +
                     w + 
                     props->margin.x2 + props->border.x2 + props->padding.x2;
-                box->x -= (w + offset);
+                box->x = -(w + offset);
                 /* margin is also taken into account */
                 box->y = il->y + props->border.y1 + props->padding.y1 + layout.margin_top;
                 /* note: the marker Y position can be modified if an
@@ -3400,10 +3556,72 @@ static int css_layout_block_recurse1(InlineLayout *il, CSSBox *box,
     return 0;
 }
 
+/* initialize 'il' for the block layout of the childs of 'block_box' */
+static void css_start_block_layout(LayoutState *s, InlineLayout *il,
+                                   LayoutOutput *block_layout,
+                                   CSSBox *block_box,
+                                   int x_parent, int y_parent)
+{
+    /* a subset of the inline layout is also used for the block layout */
+    il->ctx = s->ctx;
+    il->compute_min_max = 0;
+    il->layout_state = s;
+    il->y = 0;
+    il->x0 = x_parent;
+    il->y0 = y_parent;
+    il->total_width = block_box->width;
+    il->last_ymargin = 0; /* not used */
+    il->is_first_box = 1;
+    il->margin_top = block_layout->margin_top;
+    il->marker_box = NULL;
+    il->layout_type = LAYOUT_TYPE_BLOCK;
+    il->first_line_baseline = 0;
+    il->line_count = 0;
+}
+
+/* flush the last line and update the margins and the height of
+   'block_box' */
+static void css_end_block_layout(InlineLayout *il, LayoutOutput *block_layout,
+                                 CSSBox *block_box)
+{
+    /* start block layout to flush last line */
+    if (il->layout_type != LAYOUT_TYPE_BLOCK)
+        css_end_inline_layout(il);
+
+    /* update the bottom margin of the whole block */
+    block_layout->margin_top = il->margin_top;
+    block_layout->margin_bottom = max(block_layout->margin_bottom,
+                                      il->last_ymargin);
+    block_layout->baseline = il->first_line_baseline;
+    /* update the block height if necessary (XXX: incorrect if not
+       auto) */
+    if (il->y > block_box->height)
+        block_box->height = il->y;
+}
+
+static void css_push_layout_frame(LayoutState *s, InlineLayout *il,
+                                  CSSBox *block_box)
+{
+    if (!s->lazy)
+        return;
+    /* deeper blocks are counted but cannot be resumed */
+    if (s->nb_frames < CSS_MAX_LAYOUT_FRAMES) {
+        s->frame_blocks[s->nb_frames] = block_box;
+        s->frame_layouts[s->nb_frames] = il;
+    }
+    s->nb_frames++;
+}
+
+static void css_pop_layout_frame(LayoutState *s)
+{
+    if (s->lazy)
+        s->nb_frames--;
+}
+
 /* layout the interior of box 'block_box'. 'block_box->width' and
    'block_box->height' must have reasonnable values before calling
    this function. If height == 0, then the box is extended as needed.
-   x_parent and y_parent are the absolute coordinates of
+   x_parent and y_parentare the absolute coordinates of
    block_box. They are needed only in case of floats blocks.  */
 static int css_layout_block_recurse(LayoutState *s, LayoutOutput *block_layout,
                                     CSSBox *block_box, int x_parent, int y_parent)
@@ -3450,62 +3668,90 @@ static int css_layout_block_recurse(LayoutState *s, LayoutOutput *block_layout,
             block_box->height = block_props->height;
         return 0;
     }
-    /* a subset of the inline layout is also used for the block layout */
-    il->ctx = s->ctx;
-    il->compute_min_max = 0;
-    il->layout_state = s;
-    il->y = 0;
-    il->x0 = x_parent;
-    il->y0 = y_parent;
-    il->total_width = block_box->width;
-    il->last_ymargin = 0; /* not used */
-    il->is_first_box = 1;
-    il->margin_top = block_layout->margin_top;
-    il->marker_box = NULL;
-    il->layout_type = LAYOUT_TYPE_BLOCK;
-    il->first_line_baseline = 0;
-    il->line_count = 0;
-    
+    css_start_block_layout(s, il, block_layout, block_box,
+                           x_parent, y_parent);
+    css_push_layout_frame(s, il, block_box);
     ret = css_layout_block_iterate(il, block_box, 0);
+    css_pop_layout_frame(s);
     if (ret)
         return ret;
 
-    /* start block layout to flush last line */
-    if (il->layout_type != LAYOUT_TYPE_BLOCK)
-        css_end_inline_layout(il);
+    css_end_block_layout(il, block_layout, block_box);
+    return 0;
+}
 
-    /* update the bottom margin of the whole block */
-    block_layout->margin_top = il->margin_top;
-    block_layout->margin_bottom = max(block_layout->margin_bottom, 
-                                      il->last_ymargin);
-    block_layout->baseline = il->first_line_baseline;
-    /* update the block height if necessary (XXX: incorrect if not
-       auto) */
-    if (il->y > block_box->height)
-        block_box->height = il->y;
+/* continue the layout of the block of the frame 'frame_index' of the
+   resume point, from the child where the previous layout stopped */
+static int css_layout_block_resume(LayoutState *s, LayoutOutput *block_layout,
+                                   int frame_index)
+{
+    CSSLayoutFrame *f = &s->resume_frames[frame_index];
+    CSSBox *block_box = f->block_box, *box, *box1;
+    CSSState *block_props = block_box->props;
+    InlineLayout inline_layout, *il = &inline_layout;
+    int ret;
+
+    block_layout->margin_top = block_props->margin.y1;
+    block_layout->margin_bottom = block_props->margin.y2;
+    css_start_block_layout(s, il, block_layout, block_box, f->x0, f->y0);
+    il->y = f->y;
+    il->is_first_box = f->is_first_box;
+    il->margin_top = f->margin_top;
+    il->last_ymargin = f->last_ymargin;
+    il->first_line_baseline = f->first_line_baseline;
+    il->line_count = f->line_count;
+
+    css_push_layout_frame(s, il, block_box);
+    ret = 0;
+    box = f->box;
+    if (frame_index + 1 < s->nb_resume_frames) {
+        /* the layout stopped inside 'box' */
+        box1 = box->next;
+        ret = css_layout_block_box(il, box, frame_index + 1);
+        il->is_first_box = 0;
+        box = box1;
+    }
+    for (; box != NULL && !ret; box = box1) {
+        box1 = box->next; /* boxes may be split */
+        ret = css_layout_block_recurse1(il, box, 0);
+    }
+    css_pop_layout_frame(s);
+    if (ret)
+        return ret;
+
+    css_end_block_layout(il, block_layout, block_box);
     return 0;
 }
 
 /* layout the interior of box 'block_box'. 'block_box->width' and
    'block_box->height' must have reasonnable values before calling
    this function. If height == 0, then the box is extended as needed.
-   no floating boxes are initially registered.
+   no floating boxes are initially registered. If 'lazy' is true, the
+   layout of the normal flow stops at s->layout_limit.
    */
-static int css_layout_block(CSSContext *s, LayoutOutput *block_layout,
-                            CSSBox *block_box)
+static int css_layout_block1(CSSContext *s, LayoutOutput *block_layout,
+                             CSSBox *block_box, int lazy)
 {
     LayoutState layout_state;
     int ret;
 
+    memset(&layout_state, 0, sizeof(layout_state));
     layout_state.ctx = s;
     layout_state.first_float = NULL;
-    ret = css_layout_block_recurse(&layout_state, block_layout, block_box, 0, 0);
+    layout_state.lazy = lazy;
+ret = css_layout_block_recurse(&layout_state, block_layout, block_box, 0, 0);
  
     css_free_floats(layout_state.first_float);
 
     return ret;
 }
 
+static int css_layout_block(CSSContext *s, LayoutOutput *block_layout,
+                            CSSBox *block_box)
+{
+    return css_layout_block1(s, block_layout, block_box, 0);
+}
+
 /* min/max layout */
 static int css_layout_box_min_max(InlineLayout *il, CSSBox *box)
 {
@@ -3630,31 +3876,20 @@ static int css_layout_block_min_max(CSSContext *s,
     return 0;
 }
 
-/* bounding box extraction. get document extends & global background
-   infos. Also translate all relative coordinates into absolute
-   ones. XXX: use absolute coordinates in the whole layout. */
-static void css_compute_bbox_block(CSSContext *s,
-                                   CSSBox *box, int x_parent, int y_parent)
+/* set the bounding box of 'box' from its absolute position and the
+   bounding boxes of its childs */
+static void css_update_bbox(CSSBox *box)
 {
-    CSSBox *tt;
     CSSState *props = box->props;
+    CSSBox *tt;
     int x0, y0;
-    
-    if (props->visibility == CSS_VISIBILITY_HIDDEN) {
+
+    if (props->visibility == CSS_VISIBILITY_HIDDEN || box->skipped) {
         css_set_rect(&box->bbox, 0, 0, 0, 0);
         return;
     }
     x0 = box->x;
     y0 = box->y;
-    /* convert to absolute position if needed */
-    if (!box->absolute_pos) {
-        x0 += x_parent;
-        y0 += y_parent;
-        box->x = x0;
-        box->y = y0;
-    }
-    
-    /* update bounding box */
     css_set_rect(&box->bbox,
                  x0 - (props->padding.x1 + props->border.x1),
                  y0 - (props->padding.y1 + box->padding_top + 
@@ -3662,20 +3897,48 @@ static void css_compute_bbox_block(CSSContext *s,
                  x0 + box->width + props->padding.x2 + props->border.x2,
                  y0 + box->height + 
                  (props->padding.y2 + box->padding_bottom + props->border.y2));
+    if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
+        for (tt = box->u.child.first; tt != NULL; tt = tt->next)
+            css_union_rect(&box->bbox, &tt->bbox);
+    }
+}
 
+/* bounding box extraction. get document extends & global background
+   infos. Also translate all relative coordinates into absolute
+   ones. XXX: use absolute coordinates in the whole layout. */
+static void css_compute_bbox_block(CSSContext *s,
+                                   CSSBox *box, int x_parent, int y_parent)
+{
+    CSSBox *tt;
+    CSSState *props = box->props;
+    
+    if (props->visibility == CSS_VISIBILITY_HIDDEN || box->skipped) {
+        css_set_rect(&box->bbox, 0, 0, 0, 0);
+        return;
+    }
+    /* convert to absolute position if needed */
+    if (!box->absolute_pos) {
+        box->x += x_parent;
+        box->y += y_parent;
+    }
+    
     /* now display the content ! */
     if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
         /* other boxes are inside: display them */
         tt = box->u.child.first;
         while (tt) {
-            css_compute_bbox_block(s, tt, x0, y0);
-            css_union_rect(&box->bbox, &tt->bbox);
+            css_compute_bbox_block(s, tt, box->x, box->y);
             tt = tt->next;
         }
     }
+
+    /* update bounding box */
+    css_update_bbox(box);
 }
 
-/* main css layout function. Return non zero if interrupted */
+/* main css layout function. Return non zero if interrupted. If
+   s->layout_limit is non zero, only the boxes above it are laid out
+   and s->layout_partial is set if some boxes were skipped. */
 int css_layout(CSSContext *s, CSSBox *box, int width,
                CSSAbortFunc *abort_func, void *abort_opaque)
 {
@@ -3684,6 +3947,10 @@ int css_layout(CSSContext *s, CSSBox *box, int width,
 
     s->abort_func = abort_func;
     s->abort_opaque = abort_opaque;
+    s->has_floats = 0;
+    s->layout_partial = 0;
+    s->layout_stop_offset = -1;
+    s->nb_layout_frames = 0;
 
     /* bidi compute */
     ret = css_layout_bidir_block(s, box);
@@ -3692,14 +3959,348 @@ int css_layout(CSSContext *s, CSSBox *box, int width,
 
     /* layout */
     box->width = width;
-    ret = css_layout_block(s, &layout, box);
+    ret = css_layout_block1(s, &layout, box, 1);
     if (ret)
         return ret;
+    if (s->layout_partial && s->layout_stop_offset < 0)
+        s->layout_stop_offset = s->b ? eb_total_size(s->b) : 0;
 
     //    css_dump(box);
 
     /* compute the bbox of all non hidden boxes */
     css_compute_bbox_block(s, box, 0, 0);
+    s->layout_absolute = 1;
+    return 0;
+}
+
+/******************************************************************/
+/* incremental layout */
+
+/* merge back the boxes split by a previous layout into the box they
+   come from, for 'box', its next boxes and all their childs */
+void css_unsplit_box(CSSBox *box)
+{
+    CSSBox *box1;
+
+    for (; box != NULL; box = box->next) {
+        while ((box1 = box->next) != NULL && box1->split) {
+            box->u.buffer.end = box1->u.buffer.end;
+            box->content_eol = box1->content_eol;
+            box->next = box1->next;
+            free(box1);
+        }
+        if (box->content_type == CSS_CONTENT_TYPE_CHILDS &&
+            box->u.child.first) {
+            css_unsplit_box(box->u.child.first);
+            /* the last child may have been merged */
+            for (box1 = box->u.child.first; box1->next != NULL; 
+                 box1 = box1->next);
+            box->u.child.last = box1;
+        }
+    }
+}
+
+/* find the box whose edit buffer text contains 'offset' (start <=
+   offset <= end, including the boxes split from it). */
+CSSBox *css_find_text_box(CSSBox *box, int offset)
+{
+    CSSBox *box1, *found;
+    int end;
+
+    for (; box != NULL; box = box->next) {
+        if (box->content_type == CSS_CONTENT_TYPE_BUFFER && !box->split) {
+            end = box->u.buffer.end;
+            for (box1 = box->next; box1 != NULL && box1->split; 
+                 box1 = box1->next)
+                end = box1->u.buffer.end;
+            if (offset >= box->u.buffer.start && offset <= end)
+                return box;
+        } else if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
+            found = css_find_text_box(box->u.child.first, offset);
+            if (found)
+                return found;
+        }
+    }
+    return NULL;
+}
+
+/* add 'delta' to the edit buffer offsets of the text boxes starting
+   at or after 'offset', except 'box_except', and to the element
+   content offsets after 'offset' */
+void css_shift_text_boxes(CSSBox *box, int offset, int delta,
+                          CSSBox *box_except)
+{
+    for (; box != NULL; box = box->next) {
+        if (box->content_start > offset)
+            box->content_start += delta;
+        if (box->content_end >= offset)
+            box->content_end += delta;
+        if (box->content_type == CSS_CONTENT_TYPE_BUFFER) {
+            if (box != box_except && box->u.buffer.start >= offset) {
+                box->u.buffer.start += delta;
+                box->u.buffer.end += delta;
+            }
+        } else if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
+            css_shift_text_boxes(box->u.child.first, offset, delta,
+                                 box_except);
+        }
+    }
+}
+
+/* convert back the positions made absolute by css_compute_bbox_block()
+   to positions relative to the parent box */
+static void css_relative_pos_block(CSSBox *box, int x_parent, int y_parent)
+{
+    CSSBox *tt;
+    CSSState *props = box->props;
+
+    if (props->visibility == CSS_VISIBILITY_HIDDEN || box->skipped)
+        return;
+    /* the childs were converted with the absolute position of 'box' */
+    if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
+        for (tt = box->u.child.first; tt != NULL; tt = tt->next)
+            css_relative_pos_block(tt, box->x, box->y);
+    }
+    if (!box->absolute_pos) {
+        box->x -= x_parent;
+        box->y -= y_parent;
+    }
+}
+
+/* layout again an already laid out box tree, for example because
+   the width changed. Return non zero if interrupted */
+int css_relayout(CSSContext *s, CSSBox *box, int width,
+                 CSSAbortFunc *abort_func, void *abort_opaque)
+{
+    css_unsplit_box(box);
+    if (s->layout_absolute) {
+        css_relative_pos_block(box, 0, 0);
+        s->layout_absolute = 0;
+    }
+    box->height = 0;
+    return css_layout(s, box, width, abort_func, abort_opaque);
+}
+
+/* continue a partial lazy layout of 'box' from where it stopped, down
+   to the new s->layout_limit. The boxes already laid out are kept. If
+   the layout cannot be resumed, the whole layout is done again.
+   Return non zero if interrupted: the layout must then be done
+   again. */
+int css_layout_resume(CSSContext *s, CSSBox *box,
+                      CSSAbortFunc *abort_func, void *abort_opaque)
+{
+    CSSLayoutFrame frames[CSS_MAX_LAYOUT_FRAMES];
+    LayoutState layout_state;
+    LayoutOutput layout;
+    int nb_frames, ret;
+
+    nb_frames = s->nb_layout_frames;
+    /* floats may flow around the boxes after the resume point */
+    if (!s->layout_partial || s->has_floats || nb_frames == 0 ||
+        s->layout_frames[0].block_box != box) {
+        /* a layout from the top must reach the limit to progress */
+        s->layout_deadline = 0;
+        return css_relayout(s, box, box->width, abort_func, abort_opaque);
+    }
+    memcpy(frames, s->layout_frames, nb_frames * sizeof(frames[0]));
+
+    s->abort_func = abort_func;
+    s->abort_opaque = abort_opaque;
+    s->layout_partial = 0;
+    s->layout_stop_offset = -1;
+    s->nb_layout_frames = 0;
+
+    /* the layout is done with the positions relative to the parents */
+    if (s->layout_absolute) {
+        css_relative_pos_block(box, 0, 0);
+        s->layout_absolute = 0;
+    }
+
+    memset(&layout_state, 0, sizeof(layout_state));
+    layout_state.ctx = s;
+    layout_state.lazy = 1;
+    layout_state.resume_frames = frames;
+    layout_state.nb_resume_frames = nb_frames;
+    ret = css_layout_block_resume(&layout_state, &layout, 0);
+    css_free_floats(layout_state.first_float);
+    if (ret)
+        return ret;
+    if (s->layout_partial && s->layout_stop_offset < 0)
+        s->layout_stop_offset = s->b ? eb_total_size(s->b) : 0;
+
+    css_compute_bbox_block(s, box, 0, 0);
+    s->layout_absolute = 1;
+    return 0;
+}
+
+static int css_no_abort(void *opaque)
+{
+    return 0;
+}
+
+/* return the block whose layout must be redone if the text of
+   'box' changes, or NULL if the whole document must be laid out
+   again */
+CSSBox *css_get_dirty_block(CSSContext *s, CSSBox *box)
+{
+    CSSBox *block, *box1;
+    CSSState *props;
+
+    /* floats may flow around any block */
+    if (s->has_floats || s->layout_partial)
+        return NULL;
+
+    for (block = box->parent; block != NULL; block = block->parent) {
+        props = block->props;
+        if (props->display == CSS_DISPLAY_BLOCK ||
+            props->display == CSS_DISPLAY_LIST_ITEM)
+            break;
+    }
+    if (!block || !block->parent)
+        return NULL;
+
+    /* the block and its parents must be in the normal flow of block
+       boxes so that only their heights depend on their content */
+    for (box1 = block; box1->parent != NULL; box1 = box1->parent) {
+        props = box1->props;
+        if ((props->display != CSS_DISPLAY_BLOCK &&
+             props->display != CSS_DISPLAY_LIST_ITEM) ||
+            props->block_float != CSS_FLOAT_NONE ||
+            (props->position != CSS_POSITION_STATIC &&
+             props->position != CSS_POSITION_RELATIVE))
+            return NULL;
+    }
+    return block;
+}
+
+/* layout again the inside of 'block_box' (as returned by
+   css_get_dirty_block()) keeping its width and position. Return 0 if
+   done, or non zero if its height changed so that the whole
+   document must be laid out again. */
+int css_layout_dirty_block(CSSContext *s, CSSBox *block_box)
+{
+    LayoutOutput layout;
+    CSSState *props = block_box->props;
+    CSSBox *box;
+    int old_height;
+
+    /* the positions are not consistent during a relayout */
+    if (!s->layout_absolute)
+        return 1;
+    s->abort_func = css_no_abort;
+    s->abort_opaque = NULL;
+
+    old_height = block_box->height;
+    css_unsplit_box(block_box->u.child.first);
+    /* the boxes which are not placed by the layout keep their
+       position: it must be relative again */
+    for (box = block_box->u.child.first; box != NULL; box = box->next)
+        css_relative_pos_block(box, block_box->x, block_box->y);
+    for (box = block_box->u.child.first; box && box->next; box = box->next);
+    block_box->u.child.last = box;
+    if (css_layout_bidir_block(s, block_box))
+        return -1;
+    if (props->height == CSS_AUTO) {
+        block_box->height = 0;
+    } else {
+        block_box->height = props->height;
+    }
+    if (css_layout_block(s, &layout, block_box))
+        return -1;
+
+    /* childs have relative coordinates, the block is already absolute */
+    for (box = block_box->u.child.first; box != NULL; box = box->next)
+        css_compute_bbox_block(s, box, block_box->x, block_box->y);
+    /* new floats may flow around the boxes outside the block */
+    if (block_box->height != old_height || s->has_floats)
+        return 1;
+    for (box = block_box; box != NULL; box = box->parent)
+        css_update_bbox(box);
+    return 0;
+}
+
+/* find the innermost element which is not inline and whose content
+   contains the edit buffer text from 'offset' to 'offset + size' */
+CSSBox *css_find_content_box(CSSBox *box, int offset, int size)
+{
+    CSSBox *found;
+
+    for (; box != NULL; box = box->next) {
+        /* the offsets of the elements not closed by their end tag
+           are unknown: only their childs can be tested */
+        if (box->content_end >= 0 &&
+            (offset < box->content_start ||
+             offset + size > box->content_end))
+            continue;
+        if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
+            found = css_find_content_box(box->u.child.first, offset, size);
+            if (found)
+                return found;
+        }
+        if (box->content_end >= 0 && box->tag != CSS_ID_NIL &&
+            box->props->display != CSS_DISPLAY_INLINE)
+            return box;
+    }
+    return NULL;
+}
+
+/* return true if 'box' or its childs use counters or generated
+   content, which depend on the boxes before them */
+static int css_box_uses_counters(CSSBox *box)
+{
+    CSSState *props = box->props;
+    CSSBox *box1;
+
+    if (props->display == CSS_DISPLAY_LIST_ITEM ||
+        props->counter_reset || props->counter_increment ||
+        props->content)
+        return 1;
+    if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
+        for (box1 = box->u.child.first; box1 != NULL; box1 = box1->next) {
+            if (css_box_uses_counters(box1))
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/* replace the content of the element 'box' by the content of 'box1'
+   (as returned by xml_parse_content()) and compute its properties.
+   Return non zero if it cannot be done without computing the whole
+   document again. */
+int css_replace_childs(CSSContext *s, CSSBox *box, CSSBox *box1)
+{
+    CSSBox *box2;
+    int ret;
+
+    if (!box->parent || box->has_style || css_box_uses_counters(box))
+        return -1;
+
+    if (box->content_type == CSS_CONTENT_TYPE_CHILDS)
+        css_delete_box(box->u.child.first);
+    box->content_type = box1->content_type;
+    box->content_eol = box1->content_eol;
+    box->u = box1->u;
+    if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
+        for (box2 = box->u.child.first; box2 != NULL; box2 = box2->next)
+            box2->parent = box;
+        box1->u.child.first = NULL;
+    }
+    css_delete_box(box1);
+
+    s->counter_stack_base = NULL;
+    s->counter_stack_ptr = NULL;
+    ret = css_compute_block(s, box, box->parent->props);
+    pop_counters(s, NULL);
+    if (ret || css_box_uses_counters(box))
+        return -1;
+    /* as for the other boxes, the positions of the new boxes must
+       be absolute until the next layout */
+    if (s->layout_absolute && !box->skipped &&
+        box->content_type == CSS_CONTENT_TYPE_CHILDS) {
+        for (box2 = box->u.child.first; box2 != NULL; box2 = box2->next)
+            css_compute_bbox_block(s, box2, box->x, box->y);
+    }
     return 0;
 }
 
@@ -4224,6 +4825,8 @@ int css_box_iterate(CSSContext *s,
 {
     CSSBox *tt;
 
+    if (box->skipped)
+        return 0;
     if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
         tt = box->u.child.first;
         while (tt) {
@@ -4365,22 +4968,109 @@ void css_dump(CSSBox *box)
 }
 #endif
 
+/* memory arena */
+
+#define CSS_ARENA_BLOCK_SIZE 65536
+#define CSS_ARENA_ALIGN      8
+
+struct CSSArenaBlock {
+    CSSArenaBlock *next;
+    /* aligned data follows */
+};
+
+#define CSS_ARENA_HEADER_SIZE \
+    ((sizeof(CSSArenaBlock) + CSS_ARENA_ALIGN - 1) & ~(CSS_ARENA_ALIGN - 1))
+
+/* allocate 'size' bytes in the arena. The memory is not cleared */
+void *css_arena_alloc(CSSArena *a, int size)
+{
+    CSSArenaBlock *b;
+    unsigned char *ptr;
+    int block_size;
+
+    size = (size + CSS_ARENA_ALIGN - 1) & ~(CSS_ARENA_ALIGN - 1);
+    if (size > a->end - a->ptr) {
+        /* big objects get their own block so that the current block
+           can still be filled */
+        block_size = max(size, CSS_ARENA_BLOCK_SIZE);
+        b = (CSSArenaBlock*)malloc(CSS_ARENA_HEADER_SIZE + block_size);
+        if (!b)
+            return NULL;
+        ptr = (unsigned char *)b + CSS_ARENA_HEADER_SIZE;
+        if (block_size > CSS_ARENA_BLOCK_SIZE && a->first_block) {
+            b->next = a->first_block->next;
+            a->first_block->next = b;
+            return ptr;
+        }
+        b->next = a->first_block;
+        a->first_block = b;
+        a->ptr = ptr;
+        a->end = ptr + block_size;
+    }
+    ptr = a->ptr;
+    a->ptr += size;
+    return ptr;
+}
+
+char *css_arena_strdup(CSSArena *a, const char *str)
+{
+    char *p;
+    int len;
+
+    len = strlen(str) + 1;
+    p = (char*)css_arena_alloc(a, len);
+    if (p)
+        memcpy(p, str, len);
+    return p;
+}
+
+/* free all the objects allocated in the arena */
+void css_arena_free(CSSArena *a)
+{
+    CSSArenaBlock *b, *b_next;
+
+    for (b = a->first_block; b != NULL; b = b_next) {
+        b_next = b->next;
+        free(b);
+    }
+    a->first_block = NULL;
+    a->ptr = NULL;
+    a->end = NULL;
+}
+
 /* box handling API */
 
-/* create a new box.
-   WARNING: the tag and the attributes are freed when the box is deleted 
+/* create a new box in the document arena.
+   WARNING: the tag and the attributes are freed with the document 
  */
-CSSBox *css_new_box(CSSIdent tag, CSSAttribute *attrs)
+CSSBox *css_new_box(CSSContext *s, CSSIdent tag, CSSAttribute *attrs)
 {
-    CSSBox *box = (CSSBox*)malloc(sizeof(CSSBox));
+    CSSBox *box = (CSSBox*)css_arena_alloc(&s->arena, sizeof(CSSBox));
     if (!box)
         return NULL;
     memset(box, 0, sizeof(CSSBox));
     box->tag = tag;
     box->attrs = attrs;
+    box->content_start = -1;
+    box->content_end = -1;
     return box;
 }
 
+CSSAttribute *css_new_attr(CSSContext *s, CSSIdent attr_id, 
+                           const char *value)
+{
+    CSSAttribute *attr;
+
+    attr = (CSSAttribute*)css_arena_alloc(&s->arena, sizeof(CSSAttribute) +
+                                          strlen(value));
+    if (!attr)
+        return NULL;
+    attr->attr = attr_id;
+    attr->next = NULL;
+    strcpy(attr->value, value);
+    return attr;
+}
+
 CSSBox *css_add_box(CSSBox *parent_box, CSSBox *box)
 {
     if (parent_box->content_type != CSS_CONTENT_TYPE_CHILDS) {
@@ -4396,12 +5086,13 @@ CSSBox *css_add_box(CSSBox *parent_box, CSSBox *box)
     return box;
 }
 
-/* delete a box and all boxes after and inside */
-/* XXX: free generated content ! */
+/* delete a box and all boxes after and inside. Only what is not in
+   the document arena is freed here: the split boxes created by the
+   layout, the explicit properties and the generated content. The
+   rest is freed by css_delete_document(). */
 void css_delete_box(CSSBox *box)
 {
     CSSBox *box1;
-    CSSAttribute *a1, *a;
     CSSProperty *p1, *p;
 
     while (box != NULL) {
@@ -4409,29 +5100,19 @@ void css_delete_box(CSSBox *box)
         case CSS_CONTENT_TYPE_CHILDS:
             css_delete_box(box->u.child.first);
             break;
-        case CSS_CONTENT_TYPE_STRING:
-            /* split boxes never own their content */
-            if (!box->split)
-                free((void *)box->u.buffer.start);
-            break;
         case CSS_CONTENT_TYPE_IMAGE:
             free(box->u.image.content_alt);
             break;
         }
         box1 = box->next;
-        a = box->attrs;
-        while (a != NULL) {
-            a1 = a->next;
-            free(a);
-            a = a1;
-        }
         p = box->properties;
         while (p != NULL) {
             p1 = p->next;
             free(p);
             p = p1;
         }
-        free(box);
+        if (box->split)
+            free(box);
         box = box1;
     }
 }
@@ -4445,15 +5126,17 @@ void css_set_text_buffer(CSSBox *box,
     box->u.buffer.end = offset2;
 }
 
-/* note: the string is reallocated */
-void css_set_text_string(CSSBox *box, const char *string)
+/* note: the string is copied in the document arena */
+void css_set_text_string(CSSContext *s, CSSBox *box, const char *string)
 {
     int len;
     char *str;
 
     box->content_type = CSS_CONTENT_TYPE_STRING;
-    str = strdup(string);
-    len = strlen(string);
+    str = css_arena_strdup(&s->arena, string);
+    if (!str)
+        str = (char *)"";
+    len = strlen(str);
     box->u.buffer.start = (unsigned long)str;
     box->u.buffer.end = (unsigned long)str + len;
 }
@@ -4468,13 +5151,13 @@ void css_set_child_box(CSSBox *parent_box, CSSBox *box)
 
 /* if 'box' is not a box suitable to have child, transform it into a
    such a box */
-void css_make_child_box(CSSBox *box)
+void css_make_child_box(CSSContext *s, CSSBox *box)
 {
     CSSBox *box1;
 
     if (box->content_type != CSS_CONTENT_TYPE_CHILDS) {
         /* the box already contains text : we create a subbox cloning the parent box */
-        box1 = css_new_box(CSS_ID_NIL, NULL);
+        box1 = css_new_box(s, CSS_ID_NIL, NULL);
         box1->u.buffer.start = box->u.buffer.start;
         box1->u.buffer.end = box->u.buffer.end;
         box1->content_type = box->content_type;
@@ -4509,15 +5192,8 @@ CSSContext *css_new_document(QEditScreen *screen,
 
 void css_delete_document(CSSContext *s)
 {
-    int i;
-    CSSState *props, *props_next;
-
-    for (i = 0; i < PROPS_HASH_SIZE; i++) {
-        for (props = s->hash_props[i]; props != NULL; props = props_next) {
-            props_next = props->hash_next;
-            free_props(props);
-        }
-    }
+    free(s->props_table);
+    css_arena_free(&s->arena);
     if (s->style_sheet) {
         css_free_style_sheet(s->style_sheet);
     }
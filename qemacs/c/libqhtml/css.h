@@ -349,6 +349,10 @@ struct CSSBox {
                                      meaningful during layout */
     unsigned char split:1;        /* true if this box is a splitted box
                                      (no need to free its content) */
+    unsigned char skipped:1;      /* true if not laid out because
+                                     below the lazy layout limit */
+    unsigned char has_style:1;    /* true if style rules were defined
+                                     in its content */
     /* true if there was a space in the previous box (useful in inline
        formatting context) */
     unsigned char last_space;
@@ -358,6 +362,10 @@ struct CSSBox {
     struct CSSBox *next_inline; 
     /* parent box */
     struct CSSBox *parent; 
+    /* edit buffer offsets of the content of an element, between its
+       start and end tags. content_end is -1 if the element was not
+       closed by its end tag */
+    int content_start, content_end;
     union {
         struct {
             struct CSSBox *last;  /* used only when building the tree */
@@ -420,8 +428,7 @@ typedef struct CSSState {
     int top;
     int right;
     int bottom;
-    /* after hash_next, no hashing or bulk comparisons are done */
-    struct CSSState *hash_next;
+    /* after this point, no hashing or bulk comparisons are done */
     /* set of complex properties which are handled once after the
        cascade is done */
     struct CSSProperty *content;
@@ -520,8 +527,21 @@ int get_font_size(int i);
 
 struct CSSContext;
 
-#define PROPS_HASH_SIZE 521
-#define PROPS_SIZE ((int)&((CSSState *)0)->hash_next)
+#define PROPS_SIZE ((int)offsetof(CSSState, content))
+
+/* memory arena: the objects of a document are allocated by bumping a
+   pointer in big blocks, and they are all freed at once when the
+   document is deleted */
+typedef struct CSSArenaBlock CSSArenaBlock;
+
+typedef struct CSSArena {
+    CSSArenaBlock *first_block;
+    unsigned char *ptr, *end; /* free space in the first block */
+} CSSArena;
+
+void *css_arena_alloc(CSSArena *a, int size);
+char *css_arena_strdup(CSSArena *a, const char *str);
+void css_arena_free(CSSArena *a);
 
 typedef struct CSSCounterValue {
     CSSIdent counter_id;
@@ -529,6 +549,19 @@ typedef struct CSSCounterValue {
     struct CSSCounterValue *prev;
 } CSSCounterValue;
 
+/* resume point of a lazy layout: state of a block of the normal flow
+   when the layout stopped in or before its child 'box' */
+#define CSS_MAX_LAYOUT_FRAMES 32
+
+typedef struct CSSLayoutFrame {
+    CSSBox *block_box;
+    CSSBox *box;
+    int x0, y0, y;
+    int is_first_box;
+    int margin_top, last_ymargin;
+    int first_line_baseline, line_count;
+} CSSLayoutFrame;
+
 typedef struct CSSContext {
     CSSStyleSheet *style_sheet;
     QEditScreen *screen;
@@ -551,13 +584,31 @@ typedef struct CSSContext {
     CSSAbortFunc *abort_func;
     void *abort_opaque;
     int nb_props; /* statistics */
+    int has_floats; /* set by css_layout() if floating boxes were found */
+    /* lazy layout: if layout_limit is non zero, css_layout() stops
+       at the first block of the document flow below it. */
+    int layout_limit;
+    int layout_partial; /* set by css_layout() if boxes were skipped */
+    int layout_stop_offset; /* buffer offset of the first skipped text */
+    int layout_absolute; /* set if the box positions were made absolute */
+    /* if non zero, the lazy layout also stops at the first block after
+       this get_clock_usec() time */
+    int64_t layout_deadline;
+    /* where css_layout_resume() continues a partial layout */
+    int nb_layout_frames;
+    CSSLayoutFrame layout_frames[CSS_MAX_LAYOUT_FRAMES];
 
     /* only used during css_compute() */
     CSSCounterValue *counter_stack_ptr;
     CSSCounterValue *counter_stack_base;
 
-    /* css attributes for the boxes are shared here */
-    CSSState *hash_props[PROPS_HASH_SIZE]; 
+    /* css attributes for the boxes are shared here (open addressing
+       hash table, the size is a power of two) */
+    CSSState **props_table;
+    int props_table_size;
+
+    /* boxes, attributes, text strings and css attributes */
+    CSSArena arena;
 } CSSContext;
 
 /* document managing */
@@ -574,6 +625,20 @@ int css_layout(CSSContext *s, CSSBox *box, int width,
 void css_display(CSSContext *s, CSSBox *box, 
                  CSSRect *clip_box, int dx, int dy);
 
+/* incremental layout */
+void css_unsplit_box(CSSBox *box);
+CSSBox *css_find_text_box(CSSBox *box, int offset);
+void css_shift_text_boxes(CSSBox *box, int offset, int delta,
+                          CSSBox *box_except);
+int css_relayout(CSSContext *s, CSSBox *box, int width,
+                 CSSAbortFunc *abort_func, void *abort_opaque);
+int css_layout_resume(CSSContext *s, CSSBox *box,
+                      CSSAbortFunc *abort_func, void *abort_opaque);
+CSSBox *css_get_dirty_block(CSSContext *s, CSSBox *box);
+int css_layout_dirty_block(CSSContext *s, CSSBox *block_box);
+CSSBox *css_find_content_box(CSSBox *box, int offset, int size);
+int css_replace_childs(CSSContext *s, CSSBox *box, CSSBox *box1);
+
 /* cursor/edition handling */
 int box_get_text(CSSContext *s,
                  unsigned int *line_buf, int max_size, 
@@ -590,13 +655,15 @@ int css_box_iterate(CSSContext *s, CSSBox *box, void *opaque,
 
 
 /* box tree handling */
-CSSBox *css_new_box(CSSIdent tag, CSSAttribute *attrs);
+CSSBox *css_new_box(CSSContext *s, CSSIdent tag, CSSAttribute *attrs);
+CSSAttribute *css_new_attr(CSSContext *s, CSSIdent attr_id, 
+                           const char *value);
 CSSBox *css_add_box(CSSBox *parent_box, CSSBox *box);
 void css_delete_box(CSSBox *box);
 void css_set_text_buffer(CSSBox *box,
                          int offset1, int offset2, int eol);
-void css_set_text_string(CSSBox *box, const char *string);
-void css_make_child_box(CSSBox *box);
+void css_set_text_string(CSSContext *s, CSSBox *box, const char *string);
+void css_make_child_box(CSSContext *s, CSSBox *box);
 void css_set_child_box(CSSBox *parent_box, CSSBox *box);
 
 /* box tree display (debug) */
@@ -613,15 +680,18 @@ typedef struct XMLState XMLState;
 #define XML_DOCBOOK     0x0004 /* programlisting is handled as PRE */
 #define XML_HTML_SYNTAX 0x0008 /* modify xml parser to accept HTML syntax */
 
-XMLState *xml_begin(CSSStyleSheet *style_sheet, int flags,
+XMLState *xml_begin(CSSContext *ctx, int flags,
                     CSSAbortFunc *abort_func, void *abort_opaque, 
                     const char *filename, QECharset *charset);
 int xml_parse(XMLState *s, char *buf, int buf_len);
 CSSBox *xml_end(XMLState *s);
 
 CSSBox *xml_parse_buffer(EditBuffer *b, int offset_start, int offset_end, 
-                         CSSStyleSheet *style_sheet, int flags,
+                         CSSContext *ctx, int flags,
                          CSSAbortFunc *abort_func, void *abort_opaque);
+CSSBox *xml_parse_content(EditBuffer *b, CSSBox *box,
+                          CSSContext *ctx, int flags,
+                          CSSAbortFunc *abort_func, void *abort_opaque);
 int find_entity(const char *str);
 const char *find_entity_str(int code);
 #endif
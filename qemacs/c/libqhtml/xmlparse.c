@@ -241,6 +241,7 @@ struct XMLState {
     int html_syntax;
     int ignore_case;
     int flags;
+    CSSContext *ctx; /* the boxes are allocated in its arena */
     CSSStyleSheet *style_sheet; /* if non NULL, all style sheets are
                                    add to that */
     enum XMLParseState state;
@@ -251,6 +252,10 @@ struct XMLState {
     int base_font; /* XXX: is it correct ? */
     int lookahead_size;
     char lookahead_buf[2 * LOOKAHEAD_SIZE];
+    /* edit buffer offsets of the '<' and after the '>' of the current
+       tag, or -1 if not parsing an edit buffer */
+    int tag_start, tag_end;
+    int nb_errors;
     int pretaglen;
     char pretag[32]; /* current tag in XML_STATE_PRETAG */
     StringBuffer str;
@@ -260,7 +265,7 @@ struct XMLState {
 
 /* start xml parsing */
 
-XMLState *xml_begin(CSSStyleSheet *style_sheet, int flags,
+XMLState *xml_begin(CSSContext *ctx, int flags,
                     CSSAbortFunc *abort_func, void *abort_opaque, 
                     const char *filename, QECharset *charset)
 {
@@ -276,12 +281,15 @@ XMLState *xml_begin(CSSStyleSheet *style_sheet, int flags,
     s->ignore_case = flags & XML_IGNORE_CASE;
     s->state = XML_STATE_TEXT;
     s->box = NULL;
-    s->style_sheet = style_sheet;
+    s->ctx = ctx;
+    s->style_sheet = ctx->style_sheet;
     strbuf_init(&s->str);
     s->abort_func = abort_func;
     s->abort_opaque = abort_opaque;
     s->base_font = 3;
     s->line_num = 1;
+    s->tag_start = -1;
+    s->tag_end = -1;
     pstrcpy(s->filename, sizeof(s->filename), filename);
     s->charset = charset;
     if (charset) {
@@ -290,18 +298,6 @@ XMLState *xml_begin(CSSStyleSheet *style_sheet, int flags,
     return s;
 }
 
-static CSSAttribute *box_new_attr(CSSIdent attr_id, const char *value)
-{
-    CSSAttribute *attr;
-    attr = (CSSAttribute*)malloc(sizeof(CSSAttribute) + strlen(value));
-    if (!attr)
-        return NULL;
-    attr->attr = attr_id;
-    attr->next = NULL;
-    strcpy(attr->value, value);
-    return attr;
-}
-
 static const char *css_attr_str(CSSBox *box, CSSIdent attr_id)
 {
     CSSAttribute *attr;
@@ -391,6 +387,13 @@ void html_table_borders(CSSBox *box, int border, int padding)
     }
 }
 
+/* mark 'box' and its parents as defining style rules */
+static void xml_mark_style(CSSBox *box)
+{
+    for (; box != NULL; box = box->parent)
+        box->has_style = 1;
+}
+
 #define DEFAULT_IMG_WIDTH  32
 #define DEFAULT_IMG_HEIGHT 32
 
@@ -495,6 +498,7 @@ static void html_eval_tag(XMLState *s, CSSBox *box)
             add_attribute(&plast_attr, CSS_ID_href, CSS_ATTR_OP_SET, "");
                           
             e = add_style_entry(s->style_sheet, ss, CSS_MEDIA_ALL);
+            xml_mark_style(box->parent);
 
             /* add color property */
             last_prop = &e->props;
@@ -641,7 +645,7 @@ static void html_eval_tag(XMLState *s, CSSBox *box)
         } else {
             CSSAttribute *attr;
             /* NOTE: we add an attribute for css rules */
-            attr = box_new_attr(CSS_ID_type, "text");
+            attr = css_new_attr(s->ctx, CSS_ID_type, "text");
             if (attr) {
                 attr->next = box->attrs;
                 box->attrs = attr;
@@ -661,7 +665,7 @@ static void html_eval_tag(XMLState *s, CSSBox *box)
                attribute ? */
             value = css_attr_str(box, CSS_ID_value);
             if (value) {
-                css_set_text_string(box, value);
+                css_set_text_string(s->ctx, box, value);
             }
         }
         /* size */
@@ -772,6 +776,7 @@ static void xml_error(XMLState *s, const char *fmt, ...)
     vsnprintf(buf, sizeof(buf), fmt, ap);
     css_error(s->filename, s->line_num, buf);
     va_end(ap);
+    s->nb_errors++;
 }
 
 /* XXX: avoid using strings in tag_closed and generalize */
@@ -883,7 +888,7 @@ static int parse_tag(XMLState *s, const char *buf)
         } else {
             value[0] = '\0';
         }
-        attr = box_new_attr(css_new_ident(attr_name), value);
+        attr = css_new_attr(s->ctx, css_new_ident(attr_name), value);
         if (attr) {
             *pattr = attr;
             pattr = &attr->next;
@@ -915,12 +920,13 @@ static int parse_tag(XMLState *s, const char *buf)
     }
     
     /* create the new box and add it */
-    box = css_new_box(css_tag, NULL);
+    box = css_new_box(s->ctx, css_tag, NULL);
     box->attrs = first_attr;
+    box->content_start = s->tag_end;
     if (!s->box) {
         s->root_box = box;
     } else {
-        css_make_child_box(s->box);
+        css_make_child_box(s->ctx, s->box);
         css_add_box(s->box, box);
     }
     s->box = box;
@@ -963,6 +969,8 @@ static int parse_tag(XMLState *s, const char *buf)
                                   css_ident_str(css_tag));
                 } else {
                     html_eval_tag(s, box1);
+                    if (eot)
+                        box1->content_end = s->tag_start;
                     s->box = box1->parent;
                 }
             } else {
@@ -972,6 +980,8 @@ static int parse_tag(XMLState *s, const char *buf)
                 } else {
                     if (s->is_html)
                         html_eval_tag(s, box1);
+                    if (eot)
+                        box1->content_end = s->tag_start;
                     s->box = box1->parent;
                 }
             }
@@ -992,16 +1002,16 @@ static void flush_text(XMLState *s, const char *buf)
     if (buf[0] == '\0')
         return;
 
-    css_make_child_box(box);
+    css_make_child_box(s->ctx, box);
 
     if (box->u.child.first != NULL) {
         /* non empty box: we add an anonymous box */
-        box1 = css_new_box(CSS_ID_NIL, NULL);
+        box1 = css_new_box(s->ctx, CSS_ID_NIL, NULL);
         css_add_box(box, box1);
     } else {
         box1 = box;
     }
-    css_set_text_string(box1, buf);
+    css_set_text_string(s->ctx, box1, buf);
 }
 
 static void flush_text_buffer(XMLState *s, int offset0, int offset1)
@@ -1016,11 +1026,11 @@ static void flush_text_buffer(XMLState *s, int offset0, int offset1)
     if (offset0 >= offset1)
         return;
 
-    css_make_child_box(box);
+    css_make_child_box(s->ctx, box);
 
     if (box->u.child.first != NULL) {
         /* non empty box: we add an anonymous box */
-        box1 = css_new_box(CSS_ID_NIL, NULL);
+        box1 = css_new_box(s->ctx, CSS_ID_NIL, NULL);
         css_add_box(box, box1);
     } else {
         box1 = box;
@@ -1053,7 +1063,7 @@ static int xml_parse_internal(XMLState *s, const char *buf_start, int buf_len,
     offset = offset_start;
     offset_end = offset_start + buf_len;
     offset0 = 0; /* not used */
-    text_offset_start = 0; /* not used */
+    text_offset_start = offset_start;
     for (;;) {
         if (buf) {
             if (buf >= buf_end)
@@ -1076,6 +1086,8 @@ static int xml_parse_internal(XMLState *s, const char *buf_start, int buf_len,
         switch (s->state) {
         case XML_STATE_TAG:
             if (ch == '>') {
+                if (!buf)
+                    s->tag_end = offset;
                 strbuf_addch(&s->str, '\0');
                 ret = parse_tag(s, (char *)s->str.buf);
                 switch (ret) {
@@ -1113,6 +1125,7 @@ static int xml_parse_internal(XMLState *s, const char *buf_start, int buf_len,
                     strbuf_reset(&s->str);
                 } else {
                     flush_text_buffer(s, text_offset_start, offset0);
+                    s->tag_start = offset0;
                 }
                 s->state = XML_STATE_TAG;
             } else {
@@ -1157,6 +1170,7 @@ static int xml_parse_internal(XMLState *s, const char *buf_start, int buf_len,
                     s->str.buf[len] = '\0';
                     
                     if (!xml_tagcmp(s->pretag, "style")) {
+                        xml_mark_style(s->box);
                         if (s->style_sheet) {
                             CSSParseState b1, *b = &b1;
                             b->ptr = (char *)s->str.buf;
@@ -1273,14 +1287,14 @@ CSSBox *xml_end(XMLState *s)
 
 /* XML in edit buffer parsing */
 CSSBox *xml_parse_buffer(EditBuffer *b, int offset_start, int offset_end, 
-                         CSSStyleSheet *style_sheet, int flags,
+                         CSSContext *ctx, int flags,
                          CSSAbortFunc *abort_func, void *abort_opaque)
 {
     XMLState *s;
     CSSBox *box;
     int ret;
 
-    s = xml_begin(style_sheet, flags, abort_func, abort_opaque, b->name, NULL);
+    s = xml_begin(ctx, flags, abort_func, abort_opaque, b->name, NULL);
     ret = xml_parse_internal(s, NULL, offset_end - offset_start, 
                              b, offset_start);
     box = xml_end(s);
@@ -1291,3 +1305,66 @@ CSSBox *xml_parse_buffer(EditBuffer *b, int offset_start, int offset_end,
     return box;
 }
 
+/* parse again the content of the element 'box' from the edit buffer,
+   between its start and end tags. It is returned in a new box with
+   the same tag, or NULL if it cannot be parsed alone (for example if
+   it closes the element or defines style rules): the whole document
+   must then be parsed again. */
+CSSBox *xml_parse_content(EditBuffer *b, CSSBox *box,
+                          CSSContext *ctx, int flags,
+                          CSSAbortFunc *abort_func, void *abort_opaque)
+{
+    XMLState *s;
+    CSSBox *parent, *root, *box1;
+    CSSStyleSheetEntry **plast_entry;
+    int offset, offset_end, ch, ret;
+
+    if (box->content_end < 0)
+        return NULL;
+    /* the borders of the cells are set by the enclosing table */
+    if (flags & XML_HTML) {
+        for (box1 = box->parent; box1 != NULL; box1 = box1->parent) {
+            if (box1->tag == CSS_ID_table)
+                return NULL;
+        }
+    }
+    /* the end tag is also parsed so that the element is closed as in
+       the whole document */
+    offset_end = -1;
+    for (offset = box->content_end; offset < eb_total_size(b);) {
+        ch = eb_nextc(b, offset, &offset);
+        if (ch == '>') {
+            offset_end = offset;
+            break;
+        }
+    }
+    if (offset_end < 0)
+        return NULL;
+
+    s = xml_begin(ctx, flags, abort_func, abort_opaque, b->name, NULL);
+    if (!s)
+        return NULL;
+    /* the new element is put in an anonymous box so that we can
+       check that it is not closed before its end tag */
+    /* XXX: the font size set by a previous basefont is not known */
+    parent = css_new_box(ctx, CSS_ID_NIL, NULL);
+    root = css_new_box(ctx, box->tag, box->attrs);
+    css_add_box(parent, root);
+    root->content_start = box->content_start;
+    s->root_box = parent;
+    s->box = root;
+    plast_entry = ctx->style_sheet->plast_entry;
+    ret = xml_parse_internal(s, NULL, offset_end - box->content_start,
+                             b, box->content_start);
+    if (ret < 0 || s->nb_errors > 0 || s->state != XML_STATE_TEXT ||
+        s->root_box != parent || parent->u.child.first != root ||
+        root->next != NULL || root->content_end != box->content_end ||
+        root->has_style || ctx->style_sheet->plast_entry != plast_entry) {
+        xml_end(s);
+        css_delete_box(parent);
+        return NULL;
+    }
+    xml_end(s);
+    root->parent = NULL;
+    return root;
+}
@@ -119,9 +119,24 @@ void Page::CalcPos(CharsetDecodeState *charset_state)
 Page *Pages::FindPage(int *offset_ptr, int *idx_ptr)
 {
     int offset = *offset_ptr;
-    if (!IsOffsetInCache(offset)) {
+    if (IsOffsetInCache(offset)) {
+        PROF_COUNT(PROF_FIND_PAGE_HIT, 1);
+    } else {
         int idx = 0;
-        Page *p = PageAt(idx);
+        Page *p;
+
+        PROF_COUNT(PROF_FIND_PAGE_MISS, 1);
+        /* start from the cached page when it is closer than the first
+           one, so that sequential accesses do not rescan the table */
+        if (cur_page && offset >= cur_offset / 2) {
+            idx = cur_idx;
+            offset -= cur_offset;
+            while (offset < 0) {
+                p = PageAt(--idx);
+                offset += p->size;
+            }
+        }
+        p = PageAt(idx);
         while (offset >= p->size) {
             offset -= p->size;
             p = PageAt(++idx);
@@ -146,29 +161,69 @@ int Pages::LimitSize(int offset, int size)
     return size;
 }
 
+/* The line and char counts of a page are computed from its data, so
+   a patch must not change them: neither byte can be a newline and, in
+   UTF-8, the new byte must be of the same kind as the old one. The
+   counts of the other multi-byte charsets are not checked: any change
+   leaves patch mode. */
+bool Pages::PatchesKeepCounts(const u8 *data, const u8 *buf, int len)
+{
+    for (int i = 0; i < len; i++) {
+        u8 orig = data[i], ch = buf[i];
+        if (ch == orig)
+            continue;
+        if (patch_charset == PATCH_CHARSET_OTHER ||
+            ch == '\n' || orig == '\n')
+            return false;
+        if (patch_charset == PATCH_CHARSET_UTF8 &&
+            (utf8_length[ch] != utf8_length[orig] ||
+             ((ch & 0xc0) == 0x80) != ((orig & 0xc0) == 0x80)))
+            return false;
+    }
+    return true;
+}
+
 void Pages::ReadWrite(int offset, u8 *buf, int size, int do_write)
 {
-    int len;
+    int len, idx, i;
+    int pos = offset;
+    u8 *buf_start = buf;
+    int size_start = size;
 
-    Page *p = FindPage(&offset);
+    Page *p = FindPage(&offset, &idx);
     while (size > 0) {
         len = p->size - offset;
         if (len > size)
             len = size;
         if (do_write) {
-            p->PrepareForUpdate();
-            memcpy(p->data + offset, buf, len);
+            if (patches && p->read_only &&
+                !PatchesKeepCounts(p->data + offset, buf, len)) {
+                /* leave patch mode rather than give wrong counts */
+                FlushPatches();
+            }
+            if (patches && p->read_only) {
+                /* patch mode: keep the page mapped */
+                p->InvalidateAttrs();
+                for (i = 0; i < len; i++)
+                    SetPatch(pos + i, buf[i], p->data[offset + i]);
+            } else {
+                p->PrepareForUpdate();
+                memcpy(p->data + offset, buf, len);
+            }
         } else {
             memcpy(buf, p->data + offset, len);
         }
         buf += len;
         size -= len;
         offset += len;
-        if (offset >= p->size) {
-            p++;
+        pos += len;
+        if (offset >= p->size && size > 0) {
+            p = PageAt(++idx);
             offset = 0;
         }
     }
+    if (!do_write && patches)
+        ApplyPatches(pos - size_start, buf_start, size_start);
 }
 
 int Pages::Read(int offset, void *buf, int size)
@@ -179,10 +234,160 @@ int Pages::Read(int offset, void *buf, int size)
     return size;
 }
 
+/* return a pointer to the page data at 'offset' without copying it. The
+   number of contiguous bytes available from there (up to the end of
+   the page) is stored in '*len_ptr'. The pointer is only valid until
+   the next modification of the pages. */
+const u8 *Pages::GetSpan(int offset, int *len_ptr)
+{
+    if (offset < 0 || offset >= total_size) {
+        *len_ptr = 0;
+        return NULL;
+    }
+    int pos = offset;
+    Page *p = FindPage(&offset);
+    *len_ptr = p->size - offset;
+    if (patches) {
+        /* stop the span at the next patched byte */
+        int i = FindPatch(pos);
+        if (i < patches->Count()) {
+            PagePatch *pp = patches->AtPtr(i);
+            if (pp->offset == pos) {
+                *len_ptr = 1;
+                return &pp->ch;
+            }
+            if (pp->offset - pos < *len_ptr)
+                *len_ptr = pp->offset - pos;
+        }
+    }
+    return p->data + offset;
+}
+
+/* same as GetSpan, but for the contiguous bytes which end just before
+   'offset': return a pointer to the first of these '*len_ptr' bytes */
+const u8 *Pages::GetSpanBefore(int offset, int *len_ptr)
+{
+    if (offset <= 0 || offset > total_size) {
+        *len_ptr = 0;
+        return NULL;
+    }
+    int pos = offset - 1;
+    int page_offset = pos;
+    Page *p = FindPage(&page_offset);
+    int len = page_offset + 1;
+    if (patches) {
+        /* stop the span after the previous patched byte */
+        int i = FindPatch(offset);
+        if (i > 0) {
+            PagePatch *pp = patches->AtPtr(i - 1);
+            if (pp->offset == pos) {
+                *len_ptr = 1;
+                return &pp->ch;
+            }
+            if (pos - pp->offset < len)
+                len = pos - pp->offset;
+        }
+    }
+    *len_ptr = len;
+    return p->data + page_offset + 1 - len;
+}
+
+/************************************************************/
+/* patch mode */
+
+/* return the index of the first patch at or after 'offset' */
+int Pages::FindPatch(int offset)
+{
+    int lo = 0, hi = patches->Count();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (patches->AtPtr(mid)->offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void Pages::SetPatch(int offset, u8 ch, u8 orig)
+{
+    int i = FindPatch(offset);
+    bool found = (i < patches->Count() && patches->AtPtr(i)->offset == offset);
+
+    if (ch == orig) {
+        /* back to the file contents */
+        if (found)
+            patches->RemoveAt(i);
+    } else if (found) {
+        patches->AtPtr(i)->ch = ch;
+    } else {
+        PagePatch pp;
+        pp.offset = offset;
+        pp.ch = ch;
+        pp.orig = orig;
+        patches->InsertAt(i, &pp);
+    }
+}
+
+void Pages::ApplyPatches(int offset, u8 *buf, int size)
+{
+    PagePatch *pp;
+    for (int i = FindPatch(offset); i < patches->Count(); i++) {
+        pp = patches->AtPtr(i);
+        if (pp->offset >= offset + size)
+            break;
+        buf[pp->offset - offset] = pp->ch;
+    }
+}
+
+/* Enter patch mode: writes into read only pages are recorded in an
+   ordered overlay instead of copying the pages. This is only possible
+   while all the pages still map the file. Insertions and deletions
+   leave patch mode (see FlushPatches), and so do writes which would
+   change the line or char counts (see PatchesKeepCounts). */
+bool Pages::EnablePatches(int charset_kind)
+{
+    patch_charset = charset_kind;
+    if (patches)
+        return true;
+    if (nb_pages() == 0)
+        return false;
+    for (int idx=0; idx < nb_pages(); idx++) {
+        if (!PageAt(idx)->read_only)
+            return false;
+    }
+    patches = new Vec<PagePatch>();
+    return true;
+}
+
+/* leave patch mode: the patched bytes are copied into the pages */
+void Pages::FlushPatches()
+{
+    Vec<PagePatch> *v = patches;
+
+    if (!v)
+        return;
+    patches = NULL;
+    for (int i=0; i < v->Count(); i++) {
+        PagePatch *pp = v->AtPtr(i);
+        ReadWrite(pp->offset, &pp->ch, 1, 1);
+    }
+    delete v;
+}
+
+/* forget the patches once they have been written to the file */
+void Pages::ClearPatches()
+{
+    if (patches)
+        patches->Clear();
+}
+
 void Pages::Delete(int offset, int size)
 {
     int len;
 
+    FlushPatches();
+
     total_size -= size;
     int idx;
     Page *p = FindPage(&offset, &idx);
@@ -255,9 +460,10 @@ void Pages::InsertLowLevel(int offset, const u8 *buf, int size)
 {
     int len, len_out;
     int page_index = -1;
+
+    FlushPatches();
     total_size += size;
     if (offset > 0) {
-        int page_index;
         offset--;
         Page *p = FindPage(&offset, &page_index);
         offset++;
@@ -294,13 +500,57 @@ void Pages::InsertLowLevel(int offset, const u8 *buf, int size)
     VerifySize();
 }
 
-// TODO: this was most likely broken during conversion, got it to crash in dired mode
+/* append a new page made of the malloced 'data' block, which is
+   owned by the page afterwards */
+void Pages::AppendPage(u8 *data, int size)
+{
+    FlushPatches();
+    Page *p = new Page();
+    p->data = data;
+    p->size = size;
+    page_table->InsertAt(nb_pages(), &p);
+    total_size += size;
+}
+
+/* move all the pages of 'src_pages' at the end of these pages */
+void Pages::TakePages(Pages *src_pages)
+{
+    FlushPatches();
+    for (int idx=0; idx < src_pages->nb_pages(); idx++) {
+        Page *p = src_pages->PageAt(idx);
+        page_table->InsertAt(nb_pages(), &p);
+        total_size += p->size;
+    }
+    src_pages->page_table->Clear();
+    src_pages->total_size = 0;
+    src_pages->InvalidateCache();
+    InvalidateCache();
+    VerifySize();
+}
+
 void Pages::InsertFrom(int dest_offset, Pages *src_pages, int src_offset, int size)
 {
     Page *p, *q;
     int size_start, len, n, page_index;
     int p_idx;
 
+    FlushPatches();
+
+    if (src_pages->PatchCount() > 0) {
+        /* the patched bytes are only in the overlay of the source */
+        u8 buf[MAX_PAGE_SIZE];
+        while (size > 0) {
+            len = src_pages->Read(src_offset, buf, min(size, MAX_PAGE_SIZE));
+            if (len <= 0)
+                break;
+            InsertLowLevel(dest_offset, buf, len);
+            src_offset += len;
+            dest_offset += len;
+            size -= len;
+        }
+        return;
+    }
+
     /* insert the data from the first page if it is not completely selected */
     p = src_pages->FindPage(&src_offset, &p_idx);
     if (src_offset > 0) {
@@ -326,7 +576,7 @@ void Pages::InsertFrom(int dest_offset, Pages *src_pages, int src_offset, int si
             /* must reload q because page_table may have been
                realloced */
             q = PageAt(page_index - 1);
-            p->PrepareForUpdate();
+            q->PrepareForUpdate();
             q->data = (u8*)realloc(q->data, dest_offset);
             q->size = dest_offset;
         }
@@ -347,27 +597,25 @@ void Pages::InsertFrom(int dest_offset, Pages *src_pages, int src_offset, int si
 
     if (n > 0) {
         Page **qarr = page_table->MakeSpaceAt(page_index, n);
-        p_idx = p_start;
-        p = src_pages->PageAt(p_idx);
         page_index += n;
-        while (n > 0) {
-            len = p->size;
+        /* 'p' already points to the page holding the remaining bytes */
+        for (int i = 0; i < n; i++) {
+            Page *sp = src_pages->PageAt(p_start + i);
+            len = sp->size;
             q = new Page();
             q->size = len;
-            if (p->read_only) {
+            if (sp->read_only) {
                 /* simply copy the reference */
                 q->read_only = 1;
-                p->InvalidateAttrs();
-                q->data = p->data;
+                sp->InvalidateAttrs();
+                q->data = sp->data;
             } else {
                 /* allocate a new page */
-                p->ClearAttrs();
+                sp->ClearAttrs();
                 q->data = (u8*)malloc(len);
-                memcpy(q->data, p->data, len);
+                memcpy(q->data, sp->data, len);
             }
-            n--;
-            p = src_pages->PageAt(++p_idx);
-            q++;
+            qarr[i] = q;
         }
     }
     
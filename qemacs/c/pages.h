@@ -59,6 +59,22 @@ public:
 
 };
 
+/* a byte overwritten in patch mode. It is kept out of the (read only,
+   mmapped) page data until the patches are saved or flushed */
+struct PagePatch {
+    int     offset;
+    u8      ch;   /* patched value */
+    u8      orig; /* value in the page data */
+};
+
+/* charset of the buffer in patch mode: which byte changes keep the
+   line and char counts of the pages (see PatchesKeepCounts) */
+enum {
+    PATCH_CHARSET_8BIT,   /* one char per byte */
+    PATCH_CHARSET_UTF8,
+    PATCH_CHARSET_OTHER,  /* multi-byte: any change leaves patch mode */
+};
+
 class Pages {
 
 private:
@@ -74,6 +90,11 @@ private:
     }
 
     void Insert(int page_index, const u8 *buf, int size);
+
+    int  FindPatch(int offset);
+    void SetPatch(int offset, u8 ch, u8 orig);
+    void ApplyPatches(int offset, u8 *buf, int size);
+    bool PatchesKeepCounts(const u8 *data, const u8 *buf, int len);
     
 public:
     PtrVec<Page> *page_table;
@@ -93,14 +114,21 @@ public:
 
     int     total_size; /* sum of Page.size in page_table */
 
+    /* patch mode overlay, sorted by offset. NULL if not in patch mode */
+    Vec<PagePatch> *patches;
+    int     patch_charset; /* PATCH_CHARSET_xxx */
+
     Pages() {
         cur_page = NULL;
         total_size = 0;
         page_table = new PtrVec<Page>();
+        patches = NULL;
+        patch_charset = PATCH_CHARSET_OTHER;
     }
 
     ~Pages() {
         delete page_table;
+        delete patches;
     }
 
     int nb_pages() { return page_table->Count(); }
@@ -119,8 +147,22 @@ public:
     void Delete(int offset, int size);
     void ReadWrite(int offset, u8 *buf, int size, int do_write);
     int  Read(int offset, void *buf, int size);
+    const u8 *GetSpan(int offset, int *len_ptr);
+    const u8 *GetSpanBefore(int offset, int *len_ptr);
     void InsertLowLevel(int offset, const u8 *buf, int size);
     void InsertFrom(int dest_offset, Pages *src_pages, int src_offset, int size);
+    void AppendPage(u8 *data, int size);
+    void TakePages(Pages *src_pages);
+
+    bool EnablePatches(int charset_kind);
+    void FlushPatches();
+    void ClearPatches();
+    int  PatchCount() {
+        return patches ? patches->Count() : 0;
+    }
+    PagePatch *PatchAt(int idx) {
+        return patches->AtPtr(idx);
+    }
 
     int  GetCharOffset(int offset, QECharset *charset);
     int  GotoChar(QECharset *charset, int pos);
@@ -0,0 +1,307 @@
+/*
+ * Profiling and tracing of the editor hot paths for QEmacs.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "qe.h"
+#include "json.h"
+
+/* maximum number of events kept in a trace */
+#define PROF_TRACE_MAX  (1 << 20)
+
+int64_t prof_counters[PROF_COUNTER_NB];
+int prof_enabled;
+
+ProfileScope prof_scope_flush = { "dpy_flush", 0, 0, 0, NULL, 0 };
+
+const char * const prof_counter_names[PROF_COUNTER_NB] = {
+    "find_page_hit",
+    "find_page_miss",
+    "colorize_lines",
+    "glyphs_measured",
+    "bytes_flushed",
+    "lines_drawn",
+    "lines_skipped",
+};
+
+typedef struct ProfileEvent {
+    const char *name;
+    int64_t ts;         /* start time */
+    int64_t dur;        /* duration, or value of the counter */
+    int counter;        /* counter index, -1 for a timed scope */
+} ProfileEvent;
+
+static ProfileScope *prof_first_scope;
+static int prof_tracing;
+static ProfileEvent *prof_events;
+static int prof_nb_events;
+static int prof_events_size;
+static int prof_dropped;
+static int64_t prof_start_time;
+static int64_t prof_stop_time;
+/* counter values when profiling started */
+static int64_t prof_base[PROF_COUNTER_NB];
+/* counter values last recorded in the trace */
+static int64_t prof_sampled[PROF_COUNTER_NB];
+
+static void prof_add_event(const char *name, int64_t ts, int64_t dur,
+                           int counter)
+{
+    ProfileEvent *ev;
+    int n;
+
+    if (prof_nb_events >= prof_events_size) {
+        if (prof_events_size >= PROF_TRACE_MAX) {
+            prof_dropped++;
+            return;
+        }
+        n = prof_events_size + (prof_events_size >> 1) + 1024;
+        if (n > PROF_TRACE_MAX)
+            n = PROF_TRACE_MAX;
+        ev = (ProfileEvent*)realloc(prof_events, n * sizeof(ProfileEvent));
+        if (!ev) {
+            prof_dropped++;
+            return;
+        }
+        prof_events = ev;
+        prof_events_size = n;
+    }
+    ev = &prof_events[prof_nb_events++];
+    ev->name = name;
+    ev->ts = ts;
+    ev->dur = dur;
+    ev->counter = counter;
+}
+
+void prof_end(ProfileScope *scope, const char *name, int64_t start)
+{
+    int64_t dur;
+
+    dur = get_clock_usec() - start;
+    if (!scope->registered) {
+        scope->registered = 1;
+        scope->next = prof_first_scope;
+        prof_first_scope = scope;
+    }
+    scope->count++;
+    scope->total += dur;
+    if (dur > scope->max)
+        scope->max = dur;
+    if (prof_tracing)
+        prof_add_event(name ? name : scope->name, start, dur, -1);
+}
+
+void prof_sample_counters(void)
+{
+    int64_t now;
+    int i;
+
+    if (!prof_tracing)
+        return;
+    now = get_clock_usec();
+    for (i = 0; i < PROF_COUNTER_NB; i++) {
+        if (prof_counters[i] != prof_sampled[i]) {
+            prof_sampled[i] = prof_counters[i];
+            prof_add_event(prof_counter_names[i], now,
+                           prof_counters[i] - prof_base[i], i);
+        }
+    }
+}
+
+static void do_profile_start(EditState *s)
+{
+    ProfileScope *scope;
+
+    for (scope = prof_first_scope; scope != NULL; scope = scope->next) {
+        scope->count = 0;
+        scope->total = 0;
+        scope->max = 0;
+    }
+    memcpy(prof_base, prof_counters, sizeof(prof_base));
+    memcpy(prof_sampled, prof_counters, sizeof(prof_sampled));
+    prof_nb_events = 0;
+    prof_dropped = 0;
+    prof_start_time = get_clock_usec();
+    prof_stop_time = 0;
+    prof_enabled = 1;
+    prof_tracing = 1;
+    put_status(s, "Profiling started");
+}
+
+static void do_profile_stop(EditState *s)
+{
+    if (!prof_enabled) {
+        put_status(s, "Profiling is not started");
+        return;
+    }
+    prof_sample_counters();
+    prof_enabled = 0;
+    prof_tracing = 0;
+    prof_stop_time = get_clock_usec();
+    put_status(s, "Profiling stopped: %d events", prof_nb_events);
+}
+
+static int prof_scope_sort_func(const void *p1, const void *p2)
+{
+    const ProfileScope *s1 = *(const ProfileScope **)p1;
+    const ProfileScope *s2 = *(const ProfileScope **)p2;
+
+    if (s1->total != s2->total)
+        return s1->total < s2->total ? 1 : -1;
+    return strcmp(s1->name, s2->name);
+}
+
+/* show the counters and the scope statistics of the current or last
+   profiling session */
+static void do_profile_report(EditState *s)
+{
+    ProfileScope *scope, **scopes;
+    EditBuffer *b;
+    int64_t elapsed, hits, misses;
+    int i, n;
+
+    if (!prof_start_time) {
+        put_status(s, "No profile: use profile-start");
+        return;
+    }
+    b = eb_find("*profile*");
+    if (b) {
+        b->flags &= ~BF_READONLY;
+        eb_delete(b, 0, eb_total_size(b));
+    } else {
+        b = eb_new("*profile*", 0);
+        if (!b)
+            return;
+    }
+
+    elapsed = (prof_stop_time ? prof_stop_time : get_clock_usec())
+        - prof_start_time;
+    eb_printf(b, "Profile of %.3f s%s\n\n", (double)elapsed / 1e6,
+              prof_enabled ? " (running)" : "");
+
+    eb_printf(b, "%-24s %14s\n", "Counter", "Value");
+    for (i = 0; i < PROF_COUNTER_NB; i++) {
+        eb_printf(b, "%-24s %14lld\n", prof_counter_names[i],
+                  (long long)(prof_counters[i] - prof_base[i]));
+    }
+    hits = prof_counters[PROF_FIND_PAGE_HIT] - prof_base[PROF_FIND_PAGE_HIT];
+    misses = prof_counters[PROF_FIND_PAGE_MISS] -
+        prof_base[PROF_FIND_PAGE_MISS];
+    if (hits + misses > 0) {
+        eb_printf(b, "%-24s %13.1f%%\n", "find_page_hit_rate",
+                  100.0 * hits / (hits + misses));
+    }
+    /* the X11 and Win32 drivers draw through their libraries and
+       cannot tell how much data a flush sends */
+    eb_printf(b, "(bytes_flushed is only counted by the tty display)\n");
+
+    n = 0;
+    for (scope = prof_first_scope; scope != NULL; scope = scope->next)
+        n++;
+    scopes = n ? (ProfileScope**)malloc(n * sizeof(ProfileScope *)) : NULL;
+    if (scopes) {
+        n = 0;
+        for (scope = prof_first_scope; scope != NULL; scope = scope->next) {
+            if (scope->count)
+                scopes[n++] = scope;
+        }
+        qsort(scopes, n, sizeof(ProfileScope *), prof_scope_sort_func);
+        eb_printf(b, "\n%-24s %10s %12s %10s %10s\n",
+                  "Scope", "Count", "Total ms", "Avg us", "Max us");
+        for (i = 0; i < n; i++) {
+            scope = scopes[i];
+            eb_printf(b, "%-24s %10lld %12.3f %10lld %10lld\n",
+                      scope->name, (long long)scope->count,
+                      (double)scope->total / 1000.0,
+                      (long long)(scope->total / scope->count),
+                      (long long)scope->max);
+        }
+        free(scopes);
+    }
+
+    eb_printf(b, "\n%d trace events", prof_nb_events);
+    if (prof_dropped)
+        eb_printf(b, ", %d dropped", prof_dropped);
+    eb_printf(b, "\n");
+
+    b->modified = 0;
+    b->flags |= BF_READONLY;
+    switch_to_buffer(s, b);
+    s->offset = 0;
+}
+
+/* write the trace in the Chrome trace event format */
+static void do_profile_write_trace(EditState *s, const char *filename)
+{
+    json_doc *doc;
+    json_object *root, *events, *ev, *args;
+    ProfileEvent *p;
+    int i, ok;
+
+    if (!prof_start_time) {
+        put_status(s, "No profile: use profile-start");
+        return;
+    }
+    doc = json_doc_new();
+    if (!doc) {
+        put_status(s, "Out of memory");
+        return;
+    }
+    root = json_new_object(doc);
+    events = json_new_array(doc);
+    json_object_add(root, "traceEvents", events);
+    json_object_add(root, "displayTimeUnit", json_new_string(doc, "ms"));
+    for (i = 0; i < prof_nb_events; i++) {
+        p = &prof_events[i];
+        ev = json_new_object(doc);
+        json_object_add(ev, "name", json_new_string(doc, p->name));
+        json_object_add(ev, "pid", json_new_int(doc, 1));
+        json_object_add(ev, "tid", json_new_int(doc, 1));
+        json_object_add(ev, "ts",
+                        json_new_double(doc, (double)(p->ts - prof_start_time)));
+        if (p->counter < 0) {
+            json_object_add(ev, "cat", json_new_string(doc, "qe"));
+            json_object_add(ev, "ph", json_new_string(doc, "X"));
+            json_object_add(ev, "dur", json_new_double(doc, (double)p->dur));
+        } else {
+            json_object_add(ev, "ph", json_new_string(doc, "C"));
+            args = json_new_object(doc);
+            json_object_add(args, "value", json_new_double(doc, (double)p->dur));
+            json_object_add(ev, "args", args);
+        }
+        json_array_add(events, ev);
+    }
+    ok = json_to_file(filename, root);
+    json_doc_free(doc);
+    if (!ok)
+        put_status(s, "Could not write '%s'", filename);
+    else
+        put_status(s, "Wrote %d trace events to '%s'", prof_nb_events,
+                   filename);
+}
+
+static CmdDef profile_commands[] = {
+    CMD0( KEY_NONE, KEY_NONE, "profile-start", do_profile_start)
+    CMD0( KEY_NONE, KEY_NONE, "profile-stop", do_profile_stop)
+    CMD0( KEY_NONE, KEY_NONE, "profile-report", do_profile_report)
+    CMD_( KEY_NONE, KEY_NONE, "profile-write-trace", do_profile_write_trace,
+          "s{Write trace file: }[file]|file|")
+    CMD_DEF_END,
+};
+
+void module_profile_init(void)
+{
+    qe_register_cmd_table(profile_commands, NULL);
+}
@@ -0,0 +1,68 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+/* Assumes qe.h has already been included */
+
+/* Instrumentation of the editor hot paths.
+ *
+ * Counters are plain global integers, always incremented because it
+ * costs next to nothing. Timed scopes only read the clock while
+ * profiling is on: each one adds its duration to the statistics of the
+ * scope and, while tracing, records an event for the Chrome trace
+ * viewer (chrome://tracing or https://ui.perfetto.dev).
+ *
+ *     PROF_SCOPE(prof_layout, "css_layout");
+ *     int64_t t;
+ *
+ *     PROF_BEGIN(t);
+ *     ...
+ *     PROF_END(prof_layout, t);
+ */
+
+enum {
+    PROF_FIND_PAGE_HIT,     /* Pages::FindPage served by the page cache */
+    PROF_FIND_PAGE_MISS,    /* Pages::FindPage walked the page table */
+    PROF_COLORIZE_LINES,    /* lines passed to a colorize function */
+    PROF_GLYPHS_MEASURED,   /* glyphs measured with text_metrics() */
+    PROF_BYTES_FLUSHED,     /* bytes written to the terminal (tty only) */
+    PROF_LINES_DRAWN,       /* lines drawn by the redisplay */
+    PROF_LINES_SKIPPED,     /* lines skipped by the QELineShadow check */
+    PROF_COUNTER_NB
+};
+
+extern int64_t prof_counters[PROF_COUNTER_NB];
+extern const char * const prof_counter_names[PROF_COUNTER_NB];
+
+#define PROF_COUNT(id, n)  (prof_counters[id] += (n))
+
+typedef struct ProfileScope {
+    const char *name;
+    int64_t count;
+    int64_t total;          /* microseconds */
+    int64_t max;
+    struct ProfileScope *next;  /* list of the scopes used so far */
+    int registered;
+} ProfileScope;
+
+#define PROF_SCOPE(scope, name) \
+    static ProfileScope scope = { name, 0, 0, 0, NULL, 0 }
+
+extern int prof_enabled;
+
+/* 't' is 0 when profiling is off */
+#define PROF_BEGIN(t)  ((t) = prof_enabled ? get_clock_usec() : 0)
+#define PROF_END(scope, t) \
+    do { if (t) prof_end(&(scope), NULL, t); } while (0)
+/* same, naming the trace event differently from the scope. 'name'
+   must stay allocated, as command names do */
+#define PROF_END_NAME(scope, name, t) \
+    do { if (t) prof_end(&(scope), name, t); } while (0)
+
+void prof_end(ProfileScope *scope, const char *name, int64_t start);
+
+/* record the counters in the trace, at the end of a redisplay */
+void prof_sample_counters(void);
+
+extern ProfileScope prof_scope_flush;
+
+#endif
@@ -60,8 +60,11 @@ int S_ISREG(int mode)
     return 0;
 }
 
+int fnmatch(const char *pattern, const char *string, int flags);
+
 #else
 #include <limits.h>
+#include <fnmatch.h>
 #define  MAX_PATH    PATH_MAX
 #endif
 
@@ -92,6 +95,7 @@ static void display1(DisplayState *s);
 static void save_selection(void);
 static CompletionFunc find_completion(const char *name);
 static int dummy_dpy_init(QEditScreen *s, int w, int h);
+static void bidir_cache_free(EditState *s);
 
 QEmacsState qe_state;
 static ModeDef *first_mode = NULL;
@@ -104,6 +108,8 @@ static int screen_width = 0;
 static int screen_height = 0;
 EditBuffer *trace_buffer;
 int no_init_file;
+static const char *bench_keys_file;
+static const char *bench_json_file;
 const char *user_option;
 
 /* mode handling */
@@ -172,20 +178,280 @@ static ModeDef *find_mode(const char *mode_name)
 
 /* commands handling */
 
-CmdDef *qe_find_cmd(const char *cmd_name)
+/* command name index: open addressing hash table of the registered
+   commands, the first registered command wins as with the linear
+   search of the command tables */
+static CmdDef **cmd_table;
+static int cmd_table_size;
+static int nb_cmd_table;
+
+static unsigned int cmd_hash(const char *name)
 {
-    CmdDef *d = first_cmd;
-    while (d != NULL) {
-        while (d->name != NULL) {
-            if (!strcmp(cmd_name, d->name))
-                return d;
-            d++;
+    unsigned int h = 0;
+
+    while (*name)
+        h = h * 31 + (unsigned char)*name++;
+    return h;
+}
+
+static void cmd_table_insert(CmdDef *d)
+{
+    CmdDef **table;
+    int i, size;
+    unsigned int h;
+
+    if (2 * (nb_cmd_table + 1) > cmd_table_size) {
+        size = cmd_table_size ? 2 * cmd_table_size : 512;
+        table = (CmdDef **)calloc(size, sizeof(CmdDef *));
+        if (!table)
+            return;
+        for (i = 0; i < cmd_table_size; i++) {
+            if (cmd_table[i]) {
+                h = cmd_hash(cmd_table[i]->name) & (size - 1);
+                while (table[h])
+                    h = (h + 1) & (size - 1);
+                table[h] = cmd_table[i];
+            }
         }
-        d = d->action.next;
+        free(cmd_table);
+        cmd_table = table;
+        cmd_table_size = size;
+    }
+    h = cmd_hash(d->name) & (cmd_table_size - 1);
+    while (cmd_table[h]) {
+        if (!strcmp(cmd_table[h]->name, d->name))
+            return;
+        h = (h + 1) & (cmd_table_size - 1);
+    }
+    cmd_table[h] = d;
+    nb_cmd_table++;
+}
+
+CmdDef *qe_find_cmd(const char *cmd_name)
+{
+    CmdDef *d;
+    unsigned int h;
+
+    if (!cmd_table)
+        return NULL;
+    h = cmd_hash(cmd_name) & (cmd_table_size - 1);
+    while ((d = cmd_table[h]) != NULL) {
+        if (!strcmp(cmd_name, d->name))
+            return d;
+        h = (h + 1) & (cmd_table_size - 1);
     }
     return NULL;
 }
 
+/* key binding index: each keymap (one per mode and a global one) is
+   a trie whose edges are stored in a single open addressing hash
+   table keyed by (node, key). The root of a mode keymap is found in
+   the same table under its ModeDef pointer. Resolving a key sequence
+   thus costs one probe per key whatever the number of bindings. The
+   KeyDef list remains the reference and the tries are rebuilt from it
+   when keys are remapped. */
+typedef struct KeyNode {
+    CmdDef *cmd;            /* command bound to the sequence ending here */
+    int nb_children;
+    struct KeyNode *next;   /* list of all the nodes */
+} KeyNode;
+
+typedef struct KeyEdge {
+    const void *parent;     /* KeyNode, or ModeDef for the roots */
+    unsigned int key;
+    KeyNode *child;
+} KeyEdge;
+
+static KeyNode *global_keymap;
+static KeyNode *first_key_node;
+static KeyEdge *key_edges;
+static int key_edges_size;
+static int nb_key_edges;
+
+static inline unsigned int key_edge_hash(const void *parent, unsigned int key)
+{
+    return ((unsigned int)((unsigned long)parent >> 3) * 0x9e3779b1) ^
+        (key * 0x85ebca6b);
+}
+
+static KeyNode *key_edge_find(const void *parent, unsigned int key)
+{
+    KeyEdge *e;
+    unsigned int h;
+
+    if (!key_edges)
+        return NULL;
+    h = key_edge_hash(parent, key) & (key_edges_size - 1);
+    for (;;) {
+        e = &key_edges[h];
+        if (!e->parent)
+            return NULL;
+        if (e->parent == parent && e->key == key)
+            return e->child;
+        h = (h + 1) & (key_edges_size - 1);
+    }
+}
+
+static KeyNode *key_node_new(void)
+{
+    KeyNode *n;
+
+    n = (KeyNode*)malloc(sizeof(KeyNode));
+    if (!n)
+        return NULL;
+    n->cmd = NULL;
+    n->nb_children = 0;
+    n->next = first_key_node;
+    first_key_node = n;
+    return n;
+}
+
+/* find the child of 'parent' for 'key', creating it if needed */
+static KeyNode *key_edge_add(const void *parent, unsigned int key)
+{
+    KeyEdge *edges, *e;
+    KeyNode *n;
+    int i, size;
+    unsigned int h;
+
+    n = key_edge_find(parent, key);
+    if (n)
+        return n;
+
+    if (2 * (nb_key_edges + 1) > key_edges_size) {
+        size = key_edges_size ? 2 * key_edges_size : 1024;
+        edges = (KeyEdge*)calloc(size, sizeof(KeyEdge));
+        if (!edges)
+            return NULL;
+        for (i = 0; i < key_edges_size; i++) {
+            e = &key_edges[i];
+            if (e->parent) {
+                h = key_edge_hash(e->parent, e->key) & (size - 1);
+                while (edges[h].parent)
+                    h = (h + 1) & (size - 1);
+                edges[h] = *e;
+            }
+        }
+        free(key_edges);
+        key_edges = edges;
+        key_edges_size = size;
+    }
+    n = key_node_new();
+    if (!n)
+        return NULL;
+    h = key_edge_hash(parent, key) & (key_edges_size - 1);
+    while (key_edges[h].parent)
+        h = (h + 1) & (key_edges_size - 1);
+    e = &key_edges[h];
+    e->parent = parent;
+    e->key = key;
+    e->child = n;
+    nb_key_edges++;
+    return n;
+}
+
+/* root of the keymap of mode 'm' (NULL for the global keymap) */
+static KeyNode *keymap_root(ModeDef *m, int create)
+{
+    if (!m) {
+        if (!global_keymap && create)
+            global_keymap = key_node_new();
+        return global_keymap;
+    }
+    if (create)
+        return key_edge_add(m, KEY_NONE);
+    return key_edge_find(m, KEY_NONE);
+}
+
+static void keymap_add(KeyDef *p)
+{
+    KeyNode *n, *child;
+    int i;
+
+    n = keymap_root(p->mode, 1);
+    for (i = 0; n && i < p->nb_keys; i++) {
+        child = key_edge_find(n, p->keys[i]);
+        if (!child) {
+            child = key_edge_add(n, p->keys[i]);
+            n->nb_children++;
+        }
+        n = child;
+    }
+    /* the last binding of a sequence wins */
+    if (n)
+        n->cmd = p->cmd;
+}
+
+/* find the node of the sequence 'keys' in keymap of mode 'm' */
+static KeyNode *keymap_find(ModeDef *m, const unsigned int *keys, int nb_keys)
+{
+    KeyNode *n;
+    int i;
+
+    n = keymap_root(m, 0);
+    for (i = 0; n && i < nb_keys; i++)
+        n = key_edge_find(n, keys[i]);
+    return n;
+}
+
+/* find the node of 'keys' in the keymap of mode 'm', falling back to
+   the global keymap */
+static KeyNode *qe_find_keys(ModeDef *m, const unsigned int *keys, int nb_keys)
+{
+    KeyNode *n = NULL;
+
+    if (m)
+        n = keymap_find(m, keys, nb_keys);
+    if (!n)
+        n = keymap_find(NULL, keys, nb_keys);
+    return n;
+}
+
+static void free_keymaps(void)
+{
+    KeyNode *n, *next;
+
+    for (n = first_key_node; n != NULL; n = next) {
+        next = n->next;
+        free(n);
+    }
+    first_key_node = NULL;
+    global_keymap = NULL;
+    free(key_edges);
+    key_edges = NULL;
+    key_edges_size = 0;
+    nb_key_edges = 0;
+}
+
+/* rebuild the keymaps from the KeyDef list. Mode keys are inserted
+   at the head of the list and global keys at its tail, so the list is
+   walked backwards for the mode keys to preserve registration order. */
+static void rebuild_keymaps(void)
+{
+    KeyDef *p, **tab;
+    int i, n;
+
+    free_keymaps();
+    n = 0;
+    for (p = first_key; p != NULL; p = p->next)
+        n++;
+    tab = (KeyDef**)malloc(n * sizeof(KeyDef *) + 1);
+    if (!tab)
+        return;
+    n = 0;
+    for (p = first_key; p != NULL; p = p->next)
+        tab[n++] = p;
+    for (i = n - 1; i >= 0; i--) {
+        if (tab[i]->mode)
+            keymap_add(tab[i]);
+    }
+    for (i = 0; i < n; i++) {
+        if (!tab[i]->mode)
+            keymap_add(tab[i]);
+    }
+    free(tab);
+}
+
 void free_keys()
 {
     KeyDef *k = first_key;
@@ -194,6 +460,8 @@ void free_keys()
         free(k);
         k = next;
     }
+    first_key = NULL;
+    free_keymaps();
 }
 
 static int qe_register_binding1(unsigned int *keys, int nb_keys, CmdDef *d, ModeDef *m)
@@ -218,6 +486,7 @@ static int qe_register_binding1(unsigned int *keys, int nb_keys, CmdDef *d, Mode
         p->next = first_key;
         first_key = p;
     }
+    keymap_add(p);
     return 0;
 }
 
@@ -279,6 +548,7 @@ void do_toggle_control_h(EditState *s, int set)
             }
         }
     }
+    rebuild_keymaps();
 }
 
 void do_set_emulation(EditState *s, const char *name)
@@ -333,6 +603,10 @@ void free_cmds()
         }
         d = next;
     }
+    free(cmd_table);
+    cmd_table = NULL;
+    cmd_table_size = 0;
+    nb_cmd_table = 0;
 }
 
 /* if mode is non NULL, the defined keys are only active in this mode */
@@ -360,6 +634,7 @@ void qe_register_cmd_table(CmdDef *cmds, const char *mode)
     /* add default bindings */
     d = cmds;
     while (d->name != NULL) {
+        cmd_table_insert(d);
 #ifdef WIN32
         if (0) {
 #else
@@ -1382,8 +1657,6 @@ static void quote_key(void *opaque, int key)
     if (!KEY_SPECIAL(key) ||
         (key >= 0 && key <= 31)) {
         do_char(s, key);
-        edit_display(qs);
-        dpy_flush(&global_screen);
     }
     qe_ungrab_keys();
 }
@@ -1460,6 +1733,7 @@ EditBuffer *new_yank_buffer(void)
 
 void do_kill_region(EditState *s, int kill)
 {
+    EBReader r1, *r = &r1;
     int len, p1, p2, tmp, offset1;
     QEmacsState *qs = s->qe_state;
     EditBuffer *b;
@@ -1473,10 +1747,11 @@ void do_kill_region(EditState *s, int kill)
         if (eb_nextc(s->b, p2, &offset1) == '\n') {
             p1 = offset1;
         } else {
-            p1 = p2;
-            while (eb_nextc(s->b, p1, &offset1) != '\n') {
-                p1 = offset1;
-            }
+            /* stop before the end of line */
+            eb_reader_init(r, s->b, p2);
+            do {
+                p1 = r->offset;
+            } while (eb_readc(r) != '\n');
         }
     } else {
         /* kill/copy region */
@@ -1597,6 +1872,7 @@ static void do_set_mode_file(EditState *s, ModeDef *m, ModeSavedData *saved_data
                 saved_data_allocated = 1;
         }
         s->mode->mode_close(s);
+        bidir_cache_free(s);
         free(s->mode_data);
         s->mode_data = NULL;
         s->mode = NULL;
@@ -1723,30 +1999,17 @@ void do_convert_buffer_file_coding_system(EditState *s,
                                           const char *charset_str)
 {
     QECharset *charset;
-    EditBuffer *b1, *b;
-    int offset, c, len;
-    char buf[MAX_CHAR_BYTES];
+    EditBuffer *b;
     
     charset = read_charset(s, charset_str);
     if (!charset)
         return;
 
-    b1 = eb_new("*tmp*", BF_SYSTEM);
-
-    /* well, not very fast, but simple */
+    /* undone in a single step */
     b = s->b;
-    for (offset = 0; offset < eb_total_size(b);) {
-        c = eb_nextc(b, offset, &offset);
-        len = unicode_to_charset(buf, c, charset);
-        eb_write(b1, eb_total_size(b1), buf, len);
-    }
-    
-    /* replace current buffer with convertion */
-    eb_delete(b, 0, eb_total_size(b));
-    eb_insert_buffer(b, 0, b1, 0, eb_total_size(b1));
-
-    eb_free(b1);
-    eb_set_charset(b, charset);
+    eb_begin_undo_group(b);
+    eb_convert_charset(b, charset);
+    eb_end_undo_group(b);
 }
 
 void do_toggle_bidir(EditState *s)
@@ -2329,7 +2592,9 @@ static void flush_line(DisplayState *s,
             ls->height == line_height &&
             ls->crc == crc) {
             /* no display needed */
+            PROF_COUNT(PROF_LINES_SKIPPED, 1);
         } else {
+            PROF_COUNT(PROF_LINES_DRAWN, 1);
 #if 0
             printf("old=%d %d %d %d\n",
                    ls->y, ls->x_start, ls->height, ls->crc);
@@ -2727,16 +2992,13 @@ int display_char_bidir(DisplayState *s, int offset1, int offset2,
 void display_printhex(DisplayState *s, int offset1, int offset2, 
                       unsigned int h, int n)
 {
+    static const char hex_digits[] = "0123456789abcdef";
     int i, v;
     EditState *e = s->edit_state;
     
     s->cur_hex_mode = 1;
     for (i = 0; i < n; i++) {
-        v = (h >> ((n - i - 1) * 4)) & 0xf;
-        if (v >= 10)
-            v += 'a' - 10;
-        else
-            v += '0';
+        v = hex_digits[(h >> ((n - i - 1) * 4)) & 0xf];
         /* XXX: simplistic */
         if (e->hex_nibble == i) {
             display_char(s, offset1, offset2, v);
@@ -2816,38 +3078,90 @@ int text_backward_offset(EditState *s, int offset)
 }
 
 #ifdef CONFIG_UNICODE_JOIN
-/* max_size should be >= 2 */
-static int bidir_compute_attributes(TypeLink *list_tab, int max_size, 
+
+/* The bidir run lists of the displayed lines are cached, keyed by
+   line start offset, so that redisplaying a line (e.g. on cursor
+   motion) does not run the bidir algorithm again. The buffer
+   modification callback drops the modified lines and shifts the lines
+   after them. */
+
+#define BIDIR_CACHE_BITS 7
+#define BIDIR_CACHE_SIZE (1 << BIDIR_CACHE_BITS)
+
+typedef struct BidirLine {
+    int offset;       /* line start, -1 if the slot is free */
+    int end_offset;   /* offset of the end of line */
+    int nb_embeds;    /* 0 if the line has a single LTR run */
+    int embeds_size;
+    TypeLink *embeds;
+    FriBidiCharType base;
+    int embedding_max_level;
+} BidirLine;
+
+typedef struct BidirCache {
+    EditBuffer *b;
+    BidirLine lines[BIDIR_CACHE_SIZE];
+} BidirCache;
+
+/* compute the runs of the line starting at 'offset' into the growable
+   array '*list_tab_ptr'. Return the number of runs, including the
+   starting and ending links. */
+static int bidir_compute_attributes(TypeLink **list_tab_ptr,
+                                    int *max_size_ptr,
                                     EditBuffer *b, int offset)
 {
-    TypeLink *p;
+    EBReader r1, *r = &r1;
+    TypeLink *p, *list_tab;
     FriBidiCharType type, ltype;
-    int left, offset1;
+    int n, max_size, offset1;
     unsigned int c;
 
+    list_tab = *list_tab_ptr;
+    max_size = *max_size_ptr;
+    if (max_size < 16) {
+        max_size = 16;
+        p = (TypeLink*)realloc(list_tab, max_size * sizeof(TypeLink));
+        if (!p)
+            return 0;
+        list_tab = p;
+    }
+
     p = list_tab;
     /* Add the starting link */
     p->type = FRIBIDI_TYPE_SOT;
     p->len = 0;
     p->pos = 0;
     p++;
-    left = max_size - 2;
 
     ltype = FRIBIDI_TYPE_SOT;
 
+    eb_reader_init(r, b, offset);
     for (;;) {
-        offset1 = offset;
-        c = eb_nextc(b, offset, &offset);
+        offset1 = r->offset;
+        c = eb_readc(r);
         if (c == '\n')
             break;
         type = fribidi_get_type(c);
-        /* if not enough room, increment last link */
-        if (type != ltype && left > 0) {
+        if (type != ltype) {
+            /* keep room for the ending link */
+            n = p - list_tab;
+            if (n + 2 > max_size) {
+                TypeLink *list_tab1;
+                list_tab1 = (TypeLink*)realloc(list_tab, 2 * max_size *
+                                               sizeof(TypeLink));
+                if (!list_tab1) {
+                    /* if not enough room, increment last link */
+                    p[-1].len++;
+                    continue;
+                }
+                list_tab = list_tab1;
+                max_size *= 2;
+                p = list_tab + n;
+            }
             p->type = type;
             p->pos = offset1;
             p->len = 1;
             p++;
-            left--;
             ltype = type;
         } else {
             p[-1].len++;
@@ -2860,8 +3174,114 @@ static int bidir_compute_attributes(TypeLink *list_tab, int max_size,
     p->pos = offset1;
     p++;
 
+    *list_tab_ptr = list_tab;
+    *max_size_ptr = max_size;
     return p - list_tab;
 }
+
+static void bidir_cache_callback(EditBuffer *b, void *opaque,
+                                 enum LogOperation op,
+                                 int offset, int size)
+{
+    EditState *s = (EditState*)opaque;
+    BidirCache *c = s->bidir_cache;
+    BidirLine *l;
+    int i, j, delta, end;
+
+    if (!c)
+        return;
+    delta = 0;
+    end = offset + size;
+    switch (op) {
+    case LOGOP_INSERT:
+        delta = size;
+        end = offset;
+        break;
+    case LOGOP_DELETE:
+        delta = -size;
+        break;
+    default:
+        break;
+    }
+    for (i = 0; i < BIDIR_CACHE_SIZE; i++) {
+        l = &c->lines[i];
+        if (l->offset < 0 || l->end_offset < offset)
+            continue;
+        if (l->offset <= end) {
+            /* the line itself is modified */
+            l->offset = -1;
+        } else if (delta != 0) {
+            /* the line is after the modification: it only moves */
+            l->offset += delta;
+            l->end_offset += delta;
+            for (j = 0; j < l->nb_embeds; j++)
+                l->embeds[j].pos += delta;
+        }
+    }
+}
+
+static BidirLine *bidir_cache_get(EditState *s, int offset)
+{
+    BidirCache *c = s->bidir_cache;
+    BidirLine *l;
+    int i, n;
+
+    if (!c) {
+        c = (BidirCache*)malloc(sizeof(BidirCache));
+        if (!c)
+            return NULL;
+        memset(c, 0, sizeof(BidirCache));
+        for (i = 0; i < BIDIR_CACHE_SIZE; i++)
+            c->lines[i].offset = -1;
+        c->b = s->b;
+        s->bidir_cache = c;
+        eb_add_callback(s->b, bidir_cache_callback, s);
+    }
+    l = &c->lines[((unsigned int)offset * 0x9e3779b1) >> 
+                  (32 - BIDIR_CACHE_BITS)];
+    if (l->offset == offset)
+        return l;
+
+    /* compute the embedding levels and rle encode them */
+    n = bidir_compute_attributes(&l->embeds, &l->embeds_size, s->b, offset);
+    /* the ending link holds the end of line offset */
+    l->end_offset = (n >= 2) ? l->embeds[n - 1].pos : offset;
+    if (n > 2) {
+        l->base = FRIBIDI_TYPE_WL;
+        fribidi_analyse_string(l->embeds, &l->base, &l->embedding_max_level);
+        /* assure that base has only two possible values */
+        if (l->base != FRIBIDI_TYPE_RTL)
+            l->base = FRIBIDI_TYPE_LTR;
+        /* the list is compacted in place: shifting all the n links
+           is harmless */
+        l->nb_embeds = n;
+    } else {
+        l->nb_embeds = 0;
+    }
+    l->offset = offset;
+    return l;
+}
+
+static void bidir_cache_free(EditState *s)
+{
+    BidirCache *c = s->bidir_cache;
+    int i;
+
+    if (!c)
+        return;
+    eb_free_callback(c->b, bidir_cache_callback, s);
+    for (i = 0; i < BIDIR_CACHE_SIZE; i++)
+        free(c->lines[i].embeds);
+    free(c);
+    s->bidir_cache = NULL;
+}
+
+#else
+
+static void bidir_cache_free(EditState *s)
+{
+}
+
 #endif
 
 /************************************************************/
@@ -2908,6 +3328,8 @@ int get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
         offset = eb_goto_pos(s->b, s->colorize_nb_valid_lines - 1, 0);
         colorize_state = s->colorize_states[s->colorize_nb_valid_lines - 1];
 
+        PROF_COUNT(PROF_COLORIZE_LINES,
+                   line_num - s->colorize_nb_valid_lines + 1);
         for (l = s->colorize_nb_valid_lines; l <= line_num; l++) {
             len = eb_get_line(s->b, buf, buf_size - 1, &offset);
             buf[len] = '\n';
@@ -2924,6 +3346,7 @@ int get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
 
     colorize_state = s->colorize_states[line_num];
     s->colorize_func(buf, len, &colorize_state, 0);
+    PROF_COUNT(PROF_COLORIZE_LINES, 1);
     
     s->colorize_states[line_num + 1] = colorize_state;
 
@@ -2963,14 +3386,17 @@ void set_colorize_func(EditState *s, ColorizeFunc colorize_func)
     }
 }
                           
-#define RLE_EMBEDDINGS_SIZE    128
 #define COLORED_MAX_LINE_SIZE  1024
 
 int text_display(EditState *s, DisplayState *ds, int offset)
 {
+    EBReader r1, *r = &r1;
     int c;
     int offset0, offset1, line_num, col_num;
-    TypeLink embeds[RLE_EMBEDDINGS_SIZE], *bd;
+    TypeLink embeds_ltr[3], *embeds, *bd;
+#ifdef CONFIG_UNICODE_JOIN
+    BidirLine *bl;
+#endif
     int embedding_level, embedding_max_level;
     FriBidiCharType base;
     unsigned int colored_chars[COLORED_MAX_LINE_SIZE];
@@ -2985,14 +3411,12 @@ int text_display(EditState *s, DisplayState *ds, int offset)
     
 #ifdef CONFIG_UNICODE_JOIN
     if (s->bidir) {
-        /* compute the embedding levels and rle encode them */
-        if (bidir_compute_attributes(embeds, RLE_EMBEDDINGS_SIZE,
-                                     s->b, offset) > 2) {
-            base = FRIBIDI_TYPE_WL;
-            fribidi_analyse_string(embeds, &base, &embedding_max_level);
-            /* assure that base has only two possible values */
-            if (base != FRIBIDI_TYPE_RTL)
-                base = FRIBIDI_TYPE_LTR;
+        /* get the embedding levels from the line cache */
+        bl = bidir_cache_get(s, offset);
+        if (bl && bl->nb_embeds > 0) {
+            embeds = bl->embeds;
+            base = bl->base;
+            embedding_max_level = bl->embedding_max_level;
         } else {
             goto no_bidir;
         }
@@ -3004,6 +3428,7 @@ int text_display(EditState *s, DisplayState *ds, int offset)
 #endif
         /* all line is at embedding level 0 */
         embedding_max_level = 0;
+        embeds = embeds_ltr;
         embeds[1].level = 0;
         embeds[2].pos = 0x7fffffff;
         base = FRIBIDI_TYPE_LTR;
@@ -3036,6 +3461,7 @@ int text_display(EditState *s, DisplayState *ds, int offset)
     
     bd = embeds + 1;
     char_index = 0;
+    eb_reader_init(r, s->b, offset);
     for (;;) {
         offset0 = offset;
         if (offset >= eb_total_size(s->b)) {
@@ -3043,7 +3469,8 @@ int text_display(EditState *s, DisplayState *ds, int offset)
             offset = -1; /* signal end of text */
             break;
         } else {
-            c = eb_nextc(s->b, offset, &offset);
+            c = eb_readc(r);
+            offset = r->offset;
             if (c == '\n') {
                 display_eol(ds, offset0, offset);
                 break;
@@ -3370,6 +3797,7 @@ void exec_command(EditState *s, CmdDef *d, int argval)
         argdesc++;
         if (s->b->flags & BF_READONLY) {
             put_status(s, "Buffer is read only");
+            s->qe_state->macro_failed = s->qe_state->macro_headless;
             return;
         }
     }
@@ -3395,6 +3823,7 @@ void exec_command(EditState *s, CmdDef *d, int argval)
 /* parse as much arguments as possible. ask value to user if possible */
 static void parse_args(ExecCmdState *es)
 {
+    PROF_SCOPE(prof_command, "command");
     EditState *s = es->s;
     QEmacsState *qs = s->qe_state;
     CmdDef *d = es->d;
@@ -3403,6 +3832,7 @@ static void parse_args(ExecCmdState *es)
     char history[32];
     unsigned char arg_type;
     int ret, rep_count, no_arg;
+    int64_t t;
 
     for (;;) {
         ret = parse_arg(&es->ptype, &arg_type, 
@@ -3487,7 +3917,9 @@ static void parse_args(ExecCmdState *es)
         save_selection();
         /* CG: Should save and restore ec context */
         qs->ec.function = d->name;
+        PROF_BEGIN(t);
         call_func(d->action.func, es->nb_args, es->args, es->args_type);
+        PROF_END_NAME(prof_command, d->name, t);
         /* CG: This doesn't work if the function needs input */
         /* CG: Should test for abort condition */
         /* CG: Should follow qs->active_window ? */
@@ -3579,13 +4011,34 @@ void window_display(EditState *s)
     display_window_borders(s);
 }
 
+/* display the last status message if it changed */
+static void display_status_line(QEmacsState *qs)
+{
+    if (qs->status_invalid || strcmp(qs->status_buf, qs->status_shadow) != 0) {
+        print_at_byte(qs->screen,
+                      0, qs->screen->height - qs->status_height,
+                      qs->screen->width, qs->status_height,
+                      qs->status_buf, QE_STYLE_STATUS);
+        strcpy(qs->status_shadow, qs->status_buf);
+        qs->status_invalid = 0;
+    }
+}
+
 /* display all windows */
 /* XXX: should use correct clipping to avoid popups display hacks */
 void edit_display(QEmacsState *qs)
 {
+    PROF_SCOPE(prof_display, "edit_display");
     EditState *s;
     int has_popups;
+    int64_t t;
     
+    /* deferred until the end of the macro */
+    if (qs->macro_headless)
+        return;
+
+    PROF_BEGIN(t);
+
     /* first call hooks for mode specific fixups */
     for (s = qs->first_window; s != NULL; s = s->next_window) {
         if (s->mode->display_hook)
@@ -3601,6 +4054,10 @@ void edit_display(QEmacsState *qs)
         }
     }
 
+    /* the minibuffer covers the status line: draw the status first so
+       that a refresh of the whole screen does not hide the prompt */
+    display_status_line(qs);
+
     /* refresh normal windows and minibuf with popup kludge */
     for (s = qs->first_window; s != NULL; s = s->next_window) {
         if (!(s->flags & WF_POPUP) &&
@@ -3620,6 +4077,8 @@ void edit_display(QEmacsState *qs)
     }
 
     qs->complete_refresh = 0;
+    PROF_END(prof_display, t);
+    prof_sample_counters();
 }
 
 void do_universal_argument(EditState *s)
@@ -3679,9 +4138,29 @@ void do_end_macro(EditState *s)
     put_status(s, "Keyboard macro defined");
 }
 
-static void do_call_macro_bh(void *opaque)
+/* macro execution parameters: the macro is run macro_repeat times (0
+   means until failure), or once per line of the region */
+static int macro_repeat;
+static int macro_region_lines;
+/* maximum number of runs of a repeated macro */
+#define MACRO_MAX_RUNS  1000000
+/* last status message of the macro execution */
+static char macro_status[MAX_SCREEN_WIDTH];
+
+static int buffer_exists(QEmacsState *qs, EditBuffer *b)
+{
+    EditBuffer *b1;
+
+    for (b1 = qs->first_buffer; b1 != NULL; b1 = b1->next) {
+        if (b1 == b)
+            return 1;
+    }
+    return 0;
+}
+
+/* replay the macro keys once. Return -1 if a key failed. */
+static int macro_run_once(QEmacsState *qs)
 {
-    QEmacsState *qs = &qe_state;
     int key;
 
     /* XXX: what to do if asynchronous commands ? Command completion
@@ -3691,11 +4170,133 @@ static void do_call_macro_bh(void *opaque)
          qs->macro_key_index++) {
         key = qs->macro_keys[qs->macro_key_index];
         qe_key_process(key);
+        if (qs->macro_failed)
+            break;
     }
     qs->macro_key_index = -1;
+    return qs->macro_failed ? -1 : 0;
+}
+
+/* The display is not updated during a headless run, so the top of
+   the window would stay where the run started and the motion
+   commands, which walk the text from offset_top, would get slower at
+   each run. Keep the top of the window at the cursor line instead. */
+static void macro_sync_window(EditState *s)
+{
+    if (!s->mode->text_display || !s->mode->text_backward_offset)
+        return;
+    s->offset_top = s->mode->text_backward_offset(s, s->offset);
+    s->y_disp = 0;
+}
+
+static void do_call_macro_bh(void *opaque)
+{
+    QEmacsState *qs = &qe_state;
+    EditState *s = qs->active_window;
+    EditBuffer *b = s->b;
+    int n, offset, size, log_index, line_offset, end_offset, interrupted;
+
+    /* the display is only updated at the end of the run, and all the
+       modifications are undone in a single step */
+    qs->macro_headless = 1;
+    qs->macro_failed = 0;
+    macro_status[0] = '\0';
+    eb_begin_undo_group(b);
+
+    n = 0;
+    interrupted = 0;
+    if (macro_region_lines) {
+        /* the line starts are tracked across the modifications */
+        line_offset = eb_goto_bol(b, min(s->offset, b->mark));
+        end_offset = max(s->offset, b->mark);
+        eb_add_callback(b, eb_offset_callback, &line_offset);
+        eb_add_callback(b, eb_offset_callback, &end_offset);
+        while (line_offset < end_offset) {
+            /* any key typed stops the run */
+            if (n > 0 && is_user_input_pending()) {
+                interrupted = 1;
+                break;
+            }
+            s->offset = line_offset;
+            if (macro_run_once(qs) < 0)
+                break;
+            n++;
+            if (!buffer_exists(qs, b))
+                break;
+            macro_sync_window(qs->active_window);
+            offset = eb_next_line(b, line_offset);
+            if (offset <= line_offset)
+                break;
+            line_offset = offset;
+        }
+        if (buffer_exists(qs, b)) {
+            eb_free_callback(b, eb_offset_callback, &line_offset);
+            eb_free_callback(b, eb_offset_callback, &end_offset);
+        }
+    } else {
+        while (macro_repeat == 0 || n < macro_repeat) {
+            if (n > 0 && (is_user_input_pending() || n >= MACRO_MAX_RUNS)) {
+                interrupted = 1;
+                break;
+            }
+            s = qs->active_window;
+            offset = s->offset;
+            size = eb_total_size(s->b);
+            log_index = s->b->log_new_index;
+            if (macro_run_once(qs) < 0)
+                break;
+            n++;
+            /* stop repeating when the macro does not make progress */
+            if (macro_repeat == 0 && s == qs->active_window &&
+                s->offset == offset && eb_total_size(s->b) == size &&
+                s->b->log_new_index == log_index)
+                break;
+            if (macro_repeat != 1)
+                macro_sync_window(qs->active_window);
+        }
+    }
+
+    if (buffer_exists(qs, b))
+        eb_end_undo_group(b);
+    qs->macro_headless = 0;
+
+    s = qs->active_window;
+    if (qs->macro_failed) {
+        put_status(s, "%s (macro stopped after %d runs)", macro_status, n);
+    } else if (interrupted) {
+        put_status(s, "Macro interrupted after %d runs", n);
+    } else if (macro_repeat != 1 || macro_region_lines) {
+        put_status(s, "Macro executed %d times", n);
+    } else if (macro_status[0] != '\0') {
+        put_status(s, "%s", macro_status);
+    }
+    do_refresh(s);
+    if (macro_repeat != 1 || macro_region_lines)
+        center_cursor(s);
+    edit_display(qs);
+    dpy_flush(&global_screen);
+}
+
+/* run the last macro 'argval' times, until failure if argval is 0 */
+void do_call_macro(EditState *s, int argval)
+{
+    QEmacsState *qs = s->qe_state;
+
+    if (qs->defining_macro) {
+        qs->defining_macro = 0;
+        put_status(s, "Can't execute macro while defining one");
+        return;
+    }
+
+    if (qs->nb_macro_keys > 0) {
+        macro_repeat = (argval == NO_ARG || argval < 0) ? 1 : argval;
+        macro_region_lines = 0;
+        register_bottom_half(do_call_macro_bh, NULL);
+    }
 }
 
-void do_call_macro(EditState *s)
+/* run the last macro at the start of each line of the region */
+void do_apply_macro_to_region_lines(EditState *s)
 {
     QEmacsState *qs = s->qe_state;
 
@@ -3706,6 +4307,8 @@ void do_call_macro(EditState *s)
     }
 
     if (qs->nb_macro_keys > 0) {
+        macro_repeat = 1;
+        macro_region_lines = 1;
         register_bottom_half(do_call_macro_bh, NULL);
     }
 }
@@ -3825,14 +4428,19 @@ static void qe_key_process(int key)
     QEmacsState *qs = &qe_state;
     QEKeyContext *c = &key_ctx;
     EditState *s;
-    KeyDef *kd;
+    KeyNode *kn;
     CmdDef *d;
     char buf1[128];
+    unsigned int def_key;
     int len;
 
     if (qs->defining_macro) {
         macro_add_key(key);
     }
+    /* the display is updated once the input batch is processed (see
+       qe_handle_event()) */
+    if (!qs->macro_headless)
+        qs->display_pending = 1;
     
 again:
     if (c->grab_key_cb) {
@@ -3853,9 +4461,8 @@ again:
 
     c->keys[c->nb_keys++] = key;
     s = qs->active_window;
-    if (!s->minibuf) {
+    if (!s->minibuf && !qs->macro_headless) {
         put_status(s, "");
-        dpy_flush(&global_screen);
     }
 
     /* special case for escape : we transform it as meta so
@@ -3872,16 +4479,10 @@ again:
     }
 
     /* see if one command is found */
-    for (kd = first_key; kd != NULL; kd = kd->next) {
-        if (kd->nb_keys >= c->nb_keys) {
-            if (!memcmp(kd->keys, c->keys, 
-                        c->nb_keys * sizeof(unsigned int)) && 
-                (kd->mode == NULL || kd->mode == s->mode)) {
-                break;
-            }
-        }
-    }
-    if (!kd) {
+    kn = qe_find_keys(s->mode, c->keys, c->nb_keys);
+    if (kn && !kn->cmd && !kn->nb_children)
+        kn = NULL;
+    if (!kn) {
         /* no key found */
         if (c->nb_keys == 1) {
             if (!KEY_SPECIAL(key)) {
@@ -3898,17 +4499,12 @@ again:
                         goto next;
                     }
                 }
-                for (kd = first_key; kd != NULL; kd = kd->next) {
-                    if (kd->nb_keys == 1 &&
-                        kd->keys[0] == KEY_DEFAULT &&
-                        (kd->mode == NULL || kd->mode == s->mode)) {
-                        break;
-                    }
-                }
-                if (kd) {
+                def_key = KEY_DEFAULT;
+                kn = qe_find_keys(s->mode, &def_key, 1);
+                if (kn && kn->cmd) {
                     /* horrible kludge to pass key as intrinsic argument */
                     /* CG: should have an argument type for key */
-                    kd->cmd->val = (void *)key;
+                    kn->cmd->val = (void *)key;
                     goto exec_cmd;
                 }
             }
@@ -3920,11 +4516,12 @@ again:
                    keys_to_str(buf1, sizeof(buf1), c->keys, c->nb_keys));
         c->describe_key = 0;
         qe_key_init();
-        dpy_flush(&global_screen);
+        if (qs->macro_headless)
+            qs->macro_failed = 1;
         return;
-    } else if (c->nb_keys == kd->nb_keys) {
+    } else if (kn->cmd) {
     exec_cmd:
-        d = kd->cmd;
+        d = kn->cmd;
         if (d->action.func == (void *)do_universal_argument && 
             !c->describe_key) {
             /* special handling for universal argument */
@@ -3948,8 +4545,6 @@ again:
                 exec_command(s, d, c->argval);
             }
             qe_key_init();
-            edit_display(qs);
-            dpy_flush(&global_screen);
             /* CG: should move ungot key handling to generic event dispatch */
             if (qs->ungot_key != -1) {
                 key = qs->ungot_key;
@@ -3961,7 +4556,7 @@ again:
     }
  next:
     /* display key pressed */
-    if (!s->minibuf) {
+    if (!s->minibuf && !qs->macro_headless) {
         /* Should print argument if any in a more readable way */
         keytostr(buf1, sizeof(buf1), key);
         len = strlen(c->buf);
@@ -3970,7 +4565,6 @@ again:
         strcat(c->buf, buf1);
         strcat(c->buf, "-");
         put_status(s, "%s", c->buf);
-        dpy_flush(&global_screen);
     }
 }
 
@@ -4058,13 +4652,17 @@ void put_status(EditState *s, const char *fmt, ...)
     vsnprintf(buf, sizeof(buf), fmt, ap);
     va_end(ap);
 
-    if (qs->screen->dpy.dpy_init != dummy_dpy_init) {
-        if (strcmp(buf, qs->status_shadow) != 0) {
-            print_at_byte(qs->screen,
-                          0, qs->screen->height - qs->status_height,
-                          qs->screen->width, qs->status_height,
-                          buf, QE_STYLE_STATUS);
-            strcpy(qs->status_shadow, buf);
+    if (qs->macro_headless) {
+        /* only the last message is displayed after the macro */
+        if (buf[0] != '\0')
+            pstrcpy(macro_status, sizeof(macro_status), buf);
+        return;
+    }
+
+    if (qs->screen->dpy.dpy_init != dummy_dpy_init || bench_keys_file) {
+        /* the status line is drawn by the next edit_display() */
+        if (strcmp(buf, qs->status_buf) != 0) {
+            strcpy(qs->status_buf, buf);
             p = buf;
             skip_spaces(&p);
             if (*p)
@@ -4255,56 +4853,519 @@ void edit_close(EditState *s)
 const char *file_completion_ignore_extensions =
     "|bak|bin|dll|exe|o|obj|";
 
-void file_completion(StringArray *cs, const char *input)
-{
-    FindFileState *ffs;
-    char path[MAX_FILENAME_SIZE];
-    char file[MAX_FILENAME_SIZE];
-    char filename[MAX_FILENAME_SIZE];
-    const char *base, *ext;
+static EditState *completion_popup_window = NULL;
+
+/* File name completion index.
+ *
+ * Directory listings are cached filtered and sorted, so that completing
+ * in a large directory does not read and stat it again on each key
+ * stroke. A listing is trusted as long as the modification time of the
+ * directory is unchanged and older than the listing itself.
+ */
+#define FILE_CACHE_SIZE  16
+
+typedef struct FileCacheDir {
+    char dir[MAX_FILENAME_SIZE];    /* absolute path, "" if unused */
+    const char *ignore;             /* extension filter of the listing */
+    time_t mtime;
+    time_t scan_time;
+    int last_use;
+    int nb_names;
+    char **names;       /* sorted, directories end with DIR_SEP_CHAR */
+    char *pool;
+} FileCacheDir;
+
+static FileCacheDir file_cache[FILE_CACHE_SIZE];
+static int file_cache_clock;
+
+/* return TRUE if 'base' should not be offered for completion */
+static int file_completion_ignore(const char *base)
+{
+    const char *ext;
     int len;
 
-    splitpath(path, sizeof(path), file, sizeof(file), input);
-    pstrcat(file, sizeof(file), "*");
+    /* ignore . and .. to force direct match if
+     * single entry in directory */
+    if (!strcmp(base, ".") || !strcmp(base, ".."))
+        return 1;
+    /* ignore known backup files */
+    len = strlen(base);
+    if (!len || base[len - 1] == '~')
+        return 1;
+    /* ignore known output file extensions */
+    ext = extension(base);
+    if (*ext && strfind(file_completion_ignore_extensions, ext + 1, 1))
+        return 1;
+    return 0;
+}
 
-    if (*path)
-        ffs = find_file_open(path, file);
-    else
-        ffs = find_file_open(".", file);
+/* file names are not case sensitive on Windows */
+#ifdef WIN32
+#define file_name_cmp(s1, s2)       _stricmp(s1, s2)
+#define file_name_ncmp(s1, s2, n)   _strnicmp(s1, s2, n)
+#else
+#define file_name_cmp(s1, s2)       strcmp(s1, s2)
+#define file_name_ncmp(s1, s2, n)   strncmp(s1, s2, n)
+#endif
+
+static int file_cache_sort_func(const void *p1, const void *p2)
+{
+    return file_name_cmp(*(char **)p1, *(char **)p2);
+}
+
+static void file_cache_clear(FileCacheDir *fc)
+{
+    free(fc->names);
+    free(fc->pool);
+    memset(fc, 0, sizeof(*fc));
+}
 
+static void file_cache_scan(FileCacheDir *fc)
+{
+    FindFileState *ffs;
+    char filename[MAX_FILENAME_SIZE];
+    const char *base;
+    char *pool, *tmp;
+    int *offsets, *otmp;
+    int len, pool_len, pool_size, nb, size, i;
+
+    free(fc->names);
+    free(fc->pool);
+    fc->names = NULL;
+    fc->pool = NULL;
+    fc->nb_names = 0;
+
+    ffs = find_file_open(fc->dir, "*");
     if (!ffs)
         return;
 
+    pool = NULL;
+    pool_len = pool_size = 0;
+    offsets = NULL;
+    nb = size = 0;
     while (find_file_next(ffs, filename, sizeof(filename)) == 0) {
         struct stat sb;
 
         base = basename(filename);
-        /* ignore . and .. to force direct match if
-         * single entry in directory */
-        if (!strcmp(base, ".") || !strcmp(base, ".."))
+        if (file_completion_ignore(base))
             continue;
-        /* ignore known backup files */
         len = strlen(base);
-        if (!len || base[len - 1] == '~')
-            continue;
-        /* ignore known output file extensions */
-        ext = extension(base);
-        if (*ext && strfind(file_completion_ignore_extensions, ext + 1, 1))
-            continue;
-
+        if (pool_len + len + 2 > pool_size) {
+            pool_size = pool_size + (pool_size >> 1) + len + 4096;
+            tmp = (char*)realloc(pool, pool_size);
+            if (!tmp)
+                break;
+            pool = tmp;
+        }
+        if (nb >= size) {
+            size = size + (size >> 1) + 64;
+            otmp = (int*)realloc(offsets, size * sizeof(int));
+            if (!otmp)
+                break;
+            offsets = otmp;
+        }
+        offsets[nb++] = pool_len;
+        memcpy(pool + pool_len, base, len);
+        pool_len += len;
         /* stat the file to find out if it's a directory.
          * In that case add a slash to speed up typing long paths
          */
-        if (0 == stat(filename, &sb))
-        {
-            if (S_ISDIR(sb.st_mode))
-                pstrcat(filename, sizeof(filename), DIR_SEP_STR);
-        }
-        add_string(cs, filename);
+        if (stat(filename, &sb) == 0 && S_ISDIR(sb.st_mode))
+            pool[pool_len++] = DIR_SEP_CHAR;
+        pool[pool_len++] = '\0';
     }
-
     find_file_close(ffs);
-}
+
+    if (nb > 0) {
+        fc->names = (char**)malloc(nb * sizeof(char *));
+        if (fc->names) {
+            for (i = 0; i < nb; i++)
+                fc->names[i] = pool + offsets[i];
+            qsort(fc->names, nb, sizeof(char *), file_cache_sort_func);
+            fc->nb_names = nb;
+            fc->pool = pool;
+            pool = NULL;
+        }
+    }
+    free(offsets);
+    free(pool);
+}
+
+/* return the up to date listing of directory 'dir' or NULL */
+static FileCacheDir *file_cache_get(const char *dir)
+{
+    char path[MAX_FILENAME_SIZE];
+    FileCacheDir *fc, *fc1;
+    struct stat st;
+    int i;
+
+    canonize_absolute_path(path, sizeof(path), dir);
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    fc = NULL;
+    for (i = 0; i < FILE_CACHE_SIZE; i++) {
+        fc1 = &file_cache[i];
+        if (!strcmp(fc1->dir, path)) {
+            fc = fc1;
+            break;
+        }
+        /* recycle the least recently used entry */
+        if (!fc || fc1->last_use < fc->last_use)
+            fc = fc1;
+    }
+    fc->last_use = ++file_cache_clock;
+    if (!strcmp(fc->dir, path)
+    &&  fc->ignore == file_completion_ignore_extensions
+    &&  fc->mtime == st.st_mtime
+    &&  fc->scan_time > st.st_mtime) {
+        return fc;
+    }
+    if (strcmp(fc->dir, path)) {
+        file_cache_clear(fc);
+        fc->last_use = file_cache_clock;
+        pstrcpy(fc->dir, sizeof(fc->dir), path);
+    }
+    /* the directory may still change during the second of the scan:
+       such a listing is read again next time */
+    fc->scan_time = time(NULL);
+    fc->mtime = st.st_mtime;
+    fc->ignore = file_completion_ignore_extensions;
+    file_cache_scan(fc);
+    return fc;
+}
+
+void file_completion(StringArray *cs, const char *input)
+{
+    FileCacheDir *fc;
+    char path[MAX_FILENAME_SIZE];
+    char file[MAX_FILENAME_SIZE];
+    char filename[MAX_FILENAME_SIZE];
+    int len, lo, hi, mid, i;
+
+    splitpath(path, sizeof(path), file, sizeof(file), input);
+
+    fc = file_cache_get(*path ? path : ".");
+    if (!fc)
+        return;
+
+    if (strpbrk(file, "*?[")) {
+        /* wildcards: match the pattern against the whole listing */
+        pstrcat(file, sizeof(file), "*");
+        for (i = 0; i < fc->nb_names; i++) {
+            if (fnmatch(file, fc->names[i], 0) == 0) {
+                makepath(filename, sizeof(filename), path, fc->names[i]);
+                add_string(cs, filename);
+            }
+        }
+        return;
+    }
+
+    /* binary search the first name with prefix 'file' */
+    len = strlen(file);
+    lo = 0;
+    hi = fc->nb_names;
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if (file_name_cmp(fc->names[mid], file) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (i = lo; i < fc->nb_names; i++) {
+        if (file_name_ncmp(fc->names[i], file, len))
+            break;
+        makepath(filename, sizeof(filename), path, fc->names[i]);
+        add_string(cs, filename);
+    }
+}
+
+/* Project file index.
+ *
+ * The files below the project root are listed by a timer, a few
+ * milliseconds at a time, so that the editor stays responsive while a
+ * large tree is read. A refresh is built next to the current list,
+ * which stays in use until the new one is complete.
+ */
+#define PROJECT_INDEX_MAX       200000
+#define PROJECT_INDEX_SLICE     10      /* ms of scanning per timer call */
+#define PROJECT_INDEX_REFRESH   250     /* ms between candidate updates */
+#define PROJECT_COMPLETION_MAX  256
+
+typedef struct ProjectIndex {
+    char root[MAX_FILENAME_SIZE];
+    StringArray files;      /* complete list, relative to root */
+    StringArray building;   /* list being built */
+    StringArray dirs;       /* directories to scan, relative to root */
+    int dir_pos;
+    int last_refresh;
+    int ready;              /* 'files' holds a complete list */
+    QETimer *timer;
+} ProjectIndex;
+
+static ProjectIndex project_index;
+
+/* incremented when completion candidates may have changed without a
+   change of the minibuffer input */
+static int completion_serial;
+
+static const char * const project_markers[] = {
+    ".git", ".hg", ".svn", "_darcs", NULL,
+};
+
+/* the project root of the buffer of 's': the closest parent directory
+   with a version control directory, or the directory of the file */
+static void project_get_root(char *buf, int buf_size, EditState *s)
+{
+    char path[MAX_FILENAME_SIZE];
+    char probe[MAX_FILENAME_SIZE];
+    struct stat st;
+    char *base;
+    int i;
+
+    splitpath(path, sizeof(path), NULL, 0, s->b->filename);
+    canonize_absolute_path(buf, buf_size, *path ? path : ".");
+    pstrcpy(path, sizeof(path), buf);
+    for (;;) {
+        for (i = 0; project_markers[i]; i++) {
+            makepath(probe, sizeof(probe), path, project_markers[i]);
+            if (stat(probe, &st) == 0) {
+                pstrcpy(buf, buf_size, path);
+                return;
+            }
+        }
+        base = (char *)basename(path);
+        if (base == path || *base == '\0')
+            break;
+        if (base == path + 1)
+            *base = '\0';
+        else
+            base[-1] = '\0';
+    }
+}
+
+static void project_index_scan_dir(ProjectIndex *pi, const char *dir)
+{
+    FindFileState *ffs;
+    char path[MAX_FILENAME_SIZE];
+    char filename[MAX_FILENAME_SIZE];
+    char relname[MAX_FILENAME_SIZE];
+    const char *base;
+
+    makepath(path, sizeof(path), pi->root, dir);
+    ffs = find_file_open(path, "*");
+    if (!ffs)
+        return;
+    while (find_file_next(ffs, filename, sizeof(filename)) == 0) {
+        struct stat st;
+
+        base = basename(filename);
+        /* skip hidden files and version control directories */
+        if (base[0] == '.' || file_completion_ignore(base))
+            continue;
+#ifdef WIN32
+        if (stat(filename, &st) < 0)
+            continue;
+#else
+        /* do not follow symbolic links to avoid loops */
+        if (lstat(filename, &st) < 0)
+            continue;
+#endif
+        makepath(relname, sizeof(relname), dir, base);
+        if (S_ISDIR(st.st_mode)) {
+            add_string(&pi->dirs, relname);
+        } else {
+            if (pi->building.nb_items >= PROJECT_INDEX_MAX)
+                break;
+            add_string(&pi->building, relname);
+        }
+    }
+    find_file_close(ffs);
+}
+
+static void project_index_timer(void *opaque)
+{
+    ProjectIndex *pi = (ProjectIndex*)opaque;
+    QEmacsState *qs = &qe_state;
+    int start, now;
+
+    pi->timer = NULL;
+    start = get_clock_ms();
+    now = start;
+    while (pi->dir_pos < pi->dirs.nb_items
+       &&  pi->building.nb_items < PROJECT_INDEX_MAX) {
+        project_index_scan_dir(pi, pi->dirs.items[pi->dir_pos++]->str);
+        now = get_clock_ms();
+        if (now - start >= PROJECT_INDEX_SLICE)
+            break;
+    }
+
+    if (pi->dir_pos < pi->dirs.nb_items
+    &&  pi->building.nb_items < PROJECT_INDEX_MAX) {
+        pi->timer = qe_add_timer(0, pi, project_index_timer);
+        /* partial lists are only searched until a first one is complete */
+        if (pi->ready || now - pi->last_refresh < PROJECT_INDEX_REFRESH)
+            return;
+    } else {
+        free_strings(&pi->dirs);
+        pi->dir_pos = 0;
+        free_strings(&pi->files);
+        pi->files = pi->building;
+        memset(&pi->building, 0, sizeof(pi->building));
+        pi->ready = 1;
+    }
+    pi->last_refresh = now;
+    completion_serial++;
+    if (completion_popup_window) {
+        edit_display(qs);
+        dpy_flush(qs->screen);
+    }
+}
+
+static void project_index_free(ProjectIndex *pi)
+{
+    if (pi->timer) {
+        qe_kill_timer(pi->timer);
+        pi->timer = NULL;
+    }
+    free_strings(&pi->files);
+    free_strings(&pi->building);
+    free_strings(&pi->dirs);
+    pi->dir_pos = 0;
+    pi->ready = 0;
+    pi->root[0] = '\0';
+}
+
+/* start listing the files below 'root'. The list of the same root is
+   kept while it is refreshed */
+static void project_index_start(ProjectIndex *pi, const char *root)
+{
+    if (!strcmp(pi->root, root)) {
+        if (pi->timer)
+            return;
+    } else {
+        project_index_free(pi);
+        pstrcpy(pi->root, sizeof(pi->root), root);
+    }
+    free_strings(&pi->building);
+    free_strings(&pi->dirs);
+    pi->dir_pos = 0;
+    add_string(&pi->dirs, "");
+    pi->last_refresh = get_clock_ms();
+    pi->timer = qe_add_timer(0, pi, project_index_timer);
+}
+
+/* Score the match of the characters of 'pattern' in this order in
+   'str' from 'p', ignoring case. Consecutive characters and characters
+   at the start of a word or in the base name 'base' score more. Return
+   -1 if there is no match. */
+static int fuzzy_match1(const char *str, const char *base, const char *p,
+                        const char *pattern)
+{
+    int c, score, run;
+
+    score = 0;
+    run = 0;
+    for (; *pattern; pattern++) {
+        c = tolower((unsigned char)*pattern);
+        while (tolower((unsigned char)*p) != c) {
+            if (*p == '\0')
+                return -1;
+            p++;
+            run = 0;
+        }
+        score += 1 + 2 * run;
+        if (p == str || strchr("/\\_-. ", p[-1]))
+            score += 4;
+        if (p >= base)
+            score += 2;
+        run++;
+        p++;
+    }
+    return score;
+}
+
+/* the matches are searched from the start of the path and from the
+   base name, where they are usually meant */
+static int fuzzy_match(const char *str, const char *pattern)
+{
+    const char *base;
+    int score, score1;
+
+    base = basename(str);
+    score = fuzzy_match1(str, base, str, pattern);
+    if (score >= 0) {
+        score1 = fuzzy_match1(str, base, base, pattern);
+        if (score1 > score)
+            score = score1;
+    }
+    return score;
+}
+
+typedef struct ProjectMatch {
+    int score;
+    int len;
+    const char *str;
+} ProjectMatch;
+
+static int project_match_sort_func(const void *p1, const void *p2)
+{
+    const ProjectMatch *m1 = (const ProjectMatch *)p1;
+    const ProjectMatch *m2 = (const ProjectMatch *)p2;
+
+    if (m1->score != m2->score)
+        return m2->score - m1->score;
+    if (m1->len != m2->len)
+        return m1->len - m2->len;
+    return strcmp(m1->str, m2->str);
+}
+
+/* fuzzy completion of file names relative to the project root, best
+   matches first */
+void project_completion(StringArray *cs, const char *input)
+{
+    ProjectIndex *pi = &project_index;
+    StringArray *files;
+    ProjectMatch *matches;
+    int i, nb, score;
+
+    files = pi->ready ? &pi->files : &pi->building;
+    if (files->nb_items == 0)
+        return;
+    matches = (ProjectMatch*)malloc(files->nb_items * sizeof(ProjectMatch));
+    if (!matches)
+        return;
+    nb = 0;
+    for (i = 0; i < files->nb_items; i++) {
+        score = fuzzy_match(files->items[i]->str, input);
+        if (score >= 0) {
+            matches[nb].score = score;
+            matches[nb].len = strlen(files->items[i]->str);
+            matches[nb].str = files->items[i]->str;
+            nb++;
+        }
+    }
+    qsort(matches, nb, sizeof(ProjectMatch), project_match_sort_func);
+    if (nb > PROJECT_COMPLETION_MAX)
+        nb = PROJECT_COMPLETION_MAX;
+    for (i = 0; i < nb; i++)
+        add_string(cs, matches[i].str);
+    free(matches);
+}
+
+void do_find_file_in_project(EditState *s, const char *filename)
+{
+    char root[MAX_FILENAME_SIZE];
+    char path[MAX_FILENAME_SIZE];
+
+    if (is_abs_path(filename)) {
+        do_load(s, filename);
+        return;
+    }
+    project_get_root(root, sizeof(root), s);
+    makepath(path, sizeof(path), root, filename);
+    do_load(s, path);
+}
 
 void buffer_completion(StringArray *cs, const char *input)
 {
@@ -4339,11 +5400,16 @@ void register_completion(const char *name, CompletionFunc completion_func)
 void free_completions()
 {
     CompletionEntry *p = first_completion;
+    int i;
+
     while (p) {
         CompletionEntry *next = p->next;
         free(p);
         p = next;
     }
+    for (i = 0; i < FILE_CACHE_SIZE; i++)
+        file_cache_clear(&file_cache[i]);
+    project_index_free(&project_index);
 }
 
 static CompletionFunc find_completion(const char *name)
@@ -4369,8 +5435,9 @@ static void (*minibuffer_cb)(void *opaque, char *buf) = NULL;
 static void *minibuffer_opaque = NULL;
 static EditState *minibuffer_saved_active = NULL;
 
-static EditState *completion_popup_window = NULL;
 static CompletionFunc completion_function = NULL;
+static char completion_input[1024];
+static int completion_input_serial;
 
 static StringArray *minibuffer_history = NULL;
 static int minibuffer_history_index = 0;
@@ -4380,12 +5447,63 @@ ModeDef minibuffer_mode = {0};
 
 extern CmdDef minibuffer_commands[];
 
+static void set_minibuffer_str(EditState *s, const char *str);
+
+/* get the candidates for 'input'. Return TRUE if they all start with
+   'input': they are then sorted, otherwise they are ranked matches
+   kept in the order of the completion function */
+static int completion_get(StringArray *cs, const char *input)
+{
+    int i, len;
+
+    pstrcpy(completion_input, sizeof(completion_input), input);
+    completion_input_serial = completion_serial;
+    completion_function(cs, input);
+    len = strlen(input);
+    for (i = 0; i < cs->nb_items; i++) {
+        if (strncmp(cs->items[i]->str, input, len))
+            return 0;
+    }
+    qsort(cs->items, cs->nb_items, sizeof(StringItem *),
+          completion_sort_func);
+    return 1;
+}
+
+/* modify the list with the current matches */
+static void completion_popup_fill(EditState *e, StringArray *cs)
+{
+    EditBuffer *b = e->b;
+    char buf[4096];
+    int i, len, pos;
+
+    eb_delete(b, 0, eb_total_size(b));
+    pos = 0;
+    for (i = 0; i < cs->nb_items; i++) {
+        len = strlen(cs->items[i]->str);
+        if (pos + len + 2 > (int)sizeof(buf)) {
+            eb_insert(b, eb_total_size(b), buf, pos);
+            pos = 0;
+        }
+        buf[pos++] = ' ';
+        if (len > (int)sizeof(buf) - 2)
+            len = sizeof(buf) - 2;
+        memcpy(buf + pos, cs->items[i]->str, len);
+        pos += len;
+        if (i != cs->nb_items - 1)
+            buf[pos++] = '\n';
+    }
+    eb_insert(b, eb_total_size(b), buf, pos);
+    e->mouse_force_highlight = 1;
+    e->force_highlight = 0;
+    e->offset = 0;
+}
+
 /* XXX: utf8 ? */
 void do_completion(EditState *s)
 {
     QEmacsState *qs = s->qe_state;
     char input[1024];
-    int len, count, i, match_len, c;
+    int len, count, i, match_len, c, prefixed;
     StringArray cs;
     StringItem **outputs;
     EditState *e;
@@ -4397,7 +5515,7 @@ void do_completion(EditState *s)
 
     len = eb_get_str(s->b, input, sizeof(input));
     memset(&cs, 0, sizeof(cs));
-    completion_function(&cs, input);
+    prefixed = completion_get(&cs, input);
     count = cs.nb_items;
     outputs = cs.items;
 #if 0
@@ -4408,9 +5526,14 @@ void do_completion(EditState *s)
     /* no completion ? */
     if (count == 0)
         goto the_end;
+    if (!prefixed && count == 1) {
+        /* single ranked match: it replaces the input */
+        set_minibuffer_str(s, outputs[0]->str);
+        goto the_end;
+    }
     /* compute the longest match len */
     match_len = len;
-    for (;;) {
+    while (prefixed) {
         c = outputs[0]->str[match_len];
         if (c == '\0')
             break;
@@ -4443,20 +5566,8 @@ void do_completion(EditState *s)
                 completion_popup_window = e;
             }
         }
-        if (completion_popup_window) {
-            EditBuffer *b = completion_popup_window->b;
-            /* modify the list with the current matches */
-            qsort(outputs, count, sizeof(StringItem *), completion_sort_func);
-            eb_delete(b, 0, eb_total_size(b));
-            for (i = 0; i < count; i++) {
-                eb_printf(b, " %s", outputs[i]->str);
-                if (i != count - 1)
-                    eb_printf(b, "\n");
-            }
-            completion_popup_window->mouse_force_highlight = 1;
-            completion_popup_window->force_highlight = 0;
-            completion_popup_window->offset = 0;
-        }
+        if (completion_popup_window)
+            completion_popup_fill(completion_popup_window, &cs);
     }
  the_end:
     free_strings(&cs);
@@ -4473,6 +5584,25 @@ void do_completion_space(EditState *s)
     }
 }
 
+/* keep the completion popup in sync with the input, before each
+   redisplay */
+static void minibuffer_display_hook(EditState *s)
+{
+    char input[1024];
+    StringArray cs;
+
+    if (!completion_popup_window || !completion_function)
+        return;
+    eb_get_str(s->b, input, sizeof(input));
+    if (!strcmp(input, completion_input)
+    &&  completion_input_serial == completion_serial)
+        return;
+    memset(&cs, 0, sizeof(cs));
+    completion_get(&cs, input);
+    completion_popup_fill(completion_popup_window, &cs);
+    free_strings(&cs);
+}
+
 /* scroll in completion popup */
 void minibuf_complete_scroll_up_down(EditState *s, int dir)
 {
@@ -4575,6 +5705,7 @@ void do_minibuffer_exit(EditState *s, int abort)
         EditBuffer *b = completion_popup_window->b;
         edit_close(completion_popup_window);
         eb_free(b);
+        completion_popup_window = NULL;
         do_refresh(s);
     }
 
@@ -4597,7 +5728,7 @@ void do_minibuffer_exit(EditState *s, int abort)
     qs->active_window = minibuffer_saved_active;
 
     /* force status update */
-    strcpy(qs->status_shadow, " ");
+    qs->status_invalid = 1;
     put_status(NULL, "");
 
     /* call the callback */
@@ -4661,6 +5792,13 @@ void minibuffer_edit(const char *input, const char *prompt,
 
     completion_popup_window = NULL;
     completion_function = completion_func;
+    completion_input[0] = '\0';
+    if (completion_func == project_completion) {
+        char root[MAX_FILENAME_SIZE];
+        /* list the project files while the user types */
+        project_get_root(root, sizeof(root), minibuffer_saved_active);
+        project_index_start(&project_index, root);
+    }
     minibuffer_history = hist;
     minibuffer_history_saved_offset = 0;
     if (hist) {
@@ -4675,6 +5813,7 @@ void minibuffer_init(void)
     memcpy(&minibuffer_mode, &text_mode, sizeof(ModeDef));
     minibuffer_mode.name = "minibuffer";
     minibuffer_mode.scroll_up_down = minibuf_complete_scroll_up_down;
+    minibuffer_mode.display_hook = minibuffer_display_hook;
     qe_register_mode(&minibuffer_mode);
     qe_register_cmd_table(minibuffer_commands, "minibuffer");
 }
@@ -4963,7 +6102,7 @@ static void do_load1(EditState *s, const char *filename1,
 {
     u8 buf[1025];
     char filename[MAX_FILENAME_SIZE];
-    int mode, buf_size;
+    int mode, buf_size, utf16;
     ModeDef *selected_mode;
     EditBuffer *b;
     EditBufferDataType *bdt;
@@ -5037,8 +6176,17 @@ static void do_load1(EditState *s, const char *filename1,
     bdt = selected_mode->data_type;
 
     /* autodetect buffer charset (could move it to raw buffer loader) */
-    if (bdt == &raw_data_type) 
-        eb_set_charset(b, detect_charset(buf, buf_size));
+    if (bdt == &raw_data_type) {
+        utf16 = 0;
+        if (f)
+            eb_set_charset(b, detect_charset_file(f, &utf16));
+        else
+            eb_set_charset(b, detect_charset(buf, buf_size));
+        if (utf16) {
+            put_status(s, "UTF-16%s data is not supported, using %s",
+                       utf16 == 1 ? "LE" : "BE", b->charset->name);
+        }
+    }
 
     /* now we can set the mode */
     do_set_mode_file(s, selected_mode, NULL, f);
@@ -5158,7 +6306,45 @@ static void save_edit_cb(void *opaque, char *filename)
     save_final(s);
 }
 
+static void save_patches_confirm_cb(void *opaque, char *reply);
+static void save_final1(EditState *s);
+
+/* patches are written directly into the file: every save asks first */
+static int save_patches_ask(EditBuffer *b, 
+                            void (*cb)(void *opaque, char *reply),
+                            void *opaque)
+{
+    char buf[1024];
+
+    if (!eb_patches_in_place(b, b->filename))
+        return 0;
+    snprintf(buf, sizeof(buf), 
+             "Write %d patched bytes in place to %s? (yes or no) ",
+             b->pages.PatchCount(), b->filename);
+    minibuffer_edit(NULL, buf, NULL, NULL, cb, opaque);
+    return 1;
+}
+
 static void save_final(EditState *s)
+{
+    if (save_patches_ask(s->b, save_patches_confirm_cb, s))
+        return;
+    save_final1(s);
+}
+
+static void save_patches_confirm_cb(void *opaque, char *reply)
+{
+    int yes_replied;
+    if (!reply)
+        return;
+    yes_replied = (strcmp(reply, "yes") == 0);
+    free(reply);
+    if (!yes_replied)
+        return;
+    save_final1((EditState*)opaque);
+}
+
+static void save_final1(EditState *s)
 {
     int ret;
     ret = save_buffer(s->b);
@@ -5182,6 +6368,21 @@ typedef struct QuitState {
 static void quit_examine_buffers(QuitState *is);
 static void quit_key(void *opaque, int ch);
 static void quit_confirm_cb(void *opaque, char *reply);
+static void quit_patches_confirm_cb(void *opaque, char *reply);
+
+/* save the current buffer of 'is'. Return 1 if writing its patches in
+   place must be confirmed first: the callback then goes on with the
+   next buffers */
+static int quit_save_buffer(QuitState *is)
+{
+    if (eb_patches_in_place(is->b, is->b->filename)) {
+        qe_ungrab_keys();
+        save_patches_ask(is->b, quit_patches_confirm_cb, is);
+        return 1;
+    }
+    save_buffer(is->b);
+    return 0;
+}
 
 void do_quit(EditState *s)
 {
@@ -5213,14 +6414,14 @@ static void quit_examine_buffers(QuitState *is)
                 /* XXX: display cursor */
                 put_status(NULL, "Save file %s? (y, n, !, ., q) ", 
                            b->filename);
-                dpy_flush(&global_screen);
                 /* will wait for a key */
                 return;
             case QuitState::QS_NOSAVE:
                 is->modified = 1;
                 break;
             case QuitState::QS_SAVE:
-                save_buffer(b);
+                if (quit_save_buffer(is))
+                    return;
                 break;
             }
         }
@@ -5233,8 +6434,6 @@ static void quit_examine_buffers(QuitState *is)
         minibuffer_edit(NULL, "Modified buffers exist; exit anyway? (yes or no) ", 
                         NULL, NULL,
                         quit_confirm_cb, NULL);
-        edit_display(&qe_state);
-        dpy_flush(&global_screen);
     } else {
         url_exit();
     }
@@ -5243,7 +6442,6 @@ static void quit_examine_buffers(QuitState *is)
 static void quit_key(void *opaque, int ch)
 {
     QuitState *is = (QuitState*)opaque;
-    EditBuffer *b;
 
     switch (ch) {
     case 'y':
@@ -5267,13 +6465,12 @@ static void quit_key(void *opaque, int ch)
         /* save current and exit */
         is->state = QuitState::QS_NOSAVE;
     do_save:
-        b = is->b;
-        save_buffer(b);
+        if (quit_save_buffer(is))
+            return;
         break;
     case KEY_CTRL('g'):
         /* abort */
         put_status(NULL, "Quit");
-        dpy_flush(&global_screen);
         qe_ungrab_keys();
         return;
     default:
@@ -5293,6 +6490,24 @@ static void quit_confirm_cb(void *opaque, char *reply)
     free(reply);
 }
 
+static void quit_patches_confirm_cb(void *opaque, char *reply)
+{
+    QuitState *is = (QuitState*)opaque;
+
+    if (!reply) {
+        put_status(NULL, "Quit");
+        return;
+    }
+    if (strcmp(reply, "yes") == 0)
+        save_buffer(is->b);
+    else
+        is->modified = 1;
+    free(reply);
+    is->b = is->b->next;
+    qe_grab_keys(quit_key, is);
+    quit_examine_buffers(is);
+}
+
 
 #define SEARCH_FLAG_IGNORECASE 0x0001 
 #define SEARCH_FLAG_SMARTCASE  0x0002 /* case sensitive if upper case present */
@@ -5502,11 +6717,8 @@ static void isearch_display(ISearchState *is)
 
         /* display text */
     center_cursor(s);
-    edit_display(s->qe_state);
 
     put_status(NULL, ubuf);
-
-    dpy_flush(s->screen);
 }
 
 static void isearch_key(void *opaque, int ch)
@@ -5658,13 +6870,9 @@ typedef struct QueryReplaceState {
 
 static void query_replace_abort(QueryReplaceState *is)
 {
-    EditState *s = is->s;
-
     qe_ungrab_keys();
     put_status(NULL, "Replaced %d occurrences", is->nb_reps);
     free(is);
-    edit_display(s->qe_state);
-    dpy_flush(&global_screen);
 }
 
 static void query_replace_replace(QueryReplaceState *is)
@@ -5698,11 +6906,9 @@ static void query_replace_display(QueryReplaceState *is)
     /* display text */
     s->offset = is->found_offset;
     center_cursor(s);
-    edit_display(s->qe_state);
     
     put_status(NULL, "Query replace %s with %s: ", 
                is->search_str, is->replace_str);
-    dpy_flush(&global_screen);
 }
 
 static void query_replace_key(void *opaque, int ch)
@@ -5892,7 +7098,7 @@ void do_refresh(EditState *s1)
         e->borders_invalid = 1;
     }
     /* invalidate status line */
-    qs->status_shadow[0] = '\0';
+    qs->status_invalid = 1;
 
     if (resized) {
         put_status(NULL, "Screen is now %d by %d", width, height);
@@ -6134,6 +7340,126 @@ void do_describe_key_briefly(EditState *s)
     key_ctx.describe_key = 1;
 }
 
+void do_describe_shaping_cache(EditState *s)
+{
+    ShapingCacheStats st;
+    int total;
+
+    shaping_cache_get_stats(&st);
+    total = st.hits + st.misses;
+    put_status(s, "Shaping cache: %d entries, %d hits, %d misses (%d%% hits)",
+               st.nb_entries, st.hits, st.misses,
+               total ? (int)((st.hits * 100LL) / total) : 0);
+}
+
+/* compare the decoding throughput of eb_nextc() and of the span
+   reader on the current buffer */
+void do_benchmark_buffer_iteration(EditState *s)
+{
+    EBReader r1, *r = &r1;
+    EditBuffer *b = s->b;
+    int offset, total, n1, n2;
+    unsigned int sum1, sum2;
+    int64_t t1, t2;
+
+    total = eb_total_size(b);
+
+    t1 = get_clock_usec();
+    n1 = 0;
+    sum1 = 0;
+    for (offset = 0; offset < total;) {
+        sum1 += eb_nextc(b, offset, &offset);
+        n1++;
+    }
+    t1 = get_clock_usec() - t1;
+    if (t1 <= 0)
+        t1 = 1;
+
+    t2 = get_clock_usec();
+    n2 = 0;
+    sum2 = 0;
+    eb_reader_init(r, b, 0);
+    while (r->offset < total) {
+        sum2 += eb_readc(r);
+        n2++;
+    }
+    t2 = get_clock_usec() - t2;
+    if (t2 <= 0)
+        t2 = 1;
+
+    put_status(s, "%d bytes, %d chars: eb_nextc %d us (%d MB/s), "
+               "reader %d us (%d MB/s)%s",
+               total, n1, (int)t1, (int)(total / t1),
+               (int)t2, (int)(total / t2),
+               (n1 != n2 || sum1 != sum2) ? " MISMATCH" : "");
+}
+
+/* measure the JSON DOM on the current buffer: parse it in place,
+   serialize it and check that the result parses back the same */
+void do_benchmark_json(EditState *s)
+{
+    EditBuffer *b = s->b;
+    json_doc *doc, *doc2;
+    json_object *root, *root2;
+    json_doc_stats st;
+    char *buf, *text, *text2;
+    int total, len, ok;
+    int64_t t1, t2;
+
+    total = eb_total_size(b);
+    buf = (char*)malloc(total + 1);
+    if (!buf) {
+        put_status(s, "Out of memory");
+        return;
+    }
+    eb_read(b, 0, buf, total);
+    buf[total] = '\0';
+    doc = json_doc_new();
+    doc2 = json_doc_new();
+    if (!doc || !doc2) {
+        put_status(s, "Out of memory");
+        goto done;
+    }
+
+    t1 = get_clock_usec();
+    root = json_parse_insitu(doc, buf, total);
+    t1 = get_clock_usec() - t1;
+    if (t1 <= 0)
+        t1 = 1;
+    if (!root) {
+        put_status(s, "Invalid JSON");
+        goto done;
+    }
+
+    t2 = get_clock_usec();
+    text = json_serialize(root);
+    t2 = get_clock_usec() - t2;
+    if (t2 <= 0)
+        t2 = 1;
+    if (!text) {
+        put_status(s, "Out of memory");
+        goto done;
+    }
+    len = strlen(text);
+
+    root2 = json_deserialize(doc2, text);
+    text2 = root2 ? json_serialize(root2) : NULL;
+    ok = text2 && !strcmp(text, text2);
+
+    json_doc_get_stats(doc, &st);
+    put_status(s, "%d bytes: parse %d us (%d MB/s), "
+               "serialize %d bytes %d us (%d MB/s), "
+               "arena %d KB, %d keys%s",
+               total, (int)t1, (int)(total / t1),
+               len, (int)t2, (int)(len / t2),
+               st.arena_size >> 10, st.nb_keys,
+               ok ? "" : " MISMATCH");
+ done:
+    json_doc_free(doc2);
+    json_doc_free(doc);
+    free(buf);
+}
+
 void do_help_for_help(EditState *s)
 {
     EditBuffer *b;
@@ -6483,6 +7809,18 @@ void unget_key(int key)
 }
 
 
+#define MAX_DISPLAY_DEFERRED 64
+
+/* unlike is_user_input_pending(), really poll the display driver */
+static int input_pending(void)
+{
+#ifdef WIN32
+    return 0;
+#else
+    return __is_user_input_pending();
+#endif
+}
+
 /* handle an event sent by the GUI */
 void qe_handle_event(QEEvent *ev)
 {
@@ -6491,7 +7829,18 @@ void qe_handle_event(QEEvent *ev)
     switch (ev->type) {
     case QE_KEY_EVENT:
         qe_key_process(ev->key_event.key);
-        break;
+        if (!qs->display_pending)
+            break;
+        /* redisplay and flush only once the pending keys are
+           processed, but not too late when keys keep coming */
+        if (qs->display_deferred < MAX_DISPLAY_DEFERRED &&
+            input_pending()) {
+            qs->display_deferred++;
+            break;
+        }
+        qs->display_pending = 0;
+        qs->display_deferred = 0;
+        goto redraw;
     case QE_EXPOSE_EVENT:
         do_refresh(qs->first_window);
         goto redraw;
@@ -7073,6 +8422,16 @@ void set_user_option(const char *user)
 }
 
 #ifndef WIN32
+static void set_bench_keys_option(const char *filename)
+{
+    bench_keys_file = filename;
+}
+
+static void set_bench_json_option(const char *filename)
+{
+    bench_json_file = filename;
+}
+
 static CmdOptionDef cmd_options[] = {
     { "help", "h", NULL, 0, "display this help message and exit", 
       {func_noarg: show_usage}},
@@ -7080,6 +8439,10 @@ static CmdOptionDef cmd_options[] = {
       {int_ptr: &no_init_file}},
     { "user", "u", "USER", CMD_OPT_ARG, "load ~USER/.qe/config instead of your own", 
       {func_arg: set_user_option}},
+    { "bench-keys", NULL, "FILE", CMD_OPT_ARG, "replay the key batches of FILE on the dummy display and exit", 
+      {func_arg: set_bench_keys_option}},
+    { "bench-json", NULL, "FILE", CMD_OPT_ARG, "write the benchmark report to FILE in JSON, - for stdout", 
+      {func_arg: set_bench_json_option}},
     { "version", "V", NULL, 0, "display version information and exit", 
       {func_noarg: show_version}},
     { NULL },
@@ -7092,6 +8455,13 @@ static CmdOptionDef cmd_options[] = {
 
 /* dummy display driver for initialization time */
 
+/* The dummy driver is also the display of the key replay benchmark:
+   it then returns fonts, counts the flushes and reports the rest of
+   the current batch as pending input. Otherwise it returns no fonts
+   because the font cache is kept when the real display is opened. */
+static int dummy_dpy_flushes;
+static int bench_pending_keys;
+
 static int dummy_dpy_probe(void)
 {
     return 1;
@@ -7118,7 +8488,7 @@ static void dummy_dpy_cursor_at(QEditScreen *s, int x1, int y1, int w, int h)
 
 static int dummy_dpy_is_user_input_pending(QEditScreen *s)
 {
-    return 0;
+    return bench_pending_keys > 0;
 }
 
 static void dummy_dpy_fill_rectangle(QEditScreen *s,
@@ -7130,11 +8500,22 @@ static void dummy_dpy_fill_rectangle(QEditScreen *s,
 static QEFont *dummy_dpy_open_font(QEditScreen *s,
                                    int style, int size)
 {
-    return NULL;
+    QEFont *font;
+
+    if (!bench_keys_file)
+        return NULL;
+    font = (QEFont*)malloc(sizeof(QEFont));
+    if (!font)
+        return NULL;
+    memset(font, 0, sizeof(QEFont));
+    font->ascent = 1;
+    font->descent = 0;
+    return font;
 }
 
 static void dummy_dpy_close_font(QEditScreen *s, QEFont *font)
 {
+    free(font);
 }
 
 static void dummy_dpy_text_metrics(QEditScreen *s, QEFont *font, 
@@ -7159,6 +8540,7 @@ static void dummy_dpy_set_clip(QEditScreen *s,
 
 static void dummy_dpy_flush(QEditScreen *s)
 {
+    dummy_dpy_flushes++;
 }
 
 QEDisplay dummy_dpy = {
@@ -7179,6 +8561,427 @@ QEDisplay dummy_dpy = {
     NULL, /* no selection handling */
 };
 
+/* Key replay benchmark.
+
+   Each line of the script is a batch of keys written as in
+   execute-macro-keys, with "quoted text" standing for its characters.
+   A batch may be prefixed by the name of the operation it measures
+   and a repeat count, as in 'scroll*50: C-v'. Empty lines and lines
+   starting with '#' are ignored. The keys of a batch are seen as
+   pending input, as if they were typed faster than the redisplay, and
+   each run of a batch is one latency sample of its operation.
+
+   Timers and the event loop do not run during the replay, so the
+   flushes and the profile counters of a script are the same from one
+   run to the next: only the latencies vary. */
+
+#define BENCH_MAX_OPS   64
+#define BENCH_MAX_KEYS  1024
+
+typedef struct BenchOp {
+    char name[32];
+    int64_t *samples;       /* latency of each run, in microseconds */
+    int nb_samples;
+    int samples_size;
+    int nb_keys;
+    int flushes;
+    int64_t allocs;         /* -1 if allocations are not counted */
+    int64_t alloc_bytes;
+    int64_t counters[PROF_COUNTER_NB];
+} BenchOp;
+
+#if defined(CONFIG_BENCH_ALLOC) && defined(__GLIBC__)
+
+/* Count the allocations by interposing the glibc allocator entry
+   points: free() and the aligned allocations are left alone. The
+   counts are updated atomically because of the dired scan threads. */
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+#ifdef __cplusplus
+}
+#endif
+
+static int64_t bench_allocs;
+static int64_t bench_alloc_bytes;
+
+void *malloc(size_t size)
+{
+    __sync_fetch_and_add(&bench_allocs, 1);
+    __sync_fetch_and_add(&bench_alloc_bytes, (int64_t)size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __sync_fetch_and_add(&bench_allocs, 1);
+    __sync_fetch_and_add(&bench_alloc_bytes, (int64_t)(nmemb * size));
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __sync_fetch_and_add(&bench_allocs, 1);
+    __sync_fetch_and_add(&bench_alloc_bytes, (int64_t)size);
+    return __libc_realloc(ptr, size);
+}
+
+#define BENCH_ALLOCS()       __sync_fetch_and_add(&bench_allocs, 0)
+#define BENCH_ALLOC_BYTES()  __sync_fetch_and_add(&bench_alloc_bytes, 0)
+#else
+#define BENCH_ALLOCS()       ((int64_t)-1)
+#define BENCH_ALLOC_BYTES()  ((int64_t)-1)
+#endif
+
+static BenchOp *bench_find_op(BenchOp *ops, int *nb_ops, const char *name)
+{
+    BenchOp *op;
+    int i;
+
+    for (i = 0; i < *nb_ops; i++) {
+        if (!strcmp(ops[i].name, name))
+            return &ops[i];
+    }
+    if (*nb_ops >= BENCH_MAX_OPS)
+        return NULL;
+    op = &ops[(*nb_ops)++];
+    memset(op, 0, sizeof(BenchOp));
+    pstrcpy(op->name, sizeof(op->name), name);
+    return op;
+}
+
+static int bench_add_sample(BenchOp *op, int64_t t)
+{
+    int64_t *samples;
+    int n;
+
+    if (op->nb_samples >= op->samples_size) {
+        n = op->samples_size + (op->samples_size >> 1) + 16;
+        samples = (int64_t*)realloc(op->samples, n * sizeof(int64_t));
+        if (!samples)
+            return -1;
+        op->samples = samples;
+        op->samples_size = n;
+    }
+    op->samples[op->nb_samples++] = t;
+    return 0;
+}
+
+/* parse 'name[*count]:' at the start of a line. Return the position
+   of the keys, or 'p' if the line has no operation name */
+static const char *bench_parse_op(const char *p, char *name, int name_size,
+                                  int *repeat)
+{
+    const char *q, *q1;
+    int n;
+
+    for (q = p; (*q >= 'a' && *q <= 'z') || isdigit((unsigned char)*q) ||
+         *q == '-' || *q == '_'; q++)
+        continue;
+    if (q == p)
+        return p;
+    q1 = q;
+    n = 1;
+    if (*q1 == '*') {
+        q1++;
+        if (!isdigit((unsigned char)*q1))
+            return p;
+        n = strtol(q1, (char **)&q1, 10);
+    }
+    if (*q1 != ':')
+        return p;
+    pstrncpy(name, name_size, p, q - p);
+    *repeat = n;
+    return q1 + 1;
+}
+
+/* parse the keys of a batch. Return the number of keys, or -1 with
+   '*err_ptr' set to the first token which is not a key or a
+   terminated text */
+static int bench_parse_keys(const char *p, unsigned int *keys, int max_keys,
+                            const char **err_ptr)
+{
+    const char *q;
+    int nb_keys;
+
+    nb_keys = 0;
+    for (;;) {
+        skip_spaces(&p);
+        if (*p == '\0' || nb_keys >= max_keys)
+            break;
+        *err_ptr = p;
+        if (*p == '"') {
+            for (p++; *p != '"'; p++) {
+                if (*p == '\\' && p[1] != '\0')
+                    p++;
+                if (*p == '\0')
+                    return -1;
+                if (nb_keys < max_keys)
+                    keys[nb_keys++] = (unsigned char)*p;
+            }
+            p++;
+        } else {
+            /* strtokey() stops at the next space */
+            for (q = p; *q != '\0' && *q != ' '; q++)
+                continue;
+            if (!is_key_name(p, q - p))
+                return -1;
+            keys[nb_keys++] = strtokey(&p);
+        }
+    }
+    return nb_keys;
+}
+
+static int bench_sample_cmp(const void *p1, const void *p2)
+{
+    int64_t t1 = *(const int64_t *)p1;
+    int64_t t2 = *(const int64_t *)p2;
+
+    return (t1 > t2) - (t1 < t2);
+}
+
+/* nearest rank percentile of sorted samples */
+static int64_t bench_percentile(const int64_t *samples, int n, int pct)
+{
+    int i;
+
+    if (n == 0)
+        return 0;
+    i = (pct * n + 99) / 100 - 1;
+    if (i < 0)
+        i = 0;
+    return samples[i];
+}
+
+static json_object *bench_op_to_json(json_doc *doc, BenchOp *op)
+{
+    json_object *obj, *lat, *counters;
+    int64_t total;
+    int i, n;
+
+    n = op->nb_samples;
+    total = 0;
+    for (i = 0; i < n; i++)
+        total += op->samples[i];
+
+    obj = json_new_object(doc);
+    json_object_add(obj, "name", json_new_string(doc, op->name));
+    json_object_add(obj, "runs", json_new_int(doc, n));
+    json_object_add(obj, "keys", json_new_int(doc, op->nb_keys));
+    json_object_add(obj, "flushes", json_new_int(doc, op->flushes));
+    if (op->allocs < 0) {
+        json_object_add(obj, "allocs", json_new_null(doc));
+        json_object_add(obj, "alloc_bytes", json_new_null(doc));
+    } else {
+        json_object_add(obj, "allocs", json_new_double(doc, (double)op->allocs));
+        json_object_add(obj, "alloc_bytes",
+                        json_new_double(doc, (double)op->alloc_bytes));
+    }
+    lat = json_new_object(doc);
+    json_object_add(lat, "min", json_new_int(doc, n ? (int)op->samples[0] : 0));
+    json_object_add(lat, "p50",
+                    json_new_int(doc, (int)bench_percentile(op->samples, n, 50)));
+    json_object_add(lat, "p90",
+                    json_new_int(doc, (int)bench_percentile(op->samples, n, 90)));
+    json_object_add(lat, "p99",
+                    json_new_int(doc, (int)bench_percentile(op->samples, n, 99)));
+    json_object_add(lat, "max",
+                    json_new_int(doc, n ? (int)op->samples[n - 1] : 0));
+    json_object_add(lat, "mean", json_new_int(doc, n ? (int)(total / n) : 0));
+    json_object_add(obj, "latency_us", lat);
+    counters = json_new_object(doc);
+    for (i = 0; i < PROF_COUNTER_NB; i++) {
+        json_object_add(counters, prof_counter_names[i],
+                        json_new_double(doc, (double)op->counters[i]));
+    }
+    json_object_add(obj, "counters", counters);
+    return obj;
+}
+
+/* write the report in JSON. The members are always in the same order
+   and the operations in the order of the script, so that two reports
+   can be compared line by line once reformatted */
+static int bench_write_json(const char *filename, const char *script,
+                            BenchOp *ops, int nb_ops, BenchOp *total)
+{
+    QEmacsState *qs = &qe_state;
+    json_doc *doc;
+    json_object *root, *screen, *array;
+    char *str;
+    int i, ok;
+
+    doc = json_doc_new();
+    if (!doc)
+        return 0;
+    root = json_new_object(doc);
+    json_object_add(root, "version", json_new_int(doc, 1));
+    json_object_add(root, "script", json_new_string(doc, script));
+    json_object_add(root, "buffer",
+                    json_new_string(doc, qs->active_window ?
+                                    qs->active_window->b->name : ""));
+    screen = json_new_object(doc);
+    json_object_add(screen, "width", json_new_int(doc, qs->screen->width));
+    json_object_add(screen, "height", json_new_int(doc, qs->screen->height));
+    json_object_add(root, "screen", screen);
+    array = json_new_array(doc);
+    for (i = 0; i < nb_ops; i++)
+        json_array_add(array, bench_op_to_json(doc, &ops[i]));
+    json_object_add(root, "operations", array);
+    json_object_add(root, "total", bench_op_to_json(doc, total));
+
+    if (!strcmp(filename, "-")) {
+        str = json_serialize(root);
+        ok = (str != NULL);
+        if (ok)
+            printf("%s\n", str);
+    } else {
+        ok = json_to_file(filename, root);
+    }
+    json_doc_free(doc);
+    return ok;
+}
+
+static void bench_print_op(BenchOp *op)
+{
+    int n = op->nb_samples;
+
+    printf("%-16s %6d %8d %6d %8d %8d %8d %8d",
+           op->name, n, op->flushes, op->nb_keys,
+           (int)bench_percentile(op->samples, n, 50),
+           (int)bench_percentile(op->samples, n, 90),
+           (int)bench_percentile(op->samples, n, 99),
+           n ? (int)op->samples[n - 1] : 0);
+    if (op->allocs >= 0)
+        printf(" %10lld", (long long)op->allocs);
+    printf("\n");
+}
+
+/* Replay the script 'filename' through qe_handle_event() on the dummy
+   display and report the latency percentiles of each operation.
+   Return -1 if the script or the report has an error. */
+static int qe_bench_keys(QEmacsState *qs, const char *filename)
+{
+    FILE *f;
+    char line[4096], name[32];
+    const char *p, *err;
+    unsigned int keys[BENCH_MAX_KEYS];
+    BenchOp ops[BENCH_MAX_OPS], total1, *total = &total1, *op;
+    int i, j, n, nb_keys, nb_ops, repeat, line_num, flushes, ret;
+    int64_t t, allocs, alloc_bytes;
+    int64_t counters[PROF_COUNTER_NB];
+    QEEvent ev1, *ev = &ev1;
+
+    f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "%s: cannot open key file\n", filename);
+        return -1;
+    }
+    ret = 0;
+    nb_ops = 0;
+    memset(total, 0, sizeof(BenchOp));
+    pstrcpy(total->name, sizeof(total->name), "total");
+    line_num = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line_num++;
+        /* the last key must not include the newline */
+        line[strcspn(line, "\r\n")] = '\0';
+        p = line;
+        skip_spaces(&p);
+        if (*p == '#')
+            continue;
+        pstrcpy(name, sizeof(name), "keys");
+        repeat = 1;
+        p = bench_parse_op(p, name, sizeof(name), &repeat);
+        nb_keys = bench_parse_keys(p, keys, BENCH_MAX_KEYS, &err);
+        if (nb_keys < 0) {
+            fprintf(stderr, "%s:%d: unknown key '%.*s'\n",
+                    filename, line_num, (int)strcspn(err, " "), err);
+            ret = -1;
+            break;
+        }
+        if (nb_keys == 0)
+            continue;
+        op = bench_find_op(ops, &nb_ops, name);
+        if (!op) {
+            fprintf(stderr, "%s:%d: too many operations\n",
+                    filename, line_num);
+            ret = -1;
+            break;
+        }
+        for (n = 0; n < repeat; n++) {
+            flushes = dummy_dpy_flushes;
+            memcpy(counters, prof_counters, sizeof(counters));
+            allocs = BENCH_ALLOCS();
+            alloc_bytes = BENCH_ALLOC_BYTES();
+            t = get_clock_usec();
+            for (i = 0; i < nb_keys; i++) {
+                bench_pending_keys = nb_keys - i - 1;
+                ev->key_event.type = QE_KEY_EVENT;
+                ev->key_event.key = keys[i];
+                qe_handle_event(ev);
+            }
+            t = get_clock_usec() - t;
+            if (bench_add_sample(op, t) < 0 || bench_add_sample(total, t) < 0)
+                break;
+            op->nb_keys += nb_keys;
+            op->flushes += dummy_dpy_flushes - flushes;
+            if (allocs >= 0) {
+                op->allocs += BENCH_ALLOCS() - allocs;
+                op->alloc_bytes += BENCH_ALLOC_BYTES() - alloc_bytes;
+            }
+            for (j = 0; j < PROF_COUNTER_NB; j++)
+                op->counters[j] += prof_counters[j] - counters[j];
+        }
+    }
+    fclose(f);
+    bench_pending_keys = 0;
+    /* a partial report would hide the error */
+    if (ret < 0)
+        goto done;
+
+    for (i = 0; i < nb_ops; i++) {
+        op = &ops[i];
+        if (BENCH_ALLOCS() < 0)
+            op->allocs = op->alloc_bytes = -1;
+        total->nb_keys += op->nb_keys;
+        total->flushes += op->flushes;
+        total->allocs += op->allocs;
+        total->alloc_bytes += op->alloc_bytes;
+        for (j = 0; j < PROF_COUNTER_NB; j++)
+            total->counters[j] += op->counters[j];
+        qsort(op->samples, op->nb_samples, sizeof(int64_t), bench_sample_cmp);
+    }
+    if (BENCH_ALLOCS() < 0)
+        total->allocs = total->alloc_bytes = -1;
+    qsort(total->samples, total->nb_samples, sizeof(int64_t),
+          bench_sample_cmp);
+
+    if (bench_json_file) {
+        if (!bench_write_json(bench_json_file, filename, ops, nb_ops, total)) {
+            fprintf(stderr, "%s: cannot write report\n", bench_json_file);
+            ret = -1;
+        }
+    }
+    if (!bench_json_file || strcmp(bench_json_file, "-")) {
+        printf("%-16s %6s %8s %6s %8s %8s %8s %8s%s\n",
+               "Operation", "Runs", "Flushes", "Keys",
+               "p50 us", "p90 us", "p99 us", "max us",
+               total->allocs >= 0 ? "     Allocs" : "");
+        for (i = 0; i < nb_ops; i++)
+            bench_print_op(&ops[i]);
+        bench_print_op(total);
+    }
+
+ done:
+    for (i = 0; i < nb_ops; i++)
+        free(ops[i].samples);
+    free(total->samples);
+    return ret;
+}
+
 /* cannot use elf sections, so we initialize the modules manually */
 /* Should use a shell script to process objects and construct
  * initcall array:
@@ -7196,6 +8999,8 @@ extern void module_xml_init(void); /* xml.c(202) */
 extern void module_bufed_init(void); /* bufed.c(197) */
 extern void module_shell_init(void); /* shell.c(922) */
 extern void module_dired_init(void); /* dired.c(369) */
+extern void module_json_init(void); /* jsonview.c */
+extern void module_profile_init(void); /* profile.c */
 extern void module_win32_init(void); /* win32.c(504) */
 extern void module_x11_init(void); /* x11.c(1704) */
 extern void module_html_init(void); /* html.c(894) */
@@ -7238,6 +9043,8 @@ static inline void init_all_modules(void)
     module_shell_init(); /* shell.c(922) */
 #endif
     module_dired_init(); /* dired.c(369) */
+    module_json_init(); /* jsonview.c */
+    module_profile_init(); /* profile.c */
 
 #ifdef CONFIG_WIN32
     module_win32_init(); /* win32.c(504) */
@@ -7305,6 +9112,7 @@ void qe_init(void *opaque)
     register_completion("charset", charset_completion);
     register_completion("style", style_completion);
     register_completion("file", file_completion);
+    register_completion("project", project_completion);
     register_completion("buffer", buffer_completion);
     register_completion("color", color_completion);
     
@@ -7354,6 +9162,23 @@ void qe_init(void *opaque)
 
     qe_key_init();
 
+    if (bench_keys_file) {
+        /* stay on the dummy display */
+        global_screen.width = screen_width ? screen_width : 80;
+        global_screen.height = screen_height ? screen_height : 25;
+        do_refresh(s);
+        for (i = optind; i < argc; i++) {
+            do_load(s, argv[i]);
+        }
+        edit_display(qs);
+        dpy_flush(&global_screen);
+        i = qe_bench_keys(qs, bench_keys_file);
+        url_exit();
+        if (i < 0)
+            exit(1);
+        return;
+    }
+
     /* select the suitable display manager */
     dpy = probe_display();
     if (!dpy) {
@@ -7526,32 +9351,34 @@ failed:
 static void settings_save(void)
 {
     char            file[MAX_PATH];
+    json_doc *      doc;
     json_object *   top_level;
     int             ok;
-    int             deleted;
 
     if (!get_config_filename(file, MAX_PATH))
         return;
 
-    top_level = json_new_object();
-    if (!top_level)
+    doc = json_doc_new();
+    if (!doc)
         return;
 
-    ok = json_object_add(top_level, WIN_DX, json_new_int(global_screen.width));
+    top_level = json_new_object(doc);
+    ok = (top_level != NULL);
     if (ok)
-        ok = json_object_add(top_level, WIN_DY, json_new_int(global_screen.height));
+        ok = json_object_add(top_level, WIN_DX, json_new_int(doc, global_screen.width));
+    if (ok)
+        ok = json_object_add(top_level, WIN_DY, json_new_int(doc, global_screen.height));
 
     if (ok)
         json_to_file(file, top_level);
-    deleted = json_unref(top_level);
-    assert(deleted);
+    json_doc_free(doc);
 }
 
 static void settings_load(void)
 {
     char            file[MAX_PATH];
+    json_doc *      doc;
     json_object *   top_level;
-    int             deleted;
     json_object *   tmp;
 
     settings.window_dx = NOT_SET;
@@ -7563,24 +9390,28 @@ static void settings_load(void)
     if (!get_config_filename(file, MAX_PATH))
         return;
 
-    top_level = json_from_file(file);
-    if (!top_level)
+    doc = json_doc_new();
+    if (!doc)
         return;
 
-    tmp = json_object_get(top_level, WIN_DX);
-    if (tmp)
-        settings.window_dx = json_get_int(tmp);
-    tmp = json_object_get(top_level, WIN_DY);
-    if (tmp)
-        settings.window_dy = json_get_int(tmp);
+    top_level = json_from_file(doc, file);
+    if (top_level) {
+        tmp = json_object_get(top_level, WIN_DX);
+        if (tmp)
+            settings.window_dx = json_get_int(tmp);
+        tmp = json_object_get(top_level, WIN_DY);
+        if (tmp)
+            settings.window_dy = json_get_int(tmp);
 
-    /* TODO: more settings */
+        /* TODO: more settings */
+    }
 
-    deleted = json_unref(top_level);
-    assert(deleted);
+    json_doc_free(doc);
 }
 
+#ifdef CONFIG_HTML
 extern void free_css_ident();
+#endif
 
 void delete_windows()
 {
@@ -7618,7 +9449,10 @@ int main(int argc, char **argv)
     free_completions();
     free_cmds();
     free_keys();
+    shaping_cache_close();
+#ifdef CONFIG_HTML
     free_css_ident();
+#endif
 
     settings_save();
     return 0;
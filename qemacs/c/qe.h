@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 
 #ifdef WIN32
@@ -18,6 +19,7 @@
 #include <ctype.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <errno.h>
 
 #ifdef HAVE_QE_CONFIG_H
@@ -92,6 +94,7 @@ FindFileState *find_file_open(const char *path, const char *pattern);
 int find_file_next(FindFileState *s, char *filename, int filename_size_max);
 void find_file_close(FindFileState *s);
 void canonize_path(char *buf, int buf_size, const char *path);
+int is_abs_path(const char *path);
 void canonize_absolute_path(char *buf, int buf_size, const char *path1);
 const char *basename(const char *filename);
 const char *extension(const char *filename);
@@ -110,6 +113,7 @@ void css_strtolower(char *buf, int buf_size);
 void get_str(const char **pp, char *buf, int buf_size, const char *stop);
 int compose_keys(unsigned int *keys, int *nb_keys);
 int strtokey(const char **pp);
+int is_key_name(const char *p, int len);
 int strtokeys(const char *keystr, unsigned int *keys, int max_keys);
 void keytostr(char *buf, int buf_size, int key);
 int css_define_color(const char *name, const char *value);
@@ -145,6 +149,7 @@ static inline int css_is_space(int ch)
 int css_get_enum(const char *str, const char *enum_str);
 
 int get_clock_ms(void);
+int64_t get_clock_usec(void);
 
 typedef int (CSSAbortFunc)(void *);
 
@@ -259,6 +264,12 @@ extern QECharset charset_cp437;
 extern QECharset charset_kamen;
 extern QECharset charset_tcvn5712;
 
+/* JIS X 0208 and 0212 tables of charset_table.c. They must be
+   declared extern before their definitions: as C++, a const array
+   would otherwise not be visible from charsetmore.c */
+extern const unsigned short table_jis208[];
+extern const unsigned short table_jis212[];
+
 typedef struct CharsetDecodeState {
     /* 256 ushort table for hyper fast decoding */
     unsigned short *table; 
@@ -266,6 +277,7 @@ typedef struct CharsetDecodeState {
     int (*decode_func)(struct CharsetDecodeState *,
                        const unsigned char **); 
     QECharset *charset;
+    int ascii_idem; /* true if table[c] == c for all c < 0x80 */
 } CharsetDecodeState;
 
 #define INVALID_CHAR 0xfffd
@@ -302,12 +314,15 @@ static inline int charset_decode(CharsetDecodeState *s, const char **pp)
     return c;
 }
 
-QECharset *detect_charset (const unsigned char *buf, int size);
+QECharset *detect_charset(const unsigned char *buf, int size);
+QECharset *detect_charset_file(FILE *f, int *utf16_ptr);
 
 void decode_8bit_init(CharsetDecodeState *s);
 unsigned char *encode_8bit(QECharset *charset, unsigned char *q, int c);
 
 int unicode_to_charset(char *buf, unsigned int c, QECharset *charset);
+int charset_encode_block(QECharset *charset, u8 *dst,
+                         const unsigned int *p, int n);
 
 /* arabic.c */
 int arab_join(unsigned int *line, unsigned int *ctog, int len);
@@ -321,6 +336,14 @@ int unicode_to_glyphs(unsigned int *dst, unsigned int *char_to_glyph_pos,
                       int reverse);
 void load_ligatures(void);
 
+typedef struct ShapingCacheStats {
+    int hits, misses;
+    int nb_entries;
+} ShapingCacheStats;
+
+void shaping_cache_get_stats(ShapingCacheStats *st);
+void shaping_cache_close(void);
+
 /* qe event handling */
 
 enum QEEventType {
@@ -448,6 +471,7 @@ void qe_ungrab_keys(void);
 
 #define NO_LOGGING -1
 
+#include "profile.h"
 #include "buffer.h"
 
 void set_logging_pri(int log_pri);
@@ -539,6 +563,9 @@ typedef struct EditState {
        'colorize_states' */
     int colorize_max_valid_offset; 
 
+    /* bidir run lists of the recently displayed lines */
+    struct BidirCache *bidir_cache;
+
     int busy; /* true if editing cannot be done if the window
                  (e.g. the parser HTML is parsing the buffer to
                  produce the display */
@@ -696,12 +723,20 @@ typedef struct QEmacsState {
     int nb_macro_keys;
     int macro_keys_size;
     int macro_key_index; /* -1 means no macro is being executed */
+    int macro_headless;  /* true if display is deferred until the end
+                            of the macro execution */
+    int macro_failed;    /* set when a macro key cannot be executed */
     int ungot_key;
     /* yank buffers */
     EditBuffer *yank_buffers[NB_YANK_BUFFERS];
     int yank_current;
     char res_path[1024];
     char status_shadow[MAX_SCREEN_WIDTH];
+    char status_buf[MAX_SCREEN_WIDTH]; /* message not yet displayed */
+    int status_invalid;  /* true if the status line must be redrawn */
+    int display_pending; /* true if a redisplay is needed after the
+                            current input batch */
+    int display_deferred; /* number of events since the last redisplay */
     QErrorContext ec;
     char system_fonts[NB_FONT_FAMILIES][256];
 } QEmacsState;
@@ -898,6 +933,7 @@ void minibuffer_edit(const char *input, const char *prompt,
                      void (*cb)(void *opaque, char *buf), void *opaque);
 void command_completion(StringArray *cs, const char *input);
 void file_completion(StringArray *cs, const char *input);
+void project_completion(StringArray *cs, const char *input);
 void buffer_completion(StringArray *cs, const char *input);
 void color_completion(StringArray *cs, const char *input);
 
@@ -974,6 +1010,7 @@ void text_move_bol(EditState *s);
 void text_move_eol(EditState *s);
 void do_load(EditState *s, const char *filename);
 void do_load_file_from_path(EditState *s, const char *filename);
+void do_find_file_in_project(EditState *s, const char *filename);
 void do_goto_line(EditState *s, int line);
 void switch_to_buffer(EditState *s, EditBuffer *b);
 void do_up_down(EditState *s, int dir);
@@ -50,6 +50,9 @@ CmdDef basic_commands[] = {
     CMD0( KEY_CTRLX(KEY_CTRL('c')), KEY_NONE, "suspend-emacs", do_quit )
     CMD_( KEY_CTRLX(KEY_CTRL('f')), KEY_NONE, "find-file", do_load,
           "s{Find file: }[file]|file|")
+    CMD_( KEY_NONE, KEY_NONE, "find-file-in-project",
+          do_find_file_in_project,
+          "s{Find file in project: }[project]|file|")
     CMD_( KEY_CTRLX(KEY_CTRL('v')), KEY_NONE, "find-alternate-file", 
           do_find_alternate_file,
           "s{Find alternate file: }[file]|file|")
@@ -95,7 +98,10 @@ CmdDef basic_commands[] = {
     /* keyboard macros */
     CMD0( KEY_CTRLX('('), KEY_NONE, "start-kbd-macro", do_start_macro)
     CMD0( KEY_CTRLX(')'), KEY_NONE, "end-kbd-macro", do_end_macro)
-    CMD0( KEY_CTRLX('e'), KEY_CTRL('\\'), "call-last-kbd-macro", do_call_macro)
+    CMD_( KEY_CTRLX('e'), KEY_CTRL('\\'), "call-last-kbd-macro", do_call_macro,
+          "i")
+    CMD0( KEY_NONE, KEY_NONE, "apply-macro-to-region-lines",
+          do_apply_macro_to_region_lines)
     CMD_( KEY_NONE, KEY_NONE, "define-kbd-macro", do_define_kbd_macro,
           "s{Macro name: }[command]s{Macro keys: }s{Bind to key: }[key]")
     CMD_( KEY_NONE, KEY_NONE, "global-set-key", do_global_set_key,
@@ -126,6 +132,11 @@ CmdDef basic_commands[] = {
     CMD0( KEY_CTRLH('b'), KEY_NONE, "describe-bindings", do_describe_bindings)
     CMD0( KEY_CTRLH('c'), KEY_CTRLH('k'), "describe-key-briefly", 
           do_describe_key_briefly)
+    CMD0( KEY_NONE, KEY_NONE, "describe-shaping-cache",
+          do_describe_shaping_cache)
+    CMD0( KEY_NONE, KEY_NONE, "benchmark-buffer-iteration",
+          do_benchmark_buffer_iteration)
+    CMD0( KEY_NONE, KEY_NONE, "benchmark-json", do_benchmark_json)
 
     /* international */
     CMD_( KEY_CTRLXRET('f'), KEY_NONE, "set-buffer-file-coding-system",
@@ -245,6 +256,9 @@ CmdDef basic_commands[] = {
     CMD0( KEY_CTRLX(KEY_CTRL('c')), KEY_NONE, "suspend-emacs", do_quit )
     CMD_( KEY_CTRLX(KEY_CTRL('f')), KEY_NONE, "find-file", do_load,
           "s{Find file: }[file]|file|")
+    CMD_( KEY_NONE, KEY_NONE, "find-file-in-project",
+          do_find_file_in_project,
+          "s{Find file in project: }[project]|file|")
     CMD_( KEY_CTRLX(KEY_CTRL('v')), KEY_NONE, "find-alternate-file", 
           do_find_alternate_file,
           "s{Find alternate file: }[file]|file|")
@@ -290,7 +304,10 @@ CmdDef basic_commands[] = {
     /* keyboard macros */
     CMD0( KEY_CTRLX('('), KEY_NONE, "start-kbd-macro", do_start_macro)
     CMD0( KEY_CTRLX(')'), KEY_NONE, "end-kbd-macro", do_end_macro)
-    CMD0( KEY_CTRLX('e'), KEY_CTRL('\\'), "call-last-kbd-macro", do_call_macro)
+    CMD_( KEY_CTRLX('e'), KEY_CTRL('\\'), "call-last-kbd-macro", do_call_macro,
+          "i")
+    CMD0( KEY_NONE, KEY_NONE, "apply-macro-to-region-lines",
+          do_apply_macro_to_region_lines)
     CMD_( KEY_NONE, KEY_NONE, "define-kbd-macro", do_define_kbd_macro,
           "s{Macro name: }[command]s{Macro keys: }s{Bind to key: }[key]")
     CMD_( KEY_NONE, KEY_NONE, "global-set-key", do_global_set_key,
@@ -321,6 +338,11 @@ CmdDef basic_commands[] = {
     CMD0( KEY_CTRLH('b'), KEY_NONE, "describe-bindings", do_describe_bindings)
     CMD0( KEY_CTRLH('c'), KEY_CTRLH('k'), "describe-key-briefly", 
           do_describe_key_briefly)
+    CMD0( KEY_NONE, KEY_NONE, "describe-shaping-cache",
+          do_describe_shaping_cache)
+    CMD0( KEY_NONE, KEY_NONE, "benchmark-buffer-iteration",
+          do_benchmark_buffer_iteration)
+    CMD0( KEY_NONE, KEY_NONE, "benchmark-json", do_benchmark_json)
 
     /* international */
     CMD_( KEY_CTRLXRET('f'), KEY_NONE, "set-buffer-file-coding-system",
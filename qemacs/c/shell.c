@@ -347,7 +347,7 @@ static void tty_gotoxy(ShellState *s, int x, int y, int relative)
     unsigned char buf1[10];
 
     /* compute offset */
-    eb_get_pos(s->b, &total_lines, &col_num, s->b->total_size);
+    eb_get_pos(s->b, &total_lines, &col_num, eb_total_size(s->b));
     line_num = total_lines - TTY_YSIZE;
     if (line_num < 0)
         line_num = 0;
@@ -371,7 +371,7 @@ static void tty_gotoxy(ShellState *s, int x, int y, int relative)
     /* add lines if necessary */
     while (line_num >= total_lines) {
         buf1[0] = '\n';
-        eb_insert(s->b, s->b->total_size, buf1, 1);
+        eb_insert(s->b, eb_total_size(s->b), buf1, 1);
         total_lines++;
     }
     offset = eb_goto_pos(s->b, line_num, 0);
@@ -550,11 +550,11 @@ static void tty_emulate(ShellState *s, int c)
             /* CG: should check if column should be kept */
             offset = s->cur_offset;
             for (;;) {
-                if (offset == s->b->total_size) {
+                if (offset == eb_total_size(s->b)) {
                     /* add a new line */
                     buf1[0] = '\n';
                     eb_insert(s->b, offset, buf1, 1);
-                    offset = s->b->total_size;
+                    offset = eb_total_size(s->b);
                     break;
                 }
                 c = eb_nextc(s->b, offset, &offset);
@@ -880,7 +880,7 @@ static void shell_read_cb(void *opaque)
         return;
     
     if (trace_buffer)
-        eb_write(trace_buffer, trace_buffer->total_size, buf, len);
+        eb_write(trace_buffer, eb_total_size(trace_buffer), buf, len);
 
     for (i = 0; i < len; i++)
         tty_emulate(s, buf[i]);
@@ -918,7 +918,7 @@ void shell_pid_cb(void *opaque, int status)
                      status, time_str);
         }
     }
-    eb_write(b, b->total_size, buf, strlen(buf));
+    eb_write(b, eb_total_size(b), buf, strlen(buf));
     set_pid_handler(s->pid, NULL, NULL);
     s->pid = -1;
     /* no need to leave the pty opened */
@@ -1231,7 +1231,7 @@ static void do_compile_error(EditState *s, int dir)
     }
     for (;;) {
         if (dir > 0) {
-            if (offset >= b->total_size) {
+            if (offset >= eb_total_size(b)) {
                 put_status(s, "No more errors");
                 return;
             }
@@ -79,6 +79,9 @@ int strbuf_reserve(strbuf *buf, int size)
     if (buf->allocated >= size)
         return 1;
 
+    /* grow geometrically so that appending is linear */
+    if (size < buf->allocated * 2)
+        size = buf->allocated * 2;
     new_data = (char*)malloc(size);
     if (!new_data)
         return 0;
@@ -71,7 +71,7 @@ static int term_probe(void)
     return 1;
 }
 
-static QEDisplay tty_dpy;
+extern QEDisplay tty_dpy;
 
 static int term_init(QEditScreen *s, int w, int h)
 {
@@ -84,7 +84,7 @@ static int term_init(QEditScreen *s, int w, int h)
 
     tty_screen = s;
     ts = &tty_state;
-    s->private = ts;
+    s->private_data = ts;
     s->media = CSS_MEDIA_TTY;
 
     tcgetattr (0, &tty);
@@ -173,7 +173,7 @@ static void term_close(QEditScreen *s)
 static void term_exit(void)
 {
     QEditScreen *s = tty_screen;
-    TTYState *ts = s->private;
+    TTYState *ts = s->private_data;
 
     tcsetattr(0, TCSANOW, &ts->oldtty);
 }
@@ -181,7 +181,7 @@ static void term_exit(void)
 static void tty_resize(int sig)
 {
     QEditScreen *s = tty_screen;
-    TTYState *ts = s->private;
+    TTYState *ts = s->private_data;
     struct winsize ws;
     int size;
 
@@ -214,7 +214,7 @@ static void term_invalidate(void)
 
 static void term_cursor_at(QEditScreen *s, int x1, int y1, int w, int h)
 {
-    TTYState *ts = s->private;
+    TTYState *ts = s->private_data;
     ts->cursor_x = x1;
     ts->cursor_y = y1;
 }
@@ -276,7 +276,7 @@ static void tty_read_handler(void *opaque)
 {
     QEditScreen *s = opaque;
     QEmacsState *qs = &qe_state;
-    TTYState *ts = s->private;
+    TTYState *ts = s->private_data;
     int ch;
     QEEvent ev1, *ev = &ev1;
 
@@ -286,7 +286,7 @@ static void tty_read_handler(void *opaque)
     if (trace_buffer &&
         qs->active_window &&
         qs->active_window->b != trace_buffer) {
-        eb_write(trace_buffer, trace_buffer->total_size,
+        eb_write(trace_buffer, eb_total_size(trace_buffer),
                  ts->buf + ts->utf8_index, 1);
 #if 0
         ch = ts->buf[ts->utf8_index];
@@ -418,9 +418,9 @@ static void tty_read_handler(void *opaque)
 static inline int color_dist(unsigned int c1, unsigned c2)
 {
 
-    return (abs( (c1 & 0xff) - (c2 & 0xff)) +
-            2 * abs( ((c1 >> 8) & 0xff) - ((c2 >> 8) & 0xff)) +
-            abs( ((c1 >> 16) & 0xff) - ((c2 >> 16) & 0xff)));
+    return (abs((int)(c1 & 0xff) - (int)(c2 & 0xff)) +
+            2 * abs((int)((c1 >> 8) & 0xff) - (int)((c2 >> 8) & 0xff)) +
+            abs((int)((c1 >> 16) & 0xff) - (int)((c2 >> 16) & 0xff)));
 }
 
 #define NB_COLORS 8
@@ -455,7 +455,7 @@ static int get_tty_color(QEColor color)
 static void term_fill_rectangle(QEditScreen *s,
                                 int x1, int y1, int w, int h, QEColor color)
 {
-    TTYState *ts = s->private;
+    TTYState *ts = s->private_data;
     int x2 = x1 + w;
     int y2 = y1 + h;
     int x, y;
@@ -499,7 +499,7 @@ static QEFont *term_open_font(QEditScreen *s,
         return NULL;
     font->ascent = 0;
     font->descent = 1;
-    font->private = NULL;
+    font->private_data = NULL;
     return font;
 }
 
@@ -549,7 +549,7 @@ static void term_draw_text(QEditScreen *s, QEFont *font,
                            int x, int y, const unsigned int *str, int len,
                            QEColor color)
 {
-    TTYState *ts = s->private;
+    TTYState *ts = s->private_data;
     TTYChar *ptr;
     int fgcolor, w, n;
     unsigned int cc;
@@ -616,14 +616,15 @@ static void term_set_clip(QEditScreen *s,
 
 static void term_flush(QEditScreen *s)
 {
-    TTYState *ts = s->private;
+    TTYState *ts = s->private_data;
     TTYChar *ptr, *optr;
-    int x, y, bgcolor, fgcolor;
+    int x, y, bgcolor, fgcolor, len;
     char buf[10];
     unsigned int cc;
 
     bgcolor = -1;
     fgcolor = -1;
+    len = 0;
             
     for (y = 0; y < s->height; y++) {
         if (ts->line_updated[y]) {
@@ -633,7 +634,7 @@ static void term_flush(QEditScreen *s)
 
             if (memcmp(ptr, optr, sizeof(TTYChar) * s->width) != 0) {
                 /* XXX: currently, we update the whole line */
-                printf("\033[%d;%dH", y + 1, 1);
+                len += printf("\033[%d;%dH", y + 1, 1);
                 for (x = 0; x < s->width; x++) {
                     cc = ptr->ch;
                     if (cc != 0xffff) {
@@ -642,8 +643,8 @@ static void term_flush(QEditScreen *s)
                              (bgcolor != ptr->bgcolor))) {
                             fgcolor = ptr->fgcolor;
                             bgcolor = ptr->bgcolor;
-                            printf("\033[%d;%dm", 
-                                   30 + fgcolor, 40 + bgcolor); 
+                            len += printf("\033[%d;%dm", 
+                                          30 + fgcolor, 40 + bgcolor); 
                         }
                         /* do not display escape codes or invalid codes */
                         if (cc < 32) {
@@ -660,7 +661,7 @@ static void term_flush(QEditScreen *s)
                             unicode_to_charset(buf, cc, s->charset);
                         }
                         if (x != s->width - 1 || y != s->height - 1)
-                            printf("%s", buf);
+                            len += printf("%s", buf);
                     }
                     /* update old screen data */
                     *optr++ = *ptr++;
@@ -669,12 +670,13 @@ static void term_flush(QEditScreen *s)
         }
     }
 
-    printf("\033[%d;%dH", ts->cursor_y + 1, ts->cursor_x + 1);
+    len += printf("\033[%d;%dH", ts->cursor_y + 1, ts->cursor_x + 1);
     fflush(stdout);
+    PROF_COUNT(PROF_BYTES_FLUSHED, len);
 }
 
 
-static QEDisplay tty_dpy = {
+QEDisplay tty_dpy = {
     "vt100",
     term_probe,
     term_init,
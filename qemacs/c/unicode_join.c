@@ -236,6 +236,126 @@ static void bidi_reverse_buf(unsigned int *str, int len)
     }
 }
 
+/* shaping cache: the generic case of unicode_to_glyphs (joining,
+   ligatures and reordering) is redone for each fragment on each
+   redraw, so its results are kept in a LRU cache keyed by the source
+   chars and the direction */
+
+#define SHAPING_HASH_SIZE   1024 /* must be a power of two */
+#define SHAPING_MAX_ENTRIES 2048
+
+typedef struct ShapingEntry {
+    struct ShapingEntry *hash_next;
+    struct ShapingEntry *lru_prev, *lru_next;
+    unsigned int hash;
+    int src_size, len;
+    int reverse;
+    unsigned int data[1]; /* src[src_size], glyphs[len], ctog[src_size] */
+} ShapingEntry;
+
+static ShapingEntry *shaping_hash[SHAPING_HASH_SIZE];
+/* LRU list head: lru_next is the most recently used entry */
+static ShapingEntry shaping_lru;
+static ShapingCacheStats shaping_stats;
+
+static unsigned int shaping_hash_func(const unsigned int *src, int src_size,
+                                      int reverse)
+{
+    unsigned int h;
+    int i;
+
+    h = 2166136261U ^ reverse;
+    for (i = 0; i < src_size; i++)
+        h = (h ^ src[i]) * 16777619U;
+    return h;
+}
+
+static void shaping_lru_unlink(ShapingEntry *e)
+{
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void shaping_lru_push(ShapingEntry *e)
+{
+    e->lru_next = shaping_lru.lru_next;
+    e->lru_prev = &shaping_lru;
+    shaping_lru.lru_next->lru_prev = e;
+    shaping_lru.lru_next = e;
+}
+
+static ShapingEntry *shaping_cache_find(unsigned int h, 
+                                        const unsigned int *src,
+                                        int src_size, int reverse)
+{
+    ShapingEntry *e;
+
+    for (e = shaping_hash[h & (SHAPING_HASH_SIZE - 1)]; e != NULL;
+         e = e->hash_next) {
+        if (e->hash == h && e->src_size == src_size &&
+            e->reverse == reverse &&
+            !memcmp(e->data, src, src_size * sizeof(unsigned int))) {
+            /* move to the head of the LRU list */
+            shaping_lru_unlink(e);
+            shaping_lru_push(e);
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void shaping_cache_remove(ShapingEntry *e)
+{
+    ShapingEntry **pe;
+
+    pe = &shaping_hash[e->hash & (SHAPING_HASH_SIZE - 1)];
+    while (*pe != e)
+        pe = &(*pe)->hash_next;
+    *pe = e->hash_next;
+    shaping_lru_unlink(e);
+    free(e);
+    shaping_stats.nb_entries--;
+}
+
+static void shaping_cache_add(unsigned int h, const unsigned int *src,
+                              int src_size, int reverse,
+                              const unsigned int *glyphs, int len,
+                              const unsigned int *ctog)
+{
+    ShapingEntry *e, **pe;
+
+    if (shaping_stats.nb_entries >= SHAPING_MAX_ENTRIES)
+        shaping_cache_remove(shaping_lru.lru_prev);
+
+    e = (ShapingEntry *)malloc(sizeof(ShapingEntry) + 
+                               (2 * src_size + len) * sizeof(unsigned int));
+    if (!e)
+        return;
+    e->hash = h;
+    e->src_size = src_size;
+    e->len = len;
+    e->reverse = reverse;
+    memcpy(e->data, src, src_size * sizeof(unsigned int));
+    memcpy(e->data + src_size, glyphs, len * sizeof(unsigned int));
+    memcpy(e->data + src_size + len, ctog, src_size * sizeof(unsigned int));
+    pe = &shaping_hash[h & (SHAPING_HASH_SIZE - 1)];
+    e->hash_next = *pe;
+    *pe = e;
+    shaping_lru_push(e);
+    shaping_stats.nb_entries++;
+}
+
+void shaping_cache_get_stats(ShapingCacheStats *st)
+{
+    *st = shaping_stats;
+}
+
+void shaping_cache_close(void)
+{
+    while (shaping_stats.nb_entries > 0)
+        shaping_cache_remove(shaping_lru.lru_prev);
+}
+
 /* Convert a string of unicode characters to a string of glyphs. We
    suppose that the font implements a minimum number of standard
    ligatures chars. The string is reversed if 'reversed' is set to
@@ -251,6 +371,8 @@ int unicode_to_glyphs(unsigned int *dst, unsigned int *char_to_glyph_pos,
     unsigned int ctog1[src_size];
     unsigned int buf[src_size];
     int unicode_class;
+    unsigned int h;
+    ShapingEntry *e;
 
     unicode_class = unicode_classify(src, src_size);
     if (unicode_class == 0 && !reverse) {
@@ -267,6 +389,26 @@ int unicode_to_glyphs(unsigned int *dst, unsigned int *char_to_glyph_pos,
     } else {
         /* generic case */
 
+        if (!shaping_lru.lru_next) {
+            shaping_lru.lru_next = &shaping_lru;
+            shaping_lru.lru_prev = &shaping_lru;
+        }
+        h = shaping_hash_func(src, src_size, reverse);
+        e = shaping_cache_find(h, src, src_size, reverse);
+        if (e) {
+            shaping_stats.hits++;
+            len = e->len;
+            if (len > dst_size)
+                len = dst_size;
+            memcpy(dst, e->data + src_size, len * sizeof(unsigned int));
+            if (char_to_glyph_pos) {
+                memcpy(char_to_glyph_pos, e->data + src_size + e->len,
+                       src_size * sizeof(unsigned int));
+            }
+            return len;
+        }
+        shaping_stats.misses++;
+
         /* init current buffer */
         len = src_size;
         for (i = 0; i < len; i++)
@@ -296,6 +438,8 @@ int unicode_to_glyphs(unsigned int *dst, unsigned int *char_to_glyph_pos,
             }
         }
 
+        shaping_cache_add(h, src, src_size, reverse, buf, len, ctog);
+
         if (len > dst_size)
             len = dst_size;
         memcpy(dst, buf, len * sizeof(unsigned int));
@@ -316,6 +460,15 @@ void load_ligatures(void)
 {
 }
 
+void shaping_cache_get_stats(ShapingCacheStats *st)
+{
+    memset(st, 0, sizeof(*st));
+}
+
+void shaping_cache_close(void)
+{
+}
+
 int unicode_to_glyphs(unsigned int *dst, unsigned int *char_to_glyph_pos,
                       int dst_size, unsigned int *src, int src_size, int reverse)
 {
@@ -44,21 +44,37 @@ static int unihex_backward_offset(EditState *s, int offset)
 
 static int unihex_display(EditState *s, DisplayState *ds, int offset)
 {
-    int j, len, eof;
+    int j, len, eof, span_len;
     int offset1;
     unsigned int b;
+    const u8 *span;
     unsigned int buf[LINE_MAX_SIZE];
     unsigned int pos[LINE_MAX_SIZE];
 
     eof = 0;
     display_bol(ds);
 
-    display_printf(ds, -1, -1, "%08x ", offset);
+    display_printhex(ds, -1, -1, offset, 8);
+    display_char(ds, -1, -1, ' ');
 
     len = 0;
+    span = NULL;
+    span_len = 0;
     for (j = 0; j < s->disp_width; j++) {
         if (offset < eb_total_size(s->b)) {
-            b = eb_nextc(s->b, offset, &offset1);
+            /* decode directly from the page data with the charset
+               table, eb_nextc() is only needed for escape sequences */
+            if (span_len <= 0)
+                span = eb_get_span(s->b, offset, &span_len);
+            b = s->b->charset_state.table[*span];
+            if (b != ESCAPE_CHAR) {
+                offset1 = offset + 1;
+                span++;
+                span_len--;
+            } else {
+                b = eb_nextc(s->b, offset, &offset1);
+                span_len = 0;
+            }
             pos[len] = offset;
             buf[len] = b;
             len++;
@@ -74,10 +90,13 @@ static int unihex_display(EditState *s, DisplayState *ds, int offset)
         } else {
             if (!eof) {
                 eof = 1;
-                display_printf(ds, pos[j], pos[j] + 1, "    ");
+                display_char(ds, pos[j], pos[j] + 1, ' ');
             } else {
-                display_printf(ds, -1, -1, "    ");
+                display_char(ds, -1, -1, ' ');
             }
+            display_char(ds, -1, -1, ' ');
+            display_char(ds, -1, -1, ' ');
+            display_char(ds, -1, -1, ' ');
         }
         if ((j & 7) == 7)
             display_char(ds, -1, -1, ' ');
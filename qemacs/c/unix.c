@@ -237,6 +237,10 @@ static void url_block(void)
     PidHandler *ph, *ph1;
     struct timeval tv;
 
+    /* bottom halves may have been registered outside of the handlers
+       (for example during the first display) */
+    call_bottom_halves();
+
     delay = check_timers(MAX_DELAY);
 #if 0
     {
@@ -300,7 +300,7 @@ void canonize_path(char *buf, int buf_size, const char *path)
 }
 
 /* return TRUE if absolute path. works for files and URLs */
-static int is_abs_path(const char *path)
+int is_abs_path(const char *path)
 {
     const char *p;
     p = strchr(path, ':');
@@ -449,7 +449,7 @@ int strfind(const char *keytable, const char *str, int casefold)
     /* initial and trailing | are optional */
     /* they do not cause the empty string to match */
     for (p = keytable;;) {
-        if (!memcmp(p, str, len) && (p[len] == '|' || p[len] == '\0'))
+        if (!strncmp(p, str, len) && (p[len] == '|' || p[len] == '\0'))
             return 1;
         for (;;) {
             p = strchr(p + 1, c);
@@ -670,6 +670,28 @@ int strtokey(const char **pp)
     return key;
 }
 
+/* return true if the 'len' chars at 'p' are a key that strtokey()
+   parses completely */
+int is_key_name(const char *p, int len)
+{
+    const char *end = p + len;
+    int i;
+
+    if (len > 2 && p[0] == 'M' && p[1] == '-')
+        p += 2;
+    for (i = 0; i < (int)(sizeof(keycodes)/sizeof(keycodes[0])); i++) {
+        if ((int)strlen(keystr[i]) == end - p &&
+            !memcmp(p, keystr[i], end - p))
+            return 1;
+    }
+    if (p[0] == 'C' && p[1] == '-' && end == p + 3)
+        return 1;
+    if (p >= end)
+        return 0;
+    utf8_decode(&p);
+    return p == end;
+}
+
 int strtokeys(const char *keystr, unsigned int *keys, int max_keys)
 {
     int key, nb_keys;
@@ -967,6 +989,19 @@ int get_clock_ms(void)
 #endif
 }
 
+int64_t get_clock_usec(void)
+{
+#ifdef CONFIG_WIN32
+    struct _timeb tb;
+    _ftime(&tb);
+    return (int64_t)tb.time * 1000000 + tb.millitm * 1000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
 /* set one string. */
 StringItem *set_string(StringArray *cs, int index, const char *str)
 {
@@ -992,7 +1027,7 @@ StringItem *add_string(StringArray *cs, const char *str)
     int n;
 
     if (cs->nb_items >= cs->nb_allocated) {
-        n = cs->nb_allocated + 32;
+        n = cs->nb_allocated + (cs->nb_allocated >> 1) + 32;
         tmp = (StringItem**)realloc(cs->items, n * sizeof(StringItem *));
         if (!tmp)
             return NULL;
@@ -45,6 +45,10 @@ public:
         return els[idx];
     }
 
+    T *AtPtr(int idx) {
+        return &els[idx];
+    }
+
     int Count() {
         return len;
     }
@@ -79,7 +83,6 @@ public:
     }
 
     void RemoveAt(int idx, int count=1) {
-        T res = els[idx];
         int tomove = len - idx - count;
         if (tomove > 0) {
             T *dst = els + idx;
@@ -113,7 +116,7 @@ template <typename T>
 class PtrVec : public Vec<T*> {
 public:
     PtrVec(int initcap = 0) 
-        : Vec(initcap)
+        : Vec<T*>(initcap)
     {        
     }
 
@@ -121,8 +124,8 @@ public:
     }
 
     void DeleteAll() {
-        while (len > 0) {
-            T* el = Pop();
+        while (this->len > 0) {
+            T* el = this->Pop();
             delete el;
         }
     }
@@ -46,6 +46,14 @@ static int          font_xsize;
 
 static int          url_exit_request = 0;
 
+typedef struct BottomHalfEntry {
+    struct BottomHalfEntry *next, *prev;
+    void (*cb)(void *opaque);
+    void *opaque;
+} BottomHalfEntry;
+
+static LIST_HEAD(bottom_halves);
+
 /* state of a single window */
 typedef struct WinWindow {
     HWND    hwnd;
@@ -1135,9 +1143,46 @@ int win32_init()
     return qe_register_display(&win32_dpy);
 }
 
+/*
+ * add an explicit call back to avoid recursions 
+ */
 void register_bottom_half(void (*cb)(void *opaque), void *opaque)
 {
-    assert(0);
+    BottomHalfEntry *bh;
+
+    /* Should not fail */
+    bh = (BottomHalfEntry *)malloc(sizeof(BottomHalfEntry));
+    bh->cb = cb;
+    bh->opaque = opaque;
+    list_add(bh, &bottom_halves);
+}
+
+/*
+ * remove bottom half
+ */
+void unregister_bottom_half(void (*cb)(void *opaque), void *opaque)
+{
+    BottomHalfEntry *bh, *bh1;
+
+    list_for_each_safe(bh, bh1, &bottom_halves) {
+        if (bh->cb == cb && bh->opaque == opaque) {
+            list_del(bh);
+            free(bh);
+        }
+    }
+}
+
+/* execute stacked bottom halves */
+static void call_bottom_halves(void)
+{
+    BottomHalfEntry *bh;
+
+    while (!list_empty(&bottom_halves)) {
+        bh = (BottomHalfEntry *)bottom_halves.prev;
+        list_del(bh);
+        bh->cb(bh->opaque);
+        free(bh);
+    }
 }
 
 /* return the next event in the queue in 'ev' */
@@ -1158,6 +1203,13 @@ static int get_next_event(QEEvent *ev)
             break;
         }
 
+        /* run the bottom halves once no message is waiting */
+        if (!list_empty(&bottom_halves) &&
+            !PeekMessage(&msg, NULL, 0, 0, PM_NOREMOVE)) {
+            call_bottom_halves();
+            continue;
+        }
+
         /* check if message queued */
         if (GetMessage(&msg, NULL, 0, 0)) {
             TranslateMessage(&msg);